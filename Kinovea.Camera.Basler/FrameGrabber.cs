@@ -134,10 +134,16 @@ namespace Kinovea.Camera.Basler
                 resultingFramerate = finishline.ResultingFramerate;
             }
 
+            // Raw Bayer frames are passed along as is, the recorder tags the pattern in the file.
+            // The finish line assembles slices of the sensor, the result is no longer a regular mosaic.
+            Demosaicing pattern = Demosaicing.None;
+            if (isBayer8 && specific.Bayer8Conversion == Bayer8Conversion.Raw && !finishline.Enabled)
+                pattern = ImageFormatHelper.GetBayerPattern(pixelFormat);
+
             int bufferSize = ImageFormatHelper.ComputeBufferSize(width, height, format);
             bool topDown = true;
             
-            return new ImageDescriptor(format, width, height, topDown, bufferSize);
+            return new ImageDescriptor(format, width, height, topDown, bufferSize, pattern);
         }
 
         /// <summary>
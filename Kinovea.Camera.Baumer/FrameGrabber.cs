@@ -139,9 +139,15 @@ namespace Kinovea.Camera.Baumer
                 resultingFramerate = finishline.ResultingFramerate;
             }
 
+            // Raw Bayer frames are passed along as is, the recorder tags the pattern in the file.
+            // The finish line assembles slices of the sensor, the result is no longer a regular mosaic.
+            Demosaicing pattern = Demosaicing.None;
+            if (imageFormat == ImageFormat.Y800 && !finishline.Enabled)
+                pattern = ImageFormatHelper.GetBayerPattern(pixelFormat);
+
             int outgoingBufferSize = ImageFormatHelper.ComputeBufferSize(width, height, imageFormat);
             bool topDown = true;
-            return new ImageDescriptor(imageFormat, width, height, topDown, outgoingBufferSize);
+            return new ImageDescriptor(imageFormat, width, height, topDown, outgoingBufferSize, pattern);
         }
 
         /// <summary>
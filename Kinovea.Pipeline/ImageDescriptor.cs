@@ -18,16 +18,27 @@ namespace Kinovea.Pipeline
         public int Height { get; private set; }
         public bool TopDown { get; private set; }
         public int BufferSize { get; private set; }
+
+        /// <summary>
+        /// Bayer pattern of Y800 images carrying the raw sensor mosaic. None for regular images.
+        /// </summary>
+        public Demosaicing Demosaicing { get; private set; }
         
         private static ImageDescriptor invalid = new ImageDescriptor(ImageFormat.None, 0, 0, true, 0);
 
         public ImageDescriptor(ImageFormat format, int width, int height, bool topDown, int bufferSize)
+            : this(format, width, height, topDown, bufferSize, Demosaicing.None)
+        {
+        }
+
+        public ImageDescriptor(ImageFormat format, int width, int height, bool topDown, int bufferSize, Demosaicing demosaicing)
         {
             this.Format = format;
             this.Width = width;
             this.Height = height;
             this.TopDown = topDown;
             this.BufferSize = bufferSize;
+            this.Demosaicing = demosaicing;
         }
 
         public static bool Compatible(ImageDescriptor a, ImageDescriptor b)
@@ -1089,15 +1089,20 @@ namespace Kinovea.ScreenManager
 
             // Compute load (processing time vs frame budget).
             long ellapsed = 0;
+            WriteBehindStream writeBehind = null;
             if (recordingMode == CaptureRecordingMode.Camera)
             {
                 // Here we don't report load if not recording as it's non-blocking.
                 if (recording && consumerRealtime != null)
+                {
                     ellapsed = consumerRealtime.Ellapsed;
+                    writeBehind = consumerRealtime.WriteBehind;
+                }
             }
             else if ((recordingMode == CaptureRecordingMode.Delay || recordingMode == CaptureRecordingMode.Scheduled) && consumerDelayer != null)
             {
                 ellapsed = consumerDelayer.Ellapsed;
+                writeBehind = consumerDelayer.WriteBehind;
             }
 
             float load = (ellapsed / (1000.0f / (float)pipelineManager.Frequency)) * 100;
@@ -1108,7 +1113,13 @@ namespace Kinovea.ScreenManager
             string strLoad = string.Format(" {0:0} %", load);
             strLoad = strLoad.PadLeft(6);
             string drops = string.Format(" {0}", pipelineManager.Drops);
-            view.UpdateInfo(signal, bandwidth, strLoad, drops);
+
+            // Disk queue while recording: data not yet on disk, average write latency, times the recorder waited for the disk.
+            string disk = null;
+            if (writeBehind != null)
+                disk = string.Format(" {0:0}/{1:0} MB, {2:0} ms, {3} stalls", writeBehind.QueueBytes / (1024.0 * 1024.0), writeBehind.Capacity / (1024.0 * 1024.0), writeBehind.WriteLatency, writeBehind.Stalls);
+
+            view.UpdateInfo(signal, bandwidth, strLoad, drops, disk);
             view.UpdateLoadStatus(load);
         }
 
@@ -1872,6 +1883,9 @@ namespace Kinovea.ScreenManager
             log.DebugFormat("Manual scheduled recording: saving delay buffer content.");
 
             MJPEGWriter writer = new MJPEGWriter();
+            writer.BayerPattern = imageDescriptor.Demosaicing;
+            writer.Lossless = PreferencesManager.CapturePreferences.LosslessVideo;
+            writer.WriteBehindMemory = PreferencesManager.CapturePreferences.WriteBehindMemory;
             VideoInfo info = new VideoInfo();
             info.OriginalSize = new Size(imageDescriptor.Width, imageDescriptor.Height);
 
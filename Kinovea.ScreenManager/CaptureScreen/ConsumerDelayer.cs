@@ -24,6 +24,14 @@ namespace Kinovea.ScreenManager
 
         public long Ellapsed { get; private set; }
 
+        /// <summary>
+        /// The stream queueing the file data in front of the disk, or null if the file is written directly.
+        /// </summary>
+        public WriteBehindStream WriteBehind
+        {
+            get { return writer != null ? writer.WriteBehind : null; }
+        }
+
         private bool allocated;
         private Delayer delayer;
         private int age;
@@ -95,6 +103,9 @@ namespace Kinovea.ScreenManager
                 writer.Dispose();
 
             writer = new MJPEGWriter();
+            writer.BayerPattern = delayerImageDescriptor.Demosaicing;
+            writer.Lossless = PreferencesManager.CapturePreferences.LosslessVideo;
+            writer.WriteBehindMemory = PreferencesManager.CapturePreferences.WriteBehindMemory;
 
             VideoInfo info = new VideoInfo();
             info.OriginalSize = new Size(delayerImageDescriptor.Width, delayerImageDescriptor.Height);
@@ -25,12 +25,40 @@ namespace Kinovea.ScreenManager
 
         public long Ellapsed { get; private set; }
 
+        /// <summary>
+        /// Number of frames handed to the writer and not yet written to the file.
+        /// </summary>
+        public int QueueDepth
+        {
+            get { return writer != null ? writer.QueueDepth : 0; }
+        }
+
+        /// <summary>
+        /// Number of frames the writer could not take during the current recording.
+        /// </summary>
+        public int Drops
+        {
+            get { return drops; }
+        }
+
+        /// <summary>
+        /// The stream queueing the file data in front of the disk, or null if the file is written directly.
+        /// </summary>
+        public WriteBehindStream WriteBehind
+        {
+            get { return writer != null ? writer.WriteBehind : null; }
+        }
+
         private ImageDescriptor imageDescriptor;
         private MJPEGWriter writer;
         private bool recording;
         private string filename;
         private string shortId;
         private Stopwatch stopwatch = new Stopwatch();
+        private int drops;
+        private object lockerDrops = new object();
+        private const int MaxEncodingThreads = 8;
+        private const int WaitForRoomTimeout = 1000;
         private static readonly log4net.ILog log = log4net.LogManager.GetLogger(System.Reflection.MethodBase.GetCurrentMethod().DeclaringType);
 
         public ConsumerRealtime(string shortId)
@@ -55,10 +83,17 @@ namespace Kinovea.ScreenManager
 
             this.filename = filename;
 
+            lock (lockerDrops)
+                drops = 0;
+
             if (writer != null)
                 writer.Dispose();
 
             writer = new MJPEGWriter();
+            writer.EncodingThreads = GetEncodingThreads();
+            writer.BayerPattern = imageDescriptor.Demosaicing;
+            writer.Lossless = PreferencesManager.CapturePreferences.LosslessVideo;
+            writer.WriteBehindMemory = PreferencesManager.CapturePreferences.WriteBehindMemory;
             
             VideoInfo info = new VideoInfo();
             info.OriginalSize = new Size(imageDescriptor.Width, imageDescriptor.Height);
@@ -97,9 +132,30 @@ namespace Kinovea.ScreenManager
 
             long then = stopwatch.ElapsedMilliseconds;
 
-            writer.SaveFrame(imageDescriptor.Format, entry.Buffer, entry.PayloadLength, imageDescriptor.TopDown);
+            // When encoding in parallel, wait for a free slot in the writer rather than drop the frame.
+            // Meanwhile the incoming frames pile up in the pipeline ring buffer, which absorbs short bursts.
+            // If the encoders are still busy after the timeout the frame is dropped and counted with the pipeline drops.
+            if (writer.QueueCapacity > 0)
+                writer.WaitForRoom(WaitForRoomTimeout);
+
+            SaveResult result = writer.SaveFrame(imageDescriptor.Format, entry.Buffer, entry.PayloadLength, imageDescriptor.TopDown);
+            if (result == SaveResult.QueueFull)
+            {
+                lock (lockerDrops)
+                    drops++;
+            }
 
             Ellapsed = stopwatch.ElapsedMilliseconds - then;
         }
+
+        private static int GetEncodingThreads()
+        {
+            int threads = PreferencesManager.CapturePreferences.EncodingThreads;
+            if (threads > 0)
+                return threads;
+
+            // Leave half the cores to the camera, the display and the rest of the pipeline.
+            return Math.Min(Math.Max(Environment.ProcessorCount / 2, 1), MaxEncodingThreads);
+        }
     }
 }
@@ -17,9 +17,19 @@ namespace Kinovea.ScreenManager
     {
         public event EventHandler FrameSignaled;
 
+        /// <summary>
+        /// Frames lost in the pipeline, plus frames the recorder could not hand to the writer.
+        /// </summary>
         public long Drops
         {
-            get { return pipeline == null ? 0 : pipeline.Drops; }
+            get
+            {
+                long drops = pipeline == null ? 0 : pipeline.Drops;
+                if (consumerRealtime != null)
+                    drops += consumerRealtime.Drops;
+
+                return drops;
+            }
         }
 
         public double Frequency
@@ -131,10 +131,10 @@ namespace Kinovea.ScreenManager
             infobarCapture.Left = lblCameraTitle.Right + 5;
         }
         
-        public void UpdateInfo(string signal, string bandwidth, string load, string drops)
+        public void UpdateInfo(string signal, string bandwidth, string load, string drops, string disk)
         {
             infobarCapture.Visible = true;
-            infobarCapture.UpdateValues(signal, bandwidth, load, drops);
+            infobarCapture.UpdateValues(signal, bandwidth, load, drops, disk);
         }
 
         public void UpdateLoadStatus(float load)
@@ -50,7 +50,7 @@ namespace Kinovea.ScreenManager
         void ConfigureDisplayControl(DelayCompositeType type);
 
         void UpdateTitle(string title, Bitmap icon);
-        void UpdateInfo(string signal, string bandwidth, string load, string drops);
+        void UpdateInfo(string signal, string bandwidth, string load, string drops, string disk);
         void UpdateLoadStatus(float load);
         void UpdateGrabbingStatus(bool grabbing);
         void UpdateRecordingStatus(bool recording);
@@ -40,6 +40,8 @@
       this.button5 = new System.Windows.Forms.Button();
       this.button6 = new System.Windows.Forms.Button();
       this.lblDrops = new System.Windows.Forms.Label();
+      this.btnDiskSpacer = new System.Windows.Forms.Button();
+      this.lblDisk = new System.Windows.Forms.Label();
       this.flowLayoutPanel1.SuspendLayout();
       this.SuspendLayout();
       // 
@@ -70,6 +72,8 @@
       this.flowLayoutPanel1.Controls.Add(this.button5);
       this.flowLayoutPanel1.Controls.Add(this.button6);
       this.flowLayoutPanel1.Controls.Add(this.lblDrops);
+      this.flowLayoutPanel1.Controls.Add(this.btnDiskSpacer);
+      this.flowLayoutPanel1.Controls.Add(this.lblDisk);
       this.flowLayoutPanel1.Dock = System.Windows.Forms.DockStyle.Fill;
       this.flowLayoutPanel1.Location = new System.Drawing.Point(0, 0);
       this.flowLayoutPanel1.Margin = new System.Windows.Forms.Padding(0);
@@ -214,6 +218,34 @@
       this.lblDrops.Text = "Drops: 0";
       this.lblDrops.TextAlign = System.Drawing.ContentAlignment.MiddleLeft;
       // 
+      // btnDiskSpacer
+      // 
+      this.btnDiskSpacer.BackgroundImageLayout = System.Windows.Forms.ImageLayout.Center;
+      this.btnDiskSpacer.FlatAppearance.BorderSize = 0;
+      this.btnDiskSpacer.FlatAppearance.MouseDownBackColor = System.Drawing.Color.Transparent;
+      this.btnDiskSpacer.FlatAppearance.MouseOverBackColor = System.Drawing.Color.Transparent;
+      this.btnDiskSpacer.FlatStyle = System.Windows.Forms.FlatStyle.Flat;
+      this.btnDiskSpacer.Location = new System.Drawing.Point(557, 3);
+      this.btnDiskSpacer.Name = "btnDiskSpacer";
+      this.btnDiskSpacer.Size = new System.Drawing.Size(12, 18);
+      this.btnDiskSpacer.TabIndex = 12;
+      this.btnDiskSpacer.UseVisualStyleBackColor = true;
+      this.btnDiskSpacer.Visible = false;
+      // 
+      // lblDisk
+      // 
+      this.lblDisk.AutoSize = true;
+      this.lblDisk.FlatStyle = System.Windows.Forms.FlatStyle.Flat;
+      this.lblDisk.Font = new System.Drawing.Font("Consolas", 8.25F, System.Drawing.FontStyle.Regular, System.Drawing.GraphicsUnit.Point, ((byte)(0)));
+      this.lblDisk.Location = new System.Drawing.Point(575, 3);
+      this.lblDisk.Margin = new System.Windows.Forms.Padding(3);
+      this.lblDisk.Name = "lblDisk";
+      this.lblDisk.Size = new System.Drawing.Size(187, 13);
+      this.lblDisk.TabIndex = 13;
+      this.lblDisk.Text = "Disk: 0/128 MB, 0 ms, 0 stalls";
+      this.lblDisk.TextAlign = System.Drawing.ContentAlignment.MiddleLeft;
+      this.lblDisk.Visible = false;
+      // 
       // InfobarCapture
       // 
       this.AutoScaleDimensions = new System.Drawing.SizeF(6F, 13F);
@@ -243,5 +275,7 @@
         private System.Windows.Forms.Button button5;
         private System.Windows.Forms.Button button6;
         private System.Windows.Forms.Label lblDrops;
+        private System.Windows.Forms.Button btnDiskSpacer;
+        private System.Windows.Forms.Label lblDisk;
     }
 }
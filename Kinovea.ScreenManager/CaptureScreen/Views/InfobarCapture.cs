@@ -18,12 +18,19 @@ namespace Kinovea.ScreenManager
             InitializeComponent();
         }
 
-        public void UpdateValues(string signal, string bandwidth, string load, string drops)
+        public void UpdateValues(string signal, string bandwidth, string load, string drops, string disk)
         {
             lblSignal.Text = "Signal:" + signal;
             lblBandwidth.Text = "Throughput:" + bandwidth;
             lblLoad.Text = "Load:" + load;
             lblDrops.Text = "Drops:" + drops;
+
+            // The disk queue is only shown while recording through the write-behind stream.
+            bool hasDisk = !string.IsNullOrEmpty(disk);
+            btnDiskSpacer.Visible = hasDisk;
+            lblDisk.Visible = hasDisk;
+            if (hasDisk)
+                lblDisk.Text = "Disk:" + disk;
         }
 
         public void UpdateLoadStatus(LoadStatus status)
@@ -299,6 +299,8 @@ namespace Kinovea.ScreenManager
         private bool m_bManualSqueeze = true; // If it's allowed to manually reduce the rendering surface under the aspect ratio size.
         private static readonly Pen m_PenImageBorder = Pens.SteelBlue;
         private static readonly Size m_MinimalSize = new Size(160, 120);
+        private static readonly Font m_FontDecodingStatistics = new Font("Consolas", 8);
+        private static readonly SolidBrush m_BrushDecodingStatistics = new SolidBrush(Color.FromArgb(160, Color.Black));
         private bool m_bEnableCustomDecodingSize = true;
 
         // Selection and current position. All values in absolute timestamps.
@@ -1637,6 +1639,21 @@ namespace Kinovea.ScreenManager
             // Called back from main drawing routine.
             _canvas.DrawRectangle(m_PenImageBorder, 0, 0, pbSurfaceScreen.Width - m_PenImageBorder.Width, pbSurfaceScreen.Height - m_PenImageBorder.Width);
         }
+        private void DrawDecodingStatistics(Graphics _canvas)
+        {
+            // Time spent in each decoding stage, on top of the image. Not part of exported images.
+            DecodingStatistics statistics = m_FrameServer.VideoReader.DecodingStatistics;
+            if (statistics == null)
+                return;
+
+            string text = statistics.ToString();
+            if (string.IsNullOrEmpty(text))
+                return;
+
+            SizeF size = _canvas.MeasureString(text, m_FontDecodingStatistics);
+            _canvas.FillRectangle(m_BrushDecodingStatistics, 0, 0, size.Width + 8, size.Height + 8);
+            _canvas.DrawString(text, m_FontDecodingStatistics, Brushes.White, 4, 4);
+        }
         private void DisablePlayAndDraw()
         {
             StopPlaying();
@@ -3728,6 +3745,9 @@ namespace Kinovea.ScreenManager
 
                     FlushOnGraphics(m_FrameServer.CurrentImage, e.Graphics, m_viewportManipulator.RenderingSize, iKeyFrameIndex, m_iCurrentPosition, m_FrameServer.ImageTransform);
 
+                    if (PreferencesManager.PlayerPreferences.ShowDecodingStatistics)
+                        DrawDecodingStatistics(e.Graphics);
+
                     if (m_MessageToaster.Enabled)
                         m_MessageToaster.Draw(e.Graphics);
 
@@ -135,6 +135,9 @@ namespace Kinovea.ScreenManager
                 if(videoReader != null)
                 {
                     videoReader.Options = new VideoOptions(PreferencesManager.PlayerPreferences.AspectRatio, ImageRotation.Rotate0, Demosaicing.None, PreferencesManager.PlayerPreferences.DeinterlaceByDefault);
+                    videoReader.Options.DecodingThreads = PreferencesManager.PlayerPreferences.DecodingThreads;
+                    videoReader.Options.PlanarCache = PreferencesManager.PlayerPreferences.PlanarCache;
+                    videoReader.Options.ReadAheadMemory = PreferencesManager.PlayerPreferences.ReadAheadMemory;
                     return videoReader.Open(filePath);
                 }
                 else
@@ -178,6 +181,7 @@ namespace Kinovea.ScreenManager
                 metadata.CalibrationHelper.CaptureFramesPerSecond = videoReader.Info.FramesPerSeconds;
                 metadata.FirstTimeStamp = videoReader.Info.FirstTimeStamp;
                 metadata.ImageRotation = videoReader.Info.ImageRotation;
+                metadata.Demosaicing = videoReader.Info.Demosaicing;
             }
 
             metadata.PostSetup(init);
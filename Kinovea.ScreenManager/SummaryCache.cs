@@ -0,0 +1,646 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Drawing;
+using System.Drawing.Imaging;
+using System.IO;
+using System.IO.MemoryMappedFiles;
+using System.Linq;
+using System.Text;
+using System.Threading;
+using Kinovea.Services;
+using Kinovea.Video;
+
+namespace Kinovea.ScreenManager
+{
+    /// <summary>
+    /// Persistent cache of video summaries for the file explorer.
+    ///
+    /// The summaries are stored in a single pack file in the user profile, with the thumbnails compressed in JPEG.
+    /// A separate index maps each video to its record in the pack.
+    /// Entries are identified by the path of the video and validated against its size and last write time,
+    /// a modified video is a miss and its stale record is dropped at the next compaction.
+    /// Records are only ever appended to the pack. When the pack grows past its budget it is rewritten with
+    /// the most recently used entries only.
+    ///
+    /// Reads go through a memory mapping of the pack. Thread safe, several summary loaders may be alive at the same time.
+    ///
+    /// The files are shared by all the running instances of the program. Writes to the pack and the index are serialized
+    /// between processes with a named mutex. The index of another instance may be out of date after a compaction,
+    /// so each record starts with the key and file stamp it was written for, and a record that doesn't match its entry is a miss.
+    /// Compaction writes a new pack generation instead of replacing the pack another instance may have mapped.
+    /// </summary>
+    public class SummaryCache
+    {
+        #region Properties
+        public static SummaryCache Instance
+        {
+            get { return instance; }
+        }
+
+        /// <summary>
+        /// Number of summaries served from the cache since the start.
+        /// </summary>
+        public int Hits
+        {
+            get { return hits; }
+        }
+
+        /// <summary>
+        /// Number of summaries that had to be extracted since the start.
+        /// </summary>
+        public int Misses
+        {
+            get { return misses; }
+        }
+        #endregion
+
+        #region Members
+        private static SummaryCache instance = new SummaryCache();
+        private const string indexMagic = "KSI";
+        private const string packMagic = "KSP";
+        private const int formatVersion = 3;
+        private const long maxPackBytes = 128 * 1024 * 1024;
+        private const double compactionRatio = 0.75;
+        private const long jpegQuality = 85;
+        private const string fileLockName = "Kinovea.SummaryCache";
+        private const int fileLockTimeout = 2000;
+
+        private string indexFile;
+        private string packFile;
+        private int packGeneration;
+        private Dictionary<string, SummaryCacheEntry> entries;
+        private MemoryMappedFile map;
+        private long mappedLength;
+        private long packLength;
+        private bool dirty;
+        private int hits;
+        private int misses;
+        private object locker = new object();
+        private Mutex fileLock = new Mutex(false, fileLockName);
+        private static readonly log4net.ILog log = log4net.LogManager.GetLogger(System.Reflection.MethodBase.GetCurrentMethod().DeclaringType);
+        #endregion
+
+        private SummaryCache()
+        {
+            indexFile = Path.Combine(Software.CacheDirectory, "Summaries.index");
+            packFile = GetPackFile(0);
+        }
+
+        #region Public methods
+        /// <summary>
+        /// Returns the cached summary of this file, or null if there is none or if it is stale or too small.
+        /// </summary>
+        public VideoSummary Get(string filename, Size maxImageSize)
+        {
+            string key = GetKey(filename);
+            byte[] record = null;
+
+            // File system access stays out of the lock, it may be slow on network shares.
+            long size;
+            long lastWrite;
+            bool exists = GetFileStamp(filename, out size, out lastWrite);
+
+            lock (locker)
+            {
+                EnsureLoaded();
+
+                SummaryCacheEntry entry;
+                if (!entries.TryGetValue(key, out entry))
+                {
+                    misses++;
+                    return null;
+                }
+
+                if (!exists || size != entry.FileSize || lastWrite != entry.LastWrite)
+                {
+                    // The video was modified or removed.
+                    entries.Remove(key);
+                    dirty = true;
+                    misses++;
+                    return null;
+                }
+
+                // Thumbnails are never upscaled.
+                if (entry.MaxImageSize.Width < maxImageSize.Width || entry.MaxImageSize.Height < maxImageSize.Height)
+                {
+                    misses++;
+                    return null;
+                }
+
+                record = ReadRecord(key, entry);
+                if (record != null)
+                    entry.LastAccess = DateTime.UtcNow.Ticks;
+            }
+
+            // Decoding the thumbnails doesn't need the lock, loaders run in parallel.
+            VideoSummary summary = record != null ? ParseRecord(filename, record) : null;
+
+            lock (locker)
+            {
+                if (summary == null)
+                {
+                    entries.Remove(key);
+                    misses++;
+                }
+                else
+                {
+                    hits++;
+                }
+
+                dirty = true;
+            }
+
+            return summary;
+        }
+
+        /// <summary>
+        /// Appends the summary to the pack and references it in the index.
+        /// </summary>
+        public void Put(VideoSummary summary, Size maxImageSize)
+        {
+            if (summary == null || summary.Thumbs.Count == 0)
+                return;
+
+            long size;
+            long lastWrite;
+            if (!GetFileStamp(summary.Filename, out size, out lastWrite))
+                return;
+
+            string key = GetKey(summary.Filename);
+            byte[] record = CreateRecord(summary, key, size, lastWrite);
+            if (record == null)
+                return;
+
+            lock (locker)
+            {
+                EnsureLoaded();
+
+                if (!AcquireFileLock())
+                {
+                    log.Error("Summary could not be added to the cache, another instance is holding it.");
+                    return;
+                }
+
+                try
+                {
+                    using (FileStream stream = new FileStream(packFile, FileMode.Append, FileAccess.Write, FileShare.ReadWrite))
+                    {
+                        if (stream.Position == 0)
+                            WriteHeader(stream, packMagic);
+
+                        long offset = stream.Position;
+                        stream.Write(record, 0, record.Length);
+                        packLength = stream.Position;
+
+                        SummaryCacheEntry entry = new SummaryCacheEntry();
+                        entry.FileSize = size;
+                        entry.LastWrite = lastWrite;
+                        entry.MaxImageSize = maxImageSize;
+                        entry.Offset = offset;
+                        entry.Length = record.Length;
+                        entry.LastAccess = DateTime.UtcNow.Ticks;
+                        entries[key] = entry;
+                        dirty = true;
+                    }
+                }
+                catch (Exception e)
+                {
+                    log.ErrorFormat("Summary could not be added to the cache. {0}", e.Message);
+                }
+                finally
+                {
+                    fileLock.ReleaseMutex();
+                }
+            }
+        }
+
+        /// <summary>
+        /// Saves the index and compacts the pack if it's over budget.
+        /// Called when a summary loader has finished its batch.
+        /// </summary>
+        public void Flush()
+        {
+            lock (locker)
+            {
+                if (entries == null)
+                    return;
+
+                if (packLength <= maxPackBytes && !dirty)
+                    return;
+
+                if (!AcquireFileLock())
+                    return;
+
+                try
+                {
+                    if (packLength > maxPackBytes)
+                        Compact();
+
+                    if (dirty)
+                        SaveIndex();
+                }
+                finally
+                {
+                    fileLock.ReleaseMutex();
+                }
+            }
+        }
+        #endregion
+
+        #region Index
+        private void EnsureLoaded()
+        {
+            if (entries != null)
+                return;
+
+            entries = new Dictionary<string, SummaryCacheEntry>();
+            packLength = File.Exists(packFile) ? new FileInfo(packFile).Length : 0;
+
+            if (!File.Exists(indexFile))
+                return;
+
+            try
+            {
+                using (BinaryReader r = new BinaryReader(File.OpenRead(indexFile)))
+                {
+                    if (!ReadHeader(r, indexMagic))
+                        return;
+
+                    // The index names the pack it was written for, see Compact.
+                    packGeneration = r.ReadInt32();
+                    packFile = GetPackFile(packGeneration);
+                    packLength = File.Exists(packFile) ? new FileInfo(packFile).Length : 0;
+
+                    int count = r.ReadInt32();
+                    for (int i = 0; i < count; i++)
+                    {
+                        string key = r.ReadString();
+                        SummaryCacheEntry entry = new SummaryCacheEntry();
+                        entry.FileSize = r.ReadInt64();
+                        entry.LastWrite = r.ReadInt64();
+                        entry.MaxImageSize = new Size(r.ReadInt32(), r.ReadInt32());
+                        entry.Offset = r.ReadInt64();
+                        entry.Length = r.ReadInt32();
+                        entry.LastAccess = r.ReadInt64();
+
+                        // Records lost to a partially written pack.
+                        if (entry.Offset + entry.Length <= packLength)
+                            entries[key] = entry;
+                    }
+                }
+            }
+            catch (Exception e)
+            {
+                log.ErrorFormat("Summary cache index could not be loaded, starting afresh. {0}", e.Message);
+                entries.Clear();
+            }
+        }
+
+        private void SaveIndex()
+        {
+            try
+            {
+                using (BinaryWriter w = new BinaryWriter(File.Create(indexFile)))
+                {
+                    WriteHeader(w.BaseStream, indexMagic);
+                    w.Write(packGeneration);
+                    w.Write(entries.Count);
+                    foreach (KeyValuePair<string, SummaryCacheEntry> pair in entries)
+                    {
+                        SummaryCacheEntry entry = pair.Value;
+                        w.Write(pair.Key);
+                        w.Write(entry.FileSize);
+                        w.Write(entry.LastWrite);
+                        w.Write(entry.MaxImageSize.Width);
+                        w.Write(entry.MaxImageSize.Height);
+                        w.Write(entry.Offset);
+                        w.Write(entry.Length);
+                        w.Write(entry.LastAccess);
+                    }
+                }
+
+                dirty = false;
+            }
+            catch (Exception e)
+            {
+                log.ErrorFormat("Summary cache index could not be saved. {0}", e.Message);
+            }
+        }
+
+        private void Compact()
+        {
+            // Rewrite the pack with the most recently used entries that fit in the reduced budget.
+            // Stale records and records of deleted videos are dropped in the process.
+            // Records moved by another instance since our index was loaded don't match their entry and are dropped too.
+            // Always called with the file lock held.
+            //
+            // The compacted pack is a new file, named after the next generation and recorded in the index.
+            // Another instance may still have the old pack mapped, it can't be replaced in place.
+            CloseMap();
+
+            int newGeneration = packGeneration + 1;
+            string newPackFile = GetPackFile(newGeneration);
+            long budget = (long)(maxPackBytes * compactionRatio);
+            long newPackLength = 0;
+            Dictionary<string, SummaryCacheEntry> kept = new Dictionary<string, SummaryCacheEntry>();
+            long written = 0;
+
+            try
+            {
+                using (FileStream source = new FileStream(packFile, FileMode.Open, FileAccess.Read, FileShare.ReadWrite))
+                using (FileStream target = new FileStream(newPackFile, FileMode.Create, FileAccess.Write))
+                {
+                    WriteHeader(target, packMagic);
+
+                    foreach (KeyValuePair<string, SummaryCacheEntry> pair in entries.OrderByDescending(p => p.Value.LastAccess))
+                    {
+                        SummaryCacheEntry entry = pair.Value;
+                        if (written + entry.Length > budget)
+                            break;
+
+                        if (!File.Exists(pair.Key))
+                            continue;
+
+                        byte[] record = new byte[entry.Length];
+                        source.Seek(entry.Offset, SeekOrigin.Begin);
+                        if (source.Read(record, 0, record.Length) != record.Length || !IsRecordOf(record, pair.Key, entry))
+                            continue;
+
+                        // The current entries must stay valid in case the compaction fails.
+                        SummaryCacheEntry moved = entry.Clone();
+                        moved.Offset = target.Position;
+                        target.Write(record, 0, record.Length);
+                        written += record.Length;
+                        kept.Add(pair.Key, moved);
+                    }
+
+                    newPackLength = target.Position;
+                }
+            }
+            catch (Exception e)
+            {
+                // The old pack and index are untouched and still consistent, keep using them.
+                log.ErrorFormat("Summary cache could not be compacted. {0}", e.Message);
+                TryDelete(newPackFile);
+                return;
+            }
+
+            log.DebugFormat("Summary cache compacted. Kept {0} of {1} entries, {2:0.0} MB.", kept.Count, entries.Count, (double)newPackLength / (1024 * 1024));
+            entries = kept;
+            packGeneration = newGeneration;
+            packFile = newPackFile;
+            packLength = newPackLength;
+            dirty = true;
+
+            // Older packs go away now, or when the last instance still reading them closes them.
+            try
+            {
+                foreach (string file in Directory.GetFiles(Software.CacheDirectory, "Summaries*.pack"))
+                {
+                    if (!string.Equals(file, packFile, StringComparison.OrdinalIgnoreCase))
+                        TryDelete(file);
+                }
+            }
+            catch (Exception)
+            {
+            }
+        }
+        #endregion
+
+        #region Records
+        private byte[] CreateRecord(VideoSummary summary, string key, long size, long lastWrite)
+        {
+            // Record layout: key and file stamp of the video, summary fields, thumbnail count,
+            // then each thumbnail as length-prefixed JPEG.
+            try
+            {
+                ImageCodecInfo encoder = ImageCodecInfo.GetImageEncoders().First(c => c.FormatID == ImageFormat.Jpeg.Guid);
+                EncoderParameters parameters = new EncoderParameters(1);
+                parameters.Param[0] = new EncoderParameter(System.Drawing.Imaging.Encoder.Quality, jpegQuality);
+
+                using (MemoryStream stream = new MemoryStream())
+                using (BinaryWriter w = new BinaryWriter(stream))
+                {
+                    w.Write(key);
+                    w.Write(size);
+                    w.Write(lastWrite);
+                    w.Write(summary.IsImage);
+                    w.Write(summary.ImageSize.Width);
+                    w.Write(summary.ImageSize.Height);
+                    w.Write(summary.DurationMilliseconds);
+                    w.Write(summary.Framerate);
+                    w.Write(summary.Thumbs.Count);
+
+                    foreach (Bitmap thumb in summary.Thumbs)
+                    {
+                        using (MemoryStream jpeg = new MemoryStream())
+                        {
+                            thumb.Save(jpeg, encoder, parameters);
+                            w.Write((int)jpeg.Length);
+                            jpeg.WriteTo(stream);
+                        }
+                    }
+
+                    w.Flush();
+                    return stream.ToArray();
+                }
+            }
+            catch (Exception e)
+            {
+                log.ErrorFormat("Summary could not be serialized. {0}", e.Message);
+                return null;
+            }
+        }
+
+        private byte[] ReadRecord(string key, SummaryCacheEntry entry)
+        {
+            // The record must have been written for this video. The offsets of the index may be out of date
+            // if another instance compacted the pack since we loaded it.
+            try
+            {
+                if (map == null || entry.Offset + entry.Length > mappedLength)
+                    OpenMap();
+
+                using (MemoryMappedViewStream view = map.CreateViewStream(entry.Offset, entry.Length, MemoryMappedFileAccess.Read))
+                {
+                    byte[] record = new byte[entry.Length];
+                    if (view.Read(record, 0, record.Length) != record.Length)
+                        return null;
+
+                    if (!IsRecordOf(record, key, entry))
+                    {
+                        // Remap on next read in case the pack file itself was replaced.
+                        log.Debug("Summary cache record doesn't match its entry, the pack was modified by another instance.");
+                        view.Dispose();
+                        CloseMap();
+                        return null;
+                    }
+
+                    return record;
+                }
+            }
+            catch (Exception e)
+            {
+                log.ErrorFormat("Summary could not be read from the cache. {0}", e.Message);
+                return null;
+            }
+        }
+
+        private VideoSummary ParseRecord(string filename, byte[] record)
+        {
+            try
+            {
+                using (BinaryReader r = new BinaryReader(new MemoryStream(record)))
+                {
+                    // Key and file stamp, already checked.
+                    r.ReadString();
+                    r.ReadInt64();
+                    r.ReadInt64();
+
+                    VideoSummary summary = new VideoSummary(filename);
+                    summary.IsImage = r.ReadBoolean();
+                    summary.ImageSize = new Size(r.ReadInt32(), r.ReadInt32());
+                    summary.DurationMilliseconds = r.ReadInt64();
+                    summary.Framerate = r.ReadDouble();
+
+                    int count = r.ReadInt32();
+                    for (int i = 0; i < count; i++)
+                    {
+                        int length = r.ReadInt32();
+                        using (MemoryStream jpeg = new MemoryStream(r.ReadBytes(length)))
+                        using (Image image = Image.FromStream(jpeg))
+                        {
+                            // Detach the bitmap from the stream.
+                            summary.Thumbs.Add(new Bitmap(image));
+                        }
+                    }
+
+                    return summary;
+                }
+            }
+            catch (Exception e)
+            {
+                log.ErrorFormat("Summary could not be parsed. {0}", e.Message);
+                return null;
+            }
+        }
+
+        private static bool IsRecordOf(byte[] record, string key, SummaryCacheEntry entry)
+        {
+            try
+            {
+                using (BinaryReader r = new BinaryReader(new MemoryStream(record)))
+                    return r.ReadString() == key && r.ReadInt64() == entry.FileSize && r.ReadInt64() == entry.LastWrite;
+            }
+            catch (Exception)
+            {
+                return false;
+            }
+        }
+
+        private void OpenMap()
+        {
+            // The mapping covers the pack as it is now. It is reopened when a record appended later is requested.
+            CloseMap();
+            FileStream stream = new FileStream(packFile, FileMode.Open, FileAccess.Read, FileShare.ReadWrite | FileShare.Delete);
+            mappedLength = stream.Length;
+            map = MemoryMappedFile.CreateFromFile(stream, null, 0, MemoryMappedFileAccess.Read, null, HandleInheritability.None, false);
+        }
+
+        private void CloseMap()
+        {
+            if (map == null)
+                return;
+
+            map.Dispose();
+            map = null;
+            mappedLength = 0;
+        }
+        #endregion
+
+        #region Low level
+        private static string GetKey(string filename)
+        {
+            return Path.GetFullPath(filename).ToLowerInvariant();
+        }
+
+        private static bool GetFileStamp(string filename, out long size, out long lastWrite)
+        {
+            size = 0;
+            lastWrite = 0;
+            try
+            {
+                FileInfo info = new FileInfo(filename);
+                if (!info.Exists)
+                    return false;
+
+                size = info.Length;
+                lastWrite = info.LastWriteTimeUtc.Ticks;
+                return true;
+            }
+            catch (Exception)
+            {
+                return false;
+            }
+        }
+
+        private bool AcquireFileLock()
+        {
+            try
+            {
+                return fileLock.WaitOne(fileLockTimeout);
+            }
+            catch (AbandonedMutexException)
+            {
+                // The instance holding it exited without releasing it, we own it now.
+                return true;
+            }
+        }
+
+        private static void WriteHeader(Stream stream, string magic)
+        {
+            byte[] header = Encoding.ASCII.GetBytes(magic).Concat(BitConverter.GetBytes(formatVersion)).ToArray();
+            stream.Write(header, 0, header.Length);
+        }
+
+        private static bool ReadHeader(BinaryReader r, string magic)
+        {
+            string actual = Encoding.ASCII.GetString(r.ReadBytes(magic.Length));
+            return actual == magic && r.ReadInt32() == formatVersion;
+        }
+
+        private static string GetPackFile(int generation)
+        {
+            string name = generation == 0 ? "Summaries.pack" : string.Format("Summaries.{0}.pack", generation);
+            return Path.Combine(Software.CacheDirectory, name);
+        }
+
+        private static void TryDelete(string file)
+        {
+            try
+            {
+                if (File.Exists(file))
+                    File.Delete(file);
+            }
+            catch (Exception)
+            {
+            }
+        }
+        #endregion
+
+        private class SummaryCacheEntry
+        {
+            public long FileSize;
+            public long LastWrite;
+            public Size MaxImageSize;
+            public long Offset;
+            public int Length;
+            public long LastAccess;
+
+            public SummaryCacheEntry Clone()
+            {
+                return (SummaryCacheEntry)MemberwiseClone();
+            }
+        }
+    }
+}
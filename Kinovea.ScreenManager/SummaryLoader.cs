@@ -6,16 +6,23 @@ Licensed under the MIT license: http://www.opensource.org/licenses/mit-license.p
 #endregion
 using System;
 using System.Collections.Generic;
-using System.ComponentModel;
 using System.Diagnostics;
 using System.Drawing;
 using System.IO;
+using System.Linq;
 using System.Threading;
 
+using Kinovea.Services;
 using Kinovea.Video;
 
 namespace Kinovea.ScreenManager
 {
+    /// <summary>
+    /// Extracts the summaries of a list of files on a small pool of worker threads.
+    /// Files are taken from a shared queue, the viewer can move the visible ones to the front at any time.
+    /// Results are raised on the thread that called Run(), in completion order.
+    /// Progress is counted on delivery, so the summary reported last is always the last one raised.
+    /// </summary>
     public class SummaryLoader
     {
         public bool IsAlive 
@@ -25,18 +32,32 @@ namespace Kinovea.ScreenManager
 
         public event EventHandler<SummaryLoadedEventArgs> SummaryLoaded;
         
-        private bool isAlive;
-        private bool cancellationPending;
+        private volatile bool isAlive;
+        private volatile bool cancellationPending;
         private List<String> filenames;
+        private List<String> pending;
         private Size maxImageSize;
-        private BackgroundWorker bgWorker = new BackgroundWorker();
+        private int degreeOfParallelism;
+        private int runningWorkers;
+        private int delivered;
+        private SynchronizationContext context;
+        private object locker = new object();
         private const int thumbnailsToExtract = 5;
+        private const int maxAutomaticThreads = 4;
         private static readonly log4net.ILog log = log4net.LogManager.GetLogger(System.Reflection.MethodBase.GetCurrentMethod().DeclaringType);
         
         public SummaryLoader(List<String> filenames, Size maxImageSize)
         {
             this.filenames = filenames;
             this.maxImageSize = maxImageSize;
+
+            // Running one extraction per file all at once does more harm than good, 
+            // especially on network shares. Keep the pool small.
+            int threads = PreferencesManager.FileExplorerPreferences.SummaryLoadingThreads;
+            if (threads <= 0)
+                threads = Math.Min(maxAutomaticThreads, Math.Max(1, Environment.ProcessorCount / 2));
+
+            degreeOfParallelism = threads;
         }
         public void Run()
         {
@@ -44,72 +65,128 @@ namespace Kinovea.ScreenManager
                 return;
             
             isAlive = true;
-            bgWorker.RunWorkerCompleted += bgWorker_RunWorkerCompleted;
-            bgWorker.ProgressChanged += bgWorker_ProgressChanged;
-            bgWorker.DoWork += bgWorker_DoWork;
-            bgWorker.WorkerSupportsCancellation = true;
-            bgWorker.WorkerReportsProgress = true;
-            bgWorker.RunWorkerAsync(filenames);
+            context = SynchronizationContext.Current;
+            pending = new List<string>(filenames);
+            runningWorkers = Math.Min(degreeOfParallelism, filenames.Count);
+
+            for (int i = 0; i < runningWorkers; i++)
+            {
+                Thread thread = new Thread(Worker);
+                thread.Name = string.Format("SummaryLoader {0}", i);
+                thread.IsBackground = true;
+                thread.Priority = ThreadPriority.BelowNormal;
+                thread.Start();
+            }
         }
         public void Cancel()
         {
-            cancellationPending = true;
-            bgWorker.CancelAsync();
+            // Files being extracted will complete but nothing will be raised.
+            lock (locker)
+            {
+                cancellationPending = true;
+                if (pending != null)
+                    pending.Clear();
+            }
         }
-        private void bgWorker_DoWork(object sender, DoWorkEventArgs e)
+
+        /// <summary>
+        /// Move these files to the front of the queue, in the order passed.
+        /// Files already extracted or in progress are ignored.
+        /// </summary>
+        public void Prioritize(IEnumerable<string> files)
         {
-            // Note: having one background worker per file and running them all in parallel was tested
-            // but it does more harm than good.
-            BackgroundWorker bgWorker = sender as BackgroundWorker;
-            List<string> filenames = e.Argument as List<string>;
-            
-            if(filenames.Count < 1 || bgWorker == null)
-        	{
-        	    e.Result = null;
-        	    return;
-        	}
+            lock (locker)
+            {
+                if (pending == null || pending.Count == 0)
+                    return;
 
-            for (int i = 0; i<filenames.Count; i++)
+                HashSet<string> queued = new HashSet<string>(pending);
+                List<string> first = files.Where(f => queued.Contains(f)).Distinct().ToList();
+                if (first.Count == 0)
+                    return;
+
+                HashSet<string> moved = new HashSet<string>(first);
+                pending.RemoveAll(f => moved.Contains(f));
+                pending.InsertRange(0, first);
+            }
+        }
+        private void Worker()
+        {
+            while (true)
             {
-                if(bgWorker.CancellationPending)
+                string filename;
+                lock (locker)
+                {
+                    if (cancellationPending || pending.Count == 0)
+                        break;
+
+                    filename = pending[0];
+                    pending.RemoveAt(0);
+                }
+
+                if(string.IsNullOrEmpty(filename))
+                    continue;
+
+                VideoSummary summary = ExtractSummary(filename);
+                if (cancellationPending)
                     break;
-                
-                string filename = filenames[i];
-                VideoSummary summary = null;
+
+                Report(summary);
+            }
+
+            if (Interlocked.Decrement(ref runningWorkers) == 0)
+            {
+                SummaryCache.Instance.Flush();
+                isAlive = false;
+            }
+        }
+        private VideoSummary ExtractSummary(string filename)
+        {
+            VideoSummary summary = null;
                
-                try
+            try
+            {
+                // Revisited folders are served from the persistent cache.
+                summary = SummaryCache.Instance.Get(filename, maxImageSize);
+                if (summary == null)
                 {
-                    if(string.IsNullOrEmpty(filename))
-                       continue;
-                    
                     string extension = Path.GetExtension(filename);
                     VideoReader reader = VideoTypeManager.GetVideoReader(extension);
 
-        			if(reader != null)
+                    if (reader != null)
+                    {
                         summary = reader.ExtractSummary(filename, thumbnailsToExtract, maxImageSize);
+                        SummaryCache.Instance.Put(summary, maxImageSize);
+                    }
                 }
-                catch(Exception exp)
-                {
-                    log.ErrorFormat("Error while extracting video summary for {0}.", filename);
-                    log.Error(exp);
-                }
-                
-                if(summary == null)
-                    summary = new VideoSummary(filename);
-                
-    			bgWorker.ReportProgress(i, summary);
             }
+            catch(Exception exp)
+            {
+                log.ErrorFormat("Error while extracting video summary for {0}.", filename);
+                log.Error(exp);
+            }
+                
+            if(summary == null)
+                summary = new VideoSummary(filename);
+
+            return summary;
+        }
+        private void Report(VideoSummary summary)
+        {
+            if (context != null)
+                context.Post(state => RaiseSummaryLoaded(summary), null);
+            else
+                RaiseSummaryLoaded(summary);
         }
-        private void bgWorker_ProgressChanged(object sender, ProgressChangedEventArgs e)
+        private void RaiseSummaryLoaded(VideoSummary summary)
         {
             if(cancellationPending || SummaryLoaded == null)
                 return;
             
-            SummaryLoaded(this, new SummaryLoadedEventArgs(e.UserState as VideoSummary, e.ProgressPercentage));
-        }
-        private void bgWorker_RunWorkerCompleted(object sender, RunWorkerCompletedEventArgs e)
-        {
-            isAlive = false;
+            // Workers may post out of order relative to when they finished, 
+            // the running count must follow the order of delivery.
+            int progress = Interlocked.Increment(ref delivered) - 1;
+            SummaryLoaded(this, new SummaryLoadedEventArgs(summary, progress));
         }
     }
 }
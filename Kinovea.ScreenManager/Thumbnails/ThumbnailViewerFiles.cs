@@ -75,6 +75,8 @@ namespace Kinovea.ScreenManager
             this.Dock = DockStyle.Fill;
 
             NotificationCenter.FileSelected += NotificationCenter_FileSelected;
+            this.Scroll += (s, e) => PrioritizeVisible();
+            this.MouseWheel += (s, e) => PrioritizeVisible();
 
             this.Hotkeys = HotkeySettingsManager.LoadHotkeys("ThumbnailViewerFiles");
 
@@ -239,6 +241,23 @@ namespace Kinovea.ScreenManager
                 BeforeLoad(this, EventArgs.Empty);
 
             sl.Run();
+            PrioritizeVisible();
+        }
+        private void PrioritizeVisible()
+        {
+            // Ask the loaders to extract the thumbnails in the viewport first.
+            if (loaders.Count == 0)
+                return;
+
+            List<string> visible = thumbnails.Where(t => ClientRectangle.IntersectsWith(t.Bounds)).Select(t => t.FileName).ToList();
+            if (visible.Count == 0)
+                return;
+
+            foreach (SummaryLoader loader in loaders)
+            {
+                if (loader.IsAlive)
+                    loader.Prioritize(visible);
+            }
         }
         private void CleanupLoaders()
         {
@@ -455,8 +474,11 @@ namespace Kinovea.ScreenManager
         private void ThumbnailViewerFiles_Resize(object sender, EventArgs e)
         {
             // When manually resizing the control, we don't trigger the full populate.
-            if(this.Visible)
+            if (this.Visible)
+            {
                 DoLayout();
+                PrioritizeVisible();
+            }
         }
 
         protected override bool ProcessCmdKey(ref Message msg, Keys keyData)
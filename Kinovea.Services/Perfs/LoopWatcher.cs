@@ -33,18 +33,28 @@ namespace Kinovea.Services
     {
         private long m_Loops;
         private double m_Time;
+        private double m_Last;
         private Stopwatch m_Stopwatch = new Stopwatch();
         
         public void AddLoopTime(double time)
         {
             m_Loops++;
             m_Time += time;
+            m_Last = time;
         }
         public double Average {
             get {
                 return m_Loops > 0 ? m_Time / m_Loops : 0;
             }
         }
+        /// <summary>
+        /// Time of the last loop.
+        /// </summary>
+        public double Last {
+            get {
+                return m_Last;
+            }
+        }
         public void Restart()
         {
             m_Loops = 0;
@@ -57,7 +67,7 @@ namespace Kinovea.Services
         }
         public void LoopEnd()
         {
-            AddLoopTime(m_Stopwatch.ElapsedMilliseconds);
+            AddLoopTime(m_Stopwatch.Elapsed.TotalMilliseconds);
             m_Stopwatch.Stop();
         }
     }
@@ -0,0 +1,212 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+using System.Diagnostics;
+
+namespace Kinovea.Services
+{
+    /// <summary>
+    /// Distribution of the last durations of a recurring task.
+    /// Durations are counted in buckets of doubling width, from 2µs up to about 2s. Only the most recent samples are kept.
+    /// </summary>
+    /// <remarks>
+    /// Adding a sample is cheap enough to be done for every frame.
+    /// Samples are added by the worker thread and the distribution may be queried from any thread, all access is locked.
+    /// </remarks>
+    public class RollingHistogram
+    {
+        #region Properties
+        /// <summary>
+        /// Number of samples in the window.
+        /// </summary>
+        public int Count
+        {
+            get { lock (locker) return count; }
+        }
+
+        /// <summary>
+        /// Number of samples added since the last clear, including those that went out of the window.
+        /// </summary>
+        public long Total
+        {
+            get { lock (locker) return total; }
+        }
+
+        /// <summary>
+        /// Average duration of the samples in the window, in milliseconds.
+        /// </summary>
+        public double MeanMilliseconds
+        {
+            get { lock (locker) return count > 0 ? TicksToMilliseconds(sumTicks) / count : 0; }
+        }
+
+        /// <summary>
+        /// Sum of the durations of the samples in the window, in milliseconds.
+        /// </summary>
+        public double SumMilliseconds
+        {
+            get { lock (locker) return TicksToMilliseconds(sumTicks); }
+        }
+        #endregion
+
+        #region Members
+        public const int BucketCount = 21;
+        private long[] window;
+        private int next;
+        private int count;
+        private long total;
+        private long sumTicks;
+        private int[] buckets = new int[BucketCount];
+        private readonly object locker = new object();
+        private static readonly double ticksToMicros = 1000000.0 / Stopwatch.Frequency;
+        #endregion
+
+        public RollingHistogram(int capacity)
+        {
+            if (capacity < 1)
+                throw new ArgumentOutOfRangeException("capacity");
+
+            window = new long[capacity];
+        }
+
+        #region Public methods
+        /// <summary>
+        /// Adds a duration expressed in Stopwatch ticks.
+        /// </summary>
+        public void Add(long ticks)
+        {
+            if (ticks < 0)
+                ticks = 0;
+
+            lock (locker)
+            {
+                if (count == window.Length)
+                {
+                    long evicted = window[next];
+                    buckets[GetBucket(evicted)]--;
+                    sumTicks -= evicted;
+                }
+                else
+                {
+                    count++;
+                }
+
+                window[next] = ticks;
+                next = (next + 1) % window.Length;
+                buckets[GetBucket(ticks)]++;
+                sumTicks += ticks;
+                total++;
+            }
+        }
+
+        /// <summary>
+        /// Returns the duration under which the given fraction of the samples fall, in milliseconds.
+        /// The value is interpolated inside the bucket containing the percentile.
+        /// </summary>
+        public double Percentile(double fraction)
+        {
+            fraction = Math.Min(Math.Max(fraction, 0), 1);
+
+            lock (locker)
+            {
+                if (count == 0)
+                    return 0;
+
+                double rank = fraction * count;
+                int cumulated = 0;
+                for (int i = 0; i < BucketCount; i++)
+                {
+                    if (buckets[i] == 0 || cumulated + buckets[i] < rank)
+                    {
+                        cumulated += buckets[i];
+                        continue;
+                    }
+
+                    double lower = GetBucketLowerMilliseconds(i);
+                    double upper = GetBucketUpperMilliseconds(i);
+                    return lower + (upper - lower) * (rank - cumulated) / buckets[i];
+                }
+
+                return GetBucketUpperMilliseconds(BucketCount - 1);
+            }
+        }
+
+        /// <summary>
+        /// Returns a copy of the sample counts of each bucket.
+        /// </summary>
+        public int[] GetBuckets()
+        {
+            lock (locker)
+                return (int[])buckets.Clone();
+        }
+
+        public void Clear()
+        {
+            lock (locker)
+            {
+                next = 0;
+                count = 0;
+                total = 0;
+                sumTicks = 0;
+                Array.Clear(buckets, 0, BucketCount);
+            }
+        }
+
+        /// <summary>
+        /// Lower bound of the durations counted in the bucket, in milliseconds.
+        /// </summary>
+        public static double GetBucketLowerMilliseconds(int bucket)
+        {
+            return bucket == 0 ? 0 : (1L << bucket) / 1000.0;
+        }
+
+        /// <summary>
+        /// Upper bound of the durations counted in the bucket, in milliseconds.
+        /// The last bucket also counts anything longer.
+        /// </summary>
+        public static double GetBucketUpperMilliseconds(int bucket)
+        {
+            return (1L << (bucket + 1)) / 1000.0;
+        }
+
+        public static double TicksToMilliseconds(long ticks)
+        {
+            return (ticks * 1000.0) / Stopwatch.Frequency;
+        }
+        #endregion
+
+        #region Private methods
+        private static int GetBucket(long ticks)
+        {
+            // Bucket i holds durations in [2^i, 2^(i+1)[ µs, the first and last buckets are open ended.
+            long micros = (long)(ticks * ticksToMicros);
+            int bucket = 0;
+            while (micros > 1 && bucket < BucketCount - 1)
+            {
+                micros >>= 1;
+                bucket++;
+            }
+
+            return bucket;
+        }
+        #endregion
+    }
+}
@@ -58,6 +58,22 @@ namespace Kinovea.Services
             get { return memoryBuffer; }
             set { memoryBuffer = value; }
         }
+        /// <summary>
+        /// Number of threads encoding MJPEG frames during real time recording. 0 means automatic.
+        /// </summary>
+        public int EncodingThreads
+        {
+            get { return encodingThreads; }
+            set { encodingThreads = value; }
+        }
+        /// <summary>
+        /// Memory used to queue the recorded file data in front of the disk, in megabytes. 0 writes the file directly.
+        /// </summary>
+        public int WriteBehindMemory
+        {
+            get { return writeBehindMemory; }
+            set { writeBehindMemory = value; }
+        }
         public IEnumerable<CameraBlurb> CameraBlurbs
         {
             get { return cameraBlurbs.Values.Cast<CameraBlurb>(); }
@@ -82,6 +98,14 @@ namespace Kinovea.Services
             get { return saveUncompressedVideo; }
             set { saveUncompressedVideo = value; }
         }
+        /// <summary>
+        /// Whether uncompressed videos are stored with a lossless codec instead of raw frames.
+        /// </summary>
+        public bool LosslessVideo
+        {
+            get { return losslessVideo; }
+            set { losslessVideo = value; }
+        }
         public CaptureAutomationConfiguration CaptureAutomationConfiguration
         {
             get { return captureAutomationConfiguration; }
@@ -124,8 +148,11 @@ namespace Kinovea.Services
         private double displaySynchronizationFramerate = 25.0;
         private CaptureRecordingMode recordingMode = CaptureRecordingMode.Camera;
         private bool saveUncompressedVideo;
+        private bool losslessVideo;
         private bool verboseStats = false;
         private int memoryBuffer = 768;
+        private int encodingThreads = 0;
+        private int writeBehindMemory = 128;
         private Dictionary<string, CameraBlurb> cameraBlurbs = new Dictionary<string, CameraBlurb>();
         private DelayCompositeConfiguration delayCompositeConfiguration = new DelayCompositeConfiguration();
         private PhotofinishConfiguration photofinishConfiguration = new PhotofinishConfiguration();
@@ -164,8 +191,11 @@ namespace Kinovea.Services
             writer.WriteElementString("CaptureRecordingMode", recordingMode.ToString());
             writer.WriteElementString("VerboseStats", verboseStats ? "true" : "false");
             writer.WriteElementString("SaveUncompressedVideo", saveUncompressedVideo ? "true" : "false");
+            writer.WriteElementString("LosslessVideo", losslessVideo ? "true" : "false");
             
             writer.WriteElementString("MemoryBuffer", memoryBuffer.ToString());
+            writer.WriteElementString("EncodingThreads", encodingThreads.ToString());
+            writer.WriteElementString("WriteBehindMemory", writeBehindMemory.ToString());
             
             if(cameraBlurbs.Count > 0)
             {
@@ -227,12 +257,21 @@ namespace Kinovea.Services
                     case "SaveUncompressedVideo":
                         saveUncompressedVideo = XmlHelper.ParseBoolean(reader.ReadElementContentAsString());
                         break;
+                    case "LosslessVideo":
+                        losslessVideo = XmlHelper.ParseBoolean(reader.ReadElementContentAsString());
+                        break;
                     case "VerboseStats":
                         verboseStats = XmlHelper.ParseBoolean(reader.ReadElementContentAsString());
                         break;
                     case "MemoryBuffer":
                         memoryBuffer = reader.ReadElementContentAsInt();
                         break;
+                    case "EncodingThreads":
+                        encodingThreads = reader.ReadElementContentAsInt();
+                        break;
+                    case "WriteBehindMemory":
+                        writeBehindMemory = reader.ReadElementContentAsInt();
+                        break;
                     case "Cameras":
                         ParseCameras(reader);
                         break;
@@ -135,6 +135,16 @@ namespace Kinovea.Services
             set { fileSortAscending = value; }
         }
 
+        /// <summary>
+        /// Number of files whose summary is extracted concurrently in the explorer.
+        /// 0 means automatic, based on the number of cores.
+        /// </summary>
+        public int SummaryLoadingThreads
+        {
+            get { return summaryLoadingThreads; }
+            set { summaryLoadingThreads = value; }
+        }
+
         private int maxRecentFiles = 10;
         private int maxRecentCapturedFiles = 10;
         private List<string> recentFiles = new List<string>();
@@ -150,6 +160,7 @@ namespace Kinovea.Services
         private string lastReplayFolder;
         private FileSortAxis fileSortAxis = FileSortAxis.Name;
         private bool fileSortAscending = true;
+        private int summaryLoadingThreads = 0;
         
         public void AddRecentFile(string file)
         {
@@ -266,6 +277,7 @@ namespace Kinovea.Services
             writer.WriteElementString("LastReplayFolder", lastReplayFolder);
             writer.WriteElementString("FileSortAxis", fileSortAxis.ToString());
             writer.WriteElementString("FileSortAscending", XmlHelper.WriteBoolean(fileSortAscending));
+            writer.WriteElementString("SummaryLoadingThreads", summaryLoadingThreads.ToString());
         }
 
         private void WriteRecents(XmlWriter writer, List<string> recentFiles, int max, string collectionTag, string itemTag)
@@ -343,6 +355,9 @@ namespace Kinovea.Services
                     case "FileSortAscending":
                         fileSortAscending = XmlHelper.ParseBoolean(reader.ReadElementContentAsString());
                         break;
+                    case "SummaryLoadingThreads":
+                        summaryLoadingThreads = reader.ReadElementContentAsInt();
+                        break;
                     default:
                         reader.ReadOuterXml();
                         break;
@@ -106,11 +106,32 @@ namespace Kinovea.Services
             get { return workingZoneMemory; }
             set { workingZoneMemory = value; }
         }
+
+        public int DecodingThreads
+        {
+            get { return decodingThreads; }
+            set { decodingThreads = value; }
+        }
+        public bool PlanarCache
+        {
+            get { return planarCache; }
+            set { planarCache = value; }
+        }
+        public int ReadAheadMemory
+        {
+            get { return readAheadMemory; }
+            set { readAheadMemory = value; }
+        }
         public bool ShowCacheInTimeline
         {
             get { return showCacheInTimeline; }
             set { showCacheInTimeline = value; }
         }
+        public bool ShowDecodingStatistics
+        {
+            get { return showDecodingStatistics; }
+            set { showDecodingStatistics = value; }
+        }
         public bool SyncLockSpeed
         {
             get { return syncLockSpeed;}
@@ -231,6 +252,9 @@ namespace Kinovea.Services
         private bool deinterlaceByDefault;
         private bool interactiveFrameTracker = true;
         private int workingZoneMemory = 768;
+        private int decodingThreads = 0;
+        private bool planarCache = false;
+        private int readAheadMemory = 64;
         private InfosFading defaultFading = new InfosFading();
         private Color backgroundColor = Color.FromArgb(0, 255, 255, 255);
         private Color defaultBackgroundColor = Color.FromArgb(0, 255, 255, 255);
@@ -252,6 +276,7 @@ namespace Kinovea.Services
         private KinogramParameters kinogramParameters = new KinogramParameters();
         private KeyframePresetsParameters keyframePresetsParameters = new KeyframePresetsParameters();
         private bool showCacheInTimeline = false;
+        private bool showDecodingStatistics = false;
         private string pandocPath = "";
         private bool sideBySideHorizontal = true;
 
@@ -276,7 +301,11 @@ namespace Kinovea.Services
             writer.WriteElementString("DeinterlaceByDefault", XmlHelper.WriteBoolean(deinterlaceByDefault));
             writer.WriteElementString("InteractiveFrameTracker", XmlHelper.WriteBoolean(interactiveFrameTracker));
             writer.WriteElementString("WorkingZoneMemory", workingZoneMemory.ToString());
+            writer.WriteElementString("DecodingThreads", decodingThreads.ToString());
+            writer.WriteElementString("PlanarCache", XmlHelper.WriteBoolean(planarCache));
+            writer.WriteElementString("ReadAheadMemory", readAheadMemory.ToString());
             writer.WriteElementString("ShowCacheInTimeline", XmlHelper.WriteBoolean(showCacheInTimeline));
+            writer.WriteElementString("ShowDecodingStatistics", XmlHelper.WriteBoolean(showDecodingStatistics));
             writer.WriteElementString("SyncLockSpeed", XmlHelper.WriteBoolean(syncLockSpeed));
             writer.WriteElementString("SyncByMotion", XmlHelper.WriteBoolean(syncByMotion));
             writer.WriteElementString("ImageFormat", imageFormat.ToString());
@@ -378,9 +407,21 @@ namespace Kinovea.Services
                     case "WorkingZoneMemory":
                         workingZoneMemory = reader.ReadElementContentAsInt();
                         break;
+                    case "DecodingThreads":
+                        decodingThreads = reader.ReadElementContentAsInt();
+                        break;
+                    case "PlanarCache":
+                        planarCache = XmlHelper.ParseBoolean(reader.ReadElementContentAsString());
+                        break;
+                    case "ReadAheadMemory":
+                        readAheadMemory = reader.ReadElementContentAsInt();
+                        break;
                     case "ShowCacheInTimeline":
                         showCacheInTimeline = XmlHelper.ParseBoolean(reader.ReadElementContentAsString());
                         break;
+                    case "ShowDecodingStatistics":
+                        showDecodingStatistics = XmlHelper.ParseBoolean(reader.ReadElementContentAsString());
+                        break;
                     case "SyncLockSpeed":
                         syncLockSpeed = XmlHelper.ParseBoolean(reader.ReadElementContentAsString());
                         break;
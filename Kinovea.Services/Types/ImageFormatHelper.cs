@@ -47,5 +47,26 @@ namespace Kinovea.Services
                     return 3;
             }
         }
+
+        /// <summary>
+        /// Returns the Bayer pattern of an 8-bit raw pixel format, using GenICam pixel format names.
+        /// Returns None for any other format.
+        /// </summary>
+        public static Demosaicing GetBayerPattern(string pixelFormat)
+        {
+            switch (pixelFormat)
+            {
+                case "BayerRG8":
+                    return Demosaicing.RGGB;
+                case "BayerBG8":
+                    return Demosaicing.BGGR;
+                case "BayerGR8":
+                    return Demosaicing.GRBG;
+                case "BayerGB8":
+                    return Demosaicing.GBRG;
+                default:
+                    return Demosaicing.None;
+            }
+        }
     }
 }
@@ -0,0 +1,137 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Drawing;
+using System.Drawing.Imaging;
+using System.Runtime.InteropServices;
+using System.Diagnostics;
+using Kinovea.Services;
+using Kinovea.Video.FFMpeg;
+
+namespace Kinovea.Tests
+{
+    /// <summary>
+    /// Compare the rotation of decoded frames by GDI+ RotateFlip and by the native tiled rotation of the player.
+    /// </summary>
+    public class ImageRotate
+    {
+        private static Random random = new Random();
+
+        public static void Test()
+        {
+            int loops = 200;
+            Size[] sizes = new Size[] { new Size(1920, 1080), new Size(3840, 2160) };
+            ImageRotation[] rotations = new ImageRotation[] { ImageRotation.Rotate90, ImageRotation.Rotate180, ImageRotation.Rotate270 };
+
+            foreach (Size size in sizes)
+            {
+                foreach (ImageRotation rotation in rotations)
+                {
+                    int stride = size.Width * 4;
+                    int length = stride * size.Height;
+                    IntPtr source = CreateBuffer(length);
+                    IntPtr destination = Marshal.AllocHGlobal(length);
+
+                    bool identical = Compare(source, destination, size, rotation);
+                    double gdi = TestRotateFlip(loops, source, size, rotation);
+                    double native = TestNative(loops, source, destination, size, rotation);
+
+                    Console.WriteLine("{0}x{1} {2}. RotateFlip: {3:0.000} ms, Native: {4:0.000} ms, Speedup: {5:0.0}x. Identical: {6}.",
+                        size.Width, size.Height, rotation, gdi, native, gdi / native, identical);
+
+                    Marshal.FreeHGlobal(destination);
+                    Marshal.FreeHGlobal(source);
+                }
+            }
+
+            Console.ReadKey();
+        }
+
+        private static double TestRotateFlip(int loops, IntPtr source, Size size, ImageRotation rotation)
+        {
+            // Current path: wrap the decoded buffer in a Bitmap and rotate it with GDI+.
+            RotateFlipType type = GetRotateFlipType(rotation);
+            Stopwatch sw = Stopwatch.StartNew();
+            for (int i = 0; i < loops; i++)
+            {
+                Bitmap bmp = new Bitmap(size.Width, size.Height, size.Width * 4, PixelFormat.Format32bppPArgb, source);
+                bmp.RotateFlip(type);
+                bmp.Dispose();
+            }
+
+            double elapsed = (double)sw.ElapsedTicks / Stopwatch.Frequency;
+            return (elapsed * 1000) / loops;
+        }
+
+        private static double TestNative(int loops, IntPtr source, IntPtr destination, Size size, ImageRotation rotation)
+        {
+            // New path: rotate into a second buffer and wrap that one.
+            Size rotatedSize = GetRotatedSize(size, rotation);
+            Stopwatch sw = Stopwatch.StartNew();
+            for (int i = 0; i < loops; i++)
+            {
+                ImageRotator.Rotate(source, size.Width * 4, destination, rotatedSize.Width * 4, size.Width, size.Height, rotation);
+                Bitmap bmp = new Bitmap(rotatedSize.Width, rotatedSize.Height, rotatedSize.Width * 4, PixelFormat.Format32bppPArgb, destination);
+                bmp.Dispose();
+            }
+
+            double elapsed = (double)sw.ElapsedTicks / Stopwatch.Frequency;
+            return (elapsed * 1000) / loops;
+        }
+
+        private static bool Compare(IntPtr source, IntPtr destination, Size size, ImageRotation rotation)
+        {
+            // Check that both paths produce the same pixels.
+            Size rotatedSize = GetRotatedSize(size, rotation);
+            ImageRotator.Rotate(source, size.Width * 4, destination, rotatedSize.Width * 4, size.Width, size.Height, rotation);
+
+            Bitmap bmp = new Bitmap(size.Width, size.Height, size.Width * 4, PixelFormat.Format32bppPArgb, source);
+            bmp.RotateFlip(GetRotateFlipType(rotation));
+
+            Rectangle rect = new Rectangle(0, 0, bmp.Width, bmp.Height);
+            BitmapData bmpData = bmp.LockBits(rect, ImageLockMode.ReadOnly, bmp.PixelFormat);
+            int length = bmpData.Stride * bmpData.Height;
+            byte[] expected = new byte[length];
+            byte[] actual = new byte[length];
+            Marshal.Copy(bmpData.Scan0, expected, 0, length);
+            Marshal.Copy(destination, actual, 0, length);
+            bmp.UnlockBits(bmpData);
+
+            bool sameSize = bmp.Size == rotatedSize;
+            bmp.Dispose();
+
+            return sameSize && expected.SequenceEqual(actual);
+        }
+
+        private static IntPtr CreateBuffer(int length)
+        {
+            // Opaque pixels so premultiplication doesn't alter the values.
+            byte[] bytes = new byte[length];
+            random.NextBytes(bytes);
+            for (int i = 3; i < length; i += 4)
+                bytes[i] = 255;
+
+            IntPtr buffer = Marshal.AllocHGlobal(length);
+            Marshal.Copy(bytes, 0, buffer, length);
+            return buffer;
+        }
+
+        private static Size GetRotatedSize(Size size, ImageRotation rotation)
+        {
+            bool sideway = rotation == ImageRotation.Rotate90 || rotation == ImageRotation.Rotate270;
+            return sideway ? new Size(size.Height, size.Width) : size;
+        }
+
+        private static RotateFlipType GetRotateFlipType(ImageRotation rotation)
+        {
+            switch (rotation)
+            {
+                case ImageRotation.Rotate90: return RotateFlipType.Rotate90FlipNone;
+                case ImageRotation.Rotate180: return RotateFlipType.Rotate180FlipNone;
+                case ImageRotation.Rotate270: return RotateFlipType.Rotate270FlipNone;
+                default: return RotateFlipType.RotateNoneFlipNone;
+            }
+        }
+    }
+}
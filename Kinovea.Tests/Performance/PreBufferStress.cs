@@ -0,0 +1,147 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+using Kinovea.Services;
+using Kinovea.Video;
+
+namespace Kinovea.Tests
+{
+    /// <summary>
+    /// Hammer the PreBuffer with MoveBy and MoveTo from the consumer side while a producer thread pushes frames,
+    /// the way the UI thread and the prebuffering thread use it during playback.
+    /// The working zone is short so the producer wraps over its end regularly.
+    /// Checks that the consumer never lands on a disposed or unexpected frame and that every frame is disposed exactly once.
+    /// </summary>
+    public class PreBufferStress
+    {
+        private static Random random = new Random();
+        private const long Interval = 100;
+
+        public static void Test()
+        {
+            int seconds = 5;
+            long zoneFrames = 100;
+
+            HashSet<VideoFrame> disposed = new HashSet<VideoFrame>();
+            int errors = 0;
+            PreBuffer prebuffer = new PreBuffer((frame) => {
+                // Always called on the consumer side.
+                if (!disposed.Add(frame))
+                    errors++;
+            });
+
+            VideoSection zone = new VideoSection(0, (zoneFrames - 1) * Interval);
+            prebuffer.UpdateWorkingZone(zone);
+
+            long produced = 0;
+            ThreadCanceler canceler = new ThreadCanceler();
+            Thread producer = new Thread(() => {
+                while (!canceler.CancellationPending)
+                {
+                    VideoFrame frame = new VideoFrame();
+                    frame.Timestamp = (produced % zoneFrames) * Interval;
+                    prebuffer.Add(frame);
+                    produced++;
+                }
+            });
+            producer.Name = "PreBufferStress producer";
+            producer.Start();
+
+            int iterations = 0;
+            int reads = 0;
+            int jumps = 0;
+            long worstTicks = 0;
+            Stopwatch sw = Stopwatch.StartNew();
+            while (sw.Elapsed.TotalSeconds < seconds)
+            {
+                iterations++;
+                long start = Stopwatch.GetTimestamp();
+                if (random.Next(50) == 0)
+                {
+                    // Jump inside the buffered section.
+                    VideoSection segment = prebuffer.Segment;
+                    if (segment.IsEmpty || segment.Wrapped)
+                        continue;
+
+                    long target = segment.Start + random.Next((int)((segment.End - segment.Start) / Interval) + 1) * Interval;
+                    if (!prebuffer.MoveTo(target))
+                        continue;
+
+                    jumps++;
+                    if (prebuffer.CurrentFrame.Timestamp != target)
+                        Report(ref errors, "MoveTo landed on {0} instead of {1}.", prebuffer.CurrentFrame.Timestamp, target);
+                }
+                else
+                {
+                    VideoFrame before = prebuffer.CurrentFrame;
+                    int expectedSteps = prebuffer.Drops + random.Next(1, 4);
+                    int frames = expectedSteps - prebuffer.Drops;
+                    if (!prebuffer.MoveBy(frames))
+                    {
+                        // The consumer went faster than the producer. Let some drops accumulate, then start over.
+                        if (prebuffer.Drops > 8)
+                            prebuffer.ResetDrops();
+
+                        continue;
+                    }
+
+                    reads++;
+                    if (before != null)
+                    {
+                        long expected = (before.Timestamp + expectedSteps * Interval) % (zoneFrames * Interval);
+                        if (prebuffer.CurrentFrame.Timestamp != expected)
+                            Report(ref errors, "MoveBy landed on {0} instead of {1}.", prebuffer.CurrentFrame.Timestamp, expected);
+                    }
+                }
+
+                if (disposed.Contains(prebuffer.CurrentFrame))
+                    Report(ref errors, "Current frame {0} has been disposed.", prebuffer.CurrentFrame.Timestamp);
+
+                worstTicks = Math.Max(worstTicks, Stopwatch.GetTimestamp() - start);
+            }
+
+            canceler.Cancel();
+            prebuffer.UnblockAndMakeRoom();
+            producer.Join();
+            prebuffer.Clear();
+
+            if (disposed.Count != produced)
+                Report(ref errors, "{0} frames produced but {1} disposed.", produced, disposed.Count);
+
+            Console.WriteLine("{0} iterations in {1} s. Frames produced: {2}, reads: {3}, jumps: {4}. Worst consumer call: {5:0.000} ms. Errors: {6}.",
+                iterations, seconds, produced, reads, jumps, (double)worstTicks * 1000 / Stopwatch.Frequency, errors);
+
+            prebuffer.Dispose();
+            Console.ReadKey();
+        }
+
+        private static void Report(ref int errors, string format, params object[] args)
+        {
+            if (errors < 20)
+                Console.WriteLine(format, args);
+
+            errors++;
+        }
+    }
+}
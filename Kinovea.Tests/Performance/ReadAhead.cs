@@ -0,0 +1,191 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+using System.Diagnostics;
+using System.IO;
+using System.Threading;
+using Kinovea.Video.FFMpeg;
+
+namespace Kinovea.Tests
+{
+    /// <summary>
+    /// Compare a demuxer-like consumer reading a file directly and through the read-ahead stream,
+    /// when the file is on slow storage. The storage is simulated by a stream adding latency, a bandwidth cap and occasional hiccups.
+    /// The consumer reads small blocks and spends some time on each one, as the decoding loop would.
+    /// </summary>
+    public class ReadAhead
+    {
+        private static Random random = new Random();
+
+        public static void Test(string file = null)
+        {
+            int blockSize = 64 * 1024;
+            double workMilliseconds = 2;
+            int window = 32 * 1024 * 1024;
+
+            if (string.IsNullOrEmpty(file))
+                file = GenerateFile(48 * 1024 * 1024);
+
+            // Expected content.
+            byte[] reference = File.ReadAllBytes(file);
+
+            double maxWait;
+            double direct = Run(new ThrottledStream(File.OpenRead(file)), reference, blockSize, workMilliseconds, out maxWait);
+            Console.WriteLine("Direct: {0:0} ms, worst block: {1:0.0} ms.", direct, maxWait);
+
+            ReadAheadStream stream = new ReadAheadStream(new ThrottledStream(File.OpenRead(file)), window);
+            double readAhead = Run(stream, reference, blockSize, workMilliseconds, out maxWait);
+            Console.WriteLine("Read-ahead: {0:0} ms, worst block: {1:0.0} ms. Stalls: {2} ({3:0} ms), retargets: {4}, throughput: {5:0.0} MB/s.",
+                readAhead, maxWait, stream.Stalls, stream.StallMilliseconds, stream.Retargets, stream.Throughput);
+            stream.Dispose();
+
+            Console.WriteLine("Speedup: {0:0.0}x.", direct / readAhead);
+            Console.ReadKey();
+        }
+
+        private static double Run(object source, byte[] reference, int blockSize, double workMilliseconds, out double maxWait)
+        {
+            // Read the file front to back, with a few jumps back and forth as when the user seeks.
+            byte[] block = new byte[blockSize];
+            maxWait = 0;
+            int mismatches = 0;
+            long position = 0;
+            int blocks = 0;
+
+            Stopwatch sw = Stopwatch.StartNew();
+            while (position < reference.Length)
+            {
+                if (blocks > 0 && blocks % 200 == 0)
+                {
+                    position = random.Next(reference.Length - blockSize);
+                    Seek(source, position);
+                }
+
+                long start = Stopwatch.GetTimestamp();
+                int read = Read(source, block, blockSize);
+                maxWait = Math.Max(maxWait, (double)(Stopwatch.GetTimestamp() - start) * 1000 / Stopwatch.Frequency);
+                if (read == 0)
+                    break;
+
+                for (int i = 0; i < read; i++)
+                {
+                    if (block[i] != reference[position + i])
+                    {
+                        mismatches++;
+                        break;
+                    }
+                }
+
+                position += read;
+                blocks++;
+                Thread.Sleep(TimeSpan.FromMilliseconds(workMilliseconds));
+            }
+
+            double elapsed = sw.Elapsed.TotalMilliseconds;
+            if (mismatches > 0)
+                Console.WriteLine("{0} blocks differ from the file content.", mismatches);
+
+            if (source is Stream)
+                ((Stream)source).Dispose();
+
+            return elapsed;
+        }
+
+        private static int Read(object source, byte[] block, int count)
+        {
+            if (source is ReadAheadStream)
+                return ((ReadAheadStream)source).Read(block, 0, count);
+            else
+                return ((Stream)source).Read(block, 0, count);
+        }
+
+        private static void Seek(object source, long position)
+        {
+            if (source is ReadAheadStream)
+                ((ReadAheadStream)source).Seek(position, SeekOrigin.Begin);
+            else
+                ((Stream)source).Seek(position, SeekOrigin.Begin);
+        }
+
+        private static string GenerateFile(int length)
+        {
+            string file = Path.Combine(Path.GetTempPath(), "kinovea-readahead.bin");
+            byte[] content = new byte[length];
+            random.NextBytes(content);
+            File.WriteAllBytes(file, content);
+            return file;
+        }
+
+        /// <summary>
+        /// A stand-in for a file on a network share: each read pays a latency, the bandwidth is capped, 
+        /// and some reads stall for much longer.
+        /// </summary>
+        private class ThrottledStream : Stream
+        {
+            private Stream inner;
+            private double latencyMilliseconds = 4;
+            private double megabytesPerSecond = 40;
+            private double hiccupProbability = 0.02;
+            private double hiccupMilliseconds = 150;
+
+            public ThrottledStream(Stream inner)
+            {
+                this.inner = inner;
+            }
+
+            public override bool CanRead { get { return true; } }
+            public override bool CanSeek { get { return true; } }
+            public override bool CanWrite { get { return false; } }
+            public override long Length { get { return inner.Length; } }
+            public override long Position
+            {
+                get { return inner.Position; }
+                set { inner.Position = value; }
+            }
+
+            public override int Read(byte[] buffer, int offset, int count)
+            {
+                double delay = latencyMilliseconds + count / (megabytesPerSecond * 1024 * 1024) * 1000;
+                lock (random)
+                {
+                    if (random.NextDouble() < hiccupProbability)
+                        delay += hiccupMilliseconds;
+                }
+
+                Thread.Sleep(TimeSpan.FromMilliseconds(delay));
+                return inner.Read(buffer, offset, count);
+            }
+
+            public override long Seek(long offset, SeekOrigin origin) { return inner.Seek(offset, origin); }
+            public override void Flush() { }
+            public override void SetLength(long value) { throw new NotSupportedException(); }
+            public override void Write(byte[] buffer, int offset, int count) { throw new NotSupportedException(); }
+
+            protected override void Dispose(bool disposing)
+            {
+                if (disposing)
+                    inner.Dispose();
+
+                base.Dispose(disposing);
+            }
+        }
+    }
+}
@@ -0,0 +1,504 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+using System.Collections.Generic;
+using System.ComponentModel;
+using System.Diagnostics;
+using System.Drawing;
+using System.Drawing.Imaging;
+using System.Globalization;
+using System.IO;
+using System.Linq;
+using System.Runtime.InteropServices;
+using System.Text;
+using Newtonsoft.Json;
+using Kinovea.Services;
+using Kinovea.Video;
+using Kinovea.Video.FFMpeg;
+
+namespace Kinovea.Tests
+{
+    /// <summary>
+    /// Repeatable measurements of the video reader over a corpus of generated files, written as JSON to track regressions.
+    /// For each file: open time, summary extraction time, sequential decoding rate, random seek latency,
+    /// working zone cache filling time and the average time of each decoding stage.
+    /// The sequential decoding rate is also measured single-threaded and with the automatic decoding thread count.
+    /// </summary>
+    /// <remarks>
+    /// The corpus is made with the writers of the application (intra-only MPEG-4 and MJPEG)
+    /// and, if an ffmpeg executable is available, with H.264 at several GOP lengths.
+    /// Usage: Kinovea.Tests.exe --reader-benchmark [output.json] [corpus folder] [ffmpeg.exe]
+    /// </remarks>
+    public class ReaderBenchmark
+    {
+        private class CorpusFile
+        {
+            public string Path;
+            public string Writer;
+            public string Codec;
+            public Size Size;
+            public int Gop;
+        }
+
+        private static readonly Size[] sizes = { new Size(640, 360), new Size(1280, 720), new Size(1920, 1080) };
+        private static readonly int[] gops = { 1, 30, 250 };
+        private static readonly int[] decodingThreads = { 1, 0 };
+        private const int Frames = 150;
+        private const double FrameInterval = 1000.0 / 30;
+        private const int Seeks = 50;
+        private const int CacheMemory = 2048;
+        private const int ReadAheadMemory = 64;
+        private const int Seed = 1234;
+
+        public static void Test(string output = null, string folder = null, string ffmpeg = null)
+        {
+            if (string.IsNullOrEmpty(output))
+                output = Path.Combine(Path.GetTempPath(), string.Format("Kinovea.ReaderBenchmark-{0:yyyyMMddTHHmmss}.json", DateTime.Now));
+
+            List<CorpusFile> corpus;
+            if (string.IsNullOrEmpty(folder))
+                corpus = GenerateCorpus(Path.Combine(Path.GetTempPath(), "Kinovea.ReaderCorpus"), ffmpeg ?? FindFFmpeg());
+            else
+                corpus = ListCorpus(folder);
+
+            if (corpus.Count == 0)
+            {
+                Console.WriteLine("No files to benchmark.");
+                return;
+            }
+
+            // Warm up, the first file open pays for the library initialization.
+            using (VideoReaderFFMpeg reader = new VideoReaderFFMpeg())
+            {
+                reader.Options = VideoOptions.Default;
+                reader.Open(corpus[0].Path);
+                reader.Close();
+            }
+
+            StringBuilder sb = new StringBuilder();
+            using (JsonWriter w = new JsonTextWriter(new StringWriter(sb, CultureInfo.InvariantCulture)))
+            {
+                w.Formatting = Formatting.Indented;
+                w.WriteStartObject();
+                WriteEnvironment(w);
+
+                w.WritePropertyName("files");
+                w.WriteStartArray();
+                foreach (CorpusFile file in corpus)
+                {
+                    Console.WriteLine("Benchmarking {0}.", Path.GetFileName(file.Path));
+                    Run(w, file);
+                }
+
+                w.WriteEndArray();
+                w.WriteEndObject();
+            }
+
+            File.WriteAllText(output, sb.ToString());
+            Console.WriteLine("Results written to {0}.", output);
+        }
+
+        #region Measurements
+        private static void Run(JsonWriter w, CorpusFile file)
+        {
+            w.WriteStartObject();
+            w.WritePropertyName("file");
+            w.WriteValue(Path.GetFileName(file.Path));
+            w.WritePropertyName("writer");
+            w.WriteValue(file.Writer);
+            w.WritePropertyName("codec");
+            w.WriteValue(file.Codec);
+            w.WritePropertyName("gop");
+            w.WriteValue(file.Gop);
+
+            w.WritePropertyName("summaryMs");
+            w.WriteValue(MeasureSummary(file.Path));
+
+            MeasureDecodingThreads(w, file.Path);
+
+            VideoReaderFFMpeg reader = new VideoReaderFFMpeg();
+            reader.Options = VideoOptions.Default;
+            reader.Options.ReadAheadMemory = ReadAheadMemory;
+
+            Stopwatch sw = Stopwatch.StartNew();
+            OpenVideoResult result = reader.Open(file.Path);
+            double openMs = sw.Elapsed.TotalMilliseconds;
+
+            w.WritePropertyName("openResult");
+            w.WriteValue(result.ToString());
+            if (result != OpenVideoResult.Success)
+            {
+                reader.Dispose();
+                w.WriteEndObject();
+                return;
+            }
+
+            w.WritePropertyName("openMs");
+            w.WriteValue(openMs);
+            w.WritePropertyName("width");
+            w.WriteValue(reader.Info.ReferenceSize.Width);
+            w.WritePropertyName("height");
+            w.WriteValue(reader.Info.ReferenceSize.Height);
+            w.WritePropertyName("fps");
+            w.WriteValue(reader.Info.FramesPerSeconds);
+
+            MeasureSequential(w, reader);
+            MeasureSeeks(w, reader);
+            MeasureCacheFill(w, reader);
+
+            reader.Close();
+            reader.Dispose();
+            w.WriteEndObject();
+        }
+
+        private static double MeasureSummary(string file)
+        {
+            using (VideoReaderFFMpeg reader = new VideoReaderFFMpeg())
+            {
+                Stopwatch sw = Stopwatch.StartNew();
+                VideoSummary summary = reader.ExtractSummary(file, 4, new Size(200, 150));
+                double elapsed = sw.Elapsed.TotalMilliseconds;
+                foreach (Bitmap thumb in summary.Thumbs)
+                    thumb.Dispose();
+
+                return elapsed;
+            }
+        }
+
+        private static void MeasureSequential(JsonWriter w, VideoReaderFFMpeg reader)
+        {
+            // Decode every frame on demand, as during export or tracking.
+            reader.MoveTo(0, reader.WorkingZone.Start);
+            reader.DecodingStatistics.Reset();
+
+            int frames = 1;
+            Stopwatch sw = Stopwatch.StartNew();
+            while (reader.MoveNext(0, true))
+                frames++;
+
+            double seconds = sw.Elapsed.TotalSeconds;
+
+            w.WritePropertyName("sequential");
+            w.WriteStartObject();
+            w.WritePropertyName("frames");
+            w.WriteValue(frames);
+            w.WritePropertyName("fps");
+            w.WriteValue(seconds > 0 ? frames / seconds : 0);
+            w.WritePropertyName("stagesMs");
+            w.WriteStartObject();
+            foreach (DecodingStage stage in Enum.GetValues(typeof(DecodingStage)))
+            {
+                RollingHistogram histogram = reader.DecodingStatistics[stage];
+                if (histogram.Count == 0)
+                    continue;
+
+                w.WritePropertyName(stage.ToString());
+                w.WriteValue(histogram.MeanMilliseconds);
+            }
+
+            w.WriteEndObject();
+            w.WriteEndObject();
+        }
+
+        private static void MeasureDecodingThreads(JsonWriter w, string file)
+        {
+            // Sequential decoding with a single decoding thread and with the count picked by libavcodec (0).
+            // The thread count is applied when the decoder is opened, each setting gets its own reader.
+            w.WritePropertyName("decodingThreads");
+            w.WriteStartArray();
+            foreach (int threads in decodingThreads)
+            {
+                using (VideoReaderFFMpeg reader = new VideoReaderFFMpeg())
+                {
+                    reader.Options = VideoOptions.Default;
+                    reader.Options.ReadAheadMemory = ReadAheadMemory;
+                    reader.Options.DecodingThreads = threads;
+                    if (reader.Open(file) != OpenVideoResult.Success)
+                        continue;
+
+                    w.WriteStartObject();
+                    w.WritePropertyName("threads");
+                    w.WriteValue(threads);
+                    MeasureSequential(w, reader);
+                    w.WriteEndObject();
+
+                    reader.Close();
+                }
+            }
+
+            w.WriteEndArray();
+        }
+
+        private static void MeasureSeeks(JsonWriter w, VideoReaderFFMpeg reader)
+        {
+            // The same targets for every run so results can be compared.
+            Random random = new Random(Seed);
+            VideoSection zone = reader.WorkingZone;
+            long frames = Math.Max((zone.End - zone.Start) / reader.Info.AverageTimeStampsPerFrame, 1);
+            List<double> latencies = new List<double>();
+
+            for (int i = 0; i < Seeks; i++)
+            {
+                long from = reader.Current != null ? reader.Current.Timestamp : zone.Start;
+                long target = zone.Start + (long)(random.NextDouble() * frames) * reader.Info.AverageTimeStampsPerFrame;
+                Stopwatch sw = Stopwatch.StartNew();
+                reader.MoveTo(from, target);
+                latencies.Add(sw.Elapsed.TotalMilliseconds);
+            }
+
+            latencies.Sort();
+            w.WritePropertyName("seekMs");
+            w.WriteStartObject();
+            w.WritePropertyName("count");
+            w.WriteValue(latencies.Count);
+            w.WritePropertyName("mean");
+            w.WriteValue(latencies.Average());
+            w.WritePropertyName("p50");
+            w.WriteValue(Percentile(latencies, 0.5));
+            w.WritePropertyName("p90");
+            w.WriteValue(Percentile(latencies, 0.9));
+            w.WritePropertyName("p99");
+            w.WriteValue(Percentile(latencies, 0.99));
+            w.WritePropertyName("max");
+            w.WriteValue(latencies[latencies.Count - 1]);
+            w.WriteEndObject();
+        }
+
+        private static void MeasureCacheFill(JsonWriter w, VideoReaderFFMpeg reader)
+        {
+            w.WritePropertyName("cacheFillMs");
+            if ((reader.Flags & VideoCapabilities.CanCache) == 0)
+            {
+                w.WriteNull();
+                return;
+            }
+
+            // The work is normally run on a background worker by the UI, here it is run synchronously.
+            BackgroundWorker worker = new BackgroundWorker();
+            worker.WorkerReportsProgress = true;
+            worker.WorkerSupportsCancellation = true;
+
+            Stopwatch sw = Stopwatch.StartNew();
+            reader.UpdateWorkingZone(reader.WorkingZone, true, CacheMemory, (handler) => handler(worker, new DoWorkEventArgs(null)));
+            double elapsed = sw.Elapsed.TotalMilliseconds;
+
+            if (reader.DecodingMode == VideoDecodingMode.Caching)
+                w.WriteValue(elapsed);
+            else
+                w.WriteNull();
+        }
+
+        private static double Percentile(List<double> sorted, double fraction)
+        {
+            int index = (int)Math.Ceiling(fraction * sorted.Count) - 1;
+            return sorted[Math.Min(Math.Max(index, 0), sorted.Count - 1)];
+        }
+
+        private static void WriteEnvironment(JsonWriter w)
+        {
+            w.WritePropertyName("date");
+            w.WriteValue(DateTime.Now.ToString("yyyy-MM-ddTHH:mm:ss", CultureInfo.InvariantCulture));
+            w.WritePropertyName("machine");
+            w.WriteValue(Environment.MachineName);
+            w.WritePropertyName("os");
+            w.WriteValue(Environment.OSVersion.ToString());
+            w.WritePropertyName("processors");
+            w.WriteValue(Environment.ProcessorCount);
+            w.WritePropertyName("is64bit");
+            w.WriteValue(Environment.Is64BitProcess);
+            w.WritePropertyName("readAheadMemory");
+            w.WriteValue(ReadAheadMemory);
+        }
+        #endregion
+
+        #region Corpus
+        private static List<CorpusFile> GenerateCorpus(string folder, string ffmpeg)
+        {
+            // Files are only generated once, delete the folder to regenerate.
+            Directory.CreateDirectory(folder);
+            List<CorpusFile> corpus = new List<CorpusFile>();
+
+            foreach (Size size in sizes)
+            {
+                CorpusFile mpeg4 = MakeEntry(folder, "VideoFileWriter", "mpeg4", size, 1, "mp4");
+                if (File.Exists(mpeg4.Path) || WriteWithVideoFileWriter(mpeg4))
+                    corpus.Add(mpeg4);
+
+                CorpusFile mjpeg = MakeEntry(folder, "MJPEGWriter", "mjpeg", size, 1, "avi");
+                if (File.Exists(mjpeg.Path) || WriteWithMJPEGWriter(mjpeg))
+                    corpus.Add(mjpeg);
+
+                if (string.IsNullOrEmpty(ffmpeg))
+                    continue;
+
+                foreach (int gop in gops)
+                {
+                    CorpusFile h264 = MakeEntry(folder, "ffmpeg", "h264", size, gop, "mp4");
+                    if (File.Exists(h264.Path) || WriteWithFFmpeg(ffmpeg, h264))
+                        corpus.Add(h264);
+                }
+            }
+
+            if (string.IsNullOrEmpty(ffmpeg))
+                Console.WriteLine("ffmpeg not found, the corpus only contains intra-only files.");
+
+            return corpus;
+        }
+
+        private static List<CorpusFile> ListCorpus(string folder)
+        {
+            // Existing files, the encoding parameters are unknown.
+            return Directory.GetFiles(folder)
+                .Where(f => !Path.GetFileName(f).StartsWith("."))
+                .Select(f => new CorpusFile { Path = f, Writer = "", Codec = "", Gop = 0 })
+                .ToList();
+        }
+
+        private static CorpusFile MakeEntry(string folder, string writer, string codec, Size size, int gop, string extension)
+        {
+            CorpusFile file = new CorpusFile();
+            file.Writer = writer;
+            file.Codec = codec;
+            file.Size = size;
+            file.Gop = gop;
+            string filename = string.Format("{0}x{1}-{2}-g{3}.{4}", size.Width, size.Height, codec, gop, extension);
+            file.Path = Path.Combine(folder, filename);
+            return file;
+        }
+
+        private static bool WriteWithVideoFileWriter(CorpusFile file)
+        {
+            VideoInfo info = VideoInfo.Empty;
+            info.ReferenceSize = file.Size;
+            info.OriginalSize = file.Size;
+            info.PixelAspectRatio = 1.0;
+
+            VideoFileWriter writer = new VideoFileWriter();
+            if (writer.OpenSavingContext(file.Path, info, "mp4", FrameInterval) != SaveResult.Success)
+                return false;
+
+            bool success = true;
+            using (Bitmap bmp = new Bitmap(file.Size.Width, file.Size.Height, PixelFormat.Format32bppPArgb))
+            {
+                for (int i = 0; i < Frames && success; i++)
+                {
+                    DrawFrame(bmp, i);
+                    success = writer.SaveFrame(bmp) == SaveResult.Success;
+                }
+            }
+
+            writer.CloseSavingContext(success);
+            return success;
+        }
+
+        private static bool WriteWithMJPEGWriter(CorpusFile file)
+        {
+            VideoInfo info = VideoInfo.Empty;
+            info.OriginalSize = file.Size;
+            info.PixelAspectRatio = 1.0;
+
+            MJPEGWriter writer = new MJPEGWriter();
+            SaveResult result = writer.OpenSavingContext(file.Path, info, "avi", Kinovea.Services.ImageFormat.RGB32, false, FrameInterval, FrameInterval, ImageRotation.Rotate0);
+            if (result != SaveResult.Success)
+            {
+                writer.Dispose();
+                return false;
+            }
+
+            bool success = true;
+            int stride = file.Size.Width * 4;
+            byte[] buffer = new byte[stride * file.Size.Height];
+            using (Bitmap bmp = new Bitmap(file.Size.Width, file.Size.Height, PixelFormat.Format32bppArgb))
+            {
+                for (int i = 0; i < Frames && success; i++)
+                {
+                    DrawFrame(bmp, i);
+                    BitmapData data = bmp.LockBits(new Rectangle(Point.Empty, file.Size), ImageLockMode.ReadOnly, bmp.PixelFormat);
+                    for (int row = 0; row < file.Size.Height; row++)
+                        Marshal.Copy(data.Scan0 + row * data.Stride, buffer, row * stride, stride);
+
+                    bmp.UnlockBits(data);
+                    success = writer.SaveFrame(Kinovea.Services.ImageFormat.RGB32, buffer, buffer.Length, true) == SaveResult.Success;
+                }
+            }
+
+            writer.CloseSavingContext(success);
+            writer.Dispose();
+            return success;
+        }
+
+        private static bool WriteWithFFmpeg(string ffmpeg, CorpusFile file)
+        {
+            // Synthetic source from ffmpeg itself, encoded with B-frames as most camera and phone files.
+            string args = string.Format(CultureInfo.InvariantCulture,
+                "-y -loglevel error -f lavfi -i testsrc2=size={0}x{1}:rate=30 -frames:v {2} -c:v libx264 -pix_fmt yuv420p -g {3} -keyint_min {3} -sc_threshold 0 -bf {4} \"{5}\"",
+                file.Size.Width, file.Size.Height, Frames, file.Gop, file.Gop > 1 ? 2 : 0, file.Path);
+
+            ProcessStartInfo psi = new ProcessStartInfo(ffmpeg, args);
+            psi.UseShellExecute = false;
+            psi.CreateNoWindow = true;
+
+            try
+            {
+                using (Process process = Process.Start(psi))
+                {
+                    process.WaitForExit();
+                    return process.ExitCode == 0 && File.Exists(file.Path);
+                }
+            }
+            catch (Win32Exception)
+            {
+                return false;
+            }
+        }
+
+        private static string FindFFmpeg()
+        {
+            string path = Environment.GetEnvironmentVariable("PATH") ?? "";
+            foreach (string dir in path.Split(Path.PathSeparator))
+            {
+                string candidate = Path.Combine(dir.Trim(), "ffmpeg.exe");
+                if (File.Exists(candidate))
+                    return candidate;
+            }
+
+            return null;
+        }
+
+        private static void DrawFrame(Bitmap bmp, int frame)
+        {
+            // A moving disc over a gradient and the frame number, so consecutive frames differ and compress like real footage.
+            using (Graphics g = Graphics.FromImage(bmp))
+            using (Font font = new Font("Consolas", Math.Max(bmp.Height / 20, 8)))
+            {
+                Rectangle r = new Rectangle(0, 0, bmp.Width, bmp.Height);
+                using (Brush background = new System.Drawing.Drawing2D.LinearGradientBrush(r, Color.DarkSlateBlue, Color.DarkOrange, (frame * 3) % 360))
+                    g.FillRectangle(background, r);
+
+                int diameter = bmp.Height / 3;
+                int x = (frame * bmp.Width / Frames) % bmp.Width;
+                g.FillEllipse(Brushes.White, x, bmp.Height / 3, diameter, diameter);
+                g.DrawString(frame.ToString(CultureInfo.InvariantCulture), font, Brushes.Black, 10, 10);
+            }
+        }
+        #endregion
+    }
+}
@@ -0,0 +1,116 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Drawing;
+using System.IO;
+using System.Diagnostics;
+using Kinovea.Video;
+using Kinovea.Video.FFMpeg;
+
+namespace Kinovea.Tests
+{
+    /// <summary>
+    /// Measure the time taken to extract the summary (info + thumbnails) of video files, 
+    /// with the full decode path and with the keyframe-only, reduced resolution path.
+    /// </summary>
+    public class SummaryExtraction
+    {
+        private static Random random = new Random();
+
+        /// <summary>
+        /// Run the benchmark over the videos of a folder. 
+        /// If no folder is passed, a corpus of synthetic videos is generated in the temp directory.
+        /// </summary>
+        public static void Test(string folder = null)
+        {
+            int thumbs = 4;
+            Size maxSize = new Size(200, 150);
+
+            if (string.IsNullOrEmpty(folder))
+                folder = GenerateCorpus(20, new Size(1920, 1080), 150);
+
+            List<string> files = Directory.GetFiles(folder).Where(f => !Path.GetFileName(f).StartsWith(".")).ToList();
+            if (files.Count == 0)
+            {
+                Console.WriteLine("No files in {0}.", folder);
+                return;
+            }
+
+            // Warm up, the first file open pays for the library initialization.
+            ExtractSummary(files[0], thumbs, maxSize, true);
+
+            int fullThumbs;
+            int fastThumbs;
+            double full = Run(files, thumbs, maxSize, false, out fullThumbs);
+            double fast = Run(files, thumbs, maxSize, true, out fastThumbs);
+
+            Console.WriteLine("{0} files. Full decode: {1:0.0} ms/file ({2} thumbs), Fast: {3:0.0} ms/file ({4} thumbs), Speedup: {5:0.0}x.",
+                files.Count, full, fullThumbs, fast, fastThumbs, full / fast);
+
+            Console.ReadKey();
+        }
+
+        private static double Run(List<string> files, int thumbs, Size maxSize, bool fast, out int totalThumbs)
+        {
+            totalThumbs = 0;
+            Stopwatch sw = Stopwatch.StartNew();
+            foreach (string file in files)
+                totalThumbs += ExtractSummary(file, thumbs, maxSize, fast);
+
+            return (double)sw.ElapsedMilliseconds / files.Count;
+        }
+
+        private static int ExtractSummary(string file, int thumbs, Size maxSize, bool fast)
+        {
+            VideoReaderFFMpeg reader = new VideoReaderFFMpeg();
+            reader.FastSummary = fast;
+            VideoSummary summary = reader.ExtractSummary(file, thumbs, maxSize);
+            int count = summary.Thumbs.Count;
+            foreach (Bitmap thumb in summary.Thumbs)
+                thumb.Dispose();
+            
+            reader.Dispose();
+            return count;
+        }
+
+        private static string GenerateCorpus(int count, Size size, int frames)
+        {
+            // The files written by Kinovea are intra-only, so this corpus only measures the reduced resolution decoding.
+            // Pass a folder of camera or phone files to measure the keyframe-only decoding too.
+            string folder = Path.Combine(Path.GetTempPath(), "Kinovea.SummaryCorpus");
+            Directory.CreateDirectory(folder);
+
+            VideoInfo info = VideoInfo.Empty;
+            info.ReferenceSize = size;
+            info.PixelAspectRatio = 1.0;
+
+            for (int i = 0; i < count; i++)
+            {
+                string file = Path.Combine(folder, string.Format("clip{0:00}.mp4", i));
+                if (File.Exists(file))
+                    continue;
+
+                VideoFileWriter writer = new VideoFileWriter();
+                writer.OpenSavingContext(file, info, "mp4", 1000.0 / 30);
+                using (Bitmap bmp = new Bitmap(size.Width, size.Height))
+                using (Graphics g = Graphics.FromImage(bmp))
+                {
+                    Color background = Color.FromArgb(random.Next(256), random.Next(256), random.Next(256));
+                    for (int j = 0; j < frames; j++)
+                    {
+                        // A moving disc so consecutive frames differ.
+                        g.Clear(background);
+                        int x = (j * 10) % size.Width;
+                        g.FillEllipse(Brushes.White, x, size.Height / 3, size.Height / 3, size.Height / 3);
+                        writer.SaveFrame(bmp);
+                    }
+                }
+
+                writer.CloseSavingContext(true);
+            }
+
+            return folder;
+        }
+    }
+}
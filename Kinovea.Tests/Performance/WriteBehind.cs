@@ -0,0 +1,230 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+using System.Diagnostics;
+using System.IO;
+using System.Threading;
+using Kinovea.Video.FFMpeg;
+
+namespace Kinovea.Tests
+{
+    /// <summary>
+    /// Compare a recorder-like producer writing a file directly and through the write-behind stream,
+    /// when the disk has latency spikes. The disk is simulated by a stream adding latency, a bandwidth cap and occasional hiccups.
+    /// The producer writes one frame per period and seeks back at the end of each cluster to fill in its size, as the muxer would.
+    /// A frame is late when its write takes longer than the period.
+    /// </summary>
+    public class WriteBehind
+    {
+        private static Random random = new Random();
+
+        public static void Test()
+        {
+            int frameSize = 512 * 1024;
+            int frames = 400;
+            int framesPerCluster = 10;
+            double periodMilliseconds = 10;
+            int capacity = 64 * 1024 * 1024;
+
+            string file = Path.Combine(Path.GetTempPath(), "kinovea-writebehind.bin");
+            byte[] reference = GenerateReference(frameSize, frames, framesPerCluster);
+
+            int late;
+            double maxWait;
+            double direct = Run(new ThrottledStream(File.Create(file)), frameSize, frames, framesPerCluster, periodMilliseconds, out late, out maxWait);
+            Console.WriteLine("Direct: {0:0} ms, late frames: {1}, worst frame: {2:0.0} ms.", direct, late, maxWait);
+            Verify(file, reference);
+
+            WriteBehindStream stream = new WriteBehindStream(new ThrottledStream(File.Create(file)), capacity);
+            double writeBehind = Run(stream, frameSize, frames, framesPerCluster, periodMilliseconds, out late, out maxWait);
+            Console.WriteLine("Write-behind: {0:0} ms, late frames: {1}, worst frame: {2:0.0} ms. Stalls: {3} ({4:0} ms), latency: {5:0.0} ms (max: {6:0.0} ms), throughput: {7:0.0} MB/s.",
+                writeBehind, late, maxWait, stream.Stalls, stream.StallMilliseconds, stream.WriteLatency, stream.MaxWriteLatency, stream.Throughput);
+            stream.Dispose();
+            Verify(file, reference);
+
+            Console.ReadKey();
+        }
+
+        private static double Run(object target, int frameSize, int frames, int framesPerCluster, double periodMilliseconds, out int late, out double maxWait)
+        {
+            byte[] frame = new byte[frameSize];
+            byte[] size = new byte[4];
+            late = 0;
+            maxWait = 0;
+            long clusterStart = 0;
+
+            Stopwatch sw = Stopwatch.StartNew();
+            for (int i = 0; i < frames; i++)
+            {
+                long start = Stopwatch.GetTimestamp();
+
+                if (i % framesPerCluster == 0)
+                {
+                    // Placeholder for the cluster size.
+                    clusterStart = GetClusterStart(i / framesPerCluster, frameSize, framesPerCluster);
+                    Write(target, size, 4);
+                }
+
+                FillFrame(frame, i);
+                Write(target, frame, frameSize);
+
+                if (i % framesPerCluster == framesPerCluster - 1)
+                {
+                    // Go back and fill the cluster size in.
+                    long end = clusterStart + 4 + (long)framesPerCluster * frameSize;
+                    Seek(target, clusterStart);
+                    Write(target, BitConverter.GetBytes(framesPerCluster * frameSize), 4);
+                    Seek(target, end);
+                }
+
+                double wait = (double)(Stopwatch.GetTimestamp() - start) * 1000 / Stopwatch.Frequency;
+                maxWait = Math.Max(maxWait, wait);
+                if (wait > periodMilliseconds)
+                    late++;
+                else
+                    Thread.Sleep(TimeSpan.FromMilliseconds(periodMilliseconds - wait));
+            }
+
+            if (target is WriteBehindStream)
+                ((WriteBehindStream)target).Close();
+            else
+                ((Stream)target).Dispose();
+
+            return sw.Elapsed.TotalMilliseconds;
+        }
+
+        private static void Write(object target, byte[] buffer, int count)
+        {
+            if (target is WriteBehindStream)
+                ((WriteBehindStream)target).Write(buffer, 0, count);
+            else
+                ((Stream)target).Write(buffer, 0, count);
+        }
+
+        private static void Seek(object target, long position)
+        {
+            if (target is WriteBehindStream)
+                ((WriteBehindStream)target).Seek(position, SeekOrigin.Begin);
+            else
+                ((Stream)target).Seek(position, SeekOrigin.Begin);
+        }
+
+        private static long GetClusterStart(int cluster, int frameSize, int framesPerCluster)
+        {
+            return (long)cluster * (4 + (long)framesPerCluster * frameSize);
+        }
+
+        private static void FillFrame(byte[] frame, int index)
+        {
+            for (int i = 0; i < frame.Length; i++)
+                frame[i] = (byte)(index + i);
+        }
+
+        private static byte[] GenerateReference(int frameSize, int frames, int framesPerCluster)
+        {
+            MemoryStream stream = new MemoryStream();
+            byte[] frame = new byte[frameSize];
+            for (int i = 0; i < frames; i++)
+            {
+                if (i % framesPerCluster == 0)
+                    stream.Write(BitConverter.GetBytes(framesPerCluster * frameSize), 0, 4);
+
+                FillFrame(frame, i);
+                stream.Write(frame, 0, frameSize);
+            }
+
+            return stream.ToArray();
+        }
+
+        private static void Verify(string file, byte[] reference)
+        {
+            byte[] content = File.ReadAllBytes(file);
+            if (content.Length != reference.Length)
+            {
+                Console.WriteLine("File length: {0}, expected: {1}.", content.Length, reference.Length);
+                return;
+            }
+
+            for (int i = 0; i < content.Length; i++)
+            {
+                if (content[i] != reference[i])
+                {
+                    Console.WriteLine("File content differs at {0}.", i);
+                    return;
+                }
+            }
+        }
+
+        /// <summary>
+        /// A stand-in for a busy disk: each write pays a latency, the bandwidth is capped,
+        /// and some writes stall for much longer, as when the OS flushes its cache.
+        /// </summary>
+        private class ThrottledStream : Stream
+        {
+            private Stream inner;
+            private double latencyMilliseconds = 2;
+            private double megabytesPerSecond = 120;
+            private double hiccupProbability = 0.02;
+            private double hiccupMilliseconds = 250;
+
+            public ThrottledStream(Stream inner)
+            {
+                this.inner = inner;
+            }
+
+            public override bool CanRead { get { return false; } }
+            public override bool CanSeek { get { return true; } }
+            public override bool CanWrite { get { return true; } }
+            public override long Length { get { return inner.Length; } }
+            public override long Position
+            {
+                get { return inner.Position; }
+                set { inner.Position = value; }
+            }
+
+            public override void Write(byte[] buffer, int offset, int count)
+            {
+                double delay = latencyMilliseconds + count / (megabytesPerSecond * 1024 * 1024) * 1000;
+                lock (random)
+                {
+                    if (random.NextDouble() < hiccupProbability)
+                        delay += hiccupMilliseconds;
+                }
+
+                Thread.Sleep(TimeSpan.FromMilliseconds(delay));
+                inner.Write(buffer, offset, count);
+            }
+
+            public override long Seek(long offset, SeekOrigin origin) { return inner.Seek(offset, origin); }
+            public override void SetLength(long value) { inner.SetLength(value); }
+            public override void Flush() { inner.Flush(); }
+            public override int Read(byte[] buffer, int offset, int count) { throw new NotSupportedException(); }
+
+            protected override void Dispose(bool disposing)
+            {
+                if (disposing)
+                    inner.Dispose();
+
+                base.Dispose(disposing);
+            }
+        }
+    }
+}
@@ -0,0 +1,258 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Drawing;
+using System.Drawing.Imaging;
+using System.Globalization;
+using System.IO;
+using System.Runtime.InteropServices;
+using System.Text;
+using Newtonsoft.Json;
+using Kinovea.Services;
+using Kinovea.Video;
+using Kinovea.Video.FFMpeg;
+
+namespace Kinovea.Tests
+{
+    /// <summary>
+    /// Throughput of the capture writer for each storage mode: raw frames, MJPEG at the lowest quantizer and FFV1 lossless.
+    /// For each mode, image size and input format: frames per second, bytes written per frame and resulting disk bandwidth.
+    /// </summary>
+    /// <remarks>
+    /// The frames are prepared in memory beforehand so only the writer is measured, the time includes draining the queue and closing the file.
+    /// Pass a folder on the disk used for recording to include its write speed, the files are deleted after each run.
+    /// Usage: Kinovea.Tests.exe --writer-benchmark [output.json] [folder]
+    /// </remarks>
+    public class WriterBenchmark
+    {
+        private enum StorageMode
+        {
+            Raw,
+            MJPEG,
+            Lossless
+        }
+
+        private static readonly Size[] sizes = { new Size(640, 480), new Size(1280, 720), new Size(1920, 1080), new Size(2448, 2048) };
+        private static readonly Kinovea.Services.ImageFormat[] formats = { Kinovea.Services.ImageFormat.RGB32, Kinovea.Services.ImageFormat.Y800 };
+        private const int Frames = 300;
+        private const int DistinctFrames = 30;
+        private const double FrameInterval = 1000.0 / 30;
+        private const int WaitForRoomTimeout = 1000;
+
+        public static void Test(string output = null, string folder = null)
+        {
+            if (string.IsNullOrEmpty(output))
+                output = Path.Combine(Path.GetTempPath(), string.Format("Kinovea.WriterBenchmark-{0:yyyyMMddTHHmmss}.json", DateTime.Now));
+
+            if (string.IsNullOrEmpty(folder))
+                folder = Path.Combine(Path.GetTempPath(), "Kinovea.WriterBenchmark");
+
+            Directory.CreateDirectory(folder);
+            int threads = Math.Min(Math.Max(Environment.ProcessorCount / 2, 1), 8);
+
+            StringBuilder sb = new StringBuilder();
+            using (JsonWriter w = new JsonTextWriter(new StringWriter(sb, CultureInfo.InvariantCulture)))
+            {
+                w.Formatting = Formatting.Indented;
+                w.WriteStartObject();
+                WriteEnvironment(w, folder, threads);
+
+                w.WritePropertyName("runs");
+                w.WriteStartArray();
+                foreach (Size size in sizes)
+                {
+                    foreach (Kinovea.Services.ImageFormat format in formats)
+                    {
+                        List<byte[]> images = MakeImages(size, format);
+                        foreach (StorageMode mode in Enum.GetValues(typeof(StorageMode)))
+                        {
+                            Console.WriteLine("Benchmarking {0}x{1} {2} {3}.", size.Width, size.Height, format, mode);
+                            Run(w, folder, size, format, mode, threads, images);
+                        }
+                    }
+                }
+
+                w.WriteEndArray();
+                w.WriteEndObject();
+            }
+
+            File.WriteAllText(output, sb.ToString());
+            Console.WriteLine("Results written to {0}.", output);
+        }
+
+        private static void Run(JsonWriter w, string folder, Size size, Kinovea.Services.ImageFormat format, StorageMode mode, int threads, List<byte[]> images)
+        {
+            string path = Path.Combine(folder, string.Format("{0}x{1}-{2}-{3}.mkv", size.Width, size.Height, format, mode));
+            if (File.Exists(path))
+                File.Delete(path);
+
+            w.WriteStartObject();
+            w.WritePropertyName("width");
+            w.WriteValue(size.Width);
+            w.WritePropertyName("height");
+            w.WriteValue(size.Height);
+            w.WritePropertyName("format");
+            w.WriteValue(format.ToString());
+            w.WritePropertyName("mode");
+            w.WriteValue(mode.ToString());
+
+            VideoInfo info = VideoInfo.Empty;
+            info.OriginalSize = size;
+            info.PixelAspectRatio = 1.0;
+
+            MJPEGWriter writer = new MJPEGWriter();
+            writer.EncodingThreads = threads;
+            writer.Lossless = mode == StorageMode.Lossless;
+            bool uncompressed = mode != StorageMode.MJPEG;
+
+            Stopwatch sw = Stopwatch.StartNew();
+            SaveResult result = writer.OpenSavingContext(path, info, "matroska", format, uncompressed, FrameInterval, FrameInterval, ImageRotation.Rotate0);
+            w.WritePropertyName("openResult");
+            w.WriteValue(result.ToString());
+            if (result != SaveResult.Success)
+            {
+                writer.Dispose();
+                w.WriteEndObject();
+                return;
+            }
+
+            bool success = true;
+            int frames = 0;
+            for (int i = 0; i < Frames && success; i++)
+            {
+                // Same back-pressure as the real time recorder.
+                if (writer.QueueCapacity > 0)
+                    writer.WaitForRoom(WaitForRoomTimeout);
+
+                byte[] image = images[i % images.Count];
+                success = writer.SaveFrame(format, image, image.Length, true) == SaveResult.Success;
+                if (success)
+                    frames++;
+            }
+
+            writer.CloseSavingContext(success);
+            double seconds = sw.Elapsed.TotalSeconds;
+            int dropped = writer.DroppedFrames;
+            writer.Dispose();
+
+            long bytes = File.Exists(path) ? new FileInfo(path).Length : 0;
+            if (File.Exists(path))
+                File.Delete(path);
+
+            w.WritePropertyName("frames");
+            w.WriteValue(frames);
+            w.WritePropertyName("dropped");
+            w.WriteValue(dropped);
+            w.WritePropertyName("fps");
+            w.WriteValue(seconds > 0 ? frames / seconds : 0);
+            w.WritePropertyName("inputBytesPerFrame");
+            w.WriteValue(images[0].Length);
+            w.WritePropertyName("fileBytesPerFrame");
+            w.WriteValue(frames > 0 ? bytes / frames : 0);
+            w.WritePropertyName("writeMBps");
+            w.WriteValue(seconds > 0 ? bytes / seconds / (1024 * 1024) : 0);
+            w.WriteEndObject();
+        }
+
+        private static List<byte[]> MakeImages(Size size, Kinovea.Services.ImageFormat format)
+        {
+            // A few distinct frames cycled over the run, drawn and converted once so only the writer is measured.
+            List<byte[]> images = new List<byte[]>();
+            int stride = size.Width * 4;
+            byte[] bgra = new byte[stride * size.Height];
+            using (Bitmap bmp = new Bitmap(size.Width, size.Height, PixelFormat.Format32bppArgb))
+            {
+                for (int i = 0; i < DistinctFrames; i++)
+                {
+                    DrawFrame(bmp, i);
+                    BitmapData data = bmp.LockBits(new Rectangle(Point.Empty, size), ImageLockMode.ReadOnly, bmp.PixelFormat);
+                    for (int row = 0; row < size.Height; row++)
+                        Marshal.Copy(data.Scan0 + row * data.Stride, bgra, row * stride, stride);
+
+                    bmp.UnlockBits(data);
+
+                    if (format == Kinovea.Services.ImageFormat.Y800)
+                        images.Add(ToGray(bgra));
+                    else
+                        images.Add((byte[])bgra.Clone());
+                }
+            }
+
+            return images;
+        }
+
+        private static byte[] ToGray(byte[] bgra)
+        {
+            byte[] gray = new byte[bgra.Length / 4];
+            for (int i = 0; i < gray.Length; i++)
+                gray[i] = (byte)((bgra[i * 4] * 29 + bgra[i * 4 + 1] * 150 + bgra[i * 4 + 2] * 77) >> 8);
+
+            return gray;
+        }
+
+        private static void DrawFrame(Bitmap bmp, int frame)
+        {
+            // A moving disc over a gradient with some noise, so the frames compress like real footage rather than flat areas.
+            using (Graphics g = Graphics.FromImage(bmp))
+            using (Font font = new Font("Consolas", Math.Max(bmp.Height / 20, 8)))
+            {
+                Rectangle r = new Rectangle(0, 0, bmp.Width, bmp.Height);
+                using (Brush background = new System.Drawing.Drawing2D.LinearGradientBrush(r, Color.DarkSlateBlue, Color.DarkOrange, (frame * 12) % 360))
+                    g.FillRectangle(background, r);
+
+                Random random = new Random(frame);
+                for (int i = 0; i < 2000; i++)
+                {
+                    int gray = random.Next(256);
+                    using (Brush speck = new SolidBrush(Color.FromArgb(64, gray, gray, gray)))
+                        g.FillRectangle(speck, random.Next(bmp.Width), random.Next(bmp.Height), 3, 3);
+                }
+
+                int diameter = bmp.Height / 3;
+                int x = (frame * bmp.Width / DistinctFrames) % bmp.Width;
+                g.FillEllipse(Brushes.White, x, bmp.Height / 3, diameter, diameter);
+                g.DrawString(frame.ToString(CultureInfo.InvariantCulture), font, Brushes.Black, 10, 10);
+            }
+        }
+
+        private static void WriteEnvironment(JsonWriter w, string folder, int threads)
+        {
+            w.WritePropertyName("date");
+            w.WriteValue(DateTime.Now.ToString("yyyy-MM-ddTHH:mm:ss", CultureInfo.InvariantCulture));
+            w.WritePropertyName("machine");
+            w.WriteValue(Environment.MachineName);
+            w.WritePropertyName("os");
+            w.WriteValue(Environment.OSVersion.ToString());
+            w.WritePropertyName("processors");
+            w.WriteValue(Environment.ProcessorCount);
+            w.WritePropertyName("is64bit");
+            w.WriteValue(Environment.Is64BitProcess);
+            w.WritePropertyName("folder");
+            w.WriteValue(folder);
+            w.WritePropertyName("encodingThreads");
+            w.WriteValue(threads);
+            w.WritePropertyName("frames");
+            w.WriteValue(Frames);
+        }
+    }
+}
@@ -12,6 +12,18 @@ namespace Kinovea.Tests
     {
         public static void Main(string[] args)
         {
+            if (args.Length > 0 && args[0] == "--reader-benchmark")
+            {
+                ReaderBenchmark.Test(args.ElementAtOrDefault(1), args.ElementAtOrDefault(2), args.ElementAtOrDefault(3));
+                return;
+            }
+
+            if (args.Length > 0 && args[0] == "--writer-benchmark")
+            {
+                WriterBenchmark.Test(args.ElementAtOrDefault(1), args.ElementAtOrDefault(2));
+                return;
+            }
+
             //TestKVAFuzzer();
             //TestKSVFuzzer();
             //TestHistoryStack();
@@ -21,6 +33,13 @@ namespace Kinovea.Tests
 
             // Performance
             //ImageCopy.Test();
+            //ImageRotate.Test();
+            //PreBufferStress.Test();
+            //ReadAhead.Test();
+            //ReaderBenchmark.Test();
+            //SummaryExtraction.Test();
+            //WriteBehind.Test();
+            //WriterBenchmark.Test();
         }
         private static void TestKVAFuzzer()
         {
@@ -0,0 +1,70 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#pragma once
+
+#include <stdint.h>
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace Kinovea::Video;
+
+namespace Kinovea { namespace Video { namespace FFMpeg
+{
+    /// <summary>
+    /// A run of frames decoded on its own demuxer and decoder, starting at a keyframe.
+    /// Used for whole GOPs when filling the cache in parallel, and for chunks of GOPs during reverse playback.
+    /// </summary>
+    ref class CacheSegment
+    {
+    public:
+        int Index;
+
+        // Frames presented in [Start, End[ belong to this segment. Kinovea timestamps.
+        int64_t Start;
+        int64_t End;
+
+        // Raw decoding timestamp of the keyframe opening the segment.
+        int64_t SeekTimestamp;
+
+        // Output settings.
+        bool Planar;
+        int DecodingThreads;
+        ThreadCanceler^ Canceler;
+
+        List<VideoFrame^>^ Frames;
+        bool Success;
+
+        CacheSegment(int _index, int64_t _start, int64_t _end, int64_t _seekTimestamp)
+        {
+            Index = _index;
+            Start = _start;
+            End = _end;
+            SeekTimestamp = _seekTimestamp;
+            Planar = false;
+            DecodingThreads = 1;
+            Canceler = nullptr;
+            Frames = gcnew List<VideoFrame^>();
+            Success = false;
+        }
+    };
+}}}
@@ -0,0 +1,175 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#include "ConversionEngine.h"
+
+using namespace System::Diagnostics;
+using namespace System::Threading;
+using namespace Kinovea::Video::FFMpeg;
+
+ConversionEngine::ConversionEngine(int flags)
+{
+    m_Keys = gcnew List<ConversionKey>();
+    m_Contexts = gcnew List<IntPtr>();
+    m_Flags = flags;
+}
+ConversionEngine::~ConversionEngine()
+{
+    this->!ConversionEngine();
+}
+ConversionEngine::!ConversionEngine()
+{
+    Release();
+}
+void ConversionEngine::Invalidate()
+{
+    m_Invalidated = true;
+}
+void ConversionEngine::ResetCounters()
+{
+    m_Conversions = 0;
+    m_ContextCreations = 0;
+    m_DeinterlaceTicks = 0;
+    m_ScaleTicks = 0;
+}
+void ConversionEngine::DumpStats(String^ name)
+{
+    if (m_Conversions == 0)
+        return;
+
+    log->DebugFormat("Conversion engine ({0}). Frames:{1}, Contexts created:{2}, Deinterlace:{3:0.000} ms/frame, Scale:{4:0.000} ms/frame.",
+        name, m_Conversions, m_ContextCreations, DeinterlaceMilliseconds / m_Conversions, ScaleMilliseconds / m_Conversions);
+}
+bool ConversionEngine::Convert(AVFrame* output, AVFrame* input, int inputFormat, int inputWidth, int inputHeight, int outputFormat, int outputWidth, int outputHeight, bool deinterlace)
+{
+    if (m_Invalidated)
+    {
+        Release();
+        m_Invalidated = false;
+    }
+
+    uint8_t** ppSourceData = input->data;
+    int* piSourceStride = input->linesize;
+    AVPicture deinterlaced;
+
+    if (deinterlace)
+    {
+        // Deinterlacing happens before resizing, in the decoder format.
+        int64_t start = Stopwatch::GetTimestamp();
+        int size = avpicture_get_size((AVPixelFormat)input->format, inputWidth, inputHeight);
+        uint8_t* pBuffer = GetDeinterlaceBuffer(size);
+        if (pBuffer != nullptr)
+        {
+            avpicture_fill(&deinterlaced, pBuffer, (AVPixelFormat)input->format, inputWidth, inputHeight);
+            if (avpicture_deinterlace(&deinterlaced, (AVPicture*)input, (AVPixelFormat)input->format, inputWidth, inputHeight) >= 0)
+            {
+                ppSourceData = deinterlaced.data;
+                piSourceStride = deinterlaced.linesize;
+            }
+            else
+            {
+                log->Debug("Deinterlacing failed, use original image.");
+            }
+        }
+
+        m_DeinterlaceTicks += Stopwatch::GetTimestamp() - start;
+    }
+
+    ConversionKey key;
+    key.SourceFormat = inputFormat;
+    key.SourceWidth = inputWidth;
+    key.SourceHeight = inputHeight;
+    key.OutputFormat = outputFormat;
+    key.OutputWidth = outputWidth;
+    key.OutputHeight = outputHeight;
+    key.Flags = m_Flags;
+
+    SwsContext* pContext = GetContext(key);
+    if (pContext == nullptr)
+    {
+        log->Error("Scaler context could not be created.");
+        return false;
+    }
+
+    int64_t start = Stopwatch::GetTimestamp();
+    sws_scale(pContext, ppSourceData, piSourceStride, 0, inputHeight, output->data, output->linesize);
+    m_ScaleTicks += Stopwatch::GetTimestamp() - start;
+
+    m_Conversions++;
+    return true;
+}
+SwsContext* ConversionEngine::GetContext(ConversionKey key)
+{
+    for (int i = 0; i < m_Keys->Count; i++)
+    {
+        if (m_Keys[i].Equals(key))
+            return (SwsContext*)m_Contexts[i].ToPointer();
+    }
+
+    SwsContext* pContext = sws_getContext(
+        key.SourceWidth, key.SourceHeight, (AVPixelFormat)key.SourceFormat,
+        key.OutputWidth, key.OutputHeight, (AVPixelFormat)key.OutputFormat,
+        key.Flags, nullptr, nullptr, nullptr);
+
+    if (pContext == nullptr)
+        return nullptr;
+
+    // Only a few combinations are ever live at the same time (e.g: before and after a decoding size change).
+    if (m_Keys->Count >= MaxContexts)
+    {
+        sws_freeContext((SwsContext*)m_Contexts[0].ToPointer());
+        m_Keys->RemoveAt(0);
+        m_Contexts->RemoveAt(0);
+    }
+
+    m_Keys->Add(key);
+    m_Contexts->Add(IntPtr(pContext));
+    m_ContextCreations++;
+    return pContext;
+}
+uint8_t* ConversionEngine::GetDeinterlaceBuffer(int size)
+{
+    if (size > m_DeinterlaceBufferSize)
+    {
+        av_free(m_DeinterlaceBuffer);
+        m_DeinterlaceBuffer = (uint8_t*)av_malloc(size);
+        m_DeinterlaceBufferSize = m_DeinterlaceBuffer != nullptr ? size : 0;
+    }
+
+    return m_DeinterlaceBuffer;
+}
+void ConversionEngine::Release()
+{
+    for each (IntPtr context in m_Contexts)
+        sws_freeContext((SwsContext*)context.ToPointer());
+
+    m_Keys->Clear();
+    m_Contexts->Clear();
+
+    av_free(m_DeinterlaceBuffer);
+    m_DeinterlaceBuffer = nullptr;
+    m_DeinterlaceBufferSize = 0;
+}
+double ConversionEngine::TicksToMilliseconds(int64_t ticks)
+{
+    return (ticks * 1000.0) / Stopwatch::Frequency;
+}
@@ -0,0 +1,135 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#pragma once
+
+extern "C" {
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <avcodec.h>
+#include <swscale.h>
+}
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::Reflection;
+
+namespace Kinovea { namespace Video { namespace FFMpeg
+{
+    /// <summary>
+    /// Identifies a scaler context. Demosaicing is expressed by the source format (Bayer formats).
+    /// </summary>
+    value struct ConversionKey
+    {
+        int SourceFormat;
+        int SourceWidth;
+        int SourceHeight;
+        int OutputFormat;
+        int OutputWidth;
+        int OutputHeight;
+        int Flags;
+
+        bool Equals(ConversionKey other)
+        {
+            return SourceFormat == other.SourceFormat && SourceWidth == other.SourceWidth && SourceHeight == other.SourceHeight &&
+                OutputFormat == other.OutputFormat && OutputWidth == other.OutputWidth && OutputHeight == other.OutputHeight &&
+                Flags == other.Flags;
+        }
+    };
+
+    /// <summary>
+    /// Deinterlace, rescale and pixel format conversion of decoded frames.
+    /// Keeps the scaler contexts and the intermediate deinterlacing buffer alive between frames.
+    /// Not thread safe: each decoding thread must use its own engine.
+    /// Invalidate() may be called from any thread, the resources are released on the next conversion.
+    /// </summary>
+    public ref class ConversionEngine
+    {
+    public:
+        /// <summary>
+        /// Number of frames converted since the last reset.
+        /// </summary>
+        property int64_t Conversions {
+            int64_t get() { return m_Conversions; }
+        }
+
+        /// <summary>
+        /// Number of scaler contexts created since the last reset.
+        /// </summary>
+        property int ContextCreations {
+            int get() { return m_ContextCreations; }
+        }
+
+        /// <summary>
+        /// Total time spent in deinterlacing, in milliseconds.
+        /// </summary>
+        property double DeinterlaceMilliseconds {
+            double get() { return TicksToMilliseconds(m_DeinterlaceTicks); }
+        }
+
+        /// <summary>
+        /// Total time spent in scaling and pixel format conversion, in milliseconds.
+        /// </summary>
+        property double ScaleMilliseconds {
+            double get() { return TicksToMilliseconds(m_ScaleTicks); }
+        }
+
+    public:
+        ConversionEngine(int flags);
+        ~ConversionEngine();
+    protected:
+        !ConversionEngine();
+
+    public:
+        /// <summary>
+        /// Release all scaler contexts and buffers. The next conversion will recreate what it needs.
+        /// </summary>
+        void Invalidate();
+        void ResetCounters();
+        void DumpStats(String^ name);
+
+    internal:
+        bool Convert(AVFrame* output, AVFrame* input, int inputFormat, int inputWidth, int inputHeight, int outputFormat, int outputWidth, int outputHeight, bool deinterlace);
+
+    private:
+        SwsContext* GetContext(ConversionKey key);
+        uint8_t* GetDeinterlaceBuffer(int size);
+        void Release();
+        static double TicksToMilliseconds(int64_t ticks);
+
+    private:
+        static const int MaxContexts = 4;
+
+        List<ConversionKey>^ m_Keys;
+        List<IntPtr>^ m_Contexts;
+        uint8_t* m_DeinterlaceBuffer;
+        int m_DeinterlaceBufferSize;
+        int m_Flags;
+        bool m_Invalidated;
+
+        int64_t m_Conversions;
+        int m_ContextCreations;
+        int64_t m_DeinterlaceTicks;
+        int64_t m_ScaleTicks;
+        static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+    };
+}}}
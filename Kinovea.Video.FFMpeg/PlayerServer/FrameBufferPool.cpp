@@ -0,0 +1,175 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#include <malloc.h>
+#include <msclr\lock.h>
+#include "FrameBufferPool.h"
+
+using namespace msclr;
+using namespace System::Diagnostics;
+using namespace Kinovea::Video::FFMpeg;
+
+FrameBufferPool::FrameBufferPool(int64_t maxIdleBytes)
+{
+    m_IdleBuffers = gcnew Dictionary<int, Stack<IntPtr>^>();
+    m_BucketSizes = gcnew Dictionary<IntPtr, int>();
+    m_Locker = gcnew Object();
+    m_MaxIdleBytes = maxIdleBytes;
+}
+FrameBufferPool::~FrameBufferPool()
+{
+    this->!FrameBufferPool();
+}
+FrameBufferPool::!FrameBufferPool()
+{
+    lock l(m_Locker);
+
+    // Buffers still handed out at this point will be freed directly when released.
+    Trim();
+    m_Disposed = true;
+}
+uint8_t* FrameBufferPool::Acquire(int size)
+{
+    if (size <= 0)
+        return nullptr;
+
+    int bucketSize = GetBucketSize(size);
+    uint8_t* buffer = nullptr;
+
+    lock l(m_Locker);
+
+    Stack<IntPtr>^ idle = nullptr;
+    if (m_IdleBuffers->TryGetValue(bucketSize, idle) && idle->Count > 0)
+    {
+        buffer = (uint8_t*)idle->Pop().ToPointer();
+        m_IdleBytes -= bucketSize;
+        m_Hits++;
+    }
+    else
+    {
+        buffer = Allocate(bucketSize);
+        if (buffer == nullptr)
+            return nullptr;
+
+        m_BucketSizes->Add(IntPtr(buffer), bucketSize);
+        m_Misses++;
+    }
+
+    m_Outstanding++;
+    m_OutstandingBytes += bucketSize;
+    m_Peak = Math::Max(m_Peak, m_Outstanding);
+    m_PeakBytes = Math::Max(m_PeakBytes, m_OutstandingBytes);
+
+    return buffer;
+}
+void FrameBufferPool::Release(uint8_t* buffer)
+{
+    if (buffer == nullptr)
+        return;
+
+    lock l(m_Locker);
+
+    IntPtr ptr = IntPtr(buffer);
+    int bucketSize = 0;
+    if (!m_BucketSizes->TryGetValue(ptr, bucketSize))
+    {
+        log->Error("Releasing a buffer that was not allocated by the pool.");
+        return;
+    }
+
+    m_Outstanding--;
+    m_OutstandingBytes -= bucketSize;
+
+    // Keep the buffer around unless it would make the pool grow too large.
+    // This typically happens when a large cache is cleared all at once.
+    if (m_Disposed || m_IdleBytes + bucketSize > m_MaxIdleBytes)
+    {
+        m_BucketSizes->Remove(ptr);
+        Free(buffer);
+        return;
+    }
+
+    Stack<IntPtr>^ idle = nullptr;
+    if (!m_IdleBuffers->TryGetValue(bucketSize, idle))
+    {
+        idle = gcnew Stack<IntPtr>();
+        m_IdleBuffers->Add(bucketSize, idle);
+    }
+
+#ifdef _DEBUG
+    // A buffer released twice would later be handed out to two frames at once.
+    Debug::Assert(!idle->Contains(ptr), "Frame buffer released twice.");
+#endif
+
+    idle->Push(ptr);
+    m_IdleBytes += bucketSize;
+}
+void FrameBufferPool::Trim()
+{
+    lock l(m_Locker);
+
+    for each (KeyValuePair<int, Stack<IntPtr>^> pair in m_IdleBuffers)
+    {
+        while (pair.Value->Count > 0)
+        {
+            IntPtr ptr = pair.Value->Pop();
+            m_BucketSizes->Remove(ptr);
+            Free((uint8_t*)ptr.ToPointer());
+        }
+    }
+
+    m_IdleBuffers->Clear();
+    m_IdleBytes = 0;
+}
+void FrameBufferPool::ResetCounters()
+{
+    lock l(m_Locker);
+    m_Hits = 0;
+    m_Misses = 0;
+    m_Peak = m_Outstanding;
+    m_PeakBytes = m_OutstandingBytes;
+}
+void FrameBufferPool::DumpStats()
+{
+    double megabyte = 1024 * 1024;
+    int64_t total = m_Hits + m_Misses;
+    double hitRate = total > 0 ? (double)m_Hits / total : 0;
+    log->DebugFormat("Frame buffer pool. Hits:{0}, Misses:{1} ({2:0.0%} hit rate), Peak:{3} buffers ({4:0.0} MB), Idle:{5:0.0} MB.",
+        m_Hits, m_Misses, hitRate, m_Peak, m_PeakBytes / megabyte, m_IdleBytes / megabyte);
+}
+int FrameBufferPool::GetBucketSize(int size)
+{
+    // Round up so that buffers for slightly different frame sizes can be shared.
+    return ((size + BucketGranularity - 1) / BucketGranularity) * BucketGranularity;
+}
+uint8_t* FrameBufferPool::Allocate(int bucketSize)
+{
+    uint8_t* buffer = (uint8_t*)_aligned_malloc(bucketSize, Alignment);
+    if (buffer == nullptr)
+        log->ErrorFormat("Frame buffer could not be allocated. Size:{0}.", bucketSize);
+
+    return buffer;
+}
+void FrameBufferPool::Free(uint8_t* buffer)
+{
+    _aligned_free(buffer);
+}
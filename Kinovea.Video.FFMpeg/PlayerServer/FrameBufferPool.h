@@ -0,0 +1,118 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#pragma once
+
+#include <stdint.h>
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::Reflection;
+
+namespace Kinovea { namespace Video { namespace FFMpeg
+{
+    /// <summary>
+    /// A pool of aligned native buffers holding decoded frames.
+    /// Buffers are grouped in buckets by rounded up size and recycled between the decoding code
+    /// and the frame containers (single frame, prebuffer, cache), to avoid allocator churn at high frame rates.
+    /// Thread safe: buffers are acquired on the decoding thread and often released on the UI thread.
+    /// </summary>
+    public ref class FrameBufferPool
+    {
+    public:
+        /// <summary>
+        /// Number of acquisitions served from an idle buffer.
+        /// </summary>
+        property int64_t Hits {
+            int64_t get() { return m_Hits; }
+        }
+
+        /// <summary>
+        /// Number of acquisitions that required a new allocation.
+        /// </summary>
+        property int64_t Misses {
+            int64_t get() { return m_Misses; }
+        }
+
+        /// <summary>
+        /// Maximum number of buffers simultaneously handed out since the last reset.
+        /// </summary>
+        property int Peak {
+            int get() { return m_Peak; }
+        }
+
+        /// <summary>
+        /// Maximum number of bytes simultaneously handed out since the last reset.
+        /// </summary>
+        property int64_t PeakBytes {
+            int64_t get() { return m_PeakBytes; }
+        }
+
+        /// <summary>
+        /// Number of bytes currently kept in the pool for reuse.
+        /// </summary>
+        property int64_t IdleBytes {
+            int64_t get() { return m_IdleBytes; }
+        }
+
+    public:
+        FrameBufferPool(int64_t maxIdleBytes);
+        ~FrameBufferPool();
+    protected:
+        !FrameBufferPool();
+
+    public:
+        /// <summary>
+        /// Free all the idle buffers. Buffers currently handed out are not affected.
+        /// </summary>
+        void Trim();
+        void ResetCounters();
+        void DumpStats();
+
+    internal:
+        uint8_t* Acquire(int size);
+        void Release(uint8_t* buffer);
+
+    private:
+        int GetBucketSize(int size);
+        uint8_t* Allocate(int bucketSize);
+        void Free(uint8_t* buffer);
+
+    private:
+        static const int Alignment = 64;
+        static const int BucketGranularity = 4096;
+
+        Dictionary<int, Stack<IntPtr>^>^ m_IdleBuffers;
+        Dictionary<IntPtr, int>^ m_BucketSizes;
+        Object^ m_Locker;
+        int64_t m_MaxIdleBytes;
+        int64_t m_IdleBytes;
+        int64_t m_OutstandingBytes;
+        int64_t m_PeakBytes;
+        int m_Outstanding;
+        int m_Peak;
+        int64_t m_Hits;
+        int64_t m_Misses;
+        bool m_Disposed;
+        static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+    };
+}}}
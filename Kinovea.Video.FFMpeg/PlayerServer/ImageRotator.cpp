@@ -0,0 +1,123 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#include <string.h>
+#include "ImageRotator.h"
+
+using namespace Kinovea::Video::FFMpeg;
+
+// The kernels are compiled to native code so the optimizer can unroll and vectorize the inner loops.
+#pragma managed(push, off)
+
+// Tile side in pixels. A 32x32 tile of 32-bit pixels is 4 KB, source and destination tiles fit in L1.
+static const int TileSize = 32;
+
+static inline const uint32_t* SourceRow(const uint8_t* _pSource, int _stride, int _y)
+{
+    return (const uint32_t*)(_pSource + (intptr_t)_y * _stride);
+}
+
+static inline uint32_t* DestinationRow(uint8_t* _pDestination, int _stride, int _y)
+{
+    return (uint32_t*)(_pDestination + (intptr_t)_y * _stride);
+}
+
+static void RotateTiled90(const uint8_t* _pSource, int _sourceStride, uint8_t* _pDestination, int _destinationStride, int _width, int _height)
+{
+    // Source column x becomes destination row x, read from bottom to top.
+    for (int ty = 0; ty < _height; ty += TileSize)
+    {
+        int yEnd = ty + TileSize < _height ? ty + TileSize : _height;
+        for (int tx = 0; tx < _width; tx += TileSize)
+        {
+            int xEnd = tx + TileSize < _width ? tx + TileSize : _width;
+            for (int x = tx; x < xEnd; x++)
+            {
+                uint32_t* pDst = DestinationRow(_pDestination, _destinationStride, x) + (_height - 1);
+                for (int y = ty; y < yEnd; y++)
+                    pDst[-y] = SourceRow(_pSource, _sourceStride, y)[x];
+            }
+        }
+    }
+}
+
+static void RotateTiled270(const uint8_t* _pSource, int _sourceStride, uint8_t* _pDestination, int _destinationStride, int _width, int _height)
+{
+    // Source column x becomes destination row (width - 1 - x), read from top to bottom.
+    for (int ty = 0; ty < _height; ty += TileSize)
+    {
+        int yEnd = ty + TileSize < _height ? ty + TileSize : _height;
+        for (int tx = 0; tx < _width; tx += TileSize)
+        {
+            int xEnd = tx + TileSize < _width ? tx + TileSize : _width;
+            for (int x = tx; x < xEnd; x++)
+            {
+                uint32_t* pDst = DestinationRow(_pDestination, _destinationStride, _width - 1 - x);
+                for (int y = ty; y < yEnd; y++)
+                    pDst[y] = SourceRow(_pSource, _sourceStride, y)[x];
+            }
+        }
+    }
+}
+
+static void Rotate180(const uint8_t* _pSource, int _sourceStride, uint8_t* _pDestination, int _destinationStride, int _width, int _height)
+{
+    // Rows are swapped top to bottom and reversed. Both sides are read and written sequentially, no tiling needed.
+    for (int y = 0; y < _height; y++)
+    {
+        const uint32_t* pSrc = SourceRow(_pSource, _sourceStride, y);
+        uint32_t* pDst = DestinationRow(_pDestination, _destinationStride, _height - 1 - y) + (_width - 1);
+        for (int x = 0; x < _width; x++)
+            pDst[-x] = pSrc[x];
+    }
+}
+
+static void Copy(const uint8_t* _pSource, int _sourceStride, uint8_t* _pDestination, int _destinationStride, int _width, int _height)
+{
+    for (int y = 0; y < _height; y++)
+        memcpy(DestinationRow(_pDestination, _destinationStride, y), SourceRow(_pSource, _sourceStride, y), _width * sizeof(uint32_t));
+}
+
+#pragma managed(pop)
+
+void ImageRotator::Rotate(IntPtr _source, int _sourceStride, IntPtr _destination, int _destinationStride, int _width, int _height, ImageRotation _rotation)
+{
+    Rotate((const uint8_t*)_source.ToPointer(), _sourceStride, (uint8_t*)_destination.ToPointer(), _destinationStride, _width, _height, _rotation);
+}
+void ImageRotator::Rotate(const uint8_t* _pSource, int _sourceStride, uint8_t* _pDestination, int _destinationStride, int _width, int _height, ImageRotation _rotation)
+{
+    switch (_rotation)
+    {
+    case ImageRotation::Rotate90:
+        RotateTiled90(_pSource, _sourceStride, _pDestination, _destinationStride, _width, _height);
+        break;
+    case ImageRotation::Rotate180:
+        Rotate180(_pSource, _sourceStride, _pDestination, _destinationStride, _width, _height);
+        break;
+    case ImageRotation::Rotate270:
+        RotateTiled270(_pSource, _sourceStride, _pDestination, _destinationStride, _width, _height);
+        break;
+    default:
+        Copy(_pSource, _sourceStride, _pDestination, _destinationStride, _width, _height);
+        break;
+    }
+}
@@ -0,0 +1,51 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#pragma once
+
+#include <stdint.h>
+
+using namespace System;
+using namespace Kinovea::Services;
+
+namespace Kinovea { namespace Video { namespace FFMpeg
+{
+    /// <summary>
+    /// Rotation of 32-bit images by quarter turns, between native buffers.
+    /// Replaces Bitmap.RotateFlip on the decoding path: the image is transposed block by block
+    /// so that both the source and destination tiles stay in cache.
+    /// Rotations are clockwise, like RotateFlipType.
+    /// </summary>
+    public ref class ImageRotator abstract sealed
+    {
+    public:
+        /// <summary>
+        /// Rotate the source image into the destination buffer.
+        /// The destination must be able to hold the rotated image: for sideway rotations its width is the source height.
+        /// Strides are in bytes. The buffers must not overlap.
+        /// </summary>
+        static void Rotate(IntPtr _source, int _sourceStride, IntPtr _destination, int _destinationStride, int _width, int _height, ImageRotation _rotation);
+
+    internal:
+        static void Rotate(const uint8_t* _pSource, int _sourceStride, uint8_t* _pDestination, int _destinationStride, int _width, int _height, ImageRotation _rotation);
+    };
+}}}
@@ -19,6 +19,7 @@ along with Kinovea. If not, see http://www.gnu.org/licenses/.
 */
 
 #include "MJPEGWriter.h"
+#include <msclr\lock.h>
 
 using namespace System::Diagnostics;
 using namespace System::Drawing;
@@ -28,13 +29,19 @@ using namespace System::Runtime::InteropServices;
 
 using namespace Kinovea::Video;
 using namespace Kinovea::Video::FFMpeg;
+using namespace msclr;
 
 MJPEGWriter::MJPEGWriter()
 {
     av_register_all();
     m_swEncoding = gcnew Stopwatch();
     m_swWrite = gcnew Stopwatch();
-
+    m_PoolLocker = gcnew Object();
+    m_WriteLocker = gcnew Object();
+    m_EncodingThreads = 0;
+    m_Lossless = false;
+    m_BayerPattern = Demosaicing::None;
+    m_WriteBehindMemory = 0;
 }
 MJPEGWriter::~MJPEGWriter()
 {
@@ -57,6 +64,7 @@ SaveResult MJPEGWriter::OpenSavingContext(String^ _filePath, VideoInfo _info, St
 
     SaveResult result = SaveResult::Success;
     m_frame = 0;
+    m_framesWritten = 0;
     m_swEncoding->Start();
     m_swWrite->Start();
 
@@ -82,6 +90,10 @@ SaveResult MJPEGWriter::OpenSavingContext(String^ _filePath, VideoInfo _info, St
     m_SavingContext->iBitrate = (int)ComputeBitrate(m_SavingContext->outputSize, m_SavingContext->fFramesInterval);
     
     m_SavingContext->uncompressed = _uncompressed;
+    m_SavingContext->lossless = _uncompressed && m_Lossless;
+
+    // Raw Bayer recording only makes sense for single plane images.
+    m_bMosaic = m_BayerPattern != Demosaicing::None && _imageFormat == Kinovea::Services::ImageFormat::Y800;
 
     do
     {
@@ -117,8 +129,15 @@ SaveResult MJPEGWriter::OpenSavingContext(String^ _filePath, VideoInfo _info, St
             break;
         }
 
+        // Tag the Bayer pattern of raw recordings. The comment is the only tag written by all of AVI, MKV and MP4.
+        if (m_bMosaic)
+            av_dict_set(&m_SavingContext->pOutputFormatContext->metadata, "comment", GetBayerTag(m_BayerPattern), 0);
+
         // 4. Find encoder.
-        AVCodecID codecId = _uncompressed ? AV_CODEC_ID_RAWVIDEO : AV_CODEC_ID_MJPEG;
+        AVCodecID codecId = AV_CODEC_ID_MJPEG;
+        if (_uncompressed)
+            codecId = m_SavingContext->lossless ? AV_CODEC_ID_FFV1 : AV_CODEC_ID_RAWVIDEO;
+
         if ((m_SavingContext->pOutputCodec = avcodec_find_encoder(codecId)) == nullptr)
         {
             result = SaveResult::EncoderNotFound;
@@ -179,7 +198,10 @@ SaveResult MJPEGWriter::OpenSavingContext(String^ _filePath, VideoInfo _info, St
 
         
         // 9. Open the file.
-        averror = avio_open(&(m_SavingContext->pOutputFormatContext)->pb, m_SavingContext->pFilePath, AVIO_FLAG_WRITE);
+        averror = 0;
+        if (m_WriteBehindMemory <= 0 || !OpenWriteBehind(_filePath, m_WriteBehindMemory))
+            averror = avio_open(&(m_SavingContext->pOutputFormatContext)->pb, m_SavingContext->pFilePath, AVIO_FLAG_WRITE);
+
         if (averror < 0) 
         {
             result = SaveResult::FileNotOpened;
@@ -209,11 +231,7 @@ SaveResult MJPEGWriter::OpenSavingContext(String^ _filePath, VideoInfo _info, St
         // 12. Prepare the color conversion context.
         // Preallocating the context gains 0.5ms.
         // Using nearest neighbor instead of bilinear gains about 1.5ms on a 1600x1200 frame.
-        AVPixelFormat srcFormat = AV_PIX_FMT_BGRA;
-        if (_imageFormat == Kinovea::Services::ImageFormat::RGB24)
-            srcFormat = AV_PIX_FMT_BGR24;
-        else if (_imageFormat == Kinovea::Services::ImageFormat::Y800)
-            srcFormat = AV_PIX_FMT_GRAY8;
+        AVPixelFormat srcFormat = GetSourceFormat(_imageFormat);
         
         int flags = SWS_POINT;
         
@@ -223,12 +241,72 @@ SaveResult MJPEGWriter::OpenSavingContext(String^ _filePath, VideoInfo _info, St
             NULL, NULL, NULL);
 
         m_SavingContext->pScalingContext = scalingContext;
+
+        // 13. Size the conversion and encoding buffers.
+        int width = m_SavingContext->outputSize.Width;
+        int height = m_SavingContext->outputSize.Height;
+        m_SavingContext->iYUV420BufferSize = avpicture_get_size(AV_PIX_FMT_YUV420P, width, height);
+
+        if (!_uncompressed)
+        {
+            // The JPEG of a frame may be larger than the raw image at the lowest quantizer, for noisy images.
+            // Use the worst case bound of the encoder itself: a fixed maximum per macroblock plus room for the headers.
+            int macroblocks = ((width + 15) / 16) * ((height + 15) / 16);
+            m_SavingContext->iEncodeBufferSize = macroblocks * MaxMacroblockBytes + FF_MIN_BUFFER_SIZE;
+        }
     }
     while(false);
 
+    // 14. Spread the encoding over several threads.
+    // Encoded JPEG samples are passed through as-is and uncompressed frames are only a copy, they don't need it.
+    if (result == SaveResult::Success && !_uncompressed && _imageFormat != Kinovea::Services::ImageFormat::JPEG && m_EncodingThreads > 1)
+    {
+        if (!OpenEncodingPool(_imageFormat))
+        {
+            log->Error("Encoding pool not created, frames will be encoded synchronously.");
+            CloseEncodingPool();
+        }
+    }
+
+    // 15. Allocate the buffers of the synchronous path, reused for every frame.
+    // The recording thread should not allocate anything in the steady state. The encoding pool has its own.
+    if (result == SaveResult::Success && m_Slots == nullptr)
+        result = AllocateConversionBuffers(_uncompressed);
+
     return result;
 }
 
+SaveResult MJPEGWriter::AllocateConversionBuffers(bool _uncompressed)
+{
+    int width = m_SavingContext->outputSize.Width;
+    int height = m_SavingContext->outputSize.Height;
+    m_SavingContext->pYUV420Buffer = (uint8_t*)av_malloc(m_SavingContext->iYUV420BufferSize);
+    m_SavingContext->pYUV420Frame = av_frame_alloc();
+    if (m_SavingContext->pYUV420Buffer == nullptr || m_SavingContext->pYUV420Frame == nullptr)
+    {
+        log->Error("YUV420P frame not allocated");
+        return SaveResult::InputFrameNotAllocated;
+    }
+
+    avpicture_fill((AVPicture*)m_SavingContext->pYUV420Frame, m_SavingContext->pYUV420Buffer, AV_PIX_FMT_YUV420P, width, height);
+
+    // The mosaic only goes in the luma plane, the chroma planes stay neutral for the whole recording.
+    if (m_bMosaic)
+        FillNeutralChroma(m_SavingContext->pYUV420Frame, height);
+
+    if (!_uncompressed)
+    {
+        m_SavingContext->pEncodeBuffer = (uint8_t*)av_malloc(m_SavingContext->iEncodeBufferSize);
+        if (m_SavingContext->pEncodeBuffer == nullptr)
+        {
+            log->Error("output video buffer not allocated");
+            return SaveResult::InputFrameNotAllocated;
+        }
+    }
+
+    return SaveResult::Success;
+}
+
 void MJPEGWriter::SanityCheck(AVFormatContext* s)
 {
     // Taken/Adapted from the real sanity check from utils.c av_write_header.
@@ -274,6 +352,10 @@ SaveResult MJPEGWriter::CloseSavingContext(bool _bEncodingSuccess)
     log->Debug("Closing the saving context.");
 
     SaveResult result = SaveResult::Success;
+
+    // Queued frames must reach the file before the trailer.
+    CloseEncodingPool();
+
     m_swEncoding->Stop();
     m_swWrite->Stop();
 
@@ -299,7 +381,12 @@ SaveResult MJPEGWriter::CloseSavingContext(bool _bEncodingSuccess)
     }
 
     // Close file.
-    avio_close(m_SavingContext->pOutputFormatContext->pb);
+    if (m_WriteBehind != nullptr)
+        CloseWriteBehind();
+    else
+        avio_close(m_SavingContext->pOutputFormatContext->pb);
+
+    m_SavingContext->pOutputFormatContext->pb = nullptr;
 
     // Release muxer parameter object.
     av_free(m_SavingContext->pOutputFormatContext);
@@ -309,7 +396,19 @@ SaveResult MJPEGWriter::CloseSavingContext(bool _bEncodingSuccess)
     // Release scaling context
     sws_freeContext(m_SavingContext->pScalingContext);
 
-    // Release input frame buffer.
+    // Release conversion and encoding buffers.
+    if (m_SavingContext->pYUV420Frame != nullptr)
+        av_free(m_SavingContext->pYUV420Frame);
+
+    if (m_SavingContext->pYUV420Buffer != nullptr)
+        av_free(m_SavingContext->pYUV420Buffer);
+
+    if (m_SavingContext->pEncodeBuffer != nullptr)
+        av_free(m_SavingContext->pEncodeBuffer);
+
+    m_SavingContext->pYUV420Frame = nullptr;
+    m_SavingContext->pYUV420Buffer = nullptr;
+    m_SavingContext->pEncodeBuffer = nullptr;
 
     log->Debug("Saving video completed.");
 
@@ -323,6 +422,9 @@ SaveResult MJPEGWriter::SaveFrame(Kinovea::Services::ImageFormat format, array<S
 
     m_frame++;
 
+    if (m_Slots != nullptr && format != Kinovea::Services::ImageFormat::JPEG)
+        return EnqueueFrame(buffer, length, topDown);
+
     switch (format)
     {
     case Kinovea::Services::ImageFormat::RGB32:
@@ -459,6 +561,19 @@ bool MJPEGWriter::SetupEncoder(SavingContext^ _SavingContext, Kinovea::Services:
         _SavingContext->pOutputCodecContext->pix_fmt = AV_PIX_FMT_GRAY8;
     else
         _SavingContext->pOutputCodecContext->pix_fmt = AV_PIX_FMT_YUV420P; 	
+
+    // Lossless: same pixel formats as the raw frames, so the file is identical to a raw recording once decoded.
+    // Version 3 of FFV1 splits the image in slices encoded in parallel, each protected by a checksum.
+    // Every frame must be a keyframe, otherwise the state of the range coder carries over and frames can't be decoded on their own.
+    if (_SavingContext->lossless)
+    {
+        int threads = Math::Max(m_EncodingThreads, 1);
+        _SavingContext->pOutputCodecContext->level = 3;
+        _SavingContext->pOutputCodecContext->gop_size = 1;
+        _SavingContext->pOutputCodecContext->slices = GetLosslessSlices(threads);
+        _SavingContext->pOutputCodecContext->thread_count = threads;
+        _SavingContext->pOutputCodecContext->thread_type = FF_THREAD_SLICE;
+    }
     
 
     
@@ -558,13 +673,10 @@ bool MJPEGWriter::SetupEncoder(SavingContext^ _SavingContext, Kinovea::Services:
 bool MJPEGWriter::EncodeAndWriteVideoFrameRGB32(SavingContext^ _SavingContext, array<System::Byte>^ managedBuffer, Int64 length, bool topDown)
 {
     bool written = false;
-    AVFrame* pYUV420Frame = nullptr;
-    uint8_t* pYUV420Buffer = nullptr;
-    uint8_t* pJpegBuffer = nullptr;
     
     do
     {
-        Int64 then = m_swEncoding->ElapsedMilliseconds;
+        Int64 then = m_swEncoding->ElapsedTicks;
 
         int width = _SavingContext->outputSize.Width;
         int height = _SavingContext->outputSize.Height;
@@ -579,70 +691,41 @@ bool MJPEGWriter::EncodeAndWriteVideoFrameRGB32(SavingContext^ _SavingContext, a
           _SavingContext->pInputFrame->linesize[0] = -_SavingContext->pInputFrame->linesize[0];
         }
 
-        // Prepare the color space converted frame.
-        if ((pYUV420Frame = av_frame_alloc()) == nullptr) 
-        {
-            log->Error("YUV420P frame not allocated");
-            break;
-        }
-
-        int yuvBufferSize = avpicture_get_size(AV_PIX_FMT_YUV420P, width, height);
-        pYUV420Buffer = (uint8_t*)av_malloc(yuvBufferSize);
-        if (pYUV420Buffer == nullptr) 
+        // Perform the color space conversion into the frame allocated with the saving context.
+        AVFrame* pYUV420Frame = _SavingContext->pYUV420Frame;
+        if (sws_scale(_SavingContext->pScalingContext, _SavingContext->pInputFrame->data, _SavingContext->pInputFrame->linesize, 0, height, pYUV420Frame->data, pYUV420Frame->linesize) < 0) 
         {
-            log->Error("YUV frame buffer not allocated");
+            log->Error("Color conversion failed");
             break;
         }
         
-        avpicture_fill((AVPicture*)pYUV420Frame, pYUV420Buffer, AV_PIX_FMT_YUV420P, width, height);
-        
-        // Perform the color space conversion.
-        if (sws_scale(_SavingContext->pScalingContext, _SavingContext->pInputFrame->data, _SavingContext->pInputFrame->linesize, 0, height, pYUV420Frame->data, pYUV420Frame->linesize) < 0) 
+        if (_SavingContext->lossless)
         {
-            log->Error("Color conversion failed");
+            written = EncodeAndWriteLossless(_SavingContext, pYUV420Frame, then);
             break;
         }
-        
-        int encodedSize = yuvBufferSize;
+
+        int encodedSize = _SavingContext->iYUV420BufferSize;
         if (!_SavingContext->uncompressed)
         {
-            // Allocated JPEG frame buffer. 
-            // Assumes uncompressed size is always smaller than compressed. (Not technically true).
-            int jpegBufferSize = yuvBufferSize;
-            pJpegBuffer = (uint8_t*)av_malloc(jpegBufferSize);
-            if (pJpegBuffer == nullptr)
-            {
-                log->Error("output video buffer not allocated");
-                break;
-            }
-
             // Actual encoding step.
-            encodedSize = avcodec_encode_video(_SavingContext->pOutputCodecContext, pJpegBuffer, jpegBufferSize, pYUV420Frame);
+            encodedSize = avcodec_encode_video(_SavingContext->pOutputCodecContext, _SavingContext->pEncodeBuffer, _SavingContext->iEncodeBufferSize, pYUV420Frame);
         }
 
-        m_encodingDurationAccumulator += (m_swEncoding->ElapsedMilliseconds - then);
+        m_encodingDurationAccumulator += (m_swEncoding->ElapsedTicks - then);
         
         if (encodedSize <= 0)
             break;
 
         if (_SavingContext->uncompressed)
-            WriteBuffer(encodedSize, _SavingContext, pYUV420Buffer, true);
+            WriteBuffer(encodedSize, _SavingContext, _SavingContext->pYUV420Buffer, true);
         else
-            WriteBuffer(encodedSize, _SavingContext, pJpegBuffer, true);
+            WriteBuffer(encodedSize, _SavingContext, _SavingContext->pEncodeBuffer, true);
         
         written = true;
     }
     while(false);
 
-    if (pJpegBuffer != nullptr)
-        av_free(pJpegBuffer);
-
-    if (pYUV420Frame != nullptr)
-        av_free(pYUV420Frame);
-
-    if (pYUV420Buffer != nullptr)
-        av_free(pYUV420Buffer);
-
     return written;
 }
 
@@ -653,13 +736,10 @@ bool MJPEGWriter::EncodeAndWriteVideoFrameRGB32(SavingContext^ _SavingContext, a
 bool MJPEGWriter::EncodeAndWriteVideoFrameRGB24(SavingContext^ _SavingContext, array<System::Byte>^ managedBuffer, Int64 length, bool topDown)
 {
     bool written = false;
-    AVFrame* pYUV420Frame = nullptr;
-    uint8_t* pYUV420Buffer = nullptr;
-    uint8_t* pJpegBuffer = nullptr;
     
     do
     {
-        Int64 then = m_swEncoding->ElapsedMilliseconds;
+        Int64 then = m_swEncoding->ElapsedTicks;
 
         int width = _SavingContext->outputSize.Width;
         int height = _SavingContext->outputSize.Height;
@@ -674,70 +754,41 @@ bool MJPEGWriter::EncodeAndWriteVideoFrameRGB24(SavingContext^ _SavingContext, a
           _SavingContext->pInputFrame->linesize[0] = -_SavingContext->pInputFrame->linesize[0];
         }
 
-        // Prepare the color space converted frame.
-        if ((pYUV420Frame = av_frame_alloc()) == nullptr) 
-        {
-            log->Error("YUV420P frame not allocated");
-            break;
-        }
-
-        int yuvBufferSize = avpicture_get_size(AV_PIX_FMT_YUV420P, width, height);
-        pYUV420Buffer = (uint8_t*)av_malloc(yuvBufferSize);
-        if (pYUV420Buffer == nullptr) 
+        // Perform the color space conversion into the frame allocated with the saving context.
+        AVFrame* pYUV420Frame = _SavingContext->pYUV420Frame;
+        if (sws_scale(_SavingContext->pScalingContext, _SavingContext->pInputFrame->data, _SavingContext->pInputFrame->linesize, 0, height, pYUV420Frame->data, pYUV420Frame->linesize) < 0) 
         {
-            log->Error("YUV frame buffer not allocated");
+            log->Error("Color conversion failed");
             break;
         }
         
-        avpicture_fill((AVPicture*)pYUV420Frame, pYUV420Buffer, AV_PIX_FMT_YUV420P, width, height);
-        
-        // Perform the color space conversion.
-        if (sws_scale(_SavingContext->pScalingContext, _SavingContext->pInputFrame->data, _SavingContext->pInputFrame->linesize, 0, height, pYUV420Frame->data, pYUV420Frame->linesize) < 0) 
+        if (_SavingContext->lossless)
         {
-            log->Error("Color conversion failed");
+            written = EncodeAndWriteLossless(_SavingContext, pYUV420Frame, then);
             break;
         }
 
-        int encodedSize = yuvBufferSize;
+        int encodedSize = _SavingContext->iYUV420BufferSize;
         if (!_SavingContext->uncompressed)
         {
-            // Allocated JPEG frame buffer. 
-            // Assumes uncompressed size is always smaller than compressed. (Not technically true).
-            int jpegBufferSize = yuvBufferSize;
-            pJpegBuffer = (uint8_t*)av_malloc(jpegBufferSize);
-            if (pJpegBuffer == nullptr) 
-            {
-                log->Error("output video buffer not allocated");
-                break;
-            }
-        
             // Actual encoding step.
-            encodedSize = avcodec_encode_video(_SavingContext->pOutputCodecContext, pJpegBuffer, jpegBufferSize, pYUV420Frame);
+            encodedSize = avcodec_encode_video(_SavingContext->pOutputCodecContext, _SavingContext->pEncodeBuffer, _SavingContext->iEncodeBufferSize, pYUV420Frame);
         }
 
-        m_encodingDurationAccumulator += (m_swEncoding->ElapsedMilliseconds - then);
-
+        m_encodingDurationAccumulator += (m_swEncoding->ElapsedTicks - then);
+        
         if (encodedSize <= 0)
             break;
 
         if (_SavingContext->uncompressed)
-            WriteBuffer(encodedSize, _SavingContext, pYUV420Buffer, true);
+            WriteBuffer(encodedSize, _SavingContext, _SavingContext->pYUV420Buffer, true);
         else
-            WriteBuffer(encodedSize, _SavingContext, pJpegBuffer, true);
-
+            WriteBuffer(encodedSize, _SavingContext, _SavingContext->pEncodeBuffer, true);
+        
         written = true;
     }
     while(false);
 
-    if (pJpegBuffer != nullptr)
-        av_free(pJpegBuffer);
-
-    if (pYUV420Frame != nullptr)
-        av_free(pYUV420Frame);
-
-    if (pYUV420Buffer != nullptr)
-        av_free(pYUV420Buffer);
-
     return written;
 }
 
@@ -748,112 +799,101 @@ bool MJPEGWriter::EncodeAndWriteVideoFrameRGB24(SavingContext^ _SavingContext, a
 bool MJPEGWriter::EncodeAndWriteVideoFrameY800(SavingContext^ _SavingContext, array<System::Byte>^ managedBuffer, Int64 length, bool topDown)
 {
     bool written = false;
-    AVFrame* pYUV420Frame = nullptr;
-    uint8_t* pYUV420Buffer = nullptr;
-    uint8_t* pJpegBuffer = nullptr;
     
     do
     {
-        Int64 then = m_swEncoding->ElapsedMilliseconds;
+        Int64 then = m_swEncoding->ElapsedTicks;
 
         int width = _SavingContext->outputSize.Width;
         int height = _SavingContext->outputSize.Height;
 
         pin_ptr<uint8_t> pInputBuffer = &managedBuffer[0];
+
+        if (_SavingContext->lossless)
+        {
+            // The gray image goes straight to the encoder.
+            avpicture_fill((AVPicture*)_SavingContext->pInputFrame, pInputBuffer, AV_PIX_FMT_GRAY8, width, height);
+            if (!topDown)
+            {
+              _SavingContext->pInputFrame->data[0] += _SavingContext->pInputFrame->linesize[0] * (height - 1);
+              _SavingContext->pInputFrame->linesize[0] = -_SavingContext->pInputFrame->linesize[0];
+            }
+
+            written = EncodeAndWriteLossless(_SavingContext, _SavingContext->pInputFrame, then);
+            break;
+        }
         
         if (_SavingContext->uncompressed)
         {
             // Special shortcut for uncompressed Y800. 
-            pYUV420Buffer = (uint8_t*)av_malloc(length);
+            // The gray image is smaller than the YUV420P one, the conversion buffer is reused.
+            uint8_t* pOutputBuffer = _SavingContext->pYUV420Buffer;
+            if (length > _SavingContext->iYUV420BufferSize)
+            {
+                log->Error("Y800 frame larger than expected");
+                break;
+            }
+
             if (topDown)
             {
-                memcpy(pYUV420Buffer, pInputBuffer, length);
+                memcpy(pOutputBuffer, pInputBuffer, length);
             }
             else
             {
                 for (int i = 0; i < height; i++)
                 {
-                    uint8_t* pDst = pYUV420Buffer + i * width;
+                    uint8_t* pDst = pOutputBuffer + i * width;
                     uint8_t* pSrc = pInputBuffer + ((height - 1 - i) * width);
                     memcpy(pDst, pSrc, width);
                 }
             }
 
-            m_encodingDurationAccumulator += (m_swEncoding->ElapsedMilliseconds - then);
+            m_encodingDurationAccumulator += (m_swEncoding->ElapsedTicks - then);
 
-            WriteBuffer(length, _SavingContext, pYUV420Buffer, true);
+            WriteBuffer(length, _SavingContext, pOutputBuffer, true);
             written = true;
             break;
         }
 
-        avpicture_fill((AVPicture*)_SavingContext->pInputFrame, pInputBuffer, AV_PIX_FMT_GRAY8, width, height);
-        
-        // Alter planes and stride to vertically flip image during conversion.
-        if (!topDown)
-        {
-          _SavingContext->pInputFrame->data[0] += _SavingContext->pInputFrame->linesize[0] * (height - 1);
-          _SavingContext->pInputFrame->linesize[0] = -_SavingContext->pInputFrame->linesize[0];
-        }
-        
         // Unfortunately the MJPEG encoder doesn't know how to work directly with Y800/GRAY8 images.
         // Instead of directly pushing the buffer to the AVFrame we need to use an intermediate YUV420p frame.
-        
-        // Prepare the color space converted frame.
-        if ((pYUV420Frame = av_frame_alloc()) == nullptr) 
-        {
-            log->Error("YUV420P frame not allocated");
-            break;
-        }
-
-        int yuvBufferSize = avpicture_get_size(AV_PIX_FMT_YUV420P, width, height);
-        pYUV420Buffer = (uint8_t*)av_malloc(yuvBufferSize);
-        if (pYUV420Buffer == nullptr) 
+        AVFrame* pYUV420Frame = _SavingContext->pYUV420Frame;
+        if (m_bMosaic)
         {
-            log->Error("YUV frame buffer not allocated");
-            break;
+            // Raw Bayer: the mosaic values go untouched in the luma plane.
+            // Going through the scaler would convert them to limited range.
+            CopyMosaic(pInputBuffer, pYUV420Frame, width, height, topDown);
         }
-
-        avpicture_fill((AVPicture*)pYUV420Frame, pYUV420Buffer, AV_PIX_FMT_YUV420P, width, height);
-        
-        // Perform the color space conversion.
-        if (sws_scale(_SavingContext->pScalingContext, _SavingContext->pInputFrame->data, _SavingContext->pInputFrame->linesize, 0, height, pYUV420Frame->data, pYUV420Frame->linesize) < 0)
+        else
         {
-            log->Error("Color conversion failed");
-            break;
+            avpicture_fill((AVPicture*)_SavingContext->pInputFrame, pInputBuffer, AV_PIX_FMT_GRAY8, width, height);
+            
+            // Alter planes and stride to vertically flip image during conversion.
+            if (!topDown)
+            {
+              _SavingContext->pInputFrame->data[0] += _SavingContext->pInputFrame->linesize[0] * (height - 1);
+              _SavingContext->pInputFrame->linesize[0] = -_SavingContext->pInputFrame->linesize[0];
+            }
+            
+            if (sws_scale(_SavingContext->pScalingContext, _SavingContext->pInputFrame->data, _SavingContext->pInputFrame->linesize, 0, height, pYUV420Frame->data, pYUV420Frame->linesize) < 0)
+            {
+                log->Error("Color conversion failed");
+                break;
+            }
         }
         
-        int encodedSize = yuvBufferSize;
-        // Allocated JPEG frame buffer. 
-        // Assumes uncompressed size is always smaller than compressed. (Not technically true).
-        int jpegBufferSize = yuvBufferSize;
-        pJpegBuffer = (uint8_t*)av_malloc(jpegBufferSize);
-        if (pJpegBuffer == nullptr) 
-        {
-            log->Error("output video buffer not allocated");
-            break;
-        }
-
         // Actual encoding step.
-        encodedSize = avcodec_encode_video(_SavingContext->pOutputCodecContext, pJpegBuffer, jpegBufferSize, pYUV420Frame);
+        int encodedSize = avcodec_encode_video(_SavingContext->pOutputCodecContext, _SavingContext->pEncodeBuffer, _SavingContext->iEncodeBufferSize, pYUV420Frame);
         
-        m_encodingDurationAccumulator += (m_swEncoding->ElapsedMilliseconds - then);
+        m_encodingDurationAccumulator += (m_swEncoding->ElapsedTicks - then);
 
         if (encodedSize <= 0)
             break;
 
-        WriteBuffer(encodedSize, _SavingContext, pJpegBuffer, true);
+        WriteBuffer(encodedSize, _SavingContext, _SavingContext->pEncodeBuffer, true);
         written = true;
     }
     while(false);
-
-    if (pJpegBuffer != nullptr)
-        av_free(pJpegBuffer);
-
-    if (pYUV420Frame != nullptr)
-        av_free(pYUV420Frame);
-
-    if (pYUV420Buffer != nullptr)
-        av_free(pYUV420Buffer);
     
     return written;
 }
@@ -906,13 +946,413 @@ bool MJPEGWriter::WriteBuffer(int _iEncodedSize, SavingContext^ _SavingContext,
     fs->Write(managedBuffer, 0, _iEncodedSize);
     fs->Close();*/
     
-    m_writeDurationAccumulator += (m_swWrite->ElapsedMilliseconds - then);
+    // With the encoding pool this runs on whichever worker is writing, the stats follow the frames actually written.
+    {
+        lock w(m_WriteLocker);
+        m_writeDurationAccumulator += (m_swWrite->ElapsedMilliseconds - then);
+        m_framesWritten++;
+        LogStats();
+    }
+
+    return true;
+}
+
+///<summary>
+/// Create one encoder per worker thread and the ring of slots shared by the producer and the workers.
+/// Each worker owns its codec context, scaling context and conversion buffers, none of them are shared.
+///</summary>
+bool MJPEGWriter::OpenEncodingPool(Kinovea::Services::ImageFormat _imageFormat)
+{
+    int width = m_SavingContext->outputSize.Width;
+    int height = m_SavingContext->outputSize.Height;
+    int bytesPerPixel = 1;
+    if (_imageFormat == Kinovea::Services::ImageFormat::RGB32)
+        bytesPerPixel = 4;
+    else if (_imageFormat == Kinovea::Services::ImageFormat::RGB24)
+        bytesPerPixel = 3;
+
+    m_PoolSourceFormat = GetSourceFormat(_imageFormat);
+    m_Encoders = gcnew List<EncoderInstance^>();
+    m_FreeSlots = gcnew Stack<EncodingSlot^>();
+    m_PendingSlots = gcnew Queue<EncodingSlot^>();
+    m_InFlightSlots = gcnew Queue<EncodingSlot^>();
+    m_PoolStopping = false;
+    m_DroppedFrames = 0;
+
+    AVCodecContext* pSourceContext = m_SavingContext->pOutputCodecContext;
+    for (int i = 0; i < m_EncodingThreads; i++)
+    {
+        EncoderInstance^ encoder = gcnew EncoderInstance();
+        m_Encoders->Add(encoder);
+
+        AVCodecContext* pCodecContext = avcodec_alloc_context3(m_SavingContext->pOutputCodec);
+        encoder->pCodecContext = pCodecContext;
+        if (pCodecContext == nullptr)
+            return false;
+
+        pCodecContext->width = pSourceContext->width;
+        pCodecContext->height = pSourceContext->height;
+        pCodecContext->pix_fmt = pSourceContext->pix_fmt;
+        pCodecContext->time_base = pSourceContext->time_base;
+        pCodecContext->flags = pSourceContext->flags;
+        pCodecContext->qmin = pSourceContext->qmin;
+        pCodecContext->qmax = pSourceContext->qmax;
+        pCodecContext->global_quality = pSourceContext->global_quality;
+        pCodecContext->bit_rate = pSourceContext->bit_rate;
+        pCodecContext->sample_aspect_ratio = pSourceContext->sample_aspect_ratio;
+        pCodecContext->strict_std_compliance = pSourceContext->strict_std_compliance;
+
+        int averror = avcodec_open2(pCodecContext, m_SavingContext->pOutputCodec, nullptr);
+        if (averror < 0)
+        {
+            LogError("Pool encoder not opened", averror);
+            return false;
+        }
+
+        encoder->pScalingContext = sws_getContext(width, height, m_PoolSourceFormat, width, height, AV_PIX_FMT_YUV420P, SWS_POINT, NULL, NULL, NULL);
+        encoder->pInputFrame = av_frame_alloc();
+        encoder->pYUV420Frame = av_frame_alloc();
+        encoder->pYUV420Buffer = (uint8_t*)av_malloc(m_SavingContext->iYUV420BufferSize);
+        if (encoder->pScalingContext == nullptr || encoder->pInputFrame == nullptr || encoder->pYUV420Frame == nullptr || encoder->pYUV420Buffer == nullptr)
+            return false;
+
+        avpicture_fill((AVPicture*)encoder->pYUV420Frame, encoder->pYUV420Buffer, AV_PIX_FMT_YUV420P, width, height);
+        encoder->pYUV420Frame->width = width;
+        encoder->pYUV420Frame->height = height;
+        encoder->pYUV420Frame->format = AV_PIX_FMT_YUV420P;
+
+        if (m_bMosaic)
+            FillNeutralChroma(encoder->pYUV420Frame, height);
+    }
+
+    // The encoded packets are allocated by the encoders at the size of the JPEG, like in the lossless path.
+    // Each encoder keeps a single worst case scratch buffer internally, the slots only hold the input copy.
+    int inputSize = width * height * bytesPerPixel;
+    m_Slots = gcnew array<EncodingSlot^>(m_EncodingThreads * SlotsPerThread);
+    for (int i = 0; i < m_Slots->Length; i++)
+    {
+        EncodingSlot^ slot = gcnew EncodingSlot();
+        m_Slots[i] = slot;
+        slot->Input = gcnew array<System::Byte>(inputSize);
+        slot->pPacket = (AVPacket*)av_malloc(sizeof(AVPacket));
+        if (slot->pPacket == nullptr)
+            return false;
+
+        av_init_packet(slot->pPacket);
+        slot->pPacket->data = nullptr;
+        slot->pPacket->size = 0;
+        m_FreeSlots->Push(slot);
+    }
+
+    int64_t reserved = (int64_t)m_Slots->Length * inputSize +
+        (int64_t)m_EncodingThreads * (m_SavingContext->iYUV420BufferSize + m_SavingContext->iEncodeBufferSize);
+    log->DebugFormat("Encoding on {0} threads, queue capacity: {1} frames. Memory reserved: ~{2:0.0} MB.",
+        m_EncodingThreads, m_Slots->Length, (double)reserved / (1024 * 1024));
+
+    for (int i = 0; i < m_Encoders->Count; i++)
+    {
+        EncoderInstance^ encoder = m_Encoders[i];
+        encoder->Worker = gcnew Thread(gcnew ParameterizedThreadStart(this, &MJPEGWriter::EncodingWorker));
+        encoder->Worker->Name = String::Format("Encoding {0}", i);
+        encoder->Worker->IsBackground = true;
+        encoder->Worker->Start(encoder);
+    }
+
+    return true;
+}
+
+///<summary>
+/// Let the workers finish the frames already queued, wait for them and free the pool.
+///</summary>
+void MJPEGWriter::CloseEncodingPool()
+{
+    if (m_Encoders == nullptr)
+        return;
+
+    {
+        lock l(m_PoolLocker);
+        m_PoolStopping = true;
+        Monitor::PulseAll(m_PoolLocker);
+    }
+
+    for each (EncoderInstance^ encoder in m_Encoders)
+    {
+        if (encoder->Worker != nullptr)
+            encoder->Worker->Join();
+
+        if (encoder->pCodecContext != nullptr)
+        {
+            avcodec_close(encoder->pCodecContext);
+            av_free(encoder->pCodecContext);
+        }
+
+        if (encoder->pScalingContext != nullptr)
+            sws_freeContext(encoder->pScalingContext);
+
+        if (encoder->pInputFrame != nullptr)
+            av_free(encoder->pInputFrame);
+
+        if (encoder->pYUV420Frame != nullptr)
+            av_free(encoder->pYUV420Frame);
+
+        if (encoder->pYUV420Buffer != nullptr)
+            av_free(encoder->pYUV420Buffer);
+    }
+
+    if (m_Slots != nullptr)
+    {
+        for each (EncodingSlot^ slot in m_Slots)
+        {
+            if (slot != nullptr && slot->pPacket != nullptr)
+            {
+                av_free_packet(slot->pPacket);
+                av_free(slot->pPacket);
+            }
+        }
+    }
+
+    if (m_DroppedFrames > 0)
+        log->DebugFormat("Encoding pool closed. Frames dropped because the queue was full: {0}.", m_DroppedFrames);
+
+    {
+        lock l(m_PoolLocker);
+        m_Encoders = nullptr;
+        m_Slots = nullptr;
+        m_FreeSlots = nullptr;
+        m_PendingSlots = nullptr;
+        m_InFlightSlots = nullptr;
+    }
+}
+
+///<summary>
+/// Copy the frame into a free slot and hand it to the workers. Does not wait for the encoding.
+/// The caller may reuse its buffer as soon as this returns.
+///</summary>
+SaveResult MJPEGWriter::EnqueueFrame(array<System::Byte>^ buffer, Int64 length, bool topDown)
+{
+    EncodingSlot^ slot = nullptr;
+    {
+        lock l(m_PoolLocker);
+        if (m_FreeSlots->Count == 0)
+        {
+            m_DroppedFrames++;
+            return SaveResult::QueueFull;
+        }
+
+        slot = m_FreeSlots->Pop();
+    }
+
+    if (length > slot->Input->Length)
+    {
+        log->Error("Frame larger than expected");
+        lock l(m_PoolLocker);
+        m_FreeSlots->Push(slot);
+        return SaveResult::UnknownError;
+    }
+
+    // The copy is done outside the lock so the workers are not held up.
+    // There is a single producer, the order of the in-flight queue is the order of SaveFrame calls.
+    Buffer::BlockCopy(buffer, 0, slot->Input, 0, (int)length);
+    slot->Length = length;
+    slot->TopDown = topDown;
+    slot->Encoded = false;
+    slot->Done = false;
+
+    {
+        lock l(m_PoolLocker);
+        m_PendingSlots->Enqueue(slot);
+        m_InFlightSlots->Enqueue(slot);
+        Monitor::PulseAll(m_PoolLocker);
+    }
+
+    return SaveResult::Success;
+}
+
+int MJPEGWriter::QueueDepth::get()
+{
+    lock l(m_PoolLocker);
+    return m_InFlightSlots != nullptr ? m_InFlightSlots->Count : 0;
+}
+
+bool MJPEGWriter::WaitForRoom(int timeout)
+{
+    lock l(m_PoolLocker);
+    if (m_FreeSlots == nullptr)
+        return true;
+
+    if (m_FreeSlots->Count == 0)
+        Monitor::Wait(m_PoolLocker, timeout);
+
+    return m_FreeSlots->Count > 0;
+}
+
+void MJPEGWriter::EncodingWorker(Object^ _encoder)
+{
+    EncoderInstance^ encoder = safe_cast<EncoderInstance^>(_encoder);
+
+    while (true)
+    {
+        EncodingSlot^ slot = nullptr;
+        {
+            lock l(m_PoolLocker);
+            while (m_PendingSlots->Count == 0 && !m_PoolStopping)
+                Monitor::Wait(m_PoolLocker);
+
+            // When stopping, the queue is drained before exiting.
+            if (m_PendingSlots->Count == 0)
+                break;
+
+            slot = m_PendingSlots->Dequeue();
+        }
+
+        Int64 then = m_swEncoding->ElapsedTicks;
+        slot->Encoded = EncodeFrame(encoder, slot);
+        Interlocked::Add(m_encodingDurationAccumulator, m_swEncoding->ElapsedTicks - then);
+
+        {
+            lock l(m_PoolLocker);
+            slot->Done = true;
+        }
+
+        WriteCompletedFrames();
+    }
+}
+
+///<summary>
+/// Convert and encode the frame of a slot with the encoder of the calling worker.
+/// The JPEG is left in the packet of the slot. Returns false on error.
+///</summary>
+bool MJPEGWriter::EncodeFrame(EncoderInstance^ encoder, EncodingSlot^ slot)
+{
+    int width = m_SavingContext->outputSize.Width;
+    int height = m_SavingContext->outputSize.Height;
+
+    pin_ptr<uint8_t> pInputBuffer = &slot->Input[0];
+    if (m_bMosaic)
+    {
+        CopyMosaic(pInputBuffer, encoder->pYUV420Frame, width, height, slot->TopDown);
+        return EncodePacket(encoder, slot->pPacket);
+    }
+
+    avpicture_fill((AVPicture*)encoder->pInputFrame, pInputBuffer, m_PoolSourceFormat, width, height);
+
+    // Alter planes and stride to vertically flip image during conversion.
+    if (!slot->TopDown)
+    {
+        encoder->pInputFrame->data[0] += encoder->pInputFrame->linesize[0] * (height - 1);
+        encoder->pInputFrame->linesize[0] = -encoder->pInputFrame->linesize[0];
+    }
+
+    AVFrame* pYUV420Frame = encoder->pYUV420Frame;
+    if (sws_scale(encoder->pScalingContext, encoder->pInputFrame->data, encoder->pInputFrame->linesize, 0, height, pYUV420Frame->data, pYUV420Frame->linesize) < 0)
+    {
+        log->Error("Color conversion failed");
+        return false;
+    }
+
+    return EncodePacket(encoder, slot->pPacket);
+}
+
+///<summary>
+/// Encode the converted frame of the worker into a packet allocated by the encoder.
+///</summary>
+bool MJPEGWriter::EncodePacket(EncoderInstance^ encoder, AVPacket* _pPacket)
+{
+    int gotPacket = 0;
+    int averror = avcodec_encode_video2(encoder->pCodecContext, _pPacket, encoder->pYUV420Frame, &gotPacket);
+    if (averror < 0)
+        LogError("Pool encoding failed", averror);
 
-    LogStats();
+    return averror >= 0 && gotPacket;
+}
+
+///<summary>
+/// Write the frames at the head of the in-flight queue that are done encoding.
+/// Frames may finish out of order, they are always written in the order they were queued.
+///</summary>
+void MJPEGWriter::WriteCompletedFrames()
+{
+    lock w(m_WriteLocker);
+
+    while (true)
+    {
+        EncodingSlot^ slot = nullptr;
+        {
+            lock l(m_PoolLocker);
+            if (m_InFlightSlots->Count == 0 || !m_InFlightSlots->Peek()->Done)
+                break;
+
+            slot = m_InFlightSlots->Peek();
+        }
+
+        if (slot->Encoded)
+            WriteBuffer(slot->pPacket->size, m_SavingContext, slot->pPacket->data, true);
+        else
+            log->Error("error while encoding output frame");
+
+        av_free_packet(slot->pPacket);
+
+        {
+            lock l(m_PoolLocker);
+            m_InFlightSlots->Dequeue();
+            slot->Done = false;
+            m_FreeSlots->Push(slot);
+            Monitor::PulseAll(m_PoolLocker);
+        }
+    }
+}
+
+///<summary>
+/// Encode a frame with the lossless codec and push it to the file.
+/// The packet is allocated by the encoder, its worst case size is far larger than the frame.
+/// _then: start of the processing of this frame, for the stats.
+///</summary>
+bool MJPEGWriter::EncodeAndWriteLossless(SavingContext^ _SavingContext, AVFrame* _pFrame, Int64 _then)
+{
+    AVCodecContext* pCodecContext = _SavingContext->pOutputCodecContext;
+    _pFrame->width = pCodecContext->width;
+    _pFrame->height = pCodecContext->height;
+    _pFrame->format = pCodecContext->pix_fmt;
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = nullptr;
+    packet.size = 0;
+
+    int gotPacket = 0;
+    int averror = avcodec_encode_video2(pCodecContext, &packet, _pFrame, &gotPacket);
+
+    m_encodingDurationAccumulator += (m_swEncoding->ElapsedTicks - _then);
+
+    if (averror < 0 || !gotPacket)
+    {
+        if (averror < 0)
+            LogError("Lossless encoding failed", averror);
+
+        av_free_packet(&packet);
+        return false;
+    }
 
+    WriteBuffer(packet.size, _SavingContext, packet.data, true);
+    av_free_packet(&packet);
     return true;
 }
 
+int MJPEGWriter::GetLosslessSlices(int _threads)
+{
+    // FFV1 only accepts slice counts making a grid of at least 2x2 slices.
+    // Take the smallest one giving a slice to each thread.
+    static const int slices[] = { 4, 6, 9, 12, 16, 20, 30, 42 };
+    int count = sizeof(slices) / sizeof(slices[0]);
+    for (int i = 0; i < count; i++)
+    {
+        if (slices[i] >= _threads)
+            return slices[i];
+    }
+
+    return slices[count - 1];
+}
+
 void MJPEGWriter::LogError(String^ context, int error)
 {
     char errbuf[256];
@@ -923,13 +1363,16 @@ void MJPEGWriter::LogError(String^ context, int error)
 
 void MJPEGWriter::LogStats()
 {
-    if (m_frame % 100 != 0)
+    // Always called with the write lock held.
+    if (m_framesWritten % 100 != 0)
         return;
     
+    // Encoding is measured in stopwatch ticks, a frame at high speed takes less than a millisecond.
+    // Pool workers keep adding to the encoding accumulator while we read it, take and reset it atomically.
+    Int64 encoding = Interlocked::Exchange(m_encodingDurationAccumulator, 0);
     log->DebugFormat("Frame #{0}. Conversion/Encoding: ~{1:0.000} ms. Write: ~{2:0.000} ms.",
-        m_frame, (float)m_encodingDurationAccumulator / 100, (float)m_writeDurationAccumulator / 100);
+        m_framesWritten, (double)encoding * 1000 / Stopwatch::Frequency / 100, (float)m_writeDurationAccumulator / 100);
 
-    m_encodingDurationAccumulator = 0;
     m_writeDurationAccumulator = 0;
 }
 
@@ -943,3 +1386,102 @@ int MJPEGWriter::GreatestCommonDenominator(int a, int b)
      else
         return GreatestCommonDenominator(a, b % a);
 }
+
+AVPixelFormat MJPEGWriter::GetSourceFormat(Kinovea::Services::ImageFormat _imageFormat)
+{
+    switch (_imageFormat)
+    {
+    case Kinovea::Services::ImageFormat::RGB24:
+        return AV_PIX_FMT_BGR24;
+    case Kinovea::Services::ImageFormat::Y800:
+        return AV_PIX_FMT_GRAY8;
+    case Kinovea::Services::ImageFormat::RGB32:
+    default:
+        return AV_PIX_FMT_BGRA;
+    }
+}
+
+const char* MJPEGWriter::GetBayerTag(Demosaicing _pattern)
+{
+    // Parsed back by VideoReaderFFMpeg::GetBayerPattern.
+    switch (_pattern)
+    {
+    case Demosaicing::RGGB:
+        return "Bayer RGGB";
+    case Demosaicing::BGGR:
+        return "Bayer BGGR";
+    case Demosaicing::GRBG:
+        return "Bayer GRBG";
+    case Demosaicing::GBRG:
+        return "Bayer GBRG";
+    case Demosaicing::None:
+    default:
+        return nullptr;
+    }
+}
+
+void MJPEGWriter::FillNeutralChroma(AVFrame* _pYUV420Frame, int _height)
+{
+    int chromaHeight = (_height + 1) / 2;
+    memset(_pYUV420Frame->data[1], 128, _pYUV420Frame->linesize[1] * chromaHeight);
+    memset(_pYUV420Frame->data[2], 128, _pYUV420Frame->linesize[2] * chromaHeight);
+}
+
+void MJPEGWriter::CopyMosaic(uint8_t* _pSource, AVFrame* _pYUV420Frame, int _width, int _height, bool _topDown)
+{
+    // Note: flipping a mosaic with an even number of rows swaps the pattern rows. Raw cameras deliver top-down images.
+    for (int i = 0; i < _height; i++)
+    {
+        uint8_t* pSrc = _pSource + (_topDown ? i : _height - 1 - i) * _width;
+        uint8_t* pDst = _pYUV420Frame->data[0] + i * _pYUV420Frame->linesize[0];
+        memcpy(pDst, pSrc, _width);
+    }
+}
+
+///<summary>
+/// Set a write-behind stream as the output of the muxer, the file is then written by the stream's I/O thread.
+/// Returns false to fall back to the default file protocol.
+///</summary>
+bool MJPEGWriter::OpenWriteBehind(String^ _filePath, int _megabytes)
+{
+    try
+    {
+        m_WriteBehind = gcnew WriteBehindStream(_filePath, _megabytes * 1024 * 1024);
+    }
+    catch (Exception^ e)
+    {
+        log->Error("The write-behind stream could not be opened. Writing the file directly.", e);
+        return false;
+    }
+
+    m_pIOContext = m_WriteBehind->CreateIOContext();
+    if (m_pIOContext == nullptr)
+    {
+        log->Error("The write-behind I/O context could not be created. Writing the file directly.");
+        CloseWriteBehind();
+        return false;
+    }
+
+    m_SavingContext->pOutputFormatContext->pb = m_pIOContext;
+    return true;
+}
+
+void MJPEGWriter::CloseWriteBehind()
+{
+    // Must be called once the muxer is done with the I/O context.
+    // Pushes what is left in the context buffer, then waits for the queue to reach the disk.
+    if (m_pIOContext != nullptr)
+        avio_flush(m_pIOContext);
+
+    WriteBehindStream::FreeIOContext(&m_pIOContext);
+
+    if (m_WriteBehind == nullptr)
+        return;
+
+    if (!m_WriteBehind->Close())
+        log->Error("The recording could not be completely written to the file.");
+
+    m_WriteBehind->DumpStats();
+    delete m_WriteBehind;
+    m_WriteBehind = nullptr;
+}
@@ -33,6 +33,7 @@ extern "C"
 }
 
 #include "SavingContext.h"
+#include "WriteBehindStream.h"
 
 using namespace System;
 using namespace System::Collections::Generic;				
@@ -51,6 +52,75 @@ namespace Kinovea { namespace Video { namespace FFMpeg
 {
     public ref class MJPEGWriter
     {
+    // Properties
+    public:
+        /// <summary>
+        /// Number of threads encoding frames concurrently, each with its own encoder. Must be set before opening the saving context.
+        /// With 0 or 1 the frames are encoded synchronously in SaveFrame.
+        /// </summary>
+        property int EncodingThreads {
+            int get() { return m_EncodingThreads; }
+            void set(int value) { m_EncodingThreads = Math::Max(value, 0); }
+        }
+
+        /// <summary>
+        /// Number of frames accepted by SaveFrame and not written to the file yet.
+        /// </summary>
+        property int QueueDepth {
+            int get();
+        }
+
+        /// <summary>
+        /// Maximum number of frames in the queue, or 0 if frames are encoded synchronously.
+        /// When the queue is full SaveFrame drops the frame.
+        /// </summary>
+        property int QueueCapacity {
+            int get() { return m_Slots != nullptr ? m_Slots->Length : 0; }
+        }
+
+        /// <summary>
+        /// Number of frames dropped because the queue was full.
+        /// </summary>
+        property int DroppedFrames {
+            int get() { return m_DroppedFrames; }
+        }
+
+        /// <summary>
+        /// Whether uncompressed recordings are stored with the FFV1 lossless codec instead of raw frames.
+        /// Must be set before opening the saving context. The encoding threads work on slices of each frame.
+        /// </summary>
+        property bool Lossless {
+            bool get() { return m_Lossless; }
+            void set(bool value) { m_Lossless = value; }
+        }
+
+        /// <summary>
+        /// Bayer pattern of Y800 input frames carrying the raw sensor mosaic. Must be set before opening the saving context.
+        /// The mosaic is stored as is, losslessly or as the luma of a JPEG, and the pattern is tagged in the file
+        /// so the player can demosaic at playback.
+        /// </summary>
+        property Demosaicing BayerPattern {
+            Demosaicing get() { return m_BayerPattern; }
+            void set(Demosaicing value) { m_BayerPattern = value; }
+        }
+
+        /// <summary>
+        /// Memory used to queue the file data in front of the disk, in megabytes. Must be set before opening the saving context.
+        /// With 0 the muxer writes to the file directly.
+        /// </summary>
+        property int WriteBehindMemory {
+            int get() { return m_WriteBehindMemory; }
+            void set(int value) { m_WriteBehindMemory = Math::Max(value, 0); }
+        }
+
+        /// <summary>
+        /// The stream writing the file from its own thread, or nullptr if the file is written directly.
+        /// Gives access to the queue depth, write latency and stall counters while recording.
+        /// </summary>
+        property WriteBehindStream^ WriteBehind {
+            WriteBehindStream^ get() { return m_WriteBehind; }
+        }
+
     // Construction/Destruction
     public:
         MJPEGWriter();
@@ -64,6 +134,11 @@ namespace Kinovea { namespace Video { namespace FFMpeg
         SaveResult CloseSavingContext(bool _bEncodingSuccess);
         SaveResult SaveFrame(Kinovea::Services::ImageFormat format, array<System::Byte>^ buffer, Int64 length, bool topDown);
 
+        /// <summary>
+        /// Blocks until the queue has room for a frame or the timeout expires. Returns true if there is room.
+        /// </summary>
+        bool WaitForRoom(int timeout);
+
     // Private Methods
     private:
         double ComputeBitrate(Size outputSize, double frameInterval);
@@ -76,10 +151,58 @@ namespace Kinovea { namespace Video { namespace FFMpeg
         bool EncodeAndWriteVideoFrameJPEG(SavingContext^ _SavingContext, array<System::Byte>^ managedBuffer, Int64 length);
 
         bool WriteBuffer(int _iEncodedSize, SavingContext^ _SavingContext, uint8_t* _pOutputVideoBuffer, bool _bForceKeyframe);
+        bool EncodeAndWriteLossless(SavingContext^ _SavingContext, AVFrame* _pFrame, Int64 _then);
+        static int GetLosslessSlices(int _threads);
+        bool OpenWriteBehind(String^ _filePath, int _megabytes);
+        void CloseWriteBehind();
         void SanityCheck(AVFormatContext* s);
         void LogError(String^ context, int ffmpegError);
         void LogStats();
         static int GreatestCommonDenominator(int a, int b);
+        static AVPixelFormat GetSourceFormat(Kinovea::Services::ImageFormat _imageFormat);
+        static const char* GetBayerTag(Demosaicing _pattern);
+        static void FillNeutralChroma(AVFrame* _pYUV420Frame, int _height);
+        static void CopyMosaic(uint8_t* _pSource, AVFrame* _pYUV420Frame, int _width, int _height, bool _topDown);
+
+        bool OpenEncodingPool(Kinovea::Services::ImageFormat _imageFormat);
+        SaveResult AllocateConversionBuffers(bool _uncompressed);
+        void CloseEncodingPool();
+        SaveResult EnqueueFrame(array<System::Byte>^ buffer, Int64 length, bool topDown);
+        void EncodingWorker(Object^ _encoder);
+        void WriteCompletedFrames();
+
+    // Encoding pool
+    private:
+        /// <summary>
+        /// A frame going through the pool: copy of the input image and encoded output.
+        /// </summary>
+        ref class EncodingSlot
+        {
+        public:
+            array<System::Byte>^ Input;
+            Int64 Length;
+            bool TopDown;
+            AVPacket* pPacket;
+            bool Encoded;
+            bool Done;
+        };
+
+        /// <summary>
+        /// The encoder and conversion state owned by one worker thread.
+        /// </summary>
+        ref class EncoderInstance
+        {
+        public:
+            AVCodecContext* pCodecContext;
+            SwsContext* pScalingContext;
+            AVFrame* pInputFrame;
+            AVFrame* pYUV420Frame;
+            uint8_t* pYUV420Buffer;
+            Thread^ Worker;
+        };
+
+        bool EncodeFrame(EncoderInstance^ encoder, EncodingSlot^ slot);
+        bool EncodePacket(EncoderInstance^ encoder, AVPacket* _pPacket);
 
     // Members
     private :
@@ -87,9 +210,34 @@ namespace Kinovea { namespace Video { namespace FFMpeg
         Stopwatch^ m_swEncoding;
         Stopwatch^ m_swWrite;
         int m_frame;
+        int m_framesWritten;
         Int64 m_encodingDurationAccumulator;
         Int64 m_writeDurationAccumulator;
+
+        bool m_Lossless;
+        Demosaicing m_BayerPattern;
+        bool m_bMosaic;
+
+        int m_WriteBehindMemory;
+        WriteBehindStream^ m_WriteBehind;
+        AVIOContext* m_pIOContext;
+
+        int m_EncodingThreads;
+        AVPixelFormat m_PoolSourceFormat;
+        List<EncoderInstance^>^ m_Encoders;
+        array<EncodingSlot^>^ m_Slots;
+        Stack<EncodingSlot^>^ m_FreeSlots;
+        Queue<EncodingSlot^>^ m_PendingSlots;
+        Queue<EncodingSlot^>^ m_InFlightSlots;
+        Object^ m_PoolLocker;
+        Object^ m_WriteLocker;
+        bool m_PoolStopping;
+        int m_DroppedFrames;
+        static const int SlotsPerThread = 2;
         static const double megabyte = 1024 * 1024;
+
+        // Largest encoded macroblock, from the MPEG family encoders (MAX_MB_BYTES in mpegvideo.h).
+        static const int MaxMacroblockBytes = 30 * 16 * 16 * 3 / 8 + 120;
         static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
     };
 }}}
@@ -0,0 +1,225 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#include "PacketCache.h"
+
+using namespace System::Diagnostics;
+using namespace System::Runtime::InteropServices;
+using namespace System::Threading;
+using namespace Kinovea::Video::FFMpeg;
+
+PacketCache::PacketCache(int streamIndex, VideoSection zone)
+{
+    m_StreamIndex = streamIndex;
+    m_Zone = zone;
+    m_Packets = gcnew List<CachedPacket>();
+    m_Keyframes = gcnew List<int>();
+    m_Bytes = 0;
+    m_References = 1;
+}
+PacketCache::~PacketCache()
+{
+    this->!PacketCache();
+}
+PacketCache::!PacketCache()
+{
+    if (m_Packets == nullptr)
+        return;
+
+    for (int i = 0; i < m_Packets->Count; i++)
+        av_free(m_Packets[i].Data.ToPointer());
+
+    if (m_Bytes > 0)
+        GC::RemoveMemoryPressure(m_Bytes);
+
+    m_Packets = nullptr;
+    m_Bytes = 0;
+}
+bool PacketCache::TryAcquire()
+{
+    while (true)
+    {
+        int references = m_References;
+        if (references <= 0)
+            return false;
+
+        if (Interlocked::CompareExchange(m_References, references + 1, references) == references)
+            return true;
+    }
+}
+void PacketCache::Release()
+{
+    if (Interlocked::Decrement(m_References) != 0)
+        return;
+
+    this->!PacketCache();
+    GC::SuppressFinalize(this);
+}
+PacketCache^ PacketCache::Fill(String^ filePath, int streamIndex, VideoSection zone, int64_t startDts, int64_t endPts, int64_t budget, ThreadCanceler^ canceler)
+{
+    PacketCache^ cache = nullptr;
+    AVFormatContext* pFormatCtx = nullptr;
+    Stopwatch^ stopwatch = Stopwatch::StartNew();
+
+    do
+    {
+        // Libav expects the filename in the computer default codepage.
+        String^ encFilePath = System::Text::Encoding::Default->GetString(System::Text::Encoding::UTF8->GetBytes(filePath));
+        char* pszFilePath = static_cast<char*>(Marshal::StringToHGlobalAnsi(encFilePath).ToPointer());
+        int res = avformat_open_input(&pFormatCtx, pszFilePath, nullptr, nullptr);
+        Marshal::FreeHGlobal(safe_cast<IntPtr>(pszFilePath));
+        if (res != 0)
+        {
+            log->ErrorFormat("Packet cache: the file could not be opened.");
+            break;
+        }
+
+        if (avformat_find_stream_info(pFormatCtx, nullptr) < 0 || streamIndex < 0 || streamIndex >= (int)pFormatCtx->nb_streams)
+        {
+            log->ErrorFormat("Packet cache: video stream not found.");
+            break;
+        }
+
+        for (int i = 0; i < (int)pFormatCtx->nb_streams; i++)
+            pFormatCtx->streams[i]->discard = i == streamIndex ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+        if (avformat_seek_file(pFormatCtx, streamIndex, INT64_MIN, startDts, startDts, AVSEEK_FLAG_BACKWARD) < 0)
+            break;
+
+        // Decoding timestamps only go up and presentation timestamps are never before them,
+        // so once a packet is decoded after endPts every frame presented up to endPts and its references are in.
+        PacketCache^ candidate = gcnew PacketCache(streamIndex, zone);
+        bool started = false;
+        bool failed = false;
+        AVPacket packet;
+        while (av_read_frame(pFormatCtx, &packet) >= 0)
+        {
+            if (packet.stream_index == streamIndex)
+            {
+                int64_t dts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+                started = started || ((packet.flags & AV_PKT_FLAG_KEY) != 0 && dts >= startDts);
+                if (started && dts > endPts)
+                {
+                    av_free_packet(&packet);
+                    break;
+                }
+
+                if (started && !candidate->Add(&packet))
+                    failed = true;
+            }
+
+            av_free_packet(&packet);
+
+            if (failed || candidate->Bytes > budget || (canceler != nullptr && canceler->CancellationPending))
+            {
+                failed = true;
+                break;
+            }
+        }
+
+        if (failed || candidate->Count == 0)
+        {
+            if (candidate->Bytes > budget)
+                log->DebugFormat("Packet cache: the packets of the working zone don't fit in {0:0.0} MB.", (double)budget / (1024 * 1024));
+
+            delete candidate;
+            break;
+        }
+
+        cache = candidate;
+        log->DebugFormat("Packet cache filled in {0} ms. {1} packets, {2:0.0} MB.", stopwatch->ElapsedMilliseconds, cache->Count, (double)cache->Bytes / (1024 * 1024));
+    }
+    while (false);
+
+    if (pFormatCtx != nullptr)
+        avformat_close_input(&pFormatCtx);
+
+    return cache;
+}
+bool PacketCache::Add(AVPacket* packet)
+{
+    // Decoders may read past the end of the data, the padding must be allocated and zeroed.
+    uint8_t* data = (uint8_t*)av_malloc(packet->size + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (data == nullptr)
+        return false;
+
+    memcpy(data, packet->data, packet->size);
+    memset(data + packet->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+
+    CachedPacket cached;
+    cached.Data = IntPtr(data);
+    cached.Size = packet->size;
+    cached.Pts = packet->pts;
+    cached.Dts = packet->dts;
+    cached.Position = packet->pos;
+    cached.Duration = packet->duration;
+    cached.Flags = packet->flags;
+
+    // Keyframes are looked up with the decoding timestamps of the packet index, stored with the same fallback.
+    if ((packet->flags & AV_PKT_FLAG_KEY) != 0)
+        m_Keyframes->Add(m_Packets->Count);
+
+    m_Packets->Add(cached);
+    m_Bytes += packet->size;
+    GC::AddMemoryPressure(packet->size);
+    return true;
+}
+int PacketCache::Seek(int64_t keyframeDts)
+{
+    // Binary search on the keyframes, in decoding order.
+    int lo = 0;
+    int hi = m_Keyframes->Count - 1;
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        CachedPacket cached = m_Packets[m_Keyframes[mid]];
+        int64_t dts = cached.Dts != AV_NOPTS_VALUE ? cached.Dts : cached.Pts;
+        if (dts == keyframeDts)
+            return m_Keyframes[mid];
+        else if (dts < keyframeDts)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -1;
+}
+bool PacketCache::Read(int% cursor, AVPacket* packet)
+{
+    if (cursor < 0 || cursor >= m_Packets->Count)
+        return false;
+
+    CachedPacket cached = m_Packets[cursor];
+    cursor++;
+
+    // The packet doesn't own the data, freeing it is a no-op.
+    av_init_packet(packet);
+    packet->data = (uint8_t*)cached.Data.ToPointer();
+    packet->size = cached.Size;
+    packet->pts = cached.Pts;
+    packet->dts = cached.Dts;
+    packet->pos = cached.Position;
+    packet->duration = cached.Duration;
+    packet->flags = cached.Flags;
+    packet->stream_index = m_StreamIndex;
+    return true;
+}
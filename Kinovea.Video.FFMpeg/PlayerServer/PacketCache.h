@@ -0,0 +1,136 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#pragma once
+
+extern "C" {
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <avformat.h>
+#include <avcodec.h>
+}
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::Reflection;
+using namespace Kinovea::Services;
+using namespace Kinovea::Video;
+
+namespace Kinovea { namespace Video { namespace FFMpeg
+{
+    /// <summary>
+    /// The compressed packets of the video stream over a section of the file, kept in memory.
+    /// Used when the decoded frames of the working zone don't fit in memory: the encoded packets are typically
+    /// two orders of magnitude smaller, and any frame can be decoded from its keyframe without going back to the disk.
+    /// </summary>
+    /// <remarks>
+    /// Packets are stored in decoding order. Their data is allocated with the padding required by the decoders,
+    /// and handed out without copy: the AVPacket returned by Read doesn't own its data and must not outlive the cache.
+    /// The cache is immutable once filled and may be read by several threads at once, each with its own cursor.
+    /// The reader holds the first reference, each decoding loop takes its own with TryAcquire for as long as it reads.
+    /// The memory is freed when the last reference is released, the finalizer is only a safety net.
+    /// </remarks>
+    public ref class PacketCache
+    {
+    public:
+        /// <summary>
+        /// Section covered by the cache, in Kinovea timestamps. Any frame presented in this section can be decoded from the cache.
+        /// </summary>
+        property VideoSection Zone {
+            VideoSection get() { return m_Zone; }
+        }
+        property int Count {
+            int get() { return m_Packets->Count; }
+        }
+        /// <summary>
+        /// Raw decoding timestamp of the last packet in the cache.
+        /// </summary>
+        property int64_t LastDts {
+            int64_t get() { return m_Packets->Count > 0 ? m_Packets[m_Packets->Count - 1].Dts : AV_NOPTS_VALUE; }
+        }
+        /// <summary>
+        /// Size of the packets data in bytes.
+        /// </summary>
+        property int64_t Bytes {
+            int64_t get() { return m_Bytes; }
+        }
+
+    public:
+        ~PacketCache();
+    protected:
+        !PacketCache();
+
+    public:
+        /// <summary>
+        /// Demux the packets of the video stream from the keyframe at startDts until the decoding timestamp goes past endPts.
+        /// Timestamps are raw stream timestamps. zone is the matching section in Kinovea timestamps.
+        /// Returns nullptr on failure, cancellation, or if the packets don't fit in the budget.
+        /// This opens its own demuxer and can run on any thread.
+        /// </summary>
+        static PacketCache^ Fill(String^ filePath, int streamIndex, VideoSection zone, int64_t startDts, int64_t endPts, int64_t budget, ThreadCanceler^ canceler);
+
+        /// <summary>
+        /// Returns the position of the keyframe packet with this decoding timestamp, or -1 if it's not in the cache.
+        /// </summary>
+        int Seek(int64_t keyframeDts);
+
+        /// <summary>
+        /// Point the packet at the cached packet under the cursor and advance the cursor.
+        /// Returns false at the end of the cache.
+        /// </summary>
+        bool Read(int% cursor, AVPacket* packet);
+
+        /// <summary>
+        /// Take a reference on the cache. Returns false if the memory has already been freed.
+        /// </summary>
+        bool TryAcquire();
+
+        /// <summary>
+        /// Give a reference back. The packets are freed with the last one.
+        /// </summary>
+        void Release();
+
+    private:
+        value struct CachedPacket
+        {
+            IntPtr Data;
+            int Size;
+            int64_t Pts;
+            int64_t Dts;
+            int64_t Position;
+            int Duration;
+            int Flags;
+        };
+
+        PacketCache(int streamIndex, VideoSection zone);
+        bool Add(AVPacket* packet);
+
+    private:
+        List<CachedPacket>^ m_Packets;
+        List<int>^ m_Keyframes;
+        VideoSection m_Zone;
+        int m_StreamIndex;
+        int64_t m_Bytes;
+        int m_References;
+        static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+    };
+}}}
@@ -0,0 +1,311 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#include "PacketIndex.h"
+
+using namespace System::Diagnostics;
+using namespace System::IO;
+using namespace System::Runtime::InteropServices;
+using namespace Kinovea::Video::FFMpeg;
+
+PacketIndex::PacketIndex(List<PacketIndexEntry>^ entries, int streamIndex, int metadataStreamIndex, int64_t metadataPosition, int64_t metadataDts)
+{
+    m_StreamIndex = streamIndex;
+    m_MetadataStreamIndex = metadataStreamIndex;
+    m_MetadataPosition = metadataPosition;
+    m_MetadataDts = metadataDts;
+    m_Entries = entries->ToArray();
+
+    // Presentation order and keyframes lookup tables.
+    List<int64_t>^ keyframePts = gcnew List<int64_t>();
+    List<int64_t>^ keyframeDts = gcnew List<int64_t>();
+    m_SortedPts = gcnew array<int64_t>(m_Entries->Length);
+    m_LongestGop = 0;
+    int gop = 0;
+    for (int i = 0; i < m_Entries->Length; i++)
+    {
+        m_SortedPts[i] = m_Entries[i].Pts;
+        if (m_Entries[i].Keyframe)
+        {
+            keyframePts->Add(m_Entries[i].Pts);
+            keyframeDts->Add(m_Entries[i].Dts);
+            gop = 0;
+        }
+
+        m_LongestGop = Math::Max(m_LongestGop, ++gop);
+    }
+
+    Array::Sort(m_SortedPts);
+    m_KeyframePts = keyframePts->ToArray();
+    m_KeyframeDts = keyframeDts->ToArray();
+    Array::Sort(m_KeyframePts, m_KeyframeDts);
+
+    m_FirstPts = m_SortedPts->Length > 0 ? m_SortedPts[0] : 0;
+    m_LastPts = m_SortedPts->Length > 0 ? m_SortedPts[m_SortedPts->Length - 1] : 0;
+}
+PacketIndex^ PacketIndex::Build(String^ filePath, int streamIndex, int metadataStreamIndex, ThreadCanceler^ canceler)
+{
+    PacketIndex^ index = nullptr;
+    AVFormatContext* pFormatCtx = nullptr;
+    Stopwatch^ stopwatch = Stopwatch::StartNew();
+
+    do
+    {
+        // Libav expects the filename in the computer default codepage.
+        String^ encFilePath = System::Text::Encoding::Default->GetString(System::Text::Encoding::UTF8->GetBytes(filePath));
+        char* pszFilePath = static_cast<char*>(Marshal::StringToHGlobalAnsi(encFilePath).ToPointer());
+        int res = avformat_open_input(&pFormatCtx, pszFilePath, nullptr, nullptr);
+        Marshal::FreeHGlobal(safe_cast<IntPtr>(pszFilePath));
+        if (res != 0)
+        {
+            log->ErrorFormat("Packet index: the file could not be opened.");
+            break;
+        }
+
+        if (avformat_find_stream_info(pFormatCtx, nullptr) < 0 || streamIndex < 0 || streamIndex >= (int)pFormatCtx->nb_streams)
+        {
+            log->ErrorFormat("Packet index: video stream not found.");
+            break;
+        }
+
+        // Let the demuxer skip everything that isn't the video stream or the metadata stream.
+        for (int i = 0; i < (int)pFormatCtx->nb_streams; i++)
+            pFormatCtx->streams[i]->discard = (i == streamIndex || i == metadataStreamIndex) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+        List<PacketIndexEntry>^ entries = gcnew List<PacketIndexEntry>();
+        int64_t metadataPosition = -1;
+        int64_t metadataDts = AV_NOPTS_VALUE;
+        bool valid = true;
+        bool cancelled = false;
+        AVPacket packet;
+        while (av_read_frame(pFormatCtx, &packet) >= 0)
+        {
+            if (packet.stream_index == streamIndex)
+            {
+                PacketIndexEntry entry;
+                entry.Pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+                entry.Dts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+                entry.Position = packet.pos;
+                entry.Duration = packet.duration;
+                entry.Keyframe = (packet.flags & AV_PKT_FLAG_KEY) != 0;
+
+                if (entry.Pts == AV_NOPTS_VALUE)
+                    valid = false;
+
+                entries->Add(entry);
+            }
+            else if (packet.stream_index == metadataStreamIndex && metadataPosition < 0)
+            {
+                metadataPosition = packet.pos;
+                metadataDts = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+            }
+
+            av_free_packet(&packet);
+
+            if (!valid)
+            {
+                log->Debug("Packet index: packets without timestamps, the file cannot be indexed.");
+                break;
+            }
+
+            if (canceler != nullptr && canceler->CancellationPending)
+            {
+                cancelled = true;
+                break;
+            }
+        }
+
+        if (!valid || cancelled || entries->Count == 0)
+            break;
+
+        index = gcnew PacketIndex(entries, streamIndex, metadataStreamIndex, metadataPosition, metadataDts);
+        log->DebugFormat("Packet index built in {0} ms. {1} frames, {2} keyframes.", stopwatch->ElapsedMilliseconds, index->FrameCount, index->KeyframeCount);
+    }
+    while (false);
+
+    if (pFormatCtx != nullptr)
+        avformat_close_input(&pFormatCtx);
+
+    return index;
+}
+String^ PacketIndex::GetSidecarPath(String^ filePath)
+{
+    return filePath + ".kvi";
+}
+bool PacketIndex::GetFileStamp(String^ filePath, int64_t% size, int64_t% lastWrite)
+{
+    try
+    {
+        FileInfo^ info = gcnew FileInfo(filePath);
+        if (!info->Exists)
+            return false;
+
+        size = info->Length;
+        lastWrite = info->LastWriteTimeUtc.Ticks;
+        return true;
+    }
+    catch (Exception^)
+    {
+        return false;
+    }
+}
+bool PacketIndex::Save(String^ filePath)
+{
+    // Sidecar layout: header then one record per packet, in decoding order.
+    // Header: magic, version, video file size and last write time, stream index, 
+    // metadata stream index, metadata packet position and timestamp, packet count.
+    int64_t size = 0;
+    int64_t lastWrite = 0;
+    if (!GetFileStamp(filePath, size, lastWrite))
+        return false;
+
+    String^ sidecar = GetSidecarPath(filePath);
+    try
+    {
+        // Creating a file over a hidden one is not allowed.
+        if (File::Exists(sidecar))
+            File::Delete(sidecar);
+
+        FileStream^ stream = gcnew FileStream(sidecar, FileMode::Create, FileAccess::Write);
+        BinaryWriter^ w = gcnew BinaryWriter(stream);
+        try
+        {
+            w->Write(System::Text::Encoding::ASCII->GetBytes("KVI"));
+            w->Write(FormatVersion);
+            w->Write(size);
+            w->Write(lastWrite);
+            w->Write(m_StreamIndex);
+            w->Write(m_MetadataStreamIndex);
+            w->Write(m_MetadataPosition);
+            w->Write(m_MetadataDts);
+            w->Write(m_Entries->Length);
+            for (int i = 0; i < m_Entries->Length; i++)
+            {
+                w->Write(m_Entries[i].Pts);
+                w->Write(m_Entries[i].Dts);
+                w->Write(m_Entries[i].Position);
+                w->Write(m_Entries[i].Duration);
+                w->Write(m_Entries[i].Keyframe);
+            }
+        }
+        finally
+        {
+            w->Close();
+        }
+
+        File::SetAttributes(sidecar, File::GetAttributes(sidecar) | FileAttributes::Hidden);
+        return true;
+    }
+    catch (Exception^ e)
+    {
+        // Typically a read-only location. The index will be rebuilt next time.
+        log->DebugFormat("Packet index could not be saved next to the video. {0}", e->Message);
+        return false;
+    }
+}
+PacketIndex^ PacketIndex::Load(String^ filePath, int streamIndex, int metadataStreamIndex)
+{
+    String^ sidecar = GetSidecarPath(filePath);
+    if (!File::Exists(sidecar))
+        return nullptr;
+
+    int64_t size = 0;
+    int64_t lastWrite = 0;
+    if (!GetFileStamp(filePath, size, lastWrite))
+        return nullptr;
+
+    try
+    {
+        BinaryReader^ r = gcnew BinaryReader(File::OpenRead(sidecar));
+        try
+        {
+            String^ magic = System::Text::Encoding::ASCII->GetString(r->ReadBytes(3));
+            if (magic != "KVI" || r->ReadInt32() != FormatVersion)
+                return nullptr;
+
+            // Stale index: the video was modified since.
+            if (r->ReadInt64() != size || r->ReadInt64() != lastWrite || r->ReadInt32() != streamIndex || r->ReadInt32() != metadataStreamIndex)
+                return nullptr;
+
+            int64_t metadataPosition = r->ReadInt64();
+            int64_t metadataDts = r->ReadInt64();
+            int count = r->ReadInt32();
+            List<PacketIndexEntry>^ entries = gcnew List<PacketIndexEntry>(count);
+            for (int i = 0; i < count; i++)
+            {
+                PacketIndexEntry entry;
+                entry.Pts = r->ReadInt64();
+                entry.Dts = r->ReadInt64();
+                entry.Position = r->ReadInt64();
+                entry.Duration = r->ReadInt32();
+                entry.Keyframe = r->ReadBoolean();
+                entries->Add(entry);
+            }
+
+            if (entries->Count == 0)
+                return nullptr;
+
+            return gcnew PacketIndex(entries, streamIndex, metadataStreamIndex, metadataPosition, metadataDts);
+        }
+        finally
+        {
+            r->Close();
+        }
+    }
+    catch (Exception^ e)
+    {
+        log->ErrorFormat("Packet index could not be loaded. {0}", e->Message);
+        return nullptr;
+    }
+}
+int PacketIndex::FindKeyframe(int64_t pts)
+{
+    // Binary search for the last keyframe at or before pts.
+    int index = Array::BinarySearch(m_KeyframePts, pts);
+    if (index < 0)
+        index = ~index - 1;
+
+    return index;
+}
+int64_t PacketIndex::GetKeyframePts(int keyframe)
+{
+    return m_KeyframePts[keyframe];
+}
+int64_t PacketIndex::GetKeyframeDts(int keyframe)
+{
+    return m_KeyframeDts[keyframe];
+}
+int PacketIndex::CountFrames(int64_t start, int64_t end)
+{
+    if (end <= start)
+        return 0;
+
+    int first = Array::BinarySearch(m_SortedPts, start);
+    if (first < 0)
+        first = ~first;
+
+    int last = Array::BinarySearch(m_SortedPts, end);
+    if (last < 0)
+        last = ~last;
+
+    return last - first;
+}
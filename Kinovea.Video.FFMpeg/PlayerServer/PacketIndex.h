@@ -0,0 +1,145 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#pragma once
+
+extern "C" {
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <avformat.h>
+#include <avcodec.h>
+}
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::Reflection;
+using namespace Kinovea::Video;
+
+namespace Kinovea { namespace Video { namespace FFMpeg
+{
+    /// <summary>
+    /// One video packet as seen by the demuxer.
+    /// Timestamps are raw stream timestamps (no Kinovea offset applied).
+    /// </summary>
+    public value struct PacketIndexEntry
+    {
+        int64_t Pts;
+        int64_t Dts;
+        int64_t Position;
+        int Duration;
+        bool Keyframe;
+    };
+
+    /// <summary>
+    /// Index of the packets of the video stream: timestamps, keyframe flag and byte position.
+    /// Built in a single demux-only pass (no decoding) and persisted as a sidecar file next to the video.
+    /// Used to seek straight to the right keyframe and to get exact frame count and duration.
+    /// </summary>
+    public ref class PacketIndex
+    {
+    public:
+        /// <summary>
+        /// Number of video packets in the stream. One packet is one frame.
+        /// </summary>
+        property int FrameCount {
+            int get() { return m_Entries->Length; }
+        }
+        property int KeyframeCount {
+            int get() { return m_KeyframePts->Length; }
+        }
+        property int64_t FirstPts {
+            int64_t get() { return m_FirstPts; }
+        }
+        property int64_t LastPts {
+            int64_t get() { return m_LastPts; }
+        }
+        /// <summary>
+        /// Number of packets in the longest group of pictures.
+        /// </summary>
+        property int LongestGop {
+            int get() { return m_LongestGop; }
+        }
+        property array<PacketIndexEntry>^ Entries {
+            array<PacketIndexEntry>^ get() { return m_Entries; }
+        }
+        /// <summary>
+        /// Byte position of the first packet of the metadata stream (muxed KVA), or -1 if there is none.
+        /// </summary>
+        property int64_t MetadataPosition {
+            int64_t get() { return m_MetadataPosition; }
+        }
+        /// <summary>
+        /// Raw decoding timestamp of the first packet of the metadata stream.
+        /// </summary>
+        property int64_t MetadataDts {
+            int64_t get() { return m_MetadataDts; }
+        }
+
+    public:
+        /// <summary>
+        /// Demux the whole file and build the index of the video stream. Returns nullptr on failure or cancellation.
+        /// The location of the first packet of the metadata stream is recorded as well, pass -1 if there is no such stream.
+        /// This opens its own demuxer and can run on any thread.
+        /// </summary>
+        static PacketIndex^ Build(String^ filePath, int streamIndex, int metadataStreamIndex, ThreadCanceler^ canceler);
+
+        /// <summary>
+        /// Load the sidecar index of the video if it exists and is still valid for the file.
+        /// </summary>
+        static PacketIndex^ Load(String^ filePath, int streamIndex, int metadataStreamIndex);
+        bool Save(String^ filePath);
+
+        static String^ GetSidecarPath(String^ filePath);
+
+        /// <summary>
+        /// Returns the index in Keyframes of the last keyframe presented at or before the passed timestamp.
+        /// Returns -1 if the timestamp is before the first keyframe.
+        /// </summary>
+        int FindKeyframe(int64_t pts);
+        int64_t GetKeyframePts(int keyframe);
+        int64_t GetKeyframeDts(int keyframe);
+
+        /// <summary>
+        /// Number of frames presented in the interval [start, end[.
+        /// </summary>
+        int CountFrames(int64_t start, int64_t end);
+
+    private:
+        PacketIndex(List<PacketIndexEntry>^ entries, int streamIndex, int metadataStreamIndex, int64_t metadataPosition, int64_t metadataDts);
+        static bool GetFileStamp(String^ filePath, int64_t% size, int64_t% lastWrite);
+
+    private:
+        array<PacketIndexEntry>^ m_Entries;
+        array<int64_t>^ m_SortedPts;
+        array<int64_t>^ m_KeyframePts;
+        array<int64_t>^ m_KeyframeDts;
+        int m_StreamIndex;
+        int m_MetadataStreamIndex;
+        int64_t m_MetadataPosition;
+        int64_t m_MetadataDts;
+        int64_t m_FirstPts;
+        int64_t m_LastPts;
+        int m_LongestGop;
+        static const int FormatVersion = 2;
+        static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+    };
+}}}
@@ -0,0 +1,292 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#include <string.h>
+#include <msclr\lock.h>
+#include "ReadAheadStream.h"
+
+using namespace msclr;
+using namespace Kinovea::Video::FFMpeg;
+
+// Callbacks of the AVIOContext. The opaque pointer is a GCHandle to the stream.
+static int ReadPacketCallback(void* _opaque, uint8_t* _buffer, int _size)
+{
+    ReadAheadStream^ stream = safe_cast<ReadAheadStream^>(GCHandle::FromIntPtr(IntPtr(_opaque)).Target);
+    return stream->Read(_buffer, _size);
+}
+static int64_t SeekCallback(void* _opaque, int64_t _offset, int _whence)
+{
+    ReadAheadStream^ stream = safe_cast<ReadAheadStream^>(GCHandle::FromIntPtr(IntPtr(_opaque)).Target);
+    if (_whence & AVSEEK_SIZE)
+        return stream->Length;
+
+    switch (_whence & ~AVSEEK_FORCE)
+    {
+    case SEEK_SET: return stream->Seek(_offset, SeekOrigin::Begin);
+    case SEEK_CUR: return stream->Seek(_offset, SeekOrigin::Current);
+    case SEEK_END: return stream->Seek(_offset, SeekOrigin::End);
+    default: return -1;
+    }
+}
+
+ReadAheadStream::ReadAheadStream(String^ filePath, int capacity)
+{
+    // The stream does its own buffering, the FileStream buffer would only add a copy.
+    Initialize(gcnew FileStream(filePath, FileMode::Open, FileAccess::Read, FileShare::ReadWrite, 1, FileOptions::SequentialScan), capacity);
+}
+ReadAheadStream::ReadAheadStream(Stream^ stream, int capacity)
+{
+    Initialize(stream, capacity);
+}
+ReadAheadStream::~ReadAheadStream()
+{
+    this->!ReadAheadStream();
+}
+ReadAheadStream::!ReadAheadStream()
+{
+    {
+        lock l(m_Locker);
+        m_Cancelled = true;
+        Monitor::PulseAll(m_Locker);
+    }
+
+    if (m_IOThread != nullptr)
+        m_IOThread->Join();
+
+    m_IOThread = nullptr;
+
+    if (m_Stream != nullptr)
+        m_Stream->Close();
+
+    m_Stream = nullptr;
+
+    if (m_Handle.IsAllocated)
+        m_Handle.Free();
+}
+void ReadAheadStream::Initialize(Stream^ stream, int capacity)
+{
+    m_Stream = stream;
+    m_Length = stream->Length;
+    m_Capacity = Math::Max(capacity, (int)MinCapacity);
+    m_Ring = gcnew array<Byte>(m_Capacity);
+    m_Locker = gcnew Object();
+
+    m_IOThread = gcnew Thread(gcnew ThreadStart(this, &ReadAheadStream::IOWorker));
+    m_IOThread->Name = "ReadAhead";
+    m_IOThread->IsBackground = true;
+    m_IOThread->Start();
+}
+int ReadAheadStream::Read(array<Byte>^ buffer, int offset, int count)
+{
+    if (count <= 0)
+        return 0;
+
+    pin_ptr<Byte> pBuffer = &buffer[offset];
+    int result = Read((uint8_t*)pBuffer, count);
+    if (result == AVERROR_EOF)
+        return 0;
+
+    if (result < 0)
+        throw gcnew IOException("The read-ahead stream failed to read the underlying stream.");
+
+    return result;
+}
+int ReadAheadStream::Read(uint8_t* buffer, int size)
+{
+    lock l(m_Locker);
+
+    if (m_Position >= m_Length)
+        return AVERROR_EOF;
+
+    if (m_Position >= m_WindowEnd && !m_Failed)
+    {
+        // The I/O thread hasn't reached the position yet.
+        int64_t start = Stopwatch::GetTimestamp();
+        m_Stalls++;
+        while (m_Position >= m_WindowEnd && m_Position < m_Length && !m_Failed && !m_Cancelled)
+            Monitor::Wait(m_Locker);
+
+        m_StallTicks += Stopwatch::GetTimestamp() - start;
+    }
+
+    if (m_Failed || m_Cancelled)
+        return AVERROR(EIO);
+
+    if (m_Position >= m_WindowEnd)
+        return AVERROR_EOF;
+
+    // Copy out of the ring, in two parts if the data wraps around its end.
+    int available = (int)Math::Min((int64_t)size, m_WindowEnd - m_Position);
+    int ringOffset = (int)(m_Position % m_Capacity);
+    int first = Math::Min(available, m_Capacity - ringOffset);
+    pin_ptr<Byte> pRing = &m_Ring[0];
+    memcpy(buffer, pRing + ringOffset, first);
+    if (first < available)
+        memcpy(buffer + first, pRing, available - first);
+
+    m_Position += available;
+    m_BytesServed += available;
+
+    // Wake the I/O thread up if it was waiting for room.
+    Monitor::Pulse(m_Locker);
+    return available;
+}
+int64_t ReadAheadStream::Seek(int64_t offset, SeekOrigin origin)
+{
+    lock l(m_Locker);
+
+    int64_t position = offset;
+    if (origin == SeekOrigin::Current)
+        position += m_Position;
+    else if (origin == SeekOrigin::End)
+        position += m_Length;
+
+    if (position < 0)
+        return -1;
+
+    // Short jumps forward are reached by the I/O thread anyway, anything else moves the window.
+    if (position < m_WindowStart || position > m_WindowEnd + ChunkSize)
+        Retarget(position);
+
+    m_Position = position;
+    return position;
+}
+void ReadAheadStream::ResetCounters()
+{
+    lock l(m_Locker);
+    m_BytesFetched = 0;
+    m_BytesServed = 0;
+    m_FetchTicks = 0;
+    m_StallTicks = 0;
+    m_Stalls = 0;
+    m_Retargets = 0;
+}
+void ReadAheadStream::DumpStats()
+{
+    double megabyte = 1024 * 1024;
+    log->DebugFormat("Read-ahead. Fetched:{0:0.0} MB at {1:0.0} MB/s, Served:{2:0.0} MB, Stalls:{3} ({4:0} ms), Retargets:{5}, Window:{6:0} MB.",
+        m_BytesFetched / megabyte, Throughput, m_BytesServed / megabyte, m_Stalls, StallMilliseconds, m_Retargets, m_Capacity / megabyte);
+}
+AVIOContext* ReadAheadStream::CreateIOContext()
+{
+    uint8_t* pBuffer = (uint8_t*)av_malloc(IOBufferSize);
+    if (pBuffer == nullptr)
+        return nullptr;
+
+    if (!m_Handle.IsAllocated)
+        m_Handle = GCHandle::Alloc(this);
+
+    void* opaque = GCHandle::ToIntPtr(m_Handle).ToPointer();
+    AVIOContext* pIOContext = avio_alloc_context(pBuffer, IOBufferSize, 0, opaque, &ReadPacketCallback, nullptr, &SeekCallback);
+    if (pIOContext == nullptr)
+        av_free(pBuffer);
+
+    return pIOContext;
+}
+void ReadAheadStream::FreeIOContext(AVIOContext** _ppIOContext)
+{
+    if (*_ppIOContext == nullptr)
+        return;
+
+    // The context may have replaced its buffer, free the current one.
+    av_free((*_ppIOContext)->buffer);
+    av_free(*_ppIOContext);
+    *_ppIOContext = nullptr;
+}
+void ReadAheadStream::Retarget(int64_t position)
+{
+    // Always inside the lock.
+    // Data being fetched for the previous window is discarded when the I/O thread sees the generation change.
+    m_WindowStart = position;
+    m_WindowEnd = position;
+    m_Failed = false;
+    m_Generation++;
+    m_Retargets++;
+    Monitor::PulseAll(m_Locker);
+}
+void ReadAheadStream::IOWorker()
+{
+    while (true)
+    {
+        int64_t fetchPosition;
+        int ringOffset;
+        int count;
+        int generation;
+
+        {
+            lock l(m_Locker);
+
+            // Wait until a chunk can be fetched without overwriting data ahead of the reader.
+            while (!m_Cancelled && (m_Failed || m_WindowEnd >= m_Length || m_WindowEnd + ChunkSize - m_Position > m_Capacity))
+                Monitor::Wait(m_Locker);
+
+            if (m_Cancelled)
+                break;
+
+            fetchPosition = m_WindowEnd;
+            ringOffset = (int)(fetchPosition % m_Capacity);
+            count = (int)Math::Min((int64_t)ChunkSize, m_Length - fetchPosition);
+            count = Math::Min(count, m_Capacity - ringOffset);
+
+            // Drop the oldest data from the window. The reader only reads inside the window, so the ring 
+            // section can then be written without the lock.
+            m_WindowStart = Math::Max(m_WindowStart, fetchPosition + count - m_Capacity);
+            generation = m_Generation;
+        }
+
+        int read = 0;
+        bool failed = false;
+        int64_t start = Stopwatch::GetTimestamp();
+        try
+        {
+            if (m_Stream->Position != fetchPosition)
+                m_Stream->Position = fetchPosition;
+
+            read = m_Stream->Read(m_Ring, ringOffset, count);
+        }
+        catch (Exception^ e)
+        {
+            log->Error("Read-ahead stream failed to read the underlying stream.", e);
+            failed = true;
+        }
+
+        int64_t elapsed = Stopwatch::GetTimestamp() - start;
+
+        {
+            lock l(m_Locker);
+            m_FetchTicks += elapsed;
+            m_BytesFetched += read;
+
+            if (generation == m_Generation)
+            {
+                if (failed)
+                    m_Failed = true;
+                else if (read == 0)
+                    m_Length = m_WindowEnd;
+                else
+                    m_WindowEnd += read;
+            }
+
+            Monitor::PulseAll(m_Locker);
+        }
+    }
+}
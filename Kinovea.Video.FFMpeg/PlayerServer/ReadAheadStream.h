@@ -0,0 +1,162 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#pragma once
+
+extern "C" {
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <avformat.h>
+}
+
+#include <stdint.h>
+
+using namespace System;
+using namespace System::Diagnostics;
+using namespace System::IO;
+using namespace System::Reflection;
+using namespace System::Runtime::InteropServices;
+using namespace System::Threading;
+
+namespace Kinovea { namespace Video { namespace FFMpeg
+{
+    /// <summary>
+    /// Serves the demuxer from a window of the file kept in memory, filled ahead of the read position by a dedicated I/O thread.
+    /// With slow storage (USB drives, network shares) the waits on the disk are absorbed by the I/O thread instead of the decoding loop.
+    /// The window is a ring indexed by file position. Data behind the read position stays available until it is overwritten,
+    /// so the short backward seeks done by demuxers don't go back to the disk. Seeks outside the window retarget it.
+    /// Thread safe: the window bounds are only changed under the lock, the disk is read outside of it.
+    /// </summary>
+    public ref class ReadAheadStream
+    {
+    public:
+        property int64_t Length {
+            int64_t get() { return m_Length; }
+        }
+
+        /// <summary>
+        /// Size of the window in bytes.
+        /// </summary>
+        property int Capacity {
+            int get() { return m_Capacity; }
+        }
+
+        /// <summary>
+        /// Number of bytes read from the underlying stream.
+        /// </summary>
+        property int64_t BytesFetched {
+            int64_t get() { return m_BytesFetched; }
+        }
+
+        /// <summary>
+        /// Number of bytes handed to the demuxer.
+        /// </summary>
+        property int64_t BytesServed {
+            int64_t get() { return m_BytesServed; }
+        }
+
+        /// <summary>
+        /// Number of reads that had to wait for the I/O thread.
+        /// </summary>
+        property int Stalls {
+            int get() { return m_Stalls; }
+        }
+
+        /// <summary>
+        /// Total time spent waiting for the I/O thread, in milliseconds.
+        /// </summary>
+        property double StallMilliseconds {
+            double get() { return (double)m_StallTicks * 1000 / Stopwatch::Frequency; }
+        }
+
+        /// <summary>
+        /// Number of seeks that landed outside the window.
+        /// </summary>
+        property int Retargets {
+            int get() { return m_Retargets; }
+        }
+
+        /// <summary>
+        /// Throughput of the underlying stream while it was being read, in MB/s.
+        /// </summary>
+        property double Throughput {
+            double get() { return m_FetchTicks > 0 ? (m_BytesFetched / (1024.0 * 1024.0)) / ((double)m_FetchTicks / Stopwatch::Frequency) : 0; }
+        }
+
+    public:
+        ReadAheadStream(String^ filePath, int capacity);
+        ReadAheadStream(Stream^ stream, int capacity);
+        ~ReadAheadStream();
+    protected:
+        !ReadAheadStream();
+
+    public:
+        /// <summary>
+        /// Read from the current position. Returns 0 at the end of the stream.
+        /// </summary>
+        int Read(array<Byte>^ buffer, int offset, int count);
+        int64_t Seek(int64_t offset, SeekOrigin origin);
+        void ResetCounters();
+        void DumpStats();
+
+    internal:
+        /// <summary>
+        /// Create an AVIOContext reading from this stream, to be set as the pb of a demuxer before opening it.
+        /// Must be freed with FreeIOContext after the demuxer has been closed.
+        /// </summary>
+        AVIOContext* CreateIOContext();
+        static void FreeIOContext(AVIOContext** _ppIOContext);
+        int Read(uint8_t* buffer, int size);
+
+    private:
+        void Initialize(Stream^ stream, int capacity);
+        void Retarget(int64_t position);
+        void IOWorker();
+
+    private:
+        static const int ChunkSize = 512 * 1024;
+        static const int IOBufferSize = 64 * 1024;
+        static const int MinCapacity = 4 * ChunkSize;
+
+        Stream^ m_Stream;
+        array<Byte>^ m_Ring;
+        int m_Capacity;
+        int64_t m_Length;
+        int64_t m_Position;
+        int64_t m_WindowStart;
+        int64_t m_WindowEnd;
+        int m_Generation;
+        bool m_Failed;
+        bool m_Cancelled;
+        Thread^ m_IOThread;
+        Object^ m_Locker;
+        GCHandle m_Handle;
+
+        int64_t m_BytesFetched;
+        int64_t m_BytesServed;
+        int64_t m_FetchTicks;
+        int64_t m_StallTicks;
+        int m_Stalls;
+        int m_Retargets;
+        static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+    };
+}}}
@@ -41,6 +41,11 @@ namespace Kinovea { namespace Video { namespace FFMpeg
 		AVStream* pOutputDataStream;			// Output stream for meta data.
 		AVFrame* pInputFrame;					// The current incoming frame.
         SwsContext* pScalingContext;            // The scaling context for the RGB -> YUV color conversion.
+        AVFrame* pYUV420Frame;                  // Color converted frame, reused for each frame.
+        uint8_t* pYUV420Buffer;                 // Backing buffer of the color converted frame.
+        int iYUV420BufferSize;
+        uint8_t* pEncodeBuffer;                 // Output of the encoder, sized for the worst case.
+        int iEncodeBufferSize;
 		
 		double fPixelAspectRatio;				// Used to adapt pixel aspect ratio.
 		bool bInputWasMpeg2;					
@@ -53,6 +58,7 @@ namespace Kinovea { namespace Video { namespace FFMpeg
 		int iBitrate;				
 		Size outputSize;
         bool uncompressed;
+        bool lossless;                          // Uncompressed frames are stored with a lossless codec instead of raw.
 
 		// Control
 		bool bEncoderOpened;
@@ -65,6 +71,12 @@ namespace Kinovea { namespace Video { namespace FFMpeg
 			fPixelAspectRatio = 1.0;		// Default aspect : square pixels.
 			outputSize = Size(720, 576);
             uncompressed = false;
+            lossless = false;
+            pYUV420Frame = nullptr;
+            pYUV420Buffer = nullptr;
+            iYUV420BufferSize = 0;
+            pEncodeBuffer = nullptr;
+            iEncodeBufferSize = 0;
 		}
 	};
 }}}
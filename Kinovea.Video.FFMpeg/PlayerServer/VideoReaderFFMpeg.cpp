@@ -40,13 +40,36 @@ VideoReaderFFMpeg::VideoReaderFFMpeg()
     avfilter_register_all();
     m_Locker = gcnew Object();
     m_PreBufferingThreadCanceler = gcnew ThreadCanceler();
-
-    VideoFrameDisposer^ disposer = gcnew VideoFrameDisposer(DisposeFrame);
+    m_CacheFillingCanceler = gcnew ThreadCanceler();
+    m_ReverseDecodingCanceler = gcnew ThreadCanceler();
+    m_ReverseLocker = gcnew Object();
+    m_ScrubPrefetchCanceler = gcnew ThreadCanceler();
+    m_ScrubWakeUp = gcnew AutoResetEvent(false);
+    m_ScrubPolicy = gcnew ScrubPrefetchPolicy();
+    m_PreBufferPolicy = gcnew PreBufferDepthPolicy();
+    m_PacketIndexThreadCanceler = gcnew ThreadCanceler();
+    m_PacketCacheCanceler = gcnew ThreadCanceler();
+
+    // Idle buffers kept for reuse. The prebuffer only needs a handful of them to run without allocations,
+    // clearing a large cache should not keep hundreds of megabytes around.
+    int64_t maxIdleBytes = (Software::Is32bit ? 64 : 256) * 1024 * 1024;
+    m_FramePool = gcnew FrameBufferPool(maxIdleBytes);
+
+    VideoFrameDisposer^ disposer = gcnew VideoFrameDisposer(this, &VideoReaderFFMpeg::DisposeFrame);
+    m_Materializer = gcnew VideoFrameMaterializer(this, &VideoReaderFFMpeg::MaterializeFrame);
+    m_MaterializedFrames = gcnew LinkedList<VideoFrame^>();
+    m_MaterializeBuffers = gcnew Stack<PinnedImageBuffer^>();
+    m_MaterializeLocker = gcnew Object();
+    m_ConversionEngine = gcnew ConversionEngine(DecodingQuality);
+    m_MaterializeEngine = gcnew ConversionEngine(DecodingQuality);
     m_SingleFrameContainer = gcnew SingleFrame(disposer);
     m_PreBuffer = gcnew PreBuffer(disposer);
+    m_ReverseBuffer = gcnew ReverseBuffer(disposer);
+    m_ScrubBuffer = gcnew ScrubBuffer(disposer);
     m_Cache = gcnew Cache(disposer);
     
     m_LoopWatcher = gcnew LoopWatcher();
+    m_DecodingStatistics = gcnew Kinovea::Video::DecodingStatistics();
     DataInit();
 }
 VideoReaderFFMpeg::~VideoReaderFFMpeg()
@@ -57,6 +80,11 @@ VideoReaderFFMpeg::!VideoReaderFFMpeg()
 {
     if (m_bIsLoaded)
         Close();
+
+    ClearMaterializeBuffers();
+    delete m_FramePool;
+    delete m_ConversionEngine;
+    delete m_MaterializeEngine;
 }
 OpenVideoResult VideoReaderFFMpeg::Open(String^ filePath)
 {
@@ -72,8 +100,26 @@ void VideoReaderFFMpeg::Close()
     if (!m_bIsLoaded)
         return;
 
+    StopPacketIndexing();
+    StopPacketCaching();
     DataInit();
 
+    // All frames have been given back to the pool by the containers at this point.
+    if (m_Verbose)
+        m_FramePool->DumpStats();
+
+    m_FramePool->Trim();
+    m_FramePool->ResetCounters();
+    ClearMaterializeBuffers();
+
+    if (m_Verbose)
+        m_ConversionEngine->DumpStats("Main");
+
+    m_ConversionEngine->Invalidate();
+    m_ConversionEngine->ResetCounters();
+    m_MaterializeEngine->Invalidate();
+    m_MaterializeEngine->ResetCounters();
+
     if (m_pCodecCtx != nullptr)
         avcodec_close(m_pCodecCtx);
 
@@ -83,6 +129,8 @@ void VideoReaderFFMpeg::Close()
         avformat_close_input(&pin);
         m_pFormatCtx = pin;
     }
+
+    CloseReadAhead();
 }
 void VideoReaderFFMpeg::DataInit()
 {
@@ -91,16 +139,32 @@ void VideoReaderFFMpeg::DataInit()
     m_iVideoStream = -1;
     m_iAudioStream = -1;
     m_iMetadataStream = -1;
+    m_iMetadataAttachment = -1;
     m_VideoInfo = VideoInfo::Empty;
     m_WorkingZone = VideoSection::MakeEmpty();
     m_TimestampInfo = TimestampInfo::Empty;
     m_WasPrebuffering = false;
+    m_Reversing = false;
+    m_ReverseChunk = VideoSection::MakeEmpty();
+    m_Scrubbing = false;
+    m_ScrubBuffer->ResetStatistics();
+    m_PreBufferPolicy->Reset();
+    m_PreBuffer->Capacity = m_PreBufferPolicy->Depth;
+    m_DecodingStatistics->Reset();
     m_CanDrawUnscaled = false;
+    m_Lowres = 0;
+    m_PacketIndex = nullptr;
+    ClearPacketCache();
+    ReleaseActivePacketCache();
+    m_LastDecodedTimestamp = -1;
+    m_PlanarCache = false;
 }
 VideoSummary^ VideoReaderFFMpeg::ExtractSummary(String^ _filePath, int _thumbs, Size _maxSize)
 {
     // Open the file and extract some info + a few thumbnails.
+    // In fast summary mode the thumbnails are the keyframes closest to the requested times, decoded at reduced resolution if possible.
     m_Verbose = false;
+    m_SummaryMaxSize = _maxSize;
     VideoSummary^ summary = gcnew VideoSummary(_filePath);
 
     OpenVideoResult loaded = Load(_filePath, true);
@@ -130,18 +194,16 @@ VideoSummary^ VideoReaderFFMpeg::ExtractSummary(String^ _filePath, int _thumbs,
         else
             read = ReadFrame(ts, 1, true);
 
-        if (read == ReadResult::Success &&
-            m_FramesContainer->CurrentFrame != nullptr &&
-            m_TimestampInfo.CurrentTimestamp > previousFrameTimestamp)
-        {
-            Bitmap^ bmp = BitmapHelper::Copy(m_FramesContainer->CurrentFrame->Image);
-            summary->Thumbs->Add(bmp);
-            previousFrameTimestamp = m_TimestampInfo.CurrentTimestamp;
-        }
-        else
-        {
+        if (read != ReadResult::Success || m_FramesContainer->CurrentFrame == nullptr)
             break;
-        }
+
+        // With keyframes only, several targets in the same GOP land on the same frame.
+        if (m_TimestampInfo.CurrentTimestamp <= previousFrameTimestamp)
+            continue;
+
+        Bitmap^ bmp = BitmapHelper::Copy(m_FramesContainer->CurrentFrame->Image);
+        summary->Thumbs->Add(bmp);
+        previousFrameTimestamp = m_TimestampInfo.CurrentTimestamp;
     }
 
     Close();
@@ -180,6 +242,9 @@ bool VideoReaderFFMpeg::MoveNext(int _skip, bool _decodeIfNecessary)
     }
     else if (m_DecodingMode == VideoDecodingMode::PreBuffering)
     {
+        // Going forward again after reverse playback or scrubbing, restart the regular prebuffering from the current frame.
+        ReturnToPreBuffering(true);
+
         if (!_decodeIfNecessary || m_PreBuffer->HasNext(_skip))
         {
             m_PreBuffer->MoveBy(_skip + 1);
@@ -223,9 +288,26 @@ bool VideoReaderFFMpeg::MoveTo(int64_t from, int64_t target)
             
             moved = m_PreBuffer->MoveTo(target);
         }
+        else if (m_Reversing && m_ReverseBuffer->Contains(target))
+        {
+            moved = m_ReverseBuffer->MoveTo(target);
+        }
+        else if (m_Scrubbing && m_ScrubBuffer->Covers(target))
+        {
+            moved = MoveScrub(target);
+        }
+        else if (IsReverseStep(from, target))
+        {
+            moved = MoveBackward(target);
+        }
+        else if (IsScrubJump(from, target))
+        {
+            moved = MoveScrub(target);
+        }
         else
         {
             // Stop thread, decode frame, move to it, restart thread.
+            ReturnToPreBuffering(false);
             StopPreBuffering();
 
             // Adding the target frame will either keep the prebuffer frames contiguous or not.
@@ -258,27 +340,82 @@ bool VideoReaderFFMpeg::MoveTo(int64_t from, int64_t target)
 }
 String^ VideoReaderFFMpeg::ReadMetadata()
 {
+    // KVA attached to the container: the content is already in memory.
+    if (m_iMetadataAttachment >= 0)
+    {
+        AVCodecContext* pAttachmentCtx = m_pFormatCtx->streams[m_iMetadataAttachment]->codec;
+        if (pAttachmentCtx->extradata == nullptr || pAttachmentCtx->extradata_size <= 0)
+            return "";
+
+        array<Byte>^ data = gcnew array<Byte>(pAttachmentCtx->extradata_size);
+        Marshal::Copy(IntPtr(pAttachmentCtx->extradata), data, 0, data->Length);
+        return System::Text::Encoding::UTF8->GetString(data);
+    }
+
     if (m_iMetadataStream < 0)
         return "";
 
-    String^ metadata = "";
-    bool done = false;
-    do
+    // The index of a previous session tells where the packet is, or that there isn't any.
+    if (m_PacketIndex != nullptr && m_PacketIndex->MetadataPosition < 0)
+        return "";
+
+    // Only demux the metadata stream while looking for the packet.
+    array<AVDiscard>^ discard = gcnew array<AVDiscard>(m_pFormatCtx->nb_streams);
+    for (int i = 0; i < (int)m_pFormatCtx->nb_streams; i++)
     {
-        AVPacket InputPacket;
-        if ((av_read_frame(m_pFormatCtx, &InputPacket)) < 0)
-            break;
+        discard[i] = m_pFormatCtx->streams[i]->discard;
+        m_pFormatCtx->streams[i]->discard = i == m_iMetadataStream ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
 
-        if (InputPacket.stream_index != m_iMetadataStream)
-            continue;
+    String^ metadata = nullptr;
+    if (m_PacketIndex != nullptr)
+    {
+        // Go straight to the packet, by byte position if the demuxer supports it, by timestamp otherwise.
+        if (av_seek_frame(m_pFormatCtx, m_iMetadataStream, m_PacketIndex->MetadataPosition, AVSEEK_FLAG_BYTE) >= 0 ||
+            av_seek_frame(m_pFormatCtx, m_iMetadataStream, m_PacketIndex->MetadataDts, AVSEEK_FLAG_BACKWARD) >= 0)
+        {
+            metadata = FindMetadataPacket(MaxMetadataLookupPackets);
+        }
 
-        metadata = gcnew String((char*)InputPacket.data);
-        done = true;
-    } while (!done);
+        if (metadata == nullptr)
+        {
+            log->Debug("Metadata packet not found at its indexed location, scanning the file.");
+            avformat_seek_file(m_pFormatCtx, m_iVideoStream, m_timestampOffset, m_timestampOffset, m_timestampOffset, AVSEEK_FLAG_BACKWARD);
+        }
+    }
+
+    if (metadata == nullptr)
+        metadata = FindMetadataPacket(-1);
+
+    for (int i = 0; i < (int)m_pFormatCtx->nb_streams; i++)
+        m_pFormatCtx->streams[i]->discard = discard[i];
 
     // Back to start.
     long targetTimestamp = m_timestampOffset;
     avformat_seek_file(m_pFormatCtx, m_iVideoStream, targetTimestamp, targetTimestamp, targetTimestamp, AVSEEK_FLAG_BACKWARD);
+    m_LastDecodedTimestamp = -1;
+
+    return metadata != nullptr ? metadata : "";
+}
+String^ VideoReaderFFMpeg::FindMetadataPacket(int _maxPackets)
+{
+    // Read packets from the current position until one belongs to the metadata stream.
+    // Returns nullptr if none was found within _maxPackets packets, or before the end of the file if _maxPackets is negative.
+    String^ metadata = nullptr;
+    for (int i = 0; _maxPackets < 0 || i < _maxPackets; i++)
+    {
+        AVPacket packet;
+        if (av_read_frame(m_pFormatCtx, &packet) < 0)
+            break;
+
+        if (packet.stream_index == m_iMetadataStream)
+            metadata = gcnew String((char*)packet.data);
+
+        av_free_packet(&packet);
+
+        if (metadata != nullptr)
+            break;
+    }
 
     return metadata;
 }
@@ -297,6 +434,8 @@ bool VideoReaderFFMpeg::ChangeAspectRatio(ImageAspectRatio _ratio)
 
     // TODO: decoding size should be updated from the outside ?
     m_DecodingSize = m_VideoInfo.AspectRatioSize;
+    UpdateLowres();
+    m_ConversionEngine->Invalidate();
 
     m_FramesContainer->Clear();
     return true;
@@ -315,6 +454,8 @@ bool VideoReaderFFMpeg::ChangeImageRotation(ImageRotation rotation)
 
     UpdateReferenceSizes(Options->ImageAspectRatio, true);
     m_DecodingSize = m_VideoInfo.AspectRatioSize;
+    UpdateLowres();
+    m_ConversionEngine->Invalidate();
     m_FramesContainer->Clear();
     return true;
 }
@@ -328,6 +469,8 @@ bool VideoReaderFFMpeg::ChangeDemosaicing(Demosaicing demosaicing)
         log->ErrorFormat("PreBuffering thread is started.");
 
     Options->Demosaicing = demosaicing;
+    UpdateLowres();
+    m_ConversionEngine->Invalidate();
     
     m_FramesContainer->Clear();
     return true;
@@ -339,6 +482,7 @@ bool VideoReaderFFMpeg::ChangeDeinterlace(bool _deint)
 
     // Decoding thread should be stopped at this point.
     Options->Deinterlace = _deint;
+    m_ConversionEngine->Invalidate();
     m_FramesContainer->Clear();
     return true;
 }
@@ -368,11 +512,14 @@ bool VideoReaderFFMpeg::ChangeDecodingSize(Size _size)
     if (m_Verbose)
         log->DebugFormat("Changing decoding size from {0} to {1}", m_DecodingSize, targetSize);
 
+    ReturnToPreBuffering(true);
     long currentTimestamp = m_PreBuffer->CurrentFrame != nullptr ? m_PreBuffer->CurrentFrame->Timestamp : -1;
 
     StopPreBuffering();
     m_PreBuffer->Clear();
     m_DecodingSize = targetSize;
+    UpdateLowres();
+    m_ConversionEngine->Invalidate();
     m_CanDrawUnscaled = true;
 
     if (currentTimestamp >= 0)
@@ -394,6 +541,7 @@ void VideoReaderFFMpeg::DisableCustomDecodingSize()
     if (m_DecodingMode != VideoDecodingMode::PreBuffering)
         return;
 
+    ReturnToPreBuffering(true);
     long currentTimestamp = m_PreBuffer->CurrentFrame != nullptr ? m_PreBuffer->CurrentFrame->Timestamp : -1;
 
     StopPreBuffering();
@@ -413,6 +561,68 @@ void VideoReaderFFMpeg::ResetDecodingSize()
 {
     m_DecodingSize = m_VideoInfo.AspectRatioSize;
     m_CanDrawUnscaled = false;
+    UpdateLowres();
+    m_ConversionEngine->Invalidate();
+}
+void VideoReaderFFMpeg::UpdateLowres()
+{
+    // When the image is shown much smaller than the source, let the codec decode directly at a fraction of the size.
+    // Codecs supporting it skip the high frequency coefficients of each block, and the scaler and deinterlacer
+    // then work on the reduced image. Only done in prebuffering, the cache and the exports always get full frames.
+    // A Bayer mosaic can't be reduced before demosaicing.
+    int lowres = 0;
+    Size aspectSize = m_VideoInfo.AspectRatioSize;
+    if (m_DecodingMode == VideoDecodingMode::PreBuffering && m_DecodingSize != aspectSize && aspectSize.Width > 0 && aspectSize.Height > 0 &&
+        Options->Demosaicing == Demosaicing::None)
+    {
+        // Size needed in the coded image to produce the decoding size without upscaling.
+        int width = (int)Math::Ceiling((double)m_DecodingSize.Width * m_CodedSize.Width / aspectSize.Width);
+        int height = (int)Math::Ceiling((double)m_DecodingSize.Height * m_CodedSize.Height / aspectSize.Height);
+        lowres = GetLowres(avcodec_find_decoder(m_pCodecCtx->codec_id), m_CodedSize, Size(width, height));
+    }
+
+    SetLowres(lowres);
+}
+bool VideoReaderFFMpeg::SetLowres(int _lowres)
+{
+    // The reduction factor is only taken into account when the codec is opened, so the main decoder is reopened.
+    // The decoding threads must be stopped. The decoder state is lost, the next read will seek.
+    if (m_pCodecCtx == nullptr || _lowres == m_Lowres)
+        return true;
+
+    AVCodec* pCodec = avcodec_find_decoder(m_pCodecCtx->codec_id);
+    if (pCodec == nullptr)
+        return false;
+
+    avcodec_close(m_pCodecCtx);
+
+    // Opening the codec derives the output dimensions from the full size.
+    m_pCodecCtx->width = m_CodedSize.Width;
+    m_pCodecCtx->height = m_CodedSize.Height;
+    m_pCodecCtx->lowres = _lowres;
+    bool opened = avcodec_open2(m_pCodecCtx, pCodec, nullptr) >= 0;
+    if (!opened && _lowres > 0)
+    {
+        log->ErrorFormat("Codec could not be reopened with a reduction factor of {0}, back to full size.", _lowres);
+        m_pCodecCtx->width = m_CodedSize.Width;
+        m_pCodecCtx->height = m_CodedSize.Height;
+        m_pCodecCtx->lowres = 0;
+        opened = avcodec_open2(m_pCodecCtx, pCodec, nullptr) >= 0;
+    }
+
+    if (!opened)
+    {
+        log->Error("Codec could not be reopened.");
+        return false;
+    }
+
+    if (m_Verbose)
+        log->DebugFormat("Decoding at 1/{0} of the coded size: {1}x{2}.", 1 << m_pCodecCtx->lowres, m_pCodecCtx->width, m_pCodecCtx->height);
+
+    m_Lowres = m_pCodecCtx->lowres;
+    m_TimestampInfo = TimestampInfo::Empty;
+    m_LastDecodedTimestamp = -1;
+    return true;
 }
 bool VideoReaderFFMpeg::WorkingZoneFitsInMemory(VideoSection _newZone, int _maxMemory)
 {
@@ -420,7 +630,9 @@ bool VideoReaderFFMpeg::WorkingZoneFitsInMemory(VideoSection _newZone, int _maxM
 
     // Loading is done at full aspect ratio size, not at the current decoding size based on the rendering container.
     // Otherwise we would have to potentially reload the cache each time there is a stretch/squeeze request.
-    int64_t frameBytes = avpicture_get_size(m_PixelFormatFFmpeg, m_VideoInfo.ReferenceSize.Width, m_VideoInfo.ReferenceSize.Height);
+    // Compact frames are stored in the decoder pixel format.
+    AVPixelFormat cacheFormat = m_PlanarCache ? m_pCodecCtx->pix_fmt : m_PixelFormatFFmpeg;
+    int64_t frameBytes = avpicture_get_size(cacheFormat, m_VideoInfo.ReferenceSize.Width, m_VideoInfo.ReferenceSize.Height);
     double frameMegaBytes = (double)frameBytes / 1048576;
     double durationMegaBytes = durationSeconds * m_VideoInfo.FramesPerSeconds * frameMegaBytes;
 
@@ -439,6 +651,7 @@ void VideoReaderFFMpeg::SwitchDecodingMode(VideoDecodingMode _mode)
 
     if (m_DecodingMode == VideoDecodingMode::PreBuffering)
     {
+        ReturnToPreBuffering(false);
         StopPreBuffering();
         ResetDecodingSize();
     }
@@ -486,7 +699,10 @@ void VideoReaderFFMpeg::UpdateWorkingZone(VideoSection _newZone, bool _forceRelo
         if (m_DecodingMode == VideoDecodingMode::OnDemand && CanPreBuffer)
             SwitchDecodingMode(VideoDecodingMode::PreBuffering);
         else if (m_DecodingMode == VideoDecodingMode::PreBuffering)
+        {
+            ReturnToPreBuffering(true);
             m_PreBuffer->UpdateWorkingZone(m_WorkingZone);
+        }
     }
     else
     {
@@ -510,9 +726,11 @@ void VideoReaderFFMpeg::UpdateWorkingZone(VideoSection _newZone, bool _forceRelo
 
             m_WorkingZone = _newZone;
             SwitchToBestAfterCaching();
+            UpdatePacketCache(_maxMemory);
         }
         else
         {
+            ClearPacketCache();
             m_SectionToPrepend = VideoSection::MakeEmpty();
             m_SectionToAppend = VideoSection::MakeEmpty();
             
@@ -671,6 +889,14 @@ bool VideoReaderFFMpeg::ReadMany(BackgroundWorker^ _bgWorker, VideoSection _sect
     if (total == 0)
         return true;
 
+    // Decode in parallel if the section spans several GOPs.
+    if (!m_bIsVeryShort && ReadManyParallel(_bgWorker, _section, total, success))
+    {
+        m_WorkingZone = m_Cache->WorkingZone;
+        m_Cache->SetPrependBlock(false);
+        return success;
+    }
+
     // If the video is very short this call can only happen when opening the video.
     // We avoid a useless seek in this case. Prevent problems with non seekable files like single images.
     ReadResult res;
@@ -724,6 +950,256 @@ bool VideoReaderFFMpeg::ReadMany(BackgroundWorker^ _bgWorker, VideoSection _sect
 
     return success;
 }
+bool VideoReaderFFMpeg::ReadManyParallel(BackgroundWorker^ _bgWorker, VideoSection _section, int _total, bool% _success)
+{
+    // Split the section at keyframes and decode each segment concurrently on its own demuxer and decoder.
+    // Frames are collected per segment and pushed to the cache in order once all segments are done.
+    // Returns false if the section can't be split, in which case nothing has been added to the cache.
+    if (m_PacketIndex == nullptr)
+        return false;
+
+    int firstKeyframe = Math::Max(m_PacketIndex->FindKeyframe(_section.Start + m_timestampOffset), 0);
+    int lastKeyframe = m_PacketIndex->FindKeyframe(_section.End + m_timestampOffset);
+    int gops = lastKeyframe - firstKeyframe + 1;
+    int count = Math::Min(Math::Min(Environment::ProcessorCount, MaxCacheFillingThreads), gops);
+    if (count < 2)
+        return false;
+
+    // Frames already in the cache must not be added again.
+    int64_t start = _section.Start;
+    int64_t end = _section.End + 1;
+    if (!m_Cache->WorkingZone.IsEmpty)
+    {
+        if (m_Cache->WorkingZone.Start > _section.Start)
+            end = Math::Min(end, m_Cache->WorkingZone.Start);
+        else
+            start = Math::Max(start, m_Cache->WorkingZone.End + 1);
+    }
+
+    array<CacheSegment^>^ segments = gcnew array<CacheSegment^>(count);
+    for (int i = 0; i < count; i++)
+    {
+        int keyframe = firstKeyframe + (i * gops) / count;
+        int nextKeyframe = firstKeyframe + ((i + 1) * gops) / count;
+        int64_t segmentStart = i == 0 ? start : m_PacketIndex->GetKeyframePts(keyframe) - m_timestampOffset;
+        int64_t segmentEnd = i == count - 1 ? end : m_PacketIndex->GetKeyframePts(nextKeyframe) - m_timestampOffset;
+        segments[i] = gcnew CacheSegment(i, segmentStart, segmentEnd, m_PacketIndex->GetKeyframeDts(keyframe));
+        segments[i]->Planar = m_PlanarCache;
+        segments[i]->Canceler = m_CacheFillingCanceler;
+    }
+
+    if (m_Verbose)
+        log->DebugFormat("Caching {0} GOPs in {1} parallel segments.", gops, count);
+
+    Stopwatch^ stopwatch = Stopwatch::StartNew();
+    m_CacheFillingCanceler->Reset();
+    m_ParallelFramesRead = 0;
+
+    array<Thread^>^ threads = gcnew array<Thread^>(count);
+    for (int i = 0; i < count; i++)
+    {
+        threads[i] = gcnew Thread(gcnew ParameterizedThreadStart(this, &VideoReaderFFMpeg::DecodeSegment));
+        threads[i]->Name = String::Format("CacheFilling {0}", i);
+        threads[i]->IsBackground = true;
+        threads[i]->Start(segments[i]);
+    }
+
+    // Progress reporting and cancellation stay on the background worker thread.
+    bool cancelled = false;
+    for (int i = 0; i < count; i++)
+    {
+        while (!threads[i]->Join(ProgressInterval))
+        {
+            if (_bgWorker == nullptr)
+                continue;
+
+            if (_bgWorker->CancellationPending && !cancelled)
+            {
+                cancelled = true;
+                m_CacheFillingCanceler->Cancel();
+            }
+
+            _bgWorker->ReportProgress(Math::Min(m_ParallelFramesRead, _total), _total);
+        }
+    }
+
+    bool complete = !cancelled;
+    for (int i = 0; i < count; i++)
+        complete &= segments[i]->Success;
+
+    if (!complete)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            for each (VideoFrame^ frame in segments[i]->Frames)
+                DisposeFrame(frame);
+        }
+
+        if (!cancelled)
+        {
+            // A segment could not be decoded, let the sequential path try.
+            log->Error("Parallel caching failed. Falling back to sequential caching.");
+            return false;
+        }
+
+        if (m_Verbose)
+            log->Debug("Parallel caching cancelled.");
+
+        m_Cache->Clear();
+        _success = false;
+        return true;
+    }
+
+    // Stitch the segments.
+    int read = 0;
+    for (int i = 0; i < count; i++)
+    {
+        for each (VideoFrame^ frame in segments[i]->Frames)
+        {
+            m_Cache->Add(frame);
+            m_TimestampInfo.CurrentTimestamp = frame->Timestamp;
+            read++;
+        }
+    }
+
+    if (m_Verbose)
+        log->DebugFormat("Parallel caching: {0} frames in {1} ms.", read, stopwatch->ElapsedMilliseconds);
+
+    _success = true;
+    if (read < _total - 1)
+    {
+        log->ErrorFormat("Caching section: could only read {0} out of {1} frames.", read, _total);
+        _success = read >= (_total - 1) * 0.95;
+    }
+
+    return true;
+}
+void VideoReaderFFMpeg::DecodeSegment(Object^ _segment)
+{
+    // Decode one segment of the video in its own demuxer and decoder instances.
+    // The main decoder is not touched so the regular code path can keep using it.
+    CacheSegment^ segment = (CacheSegment^)_segment;
+    ThreadCanceler^ canceler = segment->Canceler;
+
+    AVFormatContext* pFormatCtx = nullptr;
+    AVCodecContext* pCodecCtx = nullptr;
+    AVFrame* pDecodingAVFrame = nullptr;
+    ConversionEngine^ engine = gcnew ConversionEngine(DecodingQuality);
+    PacketCache^ packets = AcquirePacketCache();
+
+    do
+    {
+        // When filling the cache each segment decodes on a single thread, the parallelism is across segments.
+        if (!OpenDecoderInstance(&pFormatCtx, &pCodecCtx, segment->DecodingThreads))
+            break;
+
+        // Start from the packet cache if the keyframe is in it, the demuxer is left alone in that case.
+        int cursor = packets != nullptr ? packets->Seek(segment->SeekTimestamp) : -1;
+        if (cursor < 0 && avformat_seek_file(pFormatCtx, m_iVideoStream, INT64_MIN, segment->SeekTimestamp, segment->SeekTimestamp, AVSEEK_FLAG_BACKWARD) < 0)
+            break;
+
+        pDecodingAVFrame = av_frame_alloc();
+        if (pDecodingAVFrame == nullptr)
+            break;
+
+        bool draining = false;
+        bool done = false;
+        bool failed = false;
+        while (!done && !failed && !canceler->CancellationPending)
+        {
+            AVPacket packet;
+            if (draining || ReadPacket(pFormatCtx, packets, cursor, &packet) < 0)
+            {
+                av_init_packet(&packet);
+                packet.data = nullptr;
+                packet.size = 0;
+                packet.stream_index = m_iVideoStream;
+                draining = true;
+            }
+
+            if (packet.stream_index != m_iVideoStream)
+            {
+                av_free_packet(&packet);
+                continue;
+            }
+
+            int gotPicture = 0;
+            avcodec_decode_video2(pCodecCtx, pDecodingAVFrame, &gotPicture, &packet);
+            av_free_packet(&packet);
+
+            if (gotPicture == 0)
+            {
+                done = draining;
+                continue;
+            }
+
+            // Frames come out in presentation order.
+            int64_t timestamp = pDecodingAVFrame->best_effort_timestamp - m_timestampOffset;
+            if (timestamp < segment->Start)
+                continue;
+
+            if (timestamp >= segment->End)
+            {
+                done = true;
+                continue;
+            }
+
+            AVPixelFormat outputFormat = segment->Planar ? pCodecCtx->pix_fmt : m_PixelFormatFFmpeg;
+            int headerSize = segment->Planar ? PlanarHeaderSize : 0;
+            uint8_t* pBuffer = m_FramePool->Acquire(headerSize + avpicture_get_size(outputFormat, m_DecodingSize.Width, m_DecodingSize.Height));
+            AVFrame* pFinalAVFrame = av_frame_alloc();
+            if (pBuffer == nullptr || pFinalAVFrame == nullptr)
+            {
+                m_FramePool->Release(pBuffer);
+                av_free(pFinalAVFrame);
+                failed = true;
+                continue;
+            }
+
+            avpicture_fill((AVPicture*)pFinalAVFrame, pBuffer + headerSize, outputFormat, m_DecodingSize.Width, m_DecodingSize.Height);
+
+            try
+            {
+                if (!RescaleAndConvert(engine, pFinalAVFrame, pDecodingAVFrame, m_DecodingSize.Width, m_DecodingSize.Height, outputFormat, Options->Deinterlace))
+                    throw gcnew InvalidOperationException("Image not converted.");
+
+                if (segment->Planar)
+                    segment->Frames->Add(CreatePlanarVideoFrame(pBuffer, outputFormat, timestamp));
+                else
+                    segment->Frames->Add(CreateVideoFrame(pFinalAVFrame, pBuffer, timestamp));
+                Interlocked::Increment(m_ParallelFramesRead);
+            }
+            catch (Exception^ exp)
+            {
+                m_FramePool->Release(pBuffer);
+                log->Error("Error while converting AVFrame to Bitmap.");
+                log->Error(exp);
+                failed = true;
+            }
+
+            av_free(pFinalAVFrame);
+        }
+
+        segment->Success = done && !failed;
+    }
+    while (false);
+
+    if (!segment->Success && !canceler->CancellationPending)
+        log->ErrorFormat("Segment {0} [{1}, {2}[ could not be decoded.", segment->Index, segment->Start, segment->End);
+
+    if (m_Verbose)
+        engine->DumpStats(Thread::CurrentThread->Name);
+
+    delete engine;
+
+    if (pDecodingAVFrame != nullptr)
+        av_free(pDecodingAVFrame);
+
+    if (packets != nullptr)
+        packets->Release();
+
+    CloseDecoderInstance(&pFormatCtx, &pCodecCtx);
+}
 void VideoReaderFFMpeg::BeforeFrameEnumeration()
 {
     // Frames are about to be enumerated (for example for saving).
@@ -775,6 +1251,11 @@ void VideoReaderFFMpeg::StartPreBuffering()
     if (m_Verbose)
         log->Debug("Starting prebuffering thread.");
 
+    // The decoding size may have changed since the last run, so the memory ceiling may have too.
+    m_PreBufferPolicy->MaxDepth = GetPreBufferCapacity();
+    m_PreBufferPolicy->BudgetMilliseconds = m_VideoInfo.FrameIntervalMilliseconds;
+    m_PreBuffer->Capacity = m_PreBufferPolicy->Depth;
+
     ParameterizedThreadStart^ pts = gcnew ParameterizedThreadStart(this, &VideoReaderFFMpeg::PreBufferingWorker);
     m_PreBufferingThreadCanceler->Reset();
     m_PreBufferingThread = gcnew Thread(pts);
@@ -801,52 +1282,726 @@ void VideoReaderFFMpeg::StopPreBuffering()
 
     m_PreBufferingThread->Join();
 }
-OpenVideoResult VideoReaderFFMpeg::Load(String^ _filePath, bool _forSummary)
+bool VideoReaderFFMpeg::IsReverseStep(int64_t _from, int64_t _target)
 {
-    OpenVideoResult result = OpenVideoResult::Success;
+    // Short backward moves are served by decoding the video backward by chunks.
+    // This requires the packet index to know where to start decoding each chunk.
+    if (m_PacketIndex == nullptr || _target >= _from || _target < m_WorkingZone.Start)
+        return false;
 
-    if (m_bIsLoaded)
-        Close();
+    return _from - _target <= MaxStepFrames * m_VideoInfo.AverageTimeStampsPerFrame;
+}
+bool VideoReaderFFMpeg::IsScrubJump(int64_t _from, int64_t _target)
+{
+    // Jumps are served by the scrubbing buffer, short forward moves during playback stay on the prebuffer.
+    // Like reverse playback this requires the packet index.
+    if (m_PacketIndex == nullptr || m_PreBuffer->IsRolloverJump(_target))
+        return false;
 
-    m_VideoInfo.FilePath = _filePath;
-    if (Options == nullptr)
-        Options = Options->Default;
+    return m_Scrubbing || Math::Abs(_target - _from) > MaxStepFrames * m_VideoInfo.AverageTimeStampsPerFrame;
+}
+bool VideoReaderFFMpeg::MoveBackward(int64_t _target)
+{
+    if (!m_Reversing)
+        StartReversePlayback();
 
-    do
+    bool pending = false;
     {
-        // Open file and get info on format (muxer).
-        AVFormatContext* pFormatCtx = nullptr;
+        lock l(m_ReverseLocker);
+        pending = m_ReverseBuffer->Contains(_target) || m_ReverseChunk.Contains(_target);
+    }
 
-        // Libav expects the filename in the computer default codepage.
-        String^ encFilePath = System::Text::Encoding::Default->GetString(System::Text::Encoding::UTF8->GetBytes(_filePath));
-        char* pszFilePath = static_cast<char*>(Marshal::StringToHGlobalAnsi(encFilePath).ToPointer());
-        if (avformat_open_input(&pFormatCtx, pszFilePath, NULL, NULL) != 0)
+    if (!pending)
+    {
+        // Neither in the buffer nor in the chunk being decoded, restart the backward decoding from the target.
+        if (m_Verbose)
+            log->DebugFormat("MoveBackward. Target:{0}. Out of reverse buffer:{1}. Restarting backward decoding.", _target, m_ReverseBuffer->Segment);
+
+        StopReverseDecoding();
+        m_ReverseBuffer->Clear();
+        StartReverseDecoding(_target + 1);
+    }
+
+    // This only blocks on the first step back or if the decoding can't keep up with the playback.
+    while (!m_ReverseBuffer->WaitFor(_target, ProgressInterval))
+    {
+        if (!m_ReverseDecodingThread->IsAlive && !m_ReverseBuffer->Contains(_target))
         {
-            result = OpenVideoResult::FileNotOpenned;
-            log->ErrorFormat("The file {0} could not be openned. (Wrong path or not a video/image.)", _filePath);
-            break;
+            log->ErrorFormat("Reverse playback: frame at {0} could not be decoded.", _target);
+            return false;
         }
-        Marshal::FreeHGlobal(safe_cast<IntPtr>(pszFilePath));
+    }
 
-        // Info on streams.
-        if (avformat_find_stream_info(pFormatCtx, nullptr) < 0)
+    return m_ReverseBuffer->MoveTo(_target);
+}
+void VideoReaderFFMpeg::StartReversePlayback()
+{
+    // The backward decoding thread replaces the prebuffering thread until we go forward again.
+    ReturnToPreBuffering(false);
+    StopPreBuffering();
+    m_PreBuffer->Clear();
+
+    // Two chunks must fit in the budget so the next one can be decoded while the current one is played.
+    // Make room for two whole GOPs if the memory budget allows it, so each GOP is decoded only once.
+    m_ReverseBuffer->Clear();
+    int gopFrames = m_PacketIndex != nullptr ? 2 * m_PacketIndex->LongestGop + MaxReverseNewFrames : 0;
+    m_ReverseBuffer->Capacity = GetSpeculativeCapacity(Math::Max(MaxReverseFrames, gopFrames));
+    m_FramesContainer = m_ReverseBuffer;
+    m_Reversing = true;
+
+    if (m_Verbose)
+        log->DebugFormat("Starting reverse playback. Capacity:{0} frames, chunks of {1} frames.", m_ReverseBuffer->Capacity, m_ReverseBuffer->ChunkCapacity);
+}
+void VideoReaderFFMpeg::StartReverseDecoding(int64_t _end)
+{
+    ParameterizedThreadStart^ pts = gcnew ParameterizedThreadStart(this, &VideoReaderFFMpeg::ReverseDecodingWorker);
+    m_ReverseDecodingCanceler->Reset();
+    m_ReverseDecodingThread = gcnew Thread(pts);
+    m_ReverseDecodingThread->Name = "ReverseDecoding";
+    m_ReverseDecodingThread->IsBackground = true;
+    m_ReverseDecodingThread->Start(_end);
+}
+void VideoReaderFFMpeg::StopReverseDecoding()
+{
+    if (m_ReverseDecodingThread == nullptr || !m_ReverseDecodingThread->IsAlive)
+        return;
+
+    // The thread may be waiting for room in the buffer or decoding a chunk, both check the canceler.
+    m_ReverseDecodingCanceler->Cancel();
+    m_ReverseBuffer->Unblock();
+    m_ReverseDecodingThread->Join();
+}
+void VideoReaderFFMpeg::ReverseDecodingWorker(Object^ _end)
+{
+    // Decode the video backward by chunks, from _end (exclusive) down to the start of the working zone.
+    // Each chunk is decoded forward from the keyframe before it and ends where the previous chunk started.
+    // A chunk is the whole GOP tail before the previous chunk whenever it fits. Only GOPs too long for the
+    // memory budget are split in several chunks, each one decoded from the same keyframe but only keeping its own frames.
+    PacketIndex^ index = m_PacketIndex;
+    int64_t chunkEnd = safe_cast<int64_t>(_end);
+    int chunkFrames = m_ReverseBuffer->ChunkCapacity;
+    int decodingThreads = Math::Max(Options->DecodingThreads, 0);
+
+    while (!m_ReverseDecodingCanceler->CancellationPending && chunkEnd > m_WorkingZone.Start)
+    {
+        int keyframe = Math::Max(index->FindKeyframe(chunkEnd - 1 + m_timestampOffset), 0);
+        int64_t gopStart = index->GetKeyframePts(keyframe) - m_timestampOffset;
+        int64_t tailStart = Math::Max(gopStart, (int64_t)m_WorkingZone.Start);
+        int tailFrames = index->CountFrames(tailStart + m_timestampOffset, chunkEnd + m_timestampOffset);
+
+        int64_t chunkStart = tailStart;
+        if (tailFrames > chunkFrames)
         {
-            result = OpenVideoResult::StreamInfoNotFound;
-            log->Error("The streams Infos were not Found.");
+            chunkStart = Math::Max(tailStart, chunkEnd - chunkFrames * m_VideoInfo.AverageTimeStampsPerFrame);
+            tailFrames = chunkFrames;
+        }
+
+        if (!m_ReverseBuffer->WaitForRoom(Math::Max(tailFrames, 1), m_ReverseDecodingCanceler))
             break;
+
+        CacheSegment^ segment = gcnew CacheSegment(0, chunkStart, chunkEnd, index->GetKeyframeDts(keyframe));
+        segment->DecodingThreads = decodingThreads;
+        segment->Canceler = m_ReverseDecodingCanceler;
+
+        {
+            lock l(m_ReverseLocker);
+            m_ReverseChunk = VideoSection(chunkStart, chunkEnd - 1);
         }
 
-        // Check for muxed KVA.
-        m_iMetadataStream = GetStreamIndex(pFormatCtx, AVMEDIA_TYPE_SUBTITLE);
-        if (m_iMetadataStream >= 0)
+        DecodeSegment(segment);
+
+        bool added = segment->Success && segment->Frames->Count > 0;
+        int64_t oldest = added ? segment->Frames[0]->Timestamp : -1;
         {
-            AVDictionaryEntry* pMetadataTag = av_dict_get(pFormatCtx->streams[m_iMetadataStream]->metadata, "language", nullptr, 0);
+            lock l(m_ReverseLocker);
+            if (added)
+                m_ReverseBuffer->AddRange(segment->Frames, chunkEnd);
 
-            if (pFormatCtx->streams[m_iMetadataStream]->codec->codec_id == CODEC_ID_TEXT &&
-                pMetadataTag != nullptr &&
-                strcmp((char*)pMetadataTag->value, "XML") == 0)
-            {
-                m_VideoInfo.HasKva = true;
+            m_ReverseChunk = VideoSection::MakeEmpty();
+        }
+
+        if (!added)
+        {
+            for each (VideoFrame^ frame in segment->Frames)
+                DisposeFrame(frame);
+
+            break;
+        }
+
+        chunkEnd = oldest;
+    }
+
+    // Wake up the UI thread in case it was waiting for a chunk that won't come.
+    m_ReverseBuffer->Unblock();
+}
+bool VideoReaderFFMpeg::MoveScrub(int64_t _target)
+{
+    // Jump while scrubbing. Frames around the predicted playhead are decoded ahead of time by the prefetching thread,
+    // misses are decoded synchronously with the main decoder.
+    if (!m_Scrubbing)
+        StartScrubbing();
+
+    m_ScrubPolicy->Record(_target);
+    m_ScrubWakeUp->Set();
+
+    if (m_ScrubBuffer->TryMoveTo(_target))
+        return true;
+
+    ReadResult res = ReadFrame(_target, 1, false);
+    if (res != ReadResult::Success)
+        return false;
+
+    // The actual timestamp we land on might not be the one requested, due to pixel to timestamp interpolation.
+    return m_ScrubBuffer->MoveTo(m_TimestampInfo.CurrentTimestamp);
+}
+void VideoReaderFFMpeg::StartScrubbing()
+{
+    // The prefetching thread replaces the prebuffering thread until we go forward again.
+    ReturnToPreBuffering(false);
+    StopPreBuffering();
+    m_PreBuffer->Clear();
+
+    m_ScrubBuffer->Clear();
+    m_ScrubBuffer->Capacity = GetSpeculativeCapacity(MaxScrubFrames);
+    m_ScrubPolicy->Reset();
+    m_FramesContainer = m_ScrubBuffer;
+    m_Scrubbing = true;
+
+    if (m_Verbose)
+        log->DebugFormat("Starting scrubbing. Capacity:{0} frames.", m_ScrubBuffer->Capacity);
+
+    m_ScrubPrefetchCanceler->Reset();
+    m_ScrubPrefetchThread = gcnew Thread(gcnew ThreadStart(this, &VideoReaderFFMpeg::ScrubPrefetchWorker));
+    m_ScrubPrefetchThread->Name = "ScrubPrefetch";
+    m_ScrubPrefetchThread->IsBackground = true;
+    m_ScrubPrefetchThread->Priority = ThreadPriority::BelowNormal;
+    m_ScrubPrefetchThread->Start();
+}
+void VideoReaderFFMpeg::StopScrubPrefetch()
+{
+    if (m_ScrubPrefetchThread == nullptr || !m_ScrubPrefetchThread->IsAlive)
+        return;
+
+    m_ScrubPrefetchCanceler->Cancel();
+    m_ScrubWakeUp->Set();
+    m_ScrubPrefetchThread->Join();
+}
+void VideoReaderFFMpeg::ScrubPrefetchWorker()
+{
+    // Decode the frames around the predicted playhead, replanning each time a new target comes in.
+    // Uses its own demuxer and decoder so the UI thread can keep using the main ones for misses.
+    AVFormatContext* pFormatCtx = nullptr;
+    AVCodecContext* pCodecCtx = nullptr;
+    if (!OpenDecoderInstance(&pFormatCtx, &pCodecCtx, Math::Max(Options->DecodingThreads, 0)))
+    {
+        log->Error("Scrub prefetching: the video could not be opened.");
+        CloseDecoderInstance(&pFormatCtx, &pCodecCtx);
+        return;
+    }
+
+    AVFrame* pDecodingAVFrame = av_frame_alloc();
+    ConversionEngine^ engine = gcnew ConversionEngine(DecodingQuality);
+    PacketIndex^ index = m_PacketIndex;
+    int windowFrames = Math::Max(m_ScrubBuffer->Capacity * 3 / 4, 1);
+    int generation = -1;
+
+    while (pDecodingAVFrame != nullptr && !m_ScrubPrefetchCanceler->CancellationPending)
+    {
+        if (m_ScrubPolicy->Generation == generation)
+        {
+            m_ScrubWakeUp->WaitOne(ProgressInterval);
+            continue;
+        }
+
+        generation = m_ScrubPolicy->Generation;
+        VideoSection window = m_ScrubPolicy->GetWindow(windowFrames, m_VideoInfo.AverageTimeStampsPerFrame, m_WorkingZone);
+        int64_t predicted = m_ScrubPolicy->Predict(m_WorkingZone);
+        if (window.IsEmpty || predicted < 0)
+            continue;
+
+        // Visit the GOPs of the window starting with the one of the predicted playhead,
+        // then alternate on both sides, beginning in the direction of motion.
+        // Replan after each GOP if the target has changed in the meantime.
+        int first = Math::Max(index->FindKeyframe(window.Start + m_timestampOffset), 0);
+        int last = Math::Max(index->FindKeyframe(window.End + m_timestampOffset), 0);
+        int center = Math::Min(Math::Max(index->FindKeyframe(predicted + m_timestampOffset), first), last);
+        int direction = m_ScrubPolicy->Velocity < 0 ? -1 : 1;
+
+        for (int i = 0; i <= 2 * (last - first); i++)
+        {
+            if (m_ScrubPrefetchCanceler->CancellationPending || m_ScrubPolicy->Generation != generation)
+                break;
+
+            int distance = (i + 1) / 2;
+            int keyframe = (i % 2 == 1) ? center + direction * distance : center - direction * distance;
+            if (keyframe < first || keyframe > last)
+                continue;
+
+            int64_t gopStart = index->GetKeyframePts(keyframe) - m_timestampOffset;
+            int64_t gopEnd = keyframe + 1 < index->KeyframeCount ? index->GetKeyframePts(keyframe + 1) - m_timestampOffset - 1 : window.End;
+            VideoSection range(Math::Max(gopStart, (int64_t)window.Start), Math::Min(gopEnd, (int64_t)window.End));
+            if (range.End < range.Start || (m_ScrubBuffer->Covers(range.Start) && m_ScrubBuffer->Covers(range.End)))
+                continue;
+
+            DecodeScrubRange(pFormatCtx, pCodecCtx, pDecodingAVFrame, engine, index->GetKeyframeDts(keyframe), range, windowFrames);
+        }
+    }
+
+    if (m_Verbose)
+        engine->DumpStats("ScrubPrefetch");
+
+    delete engine;
+
+    if (pDecodingAVFrame != nullptr)
+        av_free(pDecodingAVFrame);
+
+    CloseDecoderInstance(&pFormatCtx, &pCodecCtx);
+}
+void VideoReaderFFMpeg::DecodeScrubRange(AVFormatContext* _pFormatCtx, AVCodecContext* _pCodecCtx, AVFrame* _pDecodingAVFrame, ConversionEngine^ _engine, int64_t _seekTimestamp, VideoSection _range, int _windowFrames)
+{
+    // Decode the frames of one GOP falling in the range, starting at its keyframe.
+    // Frames decoded in sequence are linked in the buffer so in-between timestamps resolve to them.
+    PacketCache^ packets = AcquirePacketCache();
+    int cursor = packets != nullptr ? packets->Seek(_seekTimestamp) : -1;
+    if (cursor < 0 && avformat_seek_file(_pFormatCtx, m_iVideoStream, INT64_MIN, _seekTimestamp, _seekTimestamp, AVSEEK_FLAG_BACKWARD) < 0)
+    {
+        if (packets != nullptr)
+            packets->Release();
+
+        return;
+    }
+
+    avcodec_flush_buffers(_pCodecCtx);
+
+    int generation = m_ScrubPolicy->Generation;
+    int64_t previous = -1;
+    bool draining = false;
+    bool done = false;
+    while (!done && !m_ScrubPrefetchCanceler->CancellationPending)
+    {
+        AVPacket packet;
+        if (draining || ReadPacket(_pFormatCtx, packets, cursor, &packet) < 0)
+        {
+            av_init_packet(&packet);
+            packet.data = nullptr;
+            packet.size = 0;
+            packet.stream_index = m_iVideoStream;
+            draining = true;
+        }
+
+        if (packet.stream_index != m_iVideoStream)
+        {
+            av_free_packet(&packet);
+            continue;
+        }
+
+        int gotPicture = 0;
+        avcodec_decode_video2(_pCodecCtx, _pDecodingAVFrame, &gotPicture, &packet);
+        av_free_packet(&packet);
+
+        if (gotPicture == 0)
+        {
+            done = draining;
+            continue;
+        }
+
+        int64_t timestamp = _pDecodingAVFrame->best_effort_timestamp - m_timestampOffset;
+        if (timestamp > _range.End)
+        {
+            // No frame between the last one of the range and this one.
+            if (previous >= 0)
+                m_ScrubBuffer->Link(previous, timestamp);
+
+            done = true;
+            continue;
+        }
+
+        if (timestamp < _range.Start)
+            continue;
+
+        if (m_ScrubPolicy->Generation != generation)
+        {
+            // The user has moved, finish the GOP only if it's still useful.
+            generation = m_ScrubPolicy->Generation;
+            VideoSection window = m_ScrubPolicy->GetWindow(_windowFrames, m_VideoInfo.AverageTimeStampsPerFrame, m_WorkingZone);
+            if (!window.Contains(timestamp))
+                break;
+        }
+
+        if (!m_ScrubBuffer->Contains(timestamp))
+        {
+            uint8_t* pBuffer = m_FramePool->Acquire(avpicture_get_size(m_PixelFormatFFmpeg, m_DecodingSize.Width, m_DecodingSize.Height));
+            AVFrame* pFinalAVFrame = av_frame_alloc();
+            if (pBuffer == nullptr || pFinalAVFrame == nullptr)
+            {
+                m_FramePool->Release(pBuffer);
+                av_free(pFinalAVFrame);
+                break;
+            }
+
+            avpicture_fill((AVPicture*)pFinalAVFrame, pBuffer, m_PixelFormatFFmpeg, m_DecodingSize.Width, m_DecodingSize.Height);
+
+            bool added = false;
+            try
+            {
+                if (RescaleAndConvert(_engine, pFinalAVFrame, _pDecodingAVFrame, m_DecodingSize.Width, m_DecodingSize.Height, m_PixelFormatFFmpeg, Options->Deinterlace))
+                {
+                    m_ScrubBuffer->AddSpeculative(CreateVideoFrame(pFinalAVFrame, pBuffer, timestamp));
+                    added = true;
+                }
+            }
+            catch (Exception^ exp)
+            {
+                log->Error("Error while converting AVFrame to Bitmap.");
+                log->Error(exp);
+            }
+
+            av_free(pFinalAVFrame);
+
+            if (!added)
+            {
+                m_FramePool->Release(pBuffer);
+                break;
+            }
+        }
+
+        if (previous >= 0)
+            m_ScrubBuffer->Link(previous, timestamp);
+
+        previous = timestamp;
+    }
+
+    if (packets != nullptr)
+        packets->Release();
+}
+int VideoReaderFFMpeg::GetPreBufferCapacity()
+{
+    // Number of frames at the current decoding size that fit in the share of memory given to the prebuffer.
+    // The rest of the memory buffer is left for the cache and the speculative buffers.
+    int64_t frameBytes = Math::Max(avpicture_get_size(m_PixelFormatFFmpeg, m_DecodingSize.Width, m_DecodingSize.Height), 1);
+    int64_t budget = (int64_t)MemoryHelper::MaxMemoryBuffer() / 8 * 1024 * 1024;
+    return (int)Math::Min(budget / frameBytes, (int64_t)PreBuffer::MaxCapacity);
+}
+int VideoReaderFFMpeg::GetSpeculativeCapacity(int _maxFrames)
+{
+    // Number of frames at the current decoding size that fit in the memory budget of the speculative buffers.
+    int64_t frameBytes = Math::Max(avpicture_get_size(m_PixelFormatFFmpeg, m_DecodingSize.Width, m_DecodingSize.Height), 1);
+    int64_t budget = (int64_t)(Software::Is32bit ? 128 : 512) * 1024 * 1024;
+    return (int)Math::Min(budget / frameBytes, (int64_t)_maxFrames);
+}
+void VideoReaderFFMpeg::ReturnToPreBuffering(bool _resume)
+{
+    // Leave reverse playback or scrubbing and go back to regular prebuffering.
+    // When resuming, the current frame is moved to the prebuffer and the prebuffering thread restarts from there.
+    if (!m_Reversing && !m_Scrubbing)
+        return;
+
+    if (m_Verbose)
+        log->DebugFormat("Returning to prebuffering from {0}.", m_Reversing ? "reverse playback" : "scrubbing");
+
+    StopReverseDecoding();
+    StopScrubPrefetch();
+
+    if (m_Scrubbing && m_Verbose)
+        log->DebugFormat("Scrub prefetching. {0}.", m_ScrubBuffer->Statistics);
+
+    int64_t currentTimestamp = m_FramesContainer->CurrentFrame != nullptr ? m_FramesContainer->CurrentFrame->Timestamp : -1;
+
+    // If the main decoder has just produced the current frame it is already at the right place.
+    VideoFrame^ current = nullptr;
+    if (_resume && m_Scrubbing && currentTimestamp >= 0 && currentTimestamp == m_LastDecodedTimestamp)
+        current = m_ScrubBuffer->Take(currentTimestamp);
+
+    m_Reversing = false;
+    m_Scrubbing = false;
+    m_FramesContainer = m_PreBuffer;
+
+    if (_resume)
+    {
+        if (current != nullptr)
+        {
+            m_PreBuffer->Add(current);
+            m_PreBuffer->MoveTo(currentTimestamp);
+        }
+        else if (currentTimestamp >= 0)
+        {
+            ReadResult res = ReadFrame(currentTimestamp, 1, false);
+            if (res == ReadResult::Success)
+                m_PreBuffer->MoveTo(m_TimestampInfo.CurrentTimestamp);
+        }
+
+        StartPreBuffering();
+    }
+
+    m_ReverseBuffer->Clear();
+    m_ScrubBuffer->Clear();
+}
+bool VideoReaderFFMpeg::OpenDecoderInstance(AVFormatContext** _ppFormatCtx, AVCodecContext** _ppCodecCtx, int _threads)
+{
+    // Open a demuxer and a decoder on the video, independent from the main ones.
+    // On failure the caller must still call CloseDecoderInstance.
+    String^ encFilePath = System::Text::Encoding::Default->GetString(System::Text::Encoding::UTF8->GetBytes(m_VideoInfo.FilePath));
+    char* pszFilePath = static_cast<char*>(Marshal::StringToHGlobalAnsi(encFilePath).ToPointer());
+    int res = avformat_open_input(_ppFormatCtx, pszFilePath, nullptr, nullptr);
+    Marshal::FreeHGlobal(safe_cast<IntPtr>(pszFilePath));
+    if (res != 0 || avformat_find_stream_info(*_ppFormatCtx, nullptr) < 0)
+        return false;
+
+    AVCodecContext* pStreamCodecCtx = (*_ppFormatCtx)->streams[m_iVideoStream]->codec;
+    AVCodec* pCodec = avcodec_find_decoder(pStreamCodecCtx->codec_id);
+    pStreamCodecCtx->thread_count = _threads;
+    pStreamCodecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    pStreamCodecCtx->lowres = m_Lowres;
+    if (pCodec == nullptr || avcodec_open2(pStreamCodecCtx, pCodec, nullptr) < 0)
+        return false;
+
+    *_ppCodecCtx = pStreamCodecCtx;
+    return true;
+}
+void VideoReaderFFMpeg::CloseDecoderInstance(AVFormatContext** _ppFormatCtx, AVCodecContext** _ppCodecCtx)
+{
+    if (*_ppCodecCtx != nullptr)
+    {
+        avcodec_close(*_ppCodecCtx);
+        *_ppCodecCtx = nullptr;
+    }
+
+    if (*_ppFormatCtx != nullptr)
+        avformat_close_input(_ppFormatCtx);
+}
+void VideoReaderFFMpeg::StartPacketIndexing(String^ _filePath)
+{
+    // Build the packet index in the background, on a separate demuxer.
+    // The index is only used for seeking once it's complete, the duration and frame count are not updated.
+    ParameterizedThreadStart^ pts = gcnew ParameterizedThreadStart(this, &VideoReaderFFMpeg::PacketIndexingWorker);
+    m_PacketIndexThreadCanceler->Reset();
+    m_PacketIndexThread = gcnew Thread(pts);
+    m_PacketIndexThread->IsBackground = true;
+    m_PacketIndexThread->Priority = ThreadPriority::BelowNormal;
+    m_PacketIndexThread->Start(_filePath);
+}
+void VideoReaderFFMpeg::StopPacketIndexing()
+{
+    if (m_PacketIndexThread == nullptr || !m_PacketIndexThread->IsAlive)
+        return;
+
+    m_PacketIndexThreadCanceler->Cancel();
+    m_PacketIndexThread->Join();
+}
+void VideoReaderFFMpeg::PacketIndexingWorker(Object^ _filePath)
+{
+    Thread::CurrentThread->Name = "PacketIndexing";
+    String^ filePath = (String^)_filePath;
+
+    PacketIndex^ index = PacketIndex::Build(filePath, m_iVideoStream, m_iMetadataStream, m_PacketIndexThreadCanceler);
+    if (index == nullptr || m_PacketIndexThreadCanceler->CancellationPending)
+        return;
+
+    index->Save(filePath);
+
+    lock l(m_Locker);
+    if (m_bIsLoaded && m_VideoInfo.FilePath == filePath)
+        m_PacketIndex = index;
+}
+int VideoReaderFFMpeg::ReadPacket(AVFormatContext* _pFormatCtx, PacketCache^ _packets, int% _cursor, AVPacket* _packet)
+{
+    // Read the next packet from the packet cache when the cursor is in it, from the demuxer otherwise.
+    if (_packets == nullptr || _cursor < 0)
+        return av_read_frame(_pFormatCtx, _packet);
+
+    if (_packets->Read(_cursor, _packet))
+        return 0;
+
+    // The cache ends a bit after the working zone, not at the end of the file.
+    // Continue from the demuxer right after the last cached packet so the caller sees the same stream as without the cache.
+    // The demuxer was left alone while reading from the cache, it must be repositioned first.
+    _cursor = -1;
+    int64_t lastDts = _packets->LastDts;
+    if (lastDts == AV_NOPTS_VALUE || avformat_seek_file(_pFormatCtx, m_iVideoStream, INT64_MIN, lastDts, lastDts, AVSEEK_FLAG_BACKWARD) < 0)
+        return AVERROR_EOF;
+
+    while (true)
+    {
+        int result = av_read_frame(_pFormatCtx, _packet);
+        if (result < 0)
+            return result;
+
+        if (_packet->stream_index == m_iVideoStream && _packet->dts != AV_NOPTS_VALUE && _packet->dts > lastDts)
+            return 0;
+
+        av_free_packet(_packet);
+    }
+}
+void VideoReaderFFMpeg::UpdatePacketCache(int _maxMemory)
+{
+    // The decoded frames of the working zone don't fit in memory, try to keep its compressed packets instead.
+    // Jumps, scrubbing and reverse playback then decode from memory rather than going back to the disk.
+    // This needs the packet index to find the keyframes, the cache is not started if it's still being built.
+    if (m_DecodingMode != VideoDecodingMode::PreBuffering || m_PacketIndex == nullptr || m_WorkingZone.IsEmpty)
+    {
+        ClearPacketCache();
+        return;
+    }
+
+    // Reducing the working zone keeps the current cache.
+    PacketCache^ packets = m_PacketCache;
+    if (packets != nullptr && packets->Zone.Contains(m_WorkingZone.Start) && packets->Zone.Contains(m_WorkingZone.End))
+        return;
+
+    ClearPacketCache();
+    m_PacketCacheBudget = (int64_t)_maxMemory * 1024 * 1024;
+    StartPacketCaching(m_WorkingZone);
+}
+void VideoReaderFFMpeg::StartPacketCaching(VideoSection _zone)
+{
+    ParameterizedThreadStart^ pts = gcnew ParameterizedThreadStart(this, &VideoReaderFFMpeg::PacketCachingWorker);
+    m_PacketCacheCanceler->Reset();
+    m_PacketCacheThread = gcnew Thread(pts);
+    m_PacketCacheThread->IsBackground = true;
+    m_PacketCacheThread->Priority = ThreadPriority::BelowNormal;
+    m_PacketCacheThread->Start(_zone);
+}
+void VideoReaderFFMpeg::StopPacketCaching()
+{
+    if (m_PacketCacheThread == nullptr || !m_PacketCacheThread->IsAlive)
+        return;
+
+    m_PacketCacheCanceler->Cancel();
+    m_PacketCacheThread->Join();
+}
+void VideoReaderFFMpeg::ClearPacketCache()
+{
+    // Give up the reader's reference. Decoding loops still reading the cache hold their own,
+    // the memory is freed when the last of them is done.
+    StopPacketCaching();
+    PacketCache^ packets = m_PacketCache;
+    m_PacketCache = nullptr;
+    if (packets != nullptr)
+        packets->Release();
+}
+PacketCache^ VideoReaderFFMpeg::AcquirePacketCache()
+{
+    // Reference to the current packet cache for a decoding loop, to be released when done.
+    PacketCache^ packets = m_PacketCache;
+    return packets != nullptr && packets->TryAcquire() ? packets : nullptr;
+}
+void VideoReaderFFMpeg::ReleaseActivePacketCache()
+{
+    // The main decoder keeps its reference from the seek into the cache until the next seek.
+    PacketCache^ packets = m_ActivePacketCache;
+    m_ActivePacketCache = nullptr;
+    m_PacketCursor = -1;
+    if (packets != nullptr)
+        packets->Release();
+}
+void VideoReaderFFMpeg::PacketCachingWorker(Object^ _zone)
+{
+    Thread::CurrentThread->Name = "PacketCaching";
+    VideoSection zone = safe_cast<VideoSection>(_zone);
+    PacketIndex^ index = m_PacketIndex;
+
+    int keyframe = Math::Max(index->FindKeyframe(zone.Start + m_timestampOffset), 0);
+    int64_t startDts = index->GetKeyframeDts(keyframe);
+    int64_t endPts = zone.End + m_timestampOffset;
+
+    // Skip zones that obviously won't fit. The byte range includes the other streams so this is an upper bound.
+    array<PacketIndexEntry>^ entries = index->Entries;
+    int64_t firstPosition = -1;
+    int64_t lastPosition = -1;
+    for (int i = 0; i < entries->Length; i++)
+    {
+        if (entries[i].Dts < startDts || entries[i].Dts > endPts || entries[i].Position < 0)
+            continue;
+
+        if (firstPosition < 0)
+            firstPosition = entries[i].Position;
+
+        lastPosition = entries[i].Position;
+    }
+
+    if (firstPosition >= 0 && lastPosition - firstPosition > m_PacketCacheBudget)
+    {
+        if (m_Verbose)
+            log->DebugFormat("Working zone packets don't fit in memory either. {0:0.0} MB.", (double)(lastPosition - firstPosition) / (1024 * 1024));
+
+        return;
+    }
+
+    PacketCache^ packets = PacketCache::Fill(m_VideoInfo.FilePath, m_iVideoStream, zone, startDts, endPts, m_PacketCacheBudget, m_PacketCacheCanceler);
+    if (packets == nullptr)
+        return;
+
+    // Nobody else has seen the cache yet, it can be freed right away if it's no longer wanted.
+    if (m_PacketCacheCanceler->CancellationPending)
+    {
+        delete packets;
+        return;
+    }
+
+    lock l(m_Locker);
+    if (m_bIsLoaded && m_WorkingZone == zone)
+        m_PacketCache = packets;
+    else
+        delete packets;
+}
+OpenVideoResult VideoReaderFFMpeg::Load(String^ _filePath, bool _forSummary)
+{
+    OpenVideoResult result = OpenVideoResult::Success;
+
+    if (m_bIsLoaded)
+        Close();
+
+    m_VideoInfo.FilePath = _filePath;
+    if (Options == nullptr)
+        Options = Options->Default;
+
+    do
+    {
+        // Open file and get info on format (muxer).
+        AVFormatContext* pFormatCtx = nullptr;
+
+        // Read-ahead: the demuxer is served from memory filled by a dedicated I/O thread, 
+        // so slow storage doesn't stall the decoding loop. Summaries only read a few packets.
+        if (!_forSummary && Options->ReadAheadMemory > 0)
+            pFormatCtx = OpenReadAhead(_filePath, Options->ReadAheadMemory);
+
+        // Libav expects the filename in the computer default codepage.
+        String^ encFilePath = System::Text::Encoding::Default->GetString(System::Text::Encoding::UTF8->GetBytes(_filePath));
+        char* pszFilePath = static_cast<char*>(Marshal::StringToHGlobalAnsi(encFilePath).ToPointer());
+        if (avformat_open_input(&pFormatCtx, pszFilePath, NULL, NULL) != 0)
+        {
+            // The demuxer context has been freed, but not the custom I/O.
+            CloseReadAhead();
+            result = OpenVideoResult::FileNotOpenned;
+            log->ErrorFormat("The file {0} could not be openned. (Wrong path or not a video/image.)", _filePath);
+            break;
+        }
+        Marshal::FreeHGlobal(safe_cast<IntPtr>(pszFilePath));
+
+        // Info on streams.
+        if (avformat_find_stream_info(pFormatCtx, nullptr) < 0)
+        {
+            result = OpenVideoResult::StreamInfoNotFound;
+            log->Error("The streams Infos were not Found.");
+            break;
+        }
+
+        // Check for KVA attached to the container, then for muxed KVA.
+        m_iMetadataAttachment = GetKvaAttachmentIndex(pFormatCtx);
+        m_iMetadataStream = m_iMetadataAttachment < 0 ? GetStreamIndex(pFormatCtx, AVMEDIA_TYPE_SUBTITLE) : -1;
+        if (m_iMetadataAttachment >= 0)
+        {
+            m_VideoInfo.HasKva = true;
+        }
+        else if (m_iMetadataStream >= 0)
+        {
+            AVDictionaryEntry* pMetadataTag = av_dict_get(pFormatCtx->streams[m_iMetadataStream]->metadata, "language", nullptr, 0);
+
+            if (pFormatCtx->streams[m_iMetadataStream]->codec->codec_id == CODEC_ID_TEXT &&
+                pMetadataTag != nullptr &&
+                strcmp((char*)pMetadataTag->value, "XML") == 0)
+            {
+                m_VideoInfo.HasKva = true;
             }
             else
             {
@@ -879,6 +2034,9 @@ OpenVideoResult VideoReaderFFMpeg::Load(String^ _filePath, bool _forSummary)
                 m_VideoInfo.ImageRotation = ImageRotation::Rotate270;
         }
 
+        // Detect raw Bayer recordings.
+        m_VideoInfo.Demosaicing = GetBayerPattern(pFormatCtx);
+
         // Codec
         AVCodec* pCodec = nullptr;
         AVCodecContext* pCodecCtx = pFormatCtx->streams[m_iVideoStream]->codec;
@@ -890,12 +2048,38 @@ OpenVideoResult VideoReaderFFMpeg::Load(String^ _filePath, bool _forSummary)
             break;
         }
 
+        // Multi-threaded decoding. Frame threading decodes several frames in parallel
+        // and adds a delay of one frame per thread between packet input and picture output.
+        // Summaries only decode a handful of isolated frames, the delay would cost more than it saves.
+        // A thread count of 0 lets libavcodec pick one based on the number of cores.
+        pCodecCtx->thread_count = _forSummary ? 1 : Math::Max(Options->DecodingThreads, 0);
+        pCodecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+        // Fast summary: non-key frames are dropped by the decoder and the other streams by the demuxer.
+        // Codecs supporting it decode directly at a fraction of the size, the thumbnails are small anyway.
+        // The size must be kept before opening the codec, lowres changes the context dimensions.
+        Size codedSize = Size(pCodecCtx->width, pCodecCtx->height);
+        if (_forSummary && m_FastSummary)
+        {
+            pCodecCtx->skip_frame = AVDISCARD_NONKEY;
+            pCodecCtx->lowres = GetLowres(pCodec, codedSize, m_SummaryMaxSize);
+
+            for (int i = 0; i < (int)pFormatCtx->nb_streams; i++)
+            {
+                if (i != m_iVideoStream)
+                    pFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+            }
+        }
+
         if (avcodec_open2(pCodecCtx, pCodec, nullptr) < 0)
         {
             result = OpenVideoResult::CodecNotOpened;
             log->Error("Codec could not be openned. (Codec known, but not supported yet.)");
             break;
         }
+
+        if (!_forSummary && m_Verbose)
+            log->DebugFormat("Decoding threads: {0}, type: {1}.", pCodecCtx->thread_count, pCodecCtx->active_thread_type == FF_THREAD_FRAME ? "frame" : pCodecCtx->active_thread_type == FF_THREAD_SLICE ? "slice" : "none");
         
         // The fundamental unit of time in Kinovea is the timebase of the file.
         // The timebase unit is the span of time (in seconds) in which the timestamps are expressed.
@@ -1014,12 +2198,27 @@ OpenVideoResult VideoReaderFFMpeg::Load(String^ _filePath, bool _forSummary)
         m_VideoInfo.FrameIntervalMilliseconds = (double)1000 / m_VideoInfo.FramesPerSeconds;
         m_VideoInfo.AverageTimeStampsPerFrame = (int64_t)Math::Round(m_VideoInfo.AverageTimeStampsPerSeconds / m_VideoInfo.FramesPerSeconds);
 
+        // Exact frame count and duration from the packet index of a previous session, if any.
+        if (!_forSummary)
+            m_PacketIndex = PacketIndex::Load(_filePath, m_iVideoStream, m_iMetadataStream);
+
+        if (m_PacketIndex != nullptr)
+        {
+            int64_t lastTimestamp = m_PacketIndex->LastPts - m_timestampOffset;
+            m_VideoInfo.FrameCount = m_PacketIndex->FrameCount;
+            m_VideoInfo.LastTimeStamp = lastTimestamp;
+            m_VideoInfo.DurationTimeStamps = lastTimestamp - m_VideoInfo.FirstTimeStamp + m_VideoInfo.AverageTimeStampsPerFrame;
+
+            if (verbose)
+                log->DebugFormat("Packet index loaded. {0} frames, {1} keyframes.", m_PacketIndex->FrameCount, m_PacketIndex->KeyframeCount);
+        }
+
         m_WorkingZone = VideoSection(
             m_VideoInfo.FirstTimeStamp,
             m_VideoInfo.FirstTimeStamp + m_VideoInfo.DurationTimeStamps - m_VideoInfo.AverageTimeStampsPerFrame);
 
         // Image size
-        m_VideoInfo.OriginalSize = Size(pCodecCtx->width, pCodecCtx->height);
+        m_VideoInfo.OriginalSize = codedSize;
 
         if (pCodecCtx->sample_aspect_ratio.num != 0 && pCodecCtx->sample_aspect_ratio.num != pCodecCtx->sample_aspect_ratio.den)
         {
@@ -1053,11 +2252,23 @@ OpenVideoResult VideoReaderFFMpeg::Load(String^ _filePath, bool _forSummary)
         }
 
         Options->ImageRotation = m_VideoInfo.ImageRotation;
+        Options->Demosaicing = m_VideoInfo.Demosaicing;
         UpdateReferenceSizes(Options->ImageAspectRatio, verbose);
         m_DecodingSize = m_VideoInfo.AspectRatioSize;
 
         m_pFormatCtx = pFormatCtx;
         m_pCodecCtx = pCodecCtx;
+        m_CodedSize = codedSize;
+        m_Lowres = pCodecCtx->lowres;
+
+        // Compact cache: keep the frames of the working zone in the decoder planar format.
+        // Only for the common 4:2:0 formats. Raw video and Bayer mosaics go through demosaicing and are left alone.
+        m_PlanarCache = !_forSummary && Options->PlanarCache &&
+            pCodecCtx->codec_id != AV_CODEC_ID_RAWVIDEO && m_VideoInfo.Demosaicing == Demosaicing::None &&
+            (pCodecCtx->pix_fmt == AV_PIX_FMT_YUV420P || pCodecCtx->pix_fmt == AV_PIX_FMT_YUVJ420P);
+
+        if (m_PlanarCache && verbose)
+            log->Debug("Working zone cache will store planar frames.");
 
         m_bIsLoaded = true;
 
@@ -1078,7 +2289,7 @@ OpenVideoResult VideoReaderFFMpeg::Load(String^ _filePath, bool _forSummary)
             m_Capabilities = VideoCapabilities::CanCache;
             m_Capabilities = m_Capabilities | VideoCapabilities::CanChangeImageRotation;
 
-            if (m_pCodecCtx->codec_id == AV_CODEC_ID_RAWVIDEO)
+            if (m_pCodecCtx->codec_id == AV_CODEC_ID_RAWVIDEO || m_VideoInfo.Demosaicing != Demosaicing::None)
                 m_Capabilities = m_Capabilities | VideoCapabilities::CanChangeDemosaicing;
 
             SwitchDecodingMode(VideoDecodingMode::Caching);
@@ -1090,17 +2301,101 @@ OpenVideoResult VideoReaderFFMpeg::Load(String^ _filePath, bool _forSummary)
             m_Capabilities = m_Capabilities | VideoCapabilities::CanChangeAspectRatio | VideoCapabilities::CanChangeImageRotation | VideoCapabilities::CanChangeDeinterlacing;
             m_Capabilities = m_Capabilities | VideoCapabilities::CanChangeWorkingZone | VideoCapabilities::CanChangeDecodingSize;
 
-            if (m_pCodecCtx->codec_id == AV_CODEC_ID_RAWVIDEO)
+            if (m_pCodecCtx->codec_id == AV_CODEC_ID_RAWVIDEO || m_VideoInfo.Demosaicing != Demosaicing::None)
                 m_Capabilities = m_Capabilities | VideoCapabilities::CanChangeDemosaicing;
 
             SwitchDecodingMode(VideoDecodingMode::OnDemand);
+
+            if (m_PacketIndex == nullptr)
+                StartPacketIndexing(_filePath);
         }
 
         result = OpenVideoResult::Success;
     } while (false);
 
+    if (result != OpenVideoResult::Success)
+        CloseReadAhead();
+
     return result;
 }
+AVFormatContext* VideoReaderFFMpeg::OpenReadAhead(String^ _filePath, int _megabytes)
+{
+    // Returns a demuxer context reading through a read-ahead stream, or nullptr to fall back to the default file protocol.
+    try
+    {
+        m_ReadAhead = gcnew ReadAheadStream(_filePath, _megabytes * 1024 * 1024);
+    }
+    catch (Exception^ e)
+    {
+        log->Error("The read-ahead stream could not be opened. Reading the file directly.", e);
+        return nullptr;
+    }
+
+    m_pIOContext = m_ReadAhead->CreateIOContext();
+    AVFormatContext* pFormatCtx = m_pIOContext != nullptr ? avformat_alloc_context() : nullptr;
+    if (pFormatCtx == nullptr)
+    {
+        log->Error("The read-ahead I/O context could not be created. Reading the file directly.");
+        CloseReadAhead();
+        return nullptr;
+    }
+
+    pFormatCtx->pb = m_pIOContext;
+    return pFormatCtx;
+}
+void VideoReaderFFMpeg::CloseReadAhead()
+{
+    // Must be called after the demuxer reading from the stream has been closed.
+    ReadAheadStream::FreeIOContext(&m_pIOContext);
+
+    if (m_ReadAhead == nullptr)
+        return;
+
+    if (m_Verbose)
+        m_ReadAhead->DumpStats();
+
+    delete m_ReadAhead;
+    m_ReadAhead = nullptr;
+}
+int VideoReaderFFMpeg::GetKvaAttachmentIndex(AVFormatContext* _pFormatCtx)
+{
+    // Returns the index of the first attachment whose file name is a KVA file, -1 if not found.
+    for (int i = 0; i < (int)_pFormatCtx->nb_streams; i++)
+    {
+        AVStream* pStream = _pFormatCtx->streams[i];
+        if (pStream->codec->codec_type != AVMEDIA_TYPE_ATTACHMENT)
+            continue;
+
+        AVDictionaryEntry* pFilenameTag = av_dict_get(pStream->metadata, "filename", nullptr, 0);
+        if (pFilenameTag == nullptr)
+            continue;
+
+        String^ filename = gcnew String(pFilenameTag->value);
+        if (filename->EndsWith(".kva", StringComparison::OrdinalIgnoreCase))
+            return i;
+    }
+
+    return -1;
+}
+Demosaicing VideoReaderFFMpeg::GetBayerPattern(AVFormatContext* _pFormatCtx)
+{
+    // Raw Bayer recordings store the sensor mosaic as a gray image and tag the pattern in the comment, see MJPEGWriter.
+    AVDictionaryEntry* pCommentTag = av_dict_get(_pFormatCtx->metadata, "comment", nullptr, 0);
+    if (pCommentTag == nullptr)
+        return Demosaicing::None;
+
+    String^ comment = gcnew String(pCommentTag->value);
+    if (comment == "Bayer RGGB")
+        return Demosaicing::RGGB;
+    else if (comment == "Bayer BGGR")
+        return Demosaicing::BGGR;
+    else if (comment == "Bayer GRBG")
+        return Demosaicing::GRBG;
+    else if (comment == "Bayer GBRG")
+        return Demosaicing::GBRG;
+
+    return Demosaicing::None;
+}
 int VideoReaderFFMpeg::GetStreamIndex(AVFormatContext* _pFormatCtx, int _iCodecType)
 {
     // Returns the best candidate stream for the specified type, -1 if not found.
@@ -1157,6 +2452,21 @@ void VideoReaderFFMpeg::UpdateReferenceSizes(Kinovea::Services::ImageAspectRatio
     if (verbose)
         log->DebugFormat("Image size: Original:{0}, AspectRatioSize:{1}, ReferenceSize:{2}.", m_VideoInfo.OriginalSize, m_VideoInfo.AspectRatioSize, m_VideoInfo.ReferenceSize);
 }
+int VideoReaderFFMpeg::GetLowres(AVCodec* _pCodec, Size _codedSize, Size _minSize)
+{
+    // Largest power of two reduction that still gives an image at least as large as the requested size.
+    // A zero height only constrains the width.
+    if (_pCodec == nullptr || _minSize.Width <= 0)
+        return 0;
+
+    int lowres = 0;
+    while (lowres < _pCodec->max_lowres &&
+        (_codedSize.Width >> (lowres + 1)) >= _minSize.Width &&
+        (_codedSize.Height >> (lowres + 1)) >= _minSize.Height)
+        lowres++;
+
+    return lowres;
+}
 Size VideoReaderFFMpeg::FixSize(Size _size, bool sideways)
 {
     // Fix unsupported width for conversion to .NET Bitmap. Must be a multiple of 4.
@@ -1180,6 +2490,7 @@ ReadResult VideoReaderFFMpeg::ReadFrame(int64_t _iTimeStampToSeekTo, int _iFrame
     //------------------------------------------------------------------------------------
 
     m_LoopWatcher->LoopStart();
+    int64_t frameStart = Stopwatch::GetTimestamp();
 
     // TODO: shouldn't need to lock. Make sure we don't synchronously ask for a frame while prebuffering.
     lock l(m_Locker);
@@ -1208,11 +2519,23 @@ ReadResult VideoReaderFFMpeg::ReadFrame(int64_t _iTimeStampToSeekTo, int _iFrame
     {
         seeking = true;
         iFramesToDecode = 1; // We'll use the target timestamp anyway.
-        int iSeekRes = SeekTo(iTargetTimeStamp);
-        if (iSeekRes < 0)
+
+        // If the target is a bit ahead of the decoder, in the same GOP, it's cheaper to just decode forward.
+        bool sameGop = m_PacketIndex != nullptr &&
+            m_LastDecodedTimestamp >= 0 &&
+            iTargetTimeStamp > m_LastDecodedTimestamp &&
+            m_PacketIndex->FindKeyframe(iTargetTimeStamp + m_timestampOffset) == m_PacketIndex->FindKeyframe(m_LastDecodedTimestamp + m_timestampOffset);
+
+        if (!sameGop)
         {
-            log->ErrorFormat("Error during seek. Error code:{0}. Seek target was:[{1}]", iSeekRes, iTargetTimeStamp);
-            seeking = false;
+            int64_t seekStart = Stopwatch::GetTimestamp();
+            int iSeekRes = SeekTo(iTargetTimeStamp);
+            m_DecodingStatistics->Lap(DecodingStage::Seek, seekStart);
+            if (iSeekRes < 0)
+            {
+                log->ErrorFormat("Error during seek. Error code:{0}. Seek target was:[{1}]", iSeekRes, iTargetTimeStamp);
+                seeking = false;
+            }
         }
     }
 
@@ -1221,20 +2544,30 @@ ReadResult VideoReaderFFMpeg::ReadFrame(int64_t _iTimeStampToSeekTo, int _iFrame
     AVFrame* pFinalAVFrame = av_frame_alloc();
 
     // The buffer holding the actual frame data.
-    int iSizeBuffer = avpicture_get_size(m_PixelFormatFFmpeg, m_DecodingSize.Width, m_DecodingSize.Height);
-    uint8_t* pBuffer = iSizeBuffer > 0 ? new uint8_t[iSizeBuffer] : nullptr;
+    // Compact frames for the cache are stored in the decoder format, after a small header describing the image.
+    bool planar = m_PlanarCache && m_DecodingMode == VideoDecodingMode::Caching;
+    AVPixelFormat outputFormat = planar ? m_pCodecCtx->pix_fmt : m_PixelFormatFFmpeg;
+    int iHeaderSize = planar ? PlanarHeaderSize : 0;
+    int iSizeBuffer = iHeaderSize + avpicture_get_size(outputFormat, m_DecodingSize.Width, m_DecodingSize.Height);
+    uint8_t* pBuffer = m_FramePool->Acquire(iSizeBuffer);
 
     if (pDecodingAVFrame == nullptr || pFinalAVFrame == nullptr || pBuffer == nullptr)
+    {
+        m_FramePool->Release(pBuffer);
+        av_free(pFinalAVFrame);
+        av_free(pDecodingAVFrame);
         return ReadResult::MemoryNotAllocated;
+    }
 
     // Assigns appropriate parts of buffer to image planes in the AVFrame.
-    avpicture_fill((AVPicture *)pFinalAVFrame, pBuffer, m_PixelFormatFFmpeg, m_DecodingSize.Width, m_DecodingSize.Height);
+    avpicture_fill((AVPicture *)pFinalAVFrame, pBuffer + iHeaderSize, outputFormat, m_DecodingSize.Width, m_DecodingSize.Height);
 
     m_TimestampInfo.CurrentTimestamp = m_FramesContainer->CurrentFrame == nullptr ? -1 : m_FramesContainer->CurrentFrame->Timestamp;
 
     // Reading/Decoding loop
     bool done = false;
     bool bFirstPass = true;
+    bool draining = false;
     int iReadFrameResult;
     int gotPicturePtr = 0;
     int	iFramesDecoded = 0;
@@ -1249,14 +2582,21 @@ ReadResult VideoReaderFFMpeg::ReadFrame(int64_t _iTimeStampToSeekTo, int _iFrame
 
         // Read next packet
         AVPacket inputPacket;
-        iReadFrameResult = av_read_frame(m_pFormatCtx, &inputPacket);
+        int64_t stageStart = Stopwatch::GetTimestamp();
+        iReadFrameResult = draining ? -1 : ReadPacket(m_pFormatCtx, m_ActivePacketCache, m_PacketCursor, &inputPacket);
+        if (!draining)
+            stageStart = m_DecodingStatistics->Lap(DecodingStage::Demux, stageStart);
+
         if (iReadFrameResult < 0)
         {
-            // Reading error. We don't know if the error happened on a video frame or audio one.
-            done = true;
-            delete[] pBuffer;
-            result = ReadResult::FrameNotRead;
-            break;
+            // End of file or reading error.
+            // The decoder may still hold frames: the last B-frames references and the frames in flight in the threads.
+            // Feed it empty packets to get them out, until it has nothing left.
+            av_init_packet(&inputPacket);
+            inputPacket.data = nullptr;
+            inputPacket.size = 0;
+            inputPacket.stream_index = m_iVideoStream;
+            draining = true;
         }
         
         if (inputPacket.stream_index != m_iVideoStream)
@@ -1268,11 +2608,23 @@ ReadResult VideoReaderFFMpeg::ReadFrame(int64_t _iTimeStampToSeekTo, int _iFrame
         // Decode video packet. This is needed even if we're not on the final frame yet.
         // I-Frame data is kept internally by ffmpeg which will need it to build the final frame.
         avcodec_decode_video2(m_pCodecCtx, pDecodingAVFrame, &gotPicturePtr, &inputPacket);
+        m_DecodingStatistics->Lap(gotPicturePtr == 0 ? DecodingStage::BufferingSkip : DecodingStage::Decode, stageStart);
         if (gotPicturePtr == 0)
         {
+            av_free_packet(&inputPacket);
+
+            if (draining)
+            {
+                // Decoder fully drained, nothing more to read.
+                done = true;
+                m_FramePool->Release(pBuffer);
+                result = ReadResult::FrameNotRead;
+                break;
+            }
+
             // Buffering frame. libav just read a I or P frame that will be presented later.
             // (But which was necessary to get now in order to decode a coming B frame.)
-            av_free_packet(&inputPacket);
+            // With frame threading this also happens for the first packets after a seek, while the threads fill up.
             continue;
         }
 
@@ -1285,12 +2637,14 @@ ReadResult VideoReaderFFMpeg::ReadFrame(int64_t _iTimeStampToSeekTo, int _iFrame
         }
 
         m_TimestampInfo.CurrentTimestamp = beTimestamp - m_timestampOffset;
+        m_LastDecodedTimestamp = m_TimestampInfo.CurrentTimestamp;
 
-        if (seeking && bFirstPass && !_approximate && iTargetTimeStamp >= 0 && m_TimestampInfo.CurrentTimestamp > iTargetTimeStamp)
+        if (seeking && bFirstPass && !_approximate && iTargetTimeStamp >= 0 && m_TimestampInfo.CurrentTimestamp > iTargetTimeStamp && m_PacketIndex == nullptr)
         {
             // If the current ts is already after the target, we are dealing with this kind of files
             // where the seek doesn't work as advertised. We'll seek back again further,
             // and then decode until we get to it.
+            // With a packet index we land on the right keyframe directly and this doesn't happen.
 
             // Do this only once.
             bFirstPass = false;
@@ -1308,8 +2662,10 @@ ReadResult VideoReaderFFMpeg::ReadFrame(int64_t _iTimeStampToSeekTo, int _iFrame
                     m_TimestampInfo.CurrentTimestamp, iTargetTimeStamp, iSecondsBack, iForceSeekTimestamp);
             }
 
+            int64_t retryStart = Stopwatch::GetTimestamp();
             avformat_seek_file(m_pFormatCtx, m_iVideoStream, iMinTarget + m_timestampOffset, iForceSeekTimestamp + m_timestampOffset, iForceSeekTimestamp + m_timestampOffset, AVSEEK_FLAG_BACKWARD);
             avcodec_flush_buffers(m_pFormatCtx->streams[m_iVideoStream]->codec);
+            m_DecodingStatistics->Lap(DecodingStage::SeekRetry, retryStart);
 
             // Free the packet that was allocated by av_read_frame
             av_free_packet(&inputPacket);
@@ -1336,62 +2692,47 @@ ReadResult VideoReaderFFMpeg::ReadFrame(int64_t _iTimeStampToSeekTo, int _iFrame
                 log->DebugFormat("Seeking to [{0}] completed. Final position:[{1}]", iTargetTimeStamp, m_TimestampInfo.CurrentTimestamp);
 
             // Deinterlace + rescale + convert pixel format.
+            stageStart = Stopwatch::GetTimestamp();
             bool rescaled = RescaleAndConvert(
+                m_ConversionEngine,
                 pFinalAVFrame,
                 pDecodingAVFrame,
                 m_DecodingSize.Width,
                 m_DecodingSize.Height,
-                m_PixelFormatFFmpeg,
+                outputFormat,
                 Options->Deinterlace);
 
+            stageStart = m_DecodingStatistics->Lap(DecodingStage::Convert, stageStart);
+
             if (!rescaled)
             {
-                delete[] pBuffer;
+                m_FramePool->Release(pBuffer);
                 result = ReadResult::ImageNotConverted;
                 break;
             }
 
+            VideoFrame^ vf = nullptr;
             try
             {
-                // Import ffmpeg buffer into a .NET bitmap.
-                int imageStride = pFinalAVFrame->linesize[0];
-                IntPtr scan0 = IntPtr((void*)pFinalAVFrame->data[0]);
-                Bitmap^ bmp = gcnew Bitmap(m_DecodingSize.Width, m_DecodingSize.Height, imageStride, DecodingPixelFormat, scan0);
-
-                // Rotation is handled after scaling and aspect ratio fix for simplicity.
-                // In later versions of FFMpeg there are rotation routines built in, that might be simpler and faster.
-                switch (m_VideoInfo.ImageRotation)
-                {
-                case ImageRotation::Rotate90:
-                    bmp->RotateFlip(RotateFlipType::Rotate90FlipNone);
-                    break;
-                case ImageRotation::Rotate180:
-                    bmp->RotateFlip(RotateFlipType::Rotate180FlipNone);
-                    break;
-                case ImageRotation::Rotate270:
-                    bmp->RotateFlip(RotateFlipType::Rotate270FlipNone);
-                    break;
-                default:
-                    break;
-                }
-
-                // Store a pointer to the native buffer inside the Bitmap.
-                // We'll be asked to free this resource later when the frame is not used anymore.
-                // It is boxed inside an Object so we can extract it in a type-safe way.
-                IntPtr^ boxedPtr = gcnew IntPtr((void*)pBuffer);
-                bmp->Tag = boxedPtr;
-
-                // Construct the VideoFrame and push it to the current container.
-                VideoFrame^ vf = gcnew VideoFrame();
-                vf->Image = bmp;
-                vf->Timestamp = m_TimestampInfo.CurrentTimestamp;
+                // Import ffmpeg buffer into a .NET bitmap and push it to the current container.
+                vf = planar ?
+                    CreatePlanarVideoFrame(pBuffer, outputFormat, m_TimestampInfo.CurrentTimestamp) :
+                    CreateVideoFrame(pFinalAVFrame, pBuffer, m_TimestampInfo.CurrentTimestamp);
                 
+                stageStart = m_DecodingStatistics->Lap(DecodingStage::BitmapWrap, stageStart);
+                m_DecodingStatistics->Record(DecodingStage::Frame, stageStart - frameStart);
                 m_LoopWatcher->LoopEnd();
                 m_FramesContainer->Add(vf);
+                m_DecodingStatistics->Lap(DecodingStage::ContainerAdd, stageStart);
             }
             catch (Exception^ exp)
             {
-                delete[] pBuffer;
+                // Once the frame exists it owns the buffer, which may be the rotated copy, the decoded one being already released.
+                if (vf != nullptr)
+                    DisposeFrame(vf);
+                else
+                    m_FramePool->Release(pBuffer);
+
                 result = ReadResult::ImageNotConverted;
                 log->Error("Error while converting AVFrame to Bitmap.");
                 log->Error(exp);
@@ -1425,10 +2766,48 @@ int VideoReaderFFMpeg::SeekTo(int64_t _target)
     // Perform an FFMpeg seek without decoding the frame.
     // AVSEEK_FLAG_BACKWARD -> goes to first I-Frame before target.
     // Then we'll need to decode frame by frame until the target is reached.
+    ReleaseActivePacketCache();
+
+    // Jumps inside the packet cache only move the cursor, the demuxer is repositioned the next time we go outside.
+    PacketCache^ packets = AcquirePacketCache();
+    if (packets != nullptr && m_PacketIndex != nullptr && packets->Zone.Contains(_target))
+    {
+        int keyframe = m_PacketIndex->FindKeyframe(_target + m_timestampOffset);
+        int cursor = keyframe >= 0 ? packets->Seek(m_PacketIndex->GetKeyframeDts(keyframe)) : -1;
+        if (cursor >= 0)
+        {
+            m_ActivePacketCache = packets;
+            m_PacketCursor = cursor;
+            avcodec_flush_buffers(m_pFormatCtx->streams[m_iVideoStream]->codec);
+            m_TimestampInfo = TimestampInfo::Empty;
+            m_LastDecodedTimestamp = -1;
+            return 0;
+        }
+    }
+
+    if (packets != nullptr)
+        packets->Release();
+
     long minTs = m_timestampOffset;
     long ts = _target + m_timestampOffset;
     long maxTs = _target + m_timestampOffset + (int64_t)m_VideoInfo.AverageTimeStampsPerSeconds;
 
+    if (m_PacketIndex != nullptr)
+    {
+        // Target the keyframe presented at or before the target directly.
+        // Demuxers index either pts (mkv) or dts (mp4, avi). With B-frames the two differ, so accept anything
+        // from the keyframe dts to its pts. Capping at the dts would make pts-indexed demuxers go back one GOP.
+        int keyframe = m_PacketIndex->FindKeyframe(ts);
+        if (keyframe >= 0)
+        {
+            int64_t keyframeDts = m_PacketIndex->GetKeyframeDts(keyframe);
+            int64_t keyframePts = m_PacketIndex->GetKeyframePts(keyframe);
+            minTs = (long)Math::Min(keyframeDts, keyframePts);
+            ts = (long)Math::Max(keyframeDts, keyframePts);
+            maxTs = ts;
+        }
+    }
+
     int res = avformat_seek_file(
         m_pFormatCtx,
         m_iVideoStream,
@@ -1439,16 +2818,16 @@ int VideoReaderFFMpeg::SeekTo(int64_t _target)
 
     avcodec_flush_buffers(m_pFormatCtx->streams[m_iVideoStream]->codec);
     m_TimestampInfo = TimestampInfo::Empty;
+    m_LastDecodedTimestamp = -1;
     return res;
 }
-bool VideoReaderFFMpeg::RescaleAndConvert(AVFrame* _pOutputFrame, AVFrame* _pInputFrame, int _OutputWidth, int _OutputHeight, int _OutputFmt, bool _bDeinterlace)
+bool VideoReaderFFMpeg::RescaleAndConvert(ConversionEngine^ _engine, AVFrame* _pOutputFrame, AVFrame* _pInputFrame, int _OutputWidth, int _OutputHeight, int _OutputFmt, bool _bDeinterlace)
 {
     //------------------------------------------------------------------------
     // Function used by GetNextFrame.
     // Take the frame we just decoded and turn it to the right size/deint/fmt.
-    // todo: sws_getContext could be done only once.
+    // The engine keeps the scaler contexts and deinterlacing buffer between frames.
     //------------------------------------------------------------------------
-    bool bSuccess = true;
     AVPixelFormat srcFormat = m_pCodecCtx->pix_fmt;
     if (CanChangeDemosaicing)
     {
@@ -1472,82 +2851,269 @@ bool VideoReaderFFMpeg::RescaleAndConvert(AVFrame* _pOutputFrame, AVFrame* _pInp
             break;
         }
     }
-    
-    SwsContext* pSWSCtx = sws_getContext(
-        m_pCodecCtx->width, m_pCodecCtx->height, srcFormat,
-        _OutputWidth, _OutputHeight, (AVPixelFormat)_OutputFmt,
-        DecodingQuality,
-        nullptr, nullptr, nullptr);
 
-    uint8_t* pDeinterlaceBuffer = nullptr;
-    uint8_t** ppOutputData = nullptr;
-    int* piStride = nullptr;
+    bool bSuccess = _engine->Convert(
+        _pOutputFrame, _pInputFrame,
+        srcFormat, _pInputFrame->width, _pInputFrame->height,
+        _OutputFmt, _OutputWidth, _OutputHeight,
+        _bDeinterlace);
+
+    if (!bSuccess)
+        log->Error("RescaleAndConvert Error : conversion failed.");
+
+    return bSuccess;
+}
+VideoFrame^ VideoReaderFFMpeg::CreateVideoFrame(AVFrame* _pFinalAVFrame, uint8_t* _pBuffer, int64_t _timestamp)
+{
+    VideoFrame^ vf = gcnew VideoFrame();
+    vf->Image = CreateBitmap(_pBuffer, _pFinalAVFrame->linesize[0], m_DecodingSize.Width, m_DecodingSize.Height);
+    vf->Timestamp = _timestamp;
+    return vf;
+}
+VideoFrame^ VideoReaderFFMpeg::CreatePlanarVideoFrame(uint8_t* _pBuffer, AVPixelFormat _format, int64_t _timestamp)
+{
+    // The Bitmap will only be created if and when the frame is actually used.
+    PlanarFrameHeader* pHeader = (PlanarFrameHeader*)_pBuffer;
+    pHeader->Width = m_DecodingSize.Width;
+    pHeader->Height = m_DecodingSize.Height;
+    pHeader->PixelFormat = _format;
 
-    if (_bDeinterlace)
+    return gcnew VideoFrame(_timestamp, IntPtr((void*)_pBuffer), m_Materializer);
+}
+Bitmap^ VideoReaderFFMpeg::CreateBitmap(uint8_t* _pBuffer, int _stride, int _width, int _height)
+{
+    // On success the Bitmap owns exactly one pool buffer, reported by GetImageBuffer.
+    // It is either _pBuffer or a rotated copy, in which case _pBuffer has already been given back.
+    // On failure the caller still owns _pBuffer.
+    if (m_VideoInfo.ImageRotation != ImageRotation::Rotate0)
+        return CreateRotatedBitmap(_pBuffer, _stride, _width, _height);
+
+    // Import ffmpeg buffer into a .NET bitmap.
+    IntPtr scan0 = IntPtr((void*)_pBuffer);
+    Bitmap^ bmp = gcnew Bitmap(_width, _height, _stride, DecodingPixelFormat, scan0);
+
+    // Store a pointer to the native buffer inside the Bitmap.
+    // We'll be asked to free this resource later when the frame is not used anymore.
+    // It is boxed inside an Object so we can extract it in a type-safe way.
+    try
+    {
+        IntPtr^ boxedPtr = gcnew IntPtr((void*)_pBuffer);
+        bmp->Tag = boxedPtr;
+    }
+    catch (Exception^)
     {
-        AVPicture*	pDeinterlacingFrame;
-        AVPicture	tmpPicture;
+        delete bmp;
+        throw;
+    }
 
-        // Deinterlacing happens before resizing.
-        int iSizeDeinterlaced = avpicture_get_size(m_pCodecCtx->pix_fmt, m_pCodecCtx->width, m_pCodecCtx->height);
+    return bmp;
+}
+Bitmap^ VideoReaderFFMpeg::CreateRotatedBitmap(uint8_t* _pBuffer, int _stride, int _width, int _height)
+{
+    // Rotation is handled after scaling and aspect ratio fix for simplicity.
+    // The image is rotated natively into a second buffer from the pool, which becomes the one owned by the Bitmap.
+    // The decoded buffer is only given back once the Bitmap exists, so the caller still owns it if we throw.
+    bool sideway = m_VideoInfo.ImageRotation == ImageRotation::Rotate90 || m_VideoInfo.ImageRotation == ImageRotation::Rotate270;
+    int width = sideway ? _height : _width;
+    int height = sideway ? _width : _height;
+    int stride = width * 4;
 
-        pDeinterlaceBuffer = new uint8_t[iSizeDeinterlaced];
-        pDeinterlacingFrame = &tmpPicture;
-        avpicture_fill(pDeinterlacingFrame, pDeinterlaceBuffer, m_pCodecCtx->pix_fmt, m_pCodecCtx->width, m_pCodecCtx->height);
+    uint8_t* pRotated = m_FramePool->Acquire(stride * height);
+    if (pRotated == nullptr)
+        throw gcnew OutOfMemoryException("Rotated frame buffer could not be allocated.");
 
-        int resDeint = avpicture_deinterlace(pDeinterlacingFrame, (AVPicture*)_pInputFrame, m_pCodecCtx->pix_fmt, m_pCodecCtx->width, m_pCodecCtx->height);
+    int64_t rotateStart = Stopwatch::GetTimestamp();
+    ImageRotator::Rotate(_pBuffer, _stride, pRotated, stride, _width, _height, m_VideoInfo.ImageRotation);
+    m_DecodingStatistics->Lap(DecodingStage::Rotate, rotateStart);
 
-        if (resDeint < 0)
-        {
-            // Deinterlacing failed, use original image.
-            log->Debug("Deinterlacing failed, use original image.");
-            ppOutputData = _pInputFrame->data;
-            piStride = _pInputFrame->linesize;
-        }
-        else
+    Bitmap^ bmp = nullptr;
+    try
+    {
+        bmp = gcnew Bitmap(width, height, stride, DecodingPixelFormat, IntPtr((void*)pRotated));
+        IntPtr^ boxedPtr = gcnew IntPtr((void*)pRotated);
+        bmp->Tag = boxedPtr;
+    }
+    catch (Exception^)
+    {
+        if (bmp != nullptr)
+            delete bmp;
+
+        m_FramePool->Release(pRotated);
+        throw;
+    }
+
+    // Nothing can fail past this point, the Bitmap now owns the rotated buffer.
+    m_FramePool->Release(_pBuffer);
+    return bmp;
+}
+uint8_t* VideoReaderFFMpeg::GetImageBuffer(Bitmap^ _image)
+{
+    // The pointer to the native buffer was stored in the Tag property.
+    IntPtr^ ptr = dynamic_cast<IntPtr^>(_image->Tag);
+    return ptr != nullptr ? (uint8_t*)ptr->ToPointer() : nullptr;
+}
+Bitmap^ VideoReaderFFMpeg::MaterializeFrame(VideoFrame^ _frame)
+{
+    // Convert a compact frame to a displayable Bitmap.
+    // Only a few frames keep their converted image at any time, the oldest go back to their compact form.
+    // Their Bitmap is disposed and the pinned pixels are recycled for the next conversion.
+    // The frame currently shown is never forgotten this way.
+    // Called from whichever thread accesses the image.
+    lock l(m_MaterializeLocker);
+
+    if (_frame->HasImage)
+        return _frame->Image;
+
+    uint8_t* pPlanar = (uint8_t*)_frame->CompactBuffer.ToPointer();
+    PlanarFrameHeader* pHeader = (PlanarFrameHeader*)pPlanar;
+    int width = pHeader->Width;
+    int height = pHeader->Height;
+    AVPixelFormat format = (AVPixelFormat)pHeader->PixelFormat;
+
+    bool rotated = m_VideoInfo.ImageRotation != ImageRotation::Rotate0;
+    bool sideway = m_VideoInfo.ImageRotation == ImageRotation::Rotate90 || m_VideoInfo.ImageRotation == ImageRotation::Rotate270;
+    int imageWidth = sideway ? height : width;
+    int imageHeight = sideway ? width : height;
+    int size = avpicture_get_size(m_PixelFormatFFmpeg, width, height);
+
+    Bitmap^ bmp = nullptr;
+    PinnedImageBuffer^ pixels = nullptr;
+    AVFrame* pSource = av_frame_alloc();
+    AVFrame* pDestination = av_frame_alloc();
+    uint8_t* pConverted = nullptr;
+
+    try
+    {
+        pixels = AcquireMaterializeBuffer(size);
+
+        // Without rotation the conversion goes straight to the image, otherwise through a pool buffer.
+        pConverted = rotated ? m_FramePool->Acquire(size) : pixels->Pointer;
+        if (pSource == nullptr || pDestination == nullptr || pConverted == nullptr)
+            throw gcnew OutOfMemoryException("Materialized frame buffers could not be allocated.");
+
+        avpicture_fill((AVPicture*)pSource, pPlanar + PlanarHeaderSize, format, width, height);
+        avpicture_fill((AVPicture*)pDestination, pConverted, m_PixelFormatFFmpeg, width, height);
+        pSource->format = format;
+
+        if (!m_MaterializeEngine->Convert(pDestination, pSource, format, width, height, m_PixelFormatFFmpeg, width, height, false))
+            throw gcnew InvalidOperationException("Planar frame conversion failed.");
+
+        int stride = imageWidth * 4;
+        if (rotated)
         {
-            // Use deinterlaced image.
-            ppOutputData = pDeinterlacingFrame->data;
-            piStride = pDeinterlacingFrame->linesize;
+            int64_t rotateStart = Stopwatch::GetTimestamp();
+            ImageRotator::Rotate(pConverted, pDestination->linesize[0], pixels->Pointer, stride, width, height, m_VideoInfo.ImageRotation);
+            m_DecodingStatistics->Lap(DecodingStage::Rotate, rotateStart);
         }
+
+        bmp = gcnew Bitmap(imageWidth, imageHeight, stride, DecodingPixelFormat, IntPtr((void*)pixels->Pointer));
+        bmp->Tag = pixels;
     }
-    else
+    catch (Exception^ exp)
     {
-        ppOutputData = _pInputFrame->data;
-        piStride = _pInputFrame->linesize;
+        log->Error("Error while converting planar frame to Bitmap.");
+        log->Error(exp);
+        delete bmp;
+        bmp = nullptr;
+
+        if (pixels != nullptr && m_MaterializeBuffers->Count < MaterializedFramesCapacity)
+            m_MaterializeBuffers->Push(pixels);
     }
 
-    try
+    if (rotated)
+        m_FramePool->Release(pConverted);
+
+    av_free(pSource);
+    av_free(pDestination);
+
+    if (bmp == nullptr)
+        return nullptr;
+
+    _frame->Image = bmp;
+    m_MaterializedFrames->AddLast(_frame);
+
+    // Forget the oldest conversions, but never the frame currently shown.
+    int count = m_MaterializedFrames->Count;
+    while (m_MaterializedFrames->Count > MaterializedFramesCapacity && count-- > 0)
     {
-        sws_scale(pSWSCtx, ppOutputData, piStride, 0, m_pCodecCtx->height, _pOutputFrame->data, _pOutputFrame->linesize);
+        VideoFrame^ oldest = m_MaterializedFrames->First->Value;
+        m_MaterializedFrames->RemoveFirst();
+
+        if (oldest == m_Cache->CurrentFrame)
+        {
+            m_MaterializedFrames->AddLast(oldest);
+            continue;
+        }
+
+        ForgetMaterializedImage(oldest);
     }
-    catch (Exception^)
+
+    return bmp;
+}
+VideoReaderFFMpeg::PinnedImageBuffer^ VideoReaderFFMpeg::AcquireMaterializeBuffer(int _size)
+{
+    // Always inside the materialize lock.
+    // Buffers of a previous decoding size are dropped as they come up.
+    while (m_MaterializeBuffers->Count > 0)
     {
-        bSuccess = false;
-        log->Error("RescaleAndConvert Error : sws_scale failed.");
+        PinnedImageBuffer^ pixels = m_MaterializeBuffers->Pop();
+        if (pixels->Size == _size)
+            return pixels;
+
+        delete pixels;
     }
 
-    // Clean Up.
-    sws_freeContext(pSWSCtx);
+    return gcnew PinnedImageBuffer(_size);
+}
+void VideoReaderFFMpeg::ForgetMaterializedImage(VideoFrame^ _frame)
+{
+    // Always inside the materialize lock.
+    // Dispose the Bitmap and keep its pixels for the next conversion, up to the number of frames materialized at once.
+    Bitmap^ bmp = _frame->ReleaseImage();
+    if (bmp == nullptr)
+        return;
+
+    PinnedImageBuffer^ pixels = dynamic_cast<PinnedImageBuffer^>(bmp->Tag);
+    delete bmp;
 
-    if (pDeinterlaceBuffer != nullptr)
-        delete[] pDeinterlaceBuffer;
+    if (pixels == nullptr)
+        return;
 
-    return bSuccess;
+    if (m_MaterializeBuffers->Count < MaterializedFramesCapacity)
+        m_MaterializeBuffers->Push(pixels);
+    else
+        delete pixels;
+}
+void VideoReaderFFMpeg::ClearMaterializeBuffers()
+{
+    lock l(m_MaterializeLocker);
+    while (m_MaterializeBuffers->Count > 0)
+        delete m_MaterializeBuffers->Pop();
 }
 void VideoReaderFFMpeg::DisposeFrame(VideoFrame^ _frame)
 {
-    // Dispose the Bitmap and the native buffer.
-    // The pointer to the native buffer was stored in the Tag property.
-    IntPtr^ ptr = dynamic_cast<IntPtr^>(_frame->Image->Tag);
-    delete _frame->Image;
+    // Dispose the Bitmap and give the native buffers back to the pool.
+    // The materialized image of a compact frame is disposed and its pixels recycled, see MaterializeFrame.
+    if (!_frame->IsCompact)
+    {
+        DisposeImage(_frame->Image);
+        return;
+    }
 
-    if (ptr != nullptr)
+    lock l(m_MaterializeLocker);
+    if (_frame->HasImage)
     {
-        // Fixme: why is the delete [] taking more than 1ms ?
-        uint8_t* pBuf = (uint8_t*)ptr->ToPointer();
-        delete[] pBuf;
+        m_MaterializedFrames->Remove(_frame);
+        ForgetMaterializedImage(_frame);
     }
+
+    m_FramePool->Release((uint8_t*)_frame->CompactBuffer.ToPointer());
+}
+void VideoReaderFFMpeg::DisposeImage(Bitmap^ _image)
+{
+    uint8_t* pBuffer = GetImageBuffer(_image);
+    delete _image;
+    m_FramePool->Release(pBuffer);
 }
 
 void VideoReaderFFMpeg::PreBufferingWorker(Object^ _canceler)
@@ -1573,11 +3139,24 @@ void VideoReaderFFMpeg::PreBufferingWorker(Object^ _canceler)
             break;
         }
 
+        // The loop time doesn't include the wait for room in the prebuffer.
+        if (res == ReadResult::Success && m_PreBufferPolicy->Record(m_LoopWatcher->Last))
+        {
+            m_PreBuffer->Capacity = m_PreBufferPolicy->Depth;
+
+            if (m_Verbose)
+                log->DebugFormat("Prebuffer depth: {0} frames. (Decoding: {1:0.000}ms, jitter: {2:0.000}ms, budget: {3:0.000}ms).", 
+                    m_PreBufferPolicy->Depth, m_PreBufferPolicy->AverageMilliseconds, m_PreBufferPolicy->JitterMilliseconds, m_PreBufferPolicy->BudgetMilliseconds);
+        }
+
         // Check if we hit the end of the zone.
         if (m_TimestampInfo.CurrentTimestamp > m_WorkingZone.End)
         {
             if (m_Verbose)
-                log->DebugFormat("Average prebuffering loop time: {0:0.000}ms. (Budget: {1:0.000}ms).", m_LoopWatcher->Average, m_VideoInfo.FrameIntervalMilliseconds);
+            {
+                log->DebugFormat("Average prebuffering loop time: {0:0.000}ms. (Budget: {1:0.000}ms, decoding threads: {2}).", m_LoopWatcher->Average, m_VideoInfo.FrameIntervalMilliseconds, m_pCodecCtx->thread_count);
+                log->DebugFormat("Decoding stages:{0}{1}", Environment::NewLine, m_DecodingStatistics);
+            }
             
             m_LoopWatcher->Restart();
             ReadFrame(m_WorkingZone.Start, 1, false);
@@ -1632,6 +3211,7 @@ void VideoReaderFFMpeg::DumpInfo()
     log->Debug("[Codec] - Height (pixels): " + m_pCodecCtx->height);
     log->Debug("Pixel Aspect Ratio: " + m_VideoInfo.PixelAspectRatio);
     log->Debug("Image rotation: " + m_VideoInfo.ImageRotation.ToString());
+    log->Debug("Bayer pattern: " + m_VideoInfo.Demosaicing.ToString());
     log->Debug("---------------------------------------------------");
 }
 
@@ -38,7 +38,10 @@ along with Kinovea. If not, see http://www.gnu.org/licenses/.
 // The native buffer will *not* be automatically free'd when calling Bitmap->Dispose().
 // This means we need to track the pointer and deallocate manually.
 // To achieve that, we use the Tag property of the Bitmap to store an IntPtr wrapping the pointer to the buffer.
-// When asked to release this specific Bitmap, we unwrap the IntPtr to the pointer, and call delete.
+// When asked to release this specific Bitmap, we unwrap the IntPtr to the pointer, and give the buffer back to the pool.
+//
+// The native buffers come from a FrameBufferPool owned by the reader.
+// They are recycled between ReadFrame and the frame containers instead of being allocated and deleted for each frame.
 //
 // Note: Calling av_free(AVFrame*) does not deallocate the data buffer either,
 // so AVFrame variables can be local to the function, it won't kill the Bitmaps.
@@ -64,10 +67,19 @@ extern "C" {
 #include "ReadResult.h"
 #include "TimestampInfo.h"
 #include "SavingContext.h"
+#include "FrameBufferPool.h"
+#include "PacketIndex.h"
+#include "PacketCache.h"
+#include "CacheSegment.h"
+#include "ConversionEngine.h"
+#include "ImageRotator.h"
+#include "ReadAheadStream.h"
 
 using namespace System;
+using namespace System::Collections::Generic;
 using namespace System::ComponentModel;
 using namespace System::Reflection;
+using namespace System::Runtime::InteropServices;
 using namespace System::Threading;
 using namespace System::Diagnostics;
 using namespace Kinovea::Video;
@@ -77,6 +89,14 @@ using namespace Kinovea::Services;
 
 namespace Kinovea { namespace Video { namespace FFMpeg
 {
+    // Describes the image stored after it in the native buffer of a compact frame.
+    struct PlanarFrameHeader
+    {
+        int Width;
+        int Height;
+        int PixelFormat;
+    };
+
     [SupportedExtensions(
         ".3gp;.asf;.avi;.dv;.flv;.f4v;\
         .m1v;.m2p;.m2t;.m2ts;.mts;.m2v;.m4v;.ts;.ts1;.ts2;.avr;\
@@ -118,10 +138,14 @@ namespace Kinovea { namespace Video { namespace FFMpeg
         }
         virtual property VideoSection PreBufferingSegment {
             VideoSection get() override {
-                if(m_DecodingMode == VideoDecodingMode::PreBuffering)
-                    return m_PreBuffer->Segment;
+                if(m_DecodingMode != VideoDecodingMode::PreBuffering)
+                    return VideoSection::MakeEmpty();
+                else if(m_Reversing)
+                    return m_ReverseBuffer->Segment;
+                else if(m_Scrubbing)
+                    return m_ScrubBuffer->Segment;
                 else 
-                    return VideoSection::MakeEmpty(); 
+                    return m_PreBuffer->Segment;
             }
         }
         virtual property VideoFrame^ Current {
@@ -140,6 +164,56 @@ namespace Kinovea { namespace Video { namespace FFMpeg
             }
         }
 
+    // Properties (Specific).
+    public:
+        property FrameBufferPool^ FramePool {
+            FrameBufferPool^ get() { return m_FramePool; }
+        }
+        property PacketIndex^ Index {
+            PacketIndex^ get() { return m_PacketIndex; }
+        }
+        /// <summary>
+        /// Compressed packets of the working zone, kept in memory when its decoded frames don't fit. May be null.
+        /// </summary>
+        property PacketCache^ Packets {
+            PacketCache^ get() { return m_PacketCache; }
+        }
+        /// <summary>
+        /// Whether ExtractSummary decodes only keyframes, at reduced resolution when the codec supports it.
+        /// </summary>
+        property bool FastSummary {
+            bool get() { return m_FastSummary; }
+            void set(bool value) { m_FastSummary = value; }
+        }
+        /// <summary>
+        /// Parameters of the speculative decoding done while scrubbing.
+        /// </summary>
+        property ScrubPrefetchPolicy^ ScrubPolicy {
+            ScrubPrefetchPolicy^ get() { return m_ScrubPolicy; }
+        }
+        /// <summary>
+        /// Hit and miss counters of the scrubbing buffer since the video was opened.
+        /// </summary>
+        property PrefetchStatistics ScrubStatistics {
+            PrefetchStatistics get() { return m_ScrubBuffer->Statistics; }
+        }
+        /// <summary>
+        /// Decoding time estimator driving the number of frames kept in the prebuffer.
+        /// </summary>
+        property PreBufferDepthPolicy^ PreBufferPolicy {
+            PreBufferDepthPolicy^ get() { return m_PreBufferPolicy; }
+        }
+        virtual property Kinovea::Video::DecodingStatistics^ DecodingStatistics {
+            Kinovea::Video::DecodingStatistics^ get() override { return m_DecodingStatistics; }
+        }
+        /// <summary>
+        /// The stream the demuxer reads from when read-ahead is enabled, for its throughput and stall counters.
+        /// Null when the file is read directly.
+        /// </summary>
+        property ReadAheadStream^ ReadAhead {
+            ReadAheadStream^ get() { return m_ReadAhead; }
+        }
+
     // Public Methods (VideoReader subclassing).
     public:
         virtual OpenVideoResult Open(String^ _filePath) override;
@@ -185,28 +259,120 @@ namespace Kinovea { namespace Video { namespace FFMpeg
         VideoSection m_SectionToAppend;
         Size m_DecodingSize;
         bool m_CanDrawUnscaled;
+        Size m_CodedSize;
+        int m_Lowres;
         bool m_Verbose = true;
+        bool m_FastSummary = true;
+        Size m_SummaryMaxSize;
 
         // Frame containers
         IVideoFramesContainer^ m_FramesContainer;
         SingleFrame^ m_SingleFrameContainer;
         PreBuffer^ m_PreBuffer;
+        ReverseBuffer^ m_ReverseBuffer;
+        ScrubBuffer^ m_ScrubBuffer;
         Cache^ m_Cache;
-        
-        
+        FrameBufferPool^ m_FramePool;
+
+        // Packet index
+        PacketIndex^ m_PacketIndex;
+        Thread^ m_PacketIndexThread;
+        ThreadCanceler^ m_PacketIndexThreadCanceler;
+        int64_t m_LastDecodedTimestamp;
+
+        // Packet cache
+        PacketCache^ m_PacketCache;
+        PacketCache^ m_ActivePacketCache;
+        int m_PacketCursor;
+        Thread^ m_PacketCacheThread;
+        ThreadCanceler^ m_PacketCacheCanceler;
+        int64_t m_PacketCacheBudget;
+
+        // Parallel caching
+        ThreadCanceler^ m_CacheFillingCanceler;
+        int m_ParallelFramesRead;
+
+        // Compact cache
+        /// <summary>
+        /// Pixels of a materialized image, in pinned managed memory.
+        /// Recycled by the reader when the frame forgets its image, the Bitmap is disposed at that point.
+        /// </summary>
+        ref class PinnedImageBuffer
+        {
+        public:
+            PinnedImageBuffer(int size)
+            {
+                m_Data = gcnew array<Byte>(size);
+                m_Handle = GCHandle::Alloc(m_Data, GCHandleType::Pinned);
+            }
+            property int Size {
+                int get() { return m_Data->Length; }
+            }
+            ~PinnedImageBuffer() { this->!PinnedImageBuffer(); }
+            !PinnedImageBuffer()
+            {
+                if (m_Handle.IsAllocated)
+                    m_Handle.Free();
+            }
+            property uint8_t* Pointer {
+                uint8_t* get() { return (uint8_t*)m_Handle.AddrOfPinnedObject().ToPointer(); }
+            }
+        private:
+            array<Byte>^ m_Data;
+            GCHandle m_Handle;
+        };
+
+        bool m_PlanarCache;
+        VideoFrameMaterializer^ m_Materializer;
+        LinkedList<VideoFrame^>^ m_MaterializedFrames;
+        Stack<PinnedImageBuffer^>^ m_MaterializeBuffers;
+        Object^ m_MaterializeLocker;
+        ConversionEngine^ m_MaterializeEngine;
+        static const int MaterializedFramesCapacity = 8;
+        static const int PlanarHeaderSize = 64;
+        static const int MaxCacheFillingThreads = 8;
+        static const int ProgressInterval = 50;
+
+        // Reverse playback
+        bool m_Reversing;
+        Thread^ m_ReverseDecodingThread;
+        ThreadCanceler^ m_ReverseDecodingCanceler;
+        Object^ m_ReverseLocker;
+        VideoSection m_ReverseChunk;
+        static const int MaxStepFrames = 8;
+        static const int MaxReverseFrames = 256;
+        static const int MaxReverseNewFrames = 8;   // Newer frames kept by the reverse buffer, on top of the two chunks.
+
+        // Scrubbing
+        bool m_Scrubbing;
+        ScrubPrefetchPolicy^ m_ScrubPolicy;
+        Thread^ m_ScrubPrefetchThread;
+        ThreadCanceler^ m_ScrubPrefetchCanceler;
+        AutoResetEvent^ m_ScrubWakeUp;
+        static const int MaxScrubFrames = 128;
+        static const int MaxMetadataLookupPackets = 64;
+
+        // Adaptive prebuffering
+        PreBufferDepthPolicy^ m_PreBufferPolicy;
+
         // FFMpeg specifics
         int m_iVideoStream;
         int m_iAudioStream;
         int m_iMetadataStream;
+        int m_iMetadataAttachment;
         AVFormatContext* m_pFormatCtx;
         AVCodecContext* m_pCodecCtx;
+        ReadAheadStream^ m_ReadAhead;
+        AVIOContext* m_pIOContext;
         TimestampInfo m_TimestampInfo;
         static const enum AVPixelFormat m_PixelFormatFFmpeg = AV_PIX_FMT_BGRA;
         static const int DecodingQuality = SWS_FAST_BILINEAR;
+        ConversionEngine^ m_ConversionEngine;
 
         // Others
         bool m_WasPrebuffering;
         LoopWatcher^ m_LoopWatcher;
+        Kinovea::Video::DecodingStatistics^ m_DecodingStatistics;
         Thread^ m_PreBufferingThread;
         static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
 
@@ -215,22 +381,70 @@ namespace Kinovea { namespace Video { namespace FFMpeg
 
         void DataInit();
         OpenVideoResult Load(String^ _filePath, bool _forSummary);
+        AVFormatContext* OpenReadAhead(String^ _filePath, int _megabytes);
+        void CloseReadAhead();
         ReadResult ReadFrame(int64_t _iTimeStampToSeekTo, int _iFramesToDecode, bool _approximate);
         int SeekTo(int64_t _target);
-        bool RescaleAndConvert(AVFrame* _pOutputFrame, AVFrame* _pInputFrame, int _OutputWidth, int _OutputHeight, int _OutputFmt, bool _bDeinterlace);
-        static void DisposeFrame(VideoFrame^ _frame);
+        bool RescaleAndConvert(ConversionEngine^ _engine, AVFrame* _pOutputFrame, AVFrame* _pInputFrame, int _OutputWidth, int _OutputHeight, int _OutputFmt, bool _bDeinterlace);
+        VideoFrame^ CreateVideoFrame(AVFrame* _pFinalAVFrame, uint8_t* _pBuffer, int64_t _timestamp);
+        VideoFrame^ CreatePlanarVideoFrame(uint8_t* _pBuffer, AVPixelFormat _format, int64_t _timestamp);
+        Bitmap^ CreateBitmap(uint8_t* _pBuffer, int _stride, int _width, int _height);
+        Bitmap^ CreateRotatedBitmap(uint8_t* _pBuffer, int _stride, int _width, int _height);
+        static uint8_t* GetImageBuffer(Bitmap^ _image);
+        Bitmap^ MaterializeFrame(VideoFrame^ _frame);
+        void DisposeFrame(VideoFrame^ _frame);
+        void DisposeImage(Bitmap^ _image);
+        PinnedImageBuffer^ AcquireMaterializeBuffer(int _size);
+        void ForgetMaterializedImage(VideoFrame^ _frame);
+        void ClearMaterializeBuffers();
         static int GetStreamIndex(AVFormatContext* _pFormatCtx, int _iCodecType);
+        static int GetKvaAttachmentIndex(AVFormatContext* _pFormatCtx);
+        static Demosaicing GetBayerPattern(AVFormatContext* _pFormatCtx);
+        String^ FindMetadataPacket(int _maxPackets);
         void UpdateReferenceSizes(ImageAspectRatio _ratio, bool verbose);
         Size FixSize(Size _size, bool sideways);
+        static int GetLowres(AVCodec* _pCodec, Size _codedSize, Size _minSize);
         void ResetDecodingSize();
+        void UpdateLowres();
+        bool SetLowres(int _lowres);
         void PreBufferingWorker(Object^ _canceler);
         bool WorkingZoneFitsInMemory(VideoSection _newZone, int _maxMemory);
         bool ReadMany(BackgroundWorker^ _bgWorker, VideoSection _section, bool _prepend);
+        bool ReadManyParallel(BackgroundWorker^ _bgWorker, VideoSection _section, int _total, bool% _success);
+        void DecodeSegment(Object^ _segment);
         void SwitchDecodingMode(VideoDecodingMode _mode);
         void SwitchToBestAfterCaching();
         void ImportWorkingZoneToCache(System::Object^ sender,DoWorkEventArgs^ e);
         void StartPreBuffering();
         void StopPreBuffering();
+        bool IsReverseStep(int64_t _from, int64_t _target);
+        bool MoveBackward(int64_t _target);
+        void StartReversePlayback();
+        void StartReverseDecoding(int64_t _end);
+        void StopReverseDecoding();
+        void ReverseDecodingWorker(Object^ _end);
+        bool IsScrubJump(int64_t _from, int64_t _target);
+        bool MoveScrub(int64_t _target);
+        void StartScrubbing();
+        void StopScrubPrefetch();
+        void ScrubPrefetchWorker();
+        void DecodeScrubRange(AVFormatContext* _pFormatCtx, AVCodecContext* _pCodecCtx, AVFrame* _pDecodingAVFrame, ConversionEngine^ _engine, int64_t _seekTimestamp, VideoSection _range, int _windowFrames);
+        int GetSpeculativeCapacity(int _maxFrames);
+        int GetPreBufferCapacity();
+        void ReturnToPreBuffering(bool _resume);
+        bool OpenDecoderInstance(AVFormatContext** _ppFormatCtx, AVCodecContext** _ppCodecCtx, int _threads);
+        void CloseDecoderInstance(AVFormatContext** _ppFormatCtx, AVCodecContext** _ppCodecCtx);
+        void StartPacketIndexing(String^ _filePath);
+        void StopPacketIndexing();
+        void PacketIndexingWorker(Object^ _filePath);
+        int ReadPacket(AVFormatContext* _pFormatCtx, PacketCache^ _packets, int% _cursor, AVPacket* _packet);
+        void UpdatePacketCache(int _maxMemory);
+        void StartPacketCaching(VideoSection _zone);
+        PacketCache^ AcquirePacketCache();
+        void ReleaseActivePacketCache();
+        void StopPacketCaching();
+        void ClearPacketCache();
+        void PacketCachingWorker(Object^ _zone);
 
         void DumpInfo();
         static void DumpStreamsInfos(AVFormatContext* _pFormatCtx);
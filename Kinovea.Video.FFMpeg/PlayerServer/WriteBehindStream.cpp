@@ -0,0 +1,403 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#include <string.h>
+#include <msclr\lock.h>
+#include "WriteBehindStream.h"
+
+using namespace msclr;
+using namespace Kinovea::Video::FFMpeg;
+
+// Callbacks of the AVIOContext. The opaque pointer is a GCHandle to the stream.
+static int WritePacketCallback(void* _opaque, uint8_t* _buffer, int _size)
+{
+    WriteBehindStream^ stream = safe_cast<WriteBehindStream^>(GCHandle::FromIntPtr(IntPtr(_opaque)).Target);
+    return stream->Write(_buffer, _size);
+}
+static int64_t SeekCallback(void* _opaque, int64_t _offset, int _whence)
+{
+    WriteBehindStream^ stream = safe_cast<WriteBehindStream^>(GCHandle::FromIntPtr(IntPtr(_opaque)).Target);
+    if (_whence & AVSEEK_SIZE)
+        return stream->Length;
+
+    switch (_whence & ~AVSEEK_FORCE)
+    {
+    case SEEK_SET: return stream->Seek(_offset, SeekOrigin::Begin);
+    case SEEK_CUR: return stream->Seek(_offset, SeekOrigin::Current);
+    case SEEK_END: return stream->Seek(_offset, SeekOrigin::End);
+    default: return -1;
+    }
+}
+
+WriteBehindStream::WriteBehindStream(String^ filePath, int capacity)
+{
+    // The stream does its own buffering, the FileStream buffer would only add a copy.
+    Initialize(gcnew FileStream(filePath, FileMode::Create, FileAccess::Write, FileShare::Read, 1, FileOptions::None), capacity);
+}
+WriteBehindStream::WriteBehindStream(Stream^ stream, int capacity)
+{
+    Initialize(stream, capacity);
+}
+WriteBehindStream::~WriteBehindStream()
+{
+    Close();
+    this->!WriteBehindStream();
+}
+WriteBehindStream::!WriteBehindStream()
+{
+    {
+        lock l(m_Locker);
+        m_Cancelled = true;
+        Monitor::PulseAll(m_Locker);
+    }
+
+    if (m_IOThread != nullptr)
+        m_IOThread->Join();
+
+    m_IOThread = nullptr;
+
+    if (m_Stream != nullptr)
+        m_Stream->Close();
+
+    m_Stream = nullptr;
+
+    if (m_Handle.IsAllocated)
+        m_Handle.Free();
+}
+void WriteBehindStream::Initialize(Stream^ stream, int capacity)
+{
+    m_Stream = stream;
+
+    // Whole chunks so that a chunk never wraps around the end of the ring.
+    m_Capacity = (Math::Max(capacity, (int)MinCapacity) / ChunkSize) * ChunkSize;
+    m_Ring = gcnew array<Byte>(m_Capacity);
+    m_Patches = gcnew List<KeyValuePair<int64_t, array<Byte>^>>();
+    m_Locker = gcnew Object();
+
+    m_IOThread = gcnew Thread(gcnew ThreadStart(this, &WriteBehindStream::IOWorker));
+    m_IOThread->Name = "WriteBehind";
+    m_IOThread->IsBackground = true;
+    m_IOThread->Start();
+}
+void WriteBehindStream::Write(array<Byte>^ buffer, int offset, int count)
+{
+    if (count <= 0)
+        return;
+
+    pin_ptr<Byte> pBuffer = &buffer[offset];
+    if (Write((uint8_t*)pBuffer, count) < 0)
+        throw gcnew IOException("The write-behind stream failed to write the underlying stream.");
+}
+int WriteBehindStream::Write(uint8_t* buffer, int size)
+{
+    lock l(m_Locker);
+
+    int done = 0;
+    while (done < size)
+    {
+        if (m_Failed || m_Cancelled)
+            return AVERROR(EIO);
+
+        int remaining = size - done;
+
+        if (m_Position < m_Taken)
+        {
+            // The I/O thread already has this part of the file, keep the bytes aside and patch the file later.
+            int count = (int)Math::Min((int64_t)remaining, m_Taken - m_Position);
+            array<Byte>^ data = gcnew array<Byte>(count);
+            Marshal::Copy(IntPtr(buffer + done), data, 0, count);
+            m_Patches->Add(KeyValuePair<int64_t, array<Byte>^>(m_Position, data));
+            m_Position += count;
+            done += count;
+            Monitor::PulseAll(m_Locker);
+            continue;
+        }
+
+        // The ring holds up to one capacity past what is on disk. The chunk being written still occupies its part of the ring.
+        int64_t room = m_Written + m_Capacity - m_Position;
+        if (room <= 0)
+        {
+            int64_t start = Stopwatch::GetTimestamp();
+            m_Stalls++;
+            while (m_Written + m_Capacity - m_Position <= 0 && !m_Failed && !m_Cancelled)
+                Monitor::Wait(m_Locker);
+
+            m_StallTicks += Stopwatch::GetTimestamp() - start;
+            continue;
+        }
+
+        // A seek past the end leaves a gap, fill it with zeros.
+        if (m_Position > m_End)
+        {
+            CopyToRing(m_End, nullptr, (int)(m_Position - m_End));
+            m_End = m_Position;
+        }
+
+        int count = (int)Math::Min((int64_t)remaining, room);
+        CopyToRing(m_Position, buffer + done, count);
+        m_Position += count;
+        m_End = Math::Max(m_End, m_Position);
+        done += count;
+        Monitor::PulseAll(m_Locker);
+    }
+
+    return size;
+}
+int64_t WriteBehindStream::Seek(int64_t offset, SeekOrigin origin)
+{
+    lock l(m_Locker);
+
+    int64_t position = offset;
+    if (origin == SeekOrigin::Current)
+        position += m_Position;
+    else if (origin == SeekOrigin::End)
+        position += m_End;
+
+    if (position < 0)
+        return -1;
+
+    m_Position = position;
+    return position;
+}
+bool WriteBehindStream::Flush()
+{
+    lock l(m_Locker);
+
+    // Let the I/O thread write the last partial chunk.
+    m_Flushing = true;
+    Monitor::PulseAll(m_Locker);
+    while ((m_Taken < m_End || m_Patches->Count > 0 || m_Busy) && !m_Failed && !m_Cancelled)
+        Monitor::Wait(m_Locker);
+
+    m_Flushing = false;
+    return !m_Failed;
+}
+bool WriteBehindStream::Close()
+{
+    if (m_Stream == nullptr)
+        return !m_Failed;
+
+    Flush();
+
+    {
+        lock l(m_Locker);
+        m_Cancelled = true;
+        Monitor::PulseAll(m_Locker);
+    }
+
+    if (m_IOThread != nullptr)
+        m_IOThread->Join();
+
+    m_IOThread = nullptr;
+
+    try
+    {
+        // Give back the space allocated ahead of the data.
+        if (m_Allocated > m_End)
+            m_Stream->SetLength(m_End);
+
+        m_Stream->Close();
+    }
+    catch (Exception^ e)
+    {
+        log->Error("Write-behind stream failed to close the underlying stream.", e);
+        m_Failed = true;
+    }
+
+    m_Stream = nullptr;
+    return !m_Failed;
+}
+void WriteBehindStream::ResetCounters()
+{
+    lock l(m_Locker);
+    m_BytesWritten = 0;
+    m_WriteTicks = 0;
+    m_MaxWriteTicks = 0;
+    m_StallTicks = 0;
+    m_Writes = 0;
+    m_Stalls = 0;
+    m_Patched = 0;
+}
+void WriteBehindStream::DumpStats()
+{
+    double megabyte = 1024 * 1024;
+    log->DebugFormat("Write-behind. Written:{0:0.0} MB at {1:0.0} MB/s, Latency:{2:0.0} ms (max:{3:0.0} ms), Stalls:{4} ({5:0} ms), Patches:{6}, Queue:{7:0} MB.",
+        m_BytesWritten / megabyte, Throughput, WriteLatency, MaxWriteLatency, m_Stalls, StallMilliseconds, m_Patched, m_Capacity / megabyte);
+}
+AVIOContext* WriteBehindStream::CreateIOContext()
+{
+    uint8_t* pBuffer = (uint8_t*)av_malloc(IOBufferSize);
+    if (pBuffer == nullptr)
+        return nullptr;
+
+    if (!m_Handle.IsAllocated)
+        m_Handle = GCHandle::Alloc(this);
+
+    void* opaque = GCHandle::ToIntPtr(m_Handle).ToPointer();
+    AVIOContext* pIOContext = avio_alloc_context(pBuffer, IOBufferSize, 1, opaque, nullptr, &WritePacketCallback, &SeekCallback);
+    if (pIOContext == nullptr)
+        av_free(pBuffer);
+
+    return pIOContext;
+}
+void WriteBehindStream::FreeIOContext(AVIOContext** _ppIOContext)
+{
+    if (*_ppIOContext == nullptr)
+        return;
+
+    av_free((*_ppIOContext)->buffer);
+    av_free(*_ppIOContext);
+    *_ppIOContext = nullptr;
+}
+void WriteBehindStream::CopyToRing(int64_t position, uint8_t* source, int count)
+{
+    // Always inside the lock.
+    // Copy into the ring in two parts if the data wraps around its end. A null source writes zeros.
+    int ringOffset = (int)(position % m_Capacity);
+    int first = Math::Min(count, m_Capacity - ringOffset);
+    pin_ptr<Byte> pRing = &m_Ring[0];
+    if (source == nullptr)
+    {
+        memset(pRing + ringOffset, 0, first);
+        if (first < count)
+            memset(pRing, 0, count - first);
+    }
+    else
+    {
+        memcpy(pRing + ringOffset, source, first);
+        if (first < count)
+            memcpy(pRing, source + first, count - first);
+    }
+}
+bool WriteBehindStream::HasWork()
+{
+    // Always inside the lock.
+    if (m_Patches->Count > 0)
+        return true;
+
+    int64_t pending = m_End - m_Taken;
+    if (pending <= 0)
+        return false;
+
+    // Only whole chunks are written, unless someone is waiting for the data.
+    return m_Flushing || pending >= ChunkSize - (m_Taken % ChunkSize);
+}
+void WriteBehindStream::IOWorker()
+{
+    while (true)
+    {
+        int64_t position;
+        int ringOffset;
+        int count;
+        List<KeyValuePair<int64_t, array<Byte>^>>^ patches = nullptr;
+
+        {
+            lock l(m_Locker);
+
+            while (!m_Cancelled && !m_Failed && !HasWork())
+                Monitor::Wait(m_Locker);
+
+            if (m_Cancelled || m_Failed)
+                break;
+
+            // Stop at the next chunk boundary so the writes stay aligned in the file.
+            // Writes landing before m_Taken go to the patches, so the ring section can then be read without the lock.
+            position = m_Taken;
+            ringOffset = (int)(position % m_Capacity);
+            count = (int)Math::Min(m_End - position, ChunkSize - (position % ChunkSize));
+            m_Taken += count;
+
+            if (m_Patches->Count > 0)
+            {
+                patches = m_Patches;
+                m_Patches = gcnew List<KeyValuePair<int64_t, array<Byte>^>>();
+            }
+
+            m_Busy = true;
+        }
+
+        // Patches target data taken in previous rounds, which is already on disk.
+        int64_t written = 0;
+        bool failed = false;
+        int64_t start = Stopwatch::GetTimestamp();
+        try
+        {
+            if (count > 0)
+            {
+                if (m_Stream->CanSeek)
+                {
+                    if (position + count > m_Allocated)
+                    {
+                        // Grow the file ahead of the data in large steps.
+                        m_Allocated = position + count + PreallocationStep;
+                        m_Stream->SetLength(m_Allocated);
+                    }
+
+                    if (m_Stream->Position != position)
+                        m_Stream->Position = position;
+                }
+
+                m_Stream->Write(m_Ring, ringOffset, count);
+                written += count;
+            }
+
+            if (patches != nullptr)
+            {
+                for each (KeyValuePair<int64_t, array<Byte>^> patch in patches)
+                {
+                    m_Stream->Position = patch.Key;
+                    m_Stream->Write(patch.Value, 0, patch.Value->Length);
+                    written += patch.Value->Length;
+                }
+            }
+        }
+        catch (Exception^ e)
+        {
+            log->Error("Write-behind stream failed to write the underlying stream.", e);
+            failed = true;
+        }
+
+        int64_t elapsed = Stopwatch::GetTimestamp() - start;
+
+        {
+            lock l(m_Locker);
+            m_Written = position + count;
+            m_BytesWritten += written;
+
+            if (count > 0)
+            {
+                m_Writes++;
+                m_WriteTicks += elapsed;
+                m_MaxWriteTicks = Math::Max(m_MaxWriteTicks, elapsed);
+            }
+
+            if (patches != nullptr)
+                m_Patched += patches->Count;
+
+            if (failed)
+                m_Failed = true;
+
+            m_Busy = false;
+            Monitor::PulseAll(m_Locker);
+        }
+    }
+}
@@ -0,0 +1,196 @@
+﻿#pragma region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+#pragma endregion
+
+#pragma once
+
+extern "C" {
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <avformat.h>
+}
+
+#include <stdint.h>
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::Diagnostics;
+using namespace System::IO;
+using namespace System::Reflection;
+using namespace System::Runtime::InteropServices;
+using namespace System::Threading;
+
+namespace Kinovea { namespace Video { namespace FFMpeg
+{
+    /// <summary>
+    /// Takes the muxer output into memory and writes it to the file from a dedicated I/O thread.
+    /// The recording loop only waits on the disk when the queue is full, short disk hiccups are absorbed by the queue.
+    /// The queue is a ring indexed by file position. The I/O thread writes it out in large chunks aligned on the chunk size,
+    /// and the file is grown ahead of the data in large steps to limit fragmentation. The extra space is cut at close.
+    /// Muxers seek back to fill in sizes after the fact. Writes landing in data already taken by the I/O thread
+    /// are kept aside and applied once the chunk containing them is on disk.
+    /// Thread safe: the queue bounds are only changed under the lock, the disk is written outside of it.
+    /// </summary>
+    public ref class WriteBehindStream
+    {
+    public:
+        property int64_t Length {
+            int64_t get() { return m_End; }
+        }
+
+        /// <summary>
+        /// Size of the queue in bytes.
+        /// </summary>
+        property int Capacity {
+            int get() { return m_Capacity; }
+        }
+
+        /// <summary>
+        /// Number of bytes accepted and not yet on disk.
+        /// </summary>
+        property int64_t QueueBytes {
+            int64_t get() { return m_End - m_Written; }
+        }
+
+        /// <summary>
+        /// Number of bytes written to the underlying stream, including patches.
+        /// </summary>
+        property int64_t BytesWritten {
+            int64_t get() { return m_BytesWritten; }
+        }
+
+        /// <summary>
+        /// Number of writes that had to wait for room in the queue.
+        /// </summary>
+        property int Stalls {
+            int get() { return m_Stalls; }
+        }
+
+        /// <summary>
+        /// Total time spent waiting for room in the queue, in milliseconds.
+        /// </summary>
+        property double StallMilliseconds {
+            double get() { return (double)m_StallTicks * 1000 / Stopwatch::Frequency; }
+        }
+
+        /// <summary>
+        /// Average duration of a chunk write to the underlying stream, in milliseconds.
+        /// </summary>
+        property double WriteLatency {
+            double get() { return m_Writes > 0 ? ((double)m_WriteTicks * 1000 / Stopwatch::Frequency) / m_Writes : 0; }
+        }
+
+        /// <summary>
+        /// Longest chunk write to the underlying stream, in milliseconds.
+        /// </summary>
+        property double MaxWriteLatency {
+            double get() { return (double)m_MaxWriteTicks * 1000 / Stopwatch::Frequency; }
+        }
+
+        /// <summary>
+        /// Throughput of the underlying stream while it was being written, in MB/s.
+        /// </summary>
+        property double Throughput {
+            double get() { return m_WriteTicks > 0 ? (m_BytesWritten / (1024.0 * 1024.0)) / ((double)m_WriteTicks / Stopwatch::Frequency) : 0; }
+        }
+
+        /// <summary>
+        /// Whether a write to the underlying stream failed. Subsequent writes are rejected.
+        /// </summary>
+        property bool Failed {
+            bool get() { return m_Failed; }
+        }
+
+    public:
+        WriteBehindStream(String^ filePath, int capacity);
+        WriteBehindStream(Stream^ stream, int capacity);
+        ~WriteBehindStream();
+    protected:
+        !WriteBehindStream();
+
+    public:
+        /// <summary>
+        /// Write at the current position. Blocks while the queue is full.
+        /// </summary>
+        void Write(array<Byte>^ buffer, int offset, int count);
+        int64_t Seek(int64_t offset, SeekOrigin origin);
+
+        /// <summary>
+        /// Block until everything accepted so far is on disk. Returns false if the underlying stream failed.
+        /// </summary>
+        bool Flush();
+
+        /// <summary>
+        /// Flush, stop the I/O thread, trim the preallocated space and close the underlying stream.
+        /// Returns false if any data could not be written.
+        /// </summary>
+        bool Close();
+        void ResetCounters();
+        void DumpStats();
+
+    internal:
+        /// <summary>
+        /// Create an AVIOContext writing to this stream, to be set as the pb of a muxer before writing the header.
+        /// Must be flushed and freed with FreeIOContext after the trailer has been written.
+        /// </summary>
+        AVIOContext* CreateIOContext();
+        static void FreeIOContext(AVIOContext** _ppIOContext);
+        int Write(uint8_t* buffer, int size);
+
+    private:
+        void Initialize(Stream^ stream, int capacity);
+        void CopyToRing(int64_t position, uint8_t* source, int count);
+        bool HasWork();
+        void IOWorker();
+
+    private:
+        static const int ChunkSize = 4 * 1024 * 1024;
+        static const int IOBufferSize = 256 * 1024;
+        static const int MinCapacity = 4 * ChunkSize;
+        static const int64_t PreallocationStep = 64 * 1024 * 1024;
+
+        Stream^ m_Stream;
+        array<Byte>^ m_Ring;
+        int m_Capacity;
+        int64_t m_Position;
+        int64_t m_End;
+        int64_t m_Taken;
+        int64_t m_Written;
+        int64_t m_Allocated;
+        List<KeyValuePair<int64_t, array<Byte>^>>^ m_Patches;
+        bool m_Flushing;
+        bool m_Busy;
+        bool m_Failed;
+        bool m_Cancelled;
+        Thread^ m_IOThread;
+        Object^ m_Locker;
+        GCHandle m_Handle;
+
+        int64_t m_BytesWritten;
+        int64_t m_WriteTicks;
+        int64_t m_MaxWriteTicks;
+        int64_t m_StallTicks;
+        int m_Writes;
+        int m_Stalls;
+        int m_Patched;
+        static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+    };
+}}}
@@ -0,0 +1,146 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+using System.Diagnostics;
+using System.Globalization;
+using System.IO;
+using System.Text;
+using Kinovea.Services;
+
+namespace Kinovea.Video
+{
+    /// <summary>
+    /// Rolling distributions of the time spent in each stage of the decoding pipeline.
+    /// Always on, so the cost of a given file can be inspected without rebuilding with extra logging.
+    /// </summary>
+    /// <remarks>
+    /// Durations are passed in Stopwatch ticks. Stages are recorded by the decoding threads and the statistics
+    /// may be read from the UI thread at any time.
+    /// </remarks>
+    public class DecodingStatistics
+    {
+        #region Properties
+        public RollingHistogram this[DecodingStage stage]
+        {
+            get { return histograms[(int)stage]; }
+        }
+        #endregion
+
+        #region Members
+        public const int DefaultWindow = 512;
+        private static readonly DecodingStage[] stages = (DecodingStage[])Enum.GetValues(typeof(DecodingStage));
+        private RollingHistogram[] histograms;
+        #endregion
+
+        public DecodingStatistics() : this(DefaultWindow) { }
+        public DecodingStatistics(int window)
+        {
+            histograms = new RollingHistogram[stages.Length];
+            for (int i = 0; i < stages.Length; i++)
+                histograms[i] = new RollingHistogram(window);
+        }
+
+        #region Public methods
+        public void Record(DecodingStage stage, long ticks)
+        {
+            histograms[(int)stage].Add(ticks);
+        }
+
+        /// <summary>
+        /// Records the time elapsed since start and returns the current time, to chain consecutive stages.
+        /// </summary>
+        public long Lap(DecodingStage stage, long start)
+        {
+            long now = Stopwatch.GetTimestamp();
+            histograms[(int)stage].Add(now - start);
+            return now;
+        }
+
+        public void Reset()
+        {
+            foreach (RollingHistogram histogram in histograms)
+                histogram.Clear();
+        }
+
+        /// <summary>
+        /// One line per stage that has samples, with the share of the frame time.
+        /// Some stages run several times per frame, the share uses the number of runs per frame since the last reset.
+        /// </summary>
+        public override string ToString()
+        {
+            StringBuilder b = new StringBuilder();
+            RollingHistogram frame = this[DecodingStage.Frame];
+            double frameMean = frame.MeanMilliseconds;
+            long frames = frame.Total;
+            foreach (DecodingStage stage in stages)
+            {
+                RollingHistogram h = this[stage];
+                if (h.Count == 0)
+                    continue;
+
+                b.AppendFormat("{0}: {1:0.000}ms (p50:{2:0.000}, p95:{3:0.000}, n:{4})",
+                    stage, h.MeanMilliseconds, h.Percentile(0.5), h.Percentile(0.95), h.Total);
+
+                if (stage != DecodingStage.Frame && frameMean > 0 && frames > 0)
+                    b.AppendFormat(", {0:0%}", h.MeanMilliseconds * ((double)h.Total / frames) / frameMean);
+
+                b.AppendLine();
+            }
+
+            return b.ToString();
+        }
+
+        /// <summary>
+        /// Returns a CSV table with one line per stage: summary values then the sample count in each bucket.
+        /// Uses the invariant culture so the file opens the same everywhere.
+        /// </summary>
+        public string ToCsv()
+        {
+            CultureInfo culture = CultureInfo.InvariantCulture;
+            StringBuilder b = new StringBuilder();
+            b.Append("Stage,Samples,Total,Mean (ms),P50 (ms),P95 (ms),P99 (ms)");
+            for (int i = 0; i < RollingHistogram.BucketCount; i++)
+                b.AppendFormat(culture, ",<{0}ms", RollingHistogram.GetBucketUpperMilliseconds(i));
+
+            b.AppendLine();
+
+            foreach (DecodingStage stage in stages)
+            {
+                RollingHistogram h = this[stage];
+                b.AppendFormat(culture, "{0},{1},{2},{3:0.000},{4:0.000},{5:0.000},{6:0.000}",
+                    stage, h.Count, h.Total, h.MeanMilliseconds, h.Percentile(0.5), h.Percentile(0.95), h.Percentile(0.99));
+
+                foreach (int bucket in h.GetBuckets())
+                    b.AppendFormat(",{0}", bucket);
+
+                b.AppendLine();
+            }
+
+            return b.ToString();
+        }
+
+        public void WriteCsv(string path)
+        {
+            File.WriteAllText(path, ToCsv());
+        }
+        #endregion
+    }
+}
@@ -25,4 +25,5 @@ namespace Kinovea.Video
 {
     public delegate void VideoFrameDisposer(VideoFrame frame);
     public delegate bool ImageRetriever(VideoFrame frame, Bitmap output);
+    public delegate Bitmap VideoFrameMaterializer(VideoFrame frame);
 }
@@ -54,6 +54,23 @@ namespace Kinovea.Video
         Caching         // All the frames of the working zone have been loaded to a large buffer.
     }
 
+    /// <summary>
+    /// The steps a frame goes through in the video reader, for instrumentation.
+    /// </summary>
+    public enum DecodingStage
+    {
+        Demux,          // Reading packets from the file, including packets of other streams.
+        Decode,         // Decoding the packets that produce a picture.
+        BufferingSkip,  // Decoding the packets that don't produce a picture yet (reordering, frame threading).
+        Seek,           // Seeking the demuxer and flushing the decoder.
+        SeekRetry,      // Seeking further back after landing past the target.
+        Convert,        // Deinterlacing, scaling and pixel format conversion.
+        Rotate,         // Rotating the converted image.
+        BitmapWrap,     // Wrapping the image buffer into a frame object, including the rotation if any.
+        ContainerAdd,   // Pushing the frame to the container, including waiting for room in the prebuffer.
+        Frame           // The whole frame, from the request until it is ready to be pushed to the container.
+    }
+
     public enum OpenVideoResult
     {
         Success,
@@ -89,6 +106,7 @@ namespace Kinovea.Video
         UnknownError,
         MovieNotLoaded,
         TranscodeNotFinished,
-        Cancelled
+        Cancelled,
+        QueueFull
     }
 }
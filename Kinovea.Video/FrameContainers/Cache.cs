@@ -226,11 +226,19 @@ namespace Kinovea.Video
             int halfIndex = m_Frames.Count/2;
             for(int i = 0; i<halfIndex; i++)
             {
+                // Swap the frames and restore the timestamps, this works for compact frames too.
                 int opposedIndex = lastIndex - i;
-                Bitmap tmp = m_Frames[i].Image;
-                m_Frames[i].Image = m_Frames[opposedIndex].Image;
-                m_Frames[opposedIndex].Image = tmp;
+                VideoFrame tmp = m_Frames[i];
+                m_Frames[i] = m_Frames[opposedIndex];
+                m_Frames[opposedIndex] = tmp;
+
+                long timestamp = m_Frames[i].Timestamp;
+                m_Frames[i].Timestamp = m_Frames[opposedIndex].Timestamp;
+                m_Frames[opposedIndex].Timestamp = timestamp;
             }
+
+            if(m_CurrentIndex >= 0)
+                m_Current = m_Frames[m_CurrentIndex];
         }
         #endregion
     }
@@ -26,26 +26,30 @@ using System.Drawing;
 using System.Linq;
 using System.Threading;
 using Kinovea.Services;
+using Kinovea.Pipeline.MemoryLayout;
 
 namespace Kinovea.Video
 {
     /// <summary>
-    /// A buffer to anticipate some frames from the future, and remember some from the past.
+    /// A buffer to anticipate some frames from the future, and remember some from the past. 
     /// The prebuffered section is entirely contained inside the working zone boundaries.
     /// It is a contiguous set of frames, except that it may wrap over the end of the working zone.
     /// </summary>
     /// <remarks>
     /// Naming:
     /// - Segment: the section of prebuffered frames, contained inside the working zone.
+    /// - Capacity: the total number of frames the buffer may hold. It can be changed while the producer runs.
     /// - OldFramesCapacity: the number of frames kept that are older than the current point.
+    /// - Position: monotonic index of a frame since the creation of the buffer. The slot is the position modulo the ring capacity.
     ///
     /// Thread safety:
-    /// Locking is necessary around all access to m_Frames as it is read and written by both the UI and the decoding thread.
-    /// Assumedly, there is no need to lock around access to m_Current.
-    /// This is because m_Frames is only accessed for add by the decoding thread and this has no impact on m_Current reference.
-    /// The only thing that alters the reference to m_Current are: MoveNext, MoveTo, PurgeOutsiders, Clear.
-    /// All these are initiated by the UI thread itself, so it will not be using m_Current simultaneously.
-    /// Similarly, drop count is only updated in MoveNext and MoveTo, so only from the UI thread.
+    /// The frames are stored in a fixed-size ring shared by a single producer (the decoding thread) and a single consumer (the UI thread).
+    /// The producer only writes m_Head, after the frame is stored in its slot, the consumer only writes m_Tail, after the old frames are disposed.
+    /// Each side only needs a volatile read of the other's position, so the UI never waits on the decoding thread.
+    /// The positions are padded to their own cache line so the two threads don't invalidate each other's cache at each frame.
+    /// m_Current, m_CurrentPosition and the drop count are only touched by the consumer.
+    /// When the buffer is full the producer sleeps on m_RoomAvailable, which is set each time the consumer frees slots.
+    /// When the decoding thread is stopped, the UI thread may also push frames itself, the two are never running at the same time.
     ///</remarks>
     public class PreBuffer : IDisposable, IVideoFramesContainer
     {
@@ -57,27 +61,48 @@ namespace Kinovea.Video
         { 
             get 
             { 
-                lock(m_Locker) 
-                    return m_Segment;
+                long tail = m_Tail.Data;
+                long head = m_Head.Data;
+                if(head < tail)
+                    return VideoSection.MakeEmpty();
+
+                return new VideoSection(GetFrame(tail).Timestamp, GetFrame(head).Timestamp);
             } 
         }
         public int Drops { 
             get { return m_Drops; }
         }
+        /// <summary>
+        /// Total number of frames the buffer may hold.
+        /// When reduced below the current count, the producer waits until enough frames have been consumed.
+        /// </summary>
+        public int Capacity
+        {
+            get { return m_TotalCapacity; }
+            set
+            {
+                int capacity = Math.Min(Math.Max(value, MinCapacity), MaxCapacity);
+                m_OldFramesCapacity = Math.Min(m_DefaultOldFramesCapacity, capacity / 3);
+                m_TotalCapacity = capacity;
+            }
+        }
         #endregion
         
         #region Members
-        private List<VideoFrame> m_Frames = new List<VideoFrame>();
-        private VideoSection m_Segment = VideoSection.MakeEmpty();
+        private VideoFrame[] m_Slots;
+        private int m_RemainderMask;
+        private CacheLineStorageLong m_Head = new CacheLineStorageLong(-1);   // Last position written to by the producer.
+        private CacheLineStorageLong m_Tail = new CacheLineStorageLong(0);    // Oldest position still held by the consumer.
+        private ManualResetEventSlim m_RoomAvailable = new ManualResetEventSlim(true);
         private VideoSection m_WorkingZone = VideoSection.MakeEmpty();
-        private int m_CurrentIndex = -1;
+        private long m_CurrentPosition = -1;
         private VideoFrame m_Current;
-        private readonly object m_Locker = new object();
         
-        private int m_DefaultTotalCapacity = 25;
-        private int m_TotalCapacity = 25;
+        public const int MinCapacity = 8;
+        public const int MaxCapacity = 256;
+        private volatile int m_TotalCapacity = 25;
         private int m_DefaultOldFramesCapacity = 8;
-        private int m_OldFramesCapacity = 8; // Will later be taken from Prefs, possibly in MB instead of frames.
+        private volatile int m_OldFramesCapacity = 8;
         private int m_Drops;
         private VideoFrameDisposer m_DisposeBitmap;
         private TimeWatcher m_TimeWatcher = new TimeWatcher();
@@ -85,10 +110,18 @@ namespace Kinovea.Video
         #endregion
         
         #region Construction & Disposal
-        public PreBuffer(){}
+        public PreBuffer() : this(null) {}
         public PreBuffer(VideoFrameDisposer _disposeDelegate)
         {
             m_DisposeBitmap = _disposeDelegate;
+
+            // Constrain the ring to a power of two to use "&" rather than modulo when computing the slot.
+            int ringCapacity = 1;
+            while(ringCapacity < MaxCapacity)
+                ringCapacity <<= 1;
+
+            m_Slots = new VideoFrame[ringCapacity];
+            m_RemainderMask = ringCapacity - 1;
         }
         public void Dispose()
         {
@@ -102,7 +135,10 @@ namespace Kinovea.Video
         protected virtual void Dispose(bool disposing)
         {
             if (disposing)
+            {
                 Clear();
+                m_RoomAvailable.Dispose();
+            }
         }
         #endregion
         
@@ -111,29 +147,25 @@ namespace Kinovea.Video
         {
             //m_TimeWatcher.Restart();
             bool read = false;
-            lock(m_Locker)
-            {
-                int lastIndex = m_Frames.Count - 1;
-                int expectedCurrentIndex = m_CurrentIndex + m_Drops + _frames - 1;
+            long tail = m_Tail.Data;
+            long head = m_Head.Data;
+            long expectedPosition = m_CurrentPosition + m_Drops + _frames - 1;
             
-                if(expectedCurrentIndex < lastIndex)
-                {
-                    m_CurrentIndex = expectedCurrentIndex + 1;
-                    m_Drops = 0;
-                    read = true;
-                }
-                else
-                {
-                    m_Drops = expectedCurrentIndex - lastIndex + 1;
-                    //log.DebugFormat("Decoding Drops: {0}.", m_Drops);
-                }
-                
-                if(m_CurrentIndex >= 0 && m_CurrentIndex <= lastIndex)
-                    m_Current = m_Frames[m_CurrentIndex];
+            if(expectedPosition < head)
+            {
+                m_CurrentPosition = expectedPosition + 1;
+                m_Drops = 0;
+                read = true;
+            }
+            else
+            {
+                m_Drops = (int)(expectedPosition - head + 1);
+                //log.DebugFormat("Decoding Drops: {0}.", m_Drops);
             }
+                
+            if(m_CurrentPosition >= tail && m_CurrentPosition <= head)
+                m_Current = GetFrame(m_CurrentPosition);
             
-            // ForgetOldFrames will take another lock, should it be inside the first ?
-            // It will possibily do a Pulse.
             ForgetOldFrames();
             //m_TimeWatcher.DumpTimes();
             return read;
@@ -148,21 +180,20 @@ namespace Kinovea.Video
             if( m_Current != null && _timestamp == m_Current.Timestamp)
                 return true;
 
-            lock(m_Locker)
+            long tail = m_Tail.Data;
+            long head = m_Head.Data;
+            foreach(long position in SortedPositions(tail, head))
             {
-                foreach(int i in SortedFrames())
+                if(GetFrame(position).Timestamp >= _timestamp)
                 {
-                    if(m_Frames[i].Timestamp >= _timestamp)
-                    {
-                        m_CurrentIndex = i;
-                        break;
-                    }
+                    m_CurrentPosition = position;
+                    break;
                 }
-            
-                if(m_CurrentIndex >= 0 && m_CurrentIndex <= m_Frames.Count - 1)
-                    m_Current = m_Frames[m_CurrentIndex];
             }
             
+            if(m_CurrentPosition >= tail && m_CurrentPosition <= head)
+                m_Current = GetFrame(m_CurrentPosition);
+            
             ForgetOldFrames();
             
             return true;
@@ -173,127 +204,73 @@ namespace Kinovea.Video
         }
         public bool HasNext(int _skip)
         {
-            lock(m_Locker)
-                return m_CurrentIndex + m_Drops + _skip + 1 < m_Frames.Count;
+            return m_CurrentPosition + m_Drops + _skip < m_Head.Data;
         }
         public void Add(VideoFrame _frame)
         {
-            lock(m_Locker)
+            // Producer side.
+            long position = m_Head.Data + 1;
+            //log.DebugFormat("Add - Pushing frame [{0}] to prebuffer. ({1}/{2}).", _frame.Timestamp, position - m_Tail.Data + 1, m_TotalCapacity);
+            m_Slots[position & m_RemainderMask] = _frame;
+            m_Head.Data = position;
+
+            // We wait after the actual Add so the decoding thread, when woken up,
+            // can check for cancellation *before* pushing another frame.
+            // The event is reset before checking again to not miss a release happening in between.
+            while(Count >= m_TotalCapacity)
             {
-                //log.DebugFormat("Add - Pushing frame [{0}] to prebuffer. ({1}/{2}).", _frame.Timestamp, m_Frames.Count+1, m_TotalCapacity);
-                m_Frames.Add(_frame);
-                UpdateSegment();
-                while (m_Frames.Count >= m_TotalCapacity)
-                {
-                    // Will release its lock and freeze until there is a pulse.
-                    // We do this after the actual Add so the decoding thread, when woken up,
-                    // can check for cancellation *before* pushing another frame.
-                    Monitor.Wait(m_Locker);
-                }
+                m_RoomAvailable.Reset();
+                if(Count < m_TotalCapacity)
+                    break;
+
+                m_RoomAvailable.Wait();
             }
         }
         public bool Contains(long _timestamp)
         {
-            lock(m_Locker)
+            VideoSection segment = Segment;
+            if(segment.Wrapped)
             {
-                if(m_Segment.Wrapped)
-                {
-                    bool postWrap = _timestamp >= m_WorkingZone.Start && _timestamp <= m_Segment.End;
-                    bool preWrap = _timestamp >= m_Segment.Start && _timestamp <= m_WorkingZone.End;
-                    return postWrap || preWrap;
-                }
-                else
-                {
-                    return m_Segment.Contains(_timestamp);
-                }
+                bool postWrap = _timestamp >= m_WorkingZone.Start && _timestamp <= segment.End;
+                bool preWrap = _timestamp >= segment.Start && _timestamp <= m_WorkingZone.End;
+                return postWrap || preWrap;
+            }
+            else
+            {
+                return segment.Contains(_timestamp);
             }
         }
         public void Clear()
         {
-            lock(m_Locker)
-            {
-                m_Current = null;
-                
-                foreach(VideoFrame vf in m_Frames)
-                    DisposeFrame(vf);
-                
-                m_Frames.Clear();
-                m_CurrentIndex = -1;
-                m_Drops = 0;
-                m_Segment = VideoSection.MakeEmpty();
-                m_TotalCapacity = m_DefaultTotalCapacity;
-                m_OldFramesCapacity = m_DefaultOldFramesCapacity;
-                
-                Monitor.Pulse(m_Locker);
-            }
+            // Frames pushed by the producer after we read the head will stay in the buffer.
+            m_Current = null;
+            long head = m_Head.Data;
+            Release(head + 1);
+
+            m_CurrentPosition = head;
+            m_Drops = 0;
         }
         public void UnblockAndMakeRoom()
         {
-            lock(m_Locker)
-            {
-                // This is used to temporarily deactivate the prebuffering thread without 
-                // completely clearing it. The decoding thread is potentially waiting on a full buffer,
-                // so we must discard at least one frame to make it run again and check for cancellation.
-                // However, the next Add is assumed to run on the UI thread, so it must not block.
-                // So we actually need to have two empty slots: one to push the read,
-                // and one to make that push non-blocking.
-                log.Debug("Unblocking prebuffering thread and making room for a non blocking addition.");
-                
-                while(m_Frames.Count > m_TotalCapacity - 2)
-                {
-                    DisposeFrame(m_Frames[0]);
-                    m_Frames.RemoveAt(0);
-                    m_CurrentIndex--;
-                }
-                UpdateSegment();
-                
-                Monitor.Pulse(m_Locker);
-            }
+            // This is used to temporarily deactivate the prebuffering thread without 
+            // completely clearing it. The decoding thread is potentially waiting on a full buffer,
+            // so we must discard at least one frame to make it run again and check for cancellation.
+            // However, the next Add is assumed to run on the UI thread, so it must not block.
+            // So we actually need to have two empty slots: one to push the read,
+            // and one to make that push non-blocking.
+            log.Debug("Unblocking prebuffering thread and making room for a non blocking addition.");
+            
+            long excess = Count - (m_TotalCapacity - 2);
+            Release(m_Tail.Data + Math.Max(excess, 0));
         }
         
         public void UpdateWorkingZone(VideoSection _newZone)
         {
-            if(m_Frames.Count > 0)
+            if(Count > 0)
                 Clear();
             
             m_WorkingZone = _newZone;
         }
-        /// <summary>
-        /// Remove all items that are outside the working zone.
-        /// </summary>
-        public void PurgeOutsiders()
-        {
-            lock(m_Locker)
-            {
-                log.Debug("Purging Outsiders in PreBuffer.");
-                int removedAtLeft = 0;
-                foreach(int i in SortedFrames())
-                {
-                    if(m_WorkingZone.Contains(m_Frames[i].Timestamp))
-                        continue;
-                    
-                    if(m_Frames[i].Timestamp < m_WorkingZone.Start)
-                        removedAtLeft++;
-                        
-                    DisposeFrame(m_Frames[i]);
-                    m_Frames[i] = null;
-                    
-                    if(i==m_CurrentIndex)
-                        m_CurrentIndex = -1;
-                }
-                
-                if(m_CurrentIndex >= removedAtLeft)
-                    m_CurrentIndex-=removedAtLeft;
-                
-                m_CurrentIndex = Math.Max(0, m_CurrentIndex);
-                m_Current = m_Frames[m_CurrentIndex];
-                
-                m_Frames.RemoveAll(frame => object.ReferenceEquals(null, frame));
-                UpdateSegment();
-                
-                Monitor.Pulse(m_Locker);
-            }
-        }
         public bool IsRolloverJump(long _timestamp)
         {
             // A rollover (back to begining after end of working zone),
@@ -305,33 +282,49 @@ namespace Kinovea.Video
         #region Debug
         public void DumpToDisk()
         {
-            lock(m_Locker)
-                foreach(VideoFrame vf in m_Frames)
-                    vf.Image.Save(String.Format("{0}.bmp", vf.Timestamp));
+            long head = m_Head.Data;
+            for(long position = m_Tail.Data; position <= head; position++)
+            {
+                VideoFrame vf = GetFrame(position);
+                vf.Image.Save(String.Format("{0}.bmp", vf.Timestamp));
+            }
         }
         #endregion
         
         #endregion
         
         #region Private methods
-        private IEnumerable<int> SortedFrames()
+        private long Count
+        {
+            get { return m_Head.Data - m_Tail.Data + 1; }
+        }
+        private VideoFrame GetFrame(long _position)
+        {
+            return m_Slots[_position & m_RemainderMask];
+        }
+        private IEnumerable<long> SortedPositions(long _tail, long _head)
         {
-            // /!\ Should only be called from inside a lock construct.
+            // /!\ Should only be called from the consumer side.
             
-            // Returns an iterator on the indices of frames in the buffer in the order of timestamps.
-            // For example if the current buffer is [7;8;9;0;1] it will return [0;1;7;8;9].
+            // Returns an iterator on the positions of frames in the buffer in the order of timestamps.
+            // For example if the current buffer is [7;8;9;0;1] it will return the positions of [0;1;7;8;9].
             // Can be used to loop over the frames without bothering about wrapping.
+            long wrapPosition = GetWrapPosition(_tail, _head);
             
-            // todo: keep track of the wrap index outside here.
-            int wrapIndex = GetWrapIndex();
+            for(long position = wrapPosition; position <= _head; position++)
+                yield return position;
             
-            for(int i = 0; i<m_Frames.Count; i++)
-            {
-                int next = i + wrapIndex;
-                if(next > m_Frames.Count - 1)
-                    next -= m_Frames.Count;
-                yield return next;
-            }
+            for(long position = _tail; position < wrapPosition; position++)
+                yield return position;
+        }
+        private long GetWrapPosition(long _tail, long _head)
+        {
+            // Return the position of the frame right after the wrap break.
+            long position = _tail + 1;
+            while(position <= _head && GetFrame(position).Timestamp > GetFrame(position - 1).Timestamp)
+                position++;
+            
+            return position <= _head ? position : _tail;
         }
         private void DisposeFrame(VideoFrame _frame)
         {
@@ -340,51 +333,31 @@ namespace Kinovea.Video
             else
                 _frame.Image.Dispose();
         }
-        private void UpdateSegment()
+        private void ForgetOldFrames()
         {
-            // Get real data from the stored frames.
-            // Always inside a lock.
-            if(m_Frames.Count < 1)
-                m_Segment = VideoSection.MakeEmpty();
-            else
-                m_Segment = new VideoSection(m_Frames[0].Timestamp, m_Frames[m_Frames.Count - 1].Timestamp);
+            long tail = m_Tail.Data;
+            if(m_CurrentPosition - tail < m_OldFramesCapacity)
+                return;
 
-            //log.DebugFormat("Updated segment: {0}", m_Segment);
+            //log.DebugFormat("Forgetting {0} frames.", m_CurrentPosition - tail - m_OldFramesCapacity + 1);
+            Release(m_CurrentPosition - m_OldFramesCapacity + 1);
         }
-        private int GetWrapIndex()
+        private void Release(long _newTail)
         {
-            // Return the index of the frame right after the wrap break.
-            // Always inside a lock.
-            if(m_Frames.Count < 2 || !m_Segment.Wrapped)
-                return 0;
-            
-            int i = 1;
-            while(m_Frames[i].Timestamp > m_Frames[i-1].Timestamp)
-                i++;
-            
-            return i;
-        }
-        private void ForgetOldFrames()
-        {
-            if(m_CurrentIndex < m_OldFramesCapacity)
+            // Consumer side. Dispose the frames before the new tail and hand their slots back to the producer.
+            long tail = m_Tail.Data;
+            if(_newTail <= tail)
                 return;
 
-            lock(m_Locker)
+            for(long position = tail; position < _newTail; position++)
             {
-                int framesToForget = m_CurrentIndex - m_OldFramesCapacity + 1;
-                //log.DebugFormat("Forgetting {0} frames.", framesToForget);
-                
-                for(int i=0;i<framesToForget;i++)
-                    DisposeFrame(m_Frames[i]);
-
-                m_Frames.RemoveRange(0, framesToForget);
-                m_CurrentIndex -= framesToForget;
-
-
-                UpdateSegment();
-                
-                Monitor.Pulse(m_Locker);
+                long slot = position & m_RemainderMask;
+                DisposeFrame(m_Slots[slot]);
+                m_Slots[slot] = null;
             }
+
+            m_Tail.Data = _newTail;
+            m_RoomAvailable.Set();
         }
         #endregion
     }
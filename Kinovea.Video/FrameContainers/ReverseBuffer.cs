@@ -0,0 +1,289 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+using System.Collections.Generic;
+using System.Threading;
+using Kinovea.Services;
+
+namespace Kinovea.Video
+{
+    /// <summary>
+    /// A buffer of frames for backward playback.
+    /// The decoder can only go forward, so frames are decoded one chunk at a time (a GOP or the tail of a GOP),
+    /// and the chunks are pushed in front of the buffer while the frames are served in descending order.
+    /// </summary>
+    /// <remarks>
+    /// Naming:
+    /// - Segment: the section of buffered frames. It is always contiguous, the buffer must be cleared before a jump.
+    /// - Capacity: the total number of frames the buffer may hold, including the chunk being decoded.
+    /// - NewFramesCapacity: the number of frames kept that are newer than the current point.
+    ///
+    /// Thread safety:
+    /// Frames are added by the reverse decoding thread and consumed by the UI thread, all access to m_Frames is locked.
+    /// As with the PreBuffer, only the UI thread changes m_Current.
+    /// The decoding thread waits for room before decoding a chunk, the UI thread waits for the chunk containing its target.
+    /// Both are woken up by a pulse on the locker.
+    /// </remarks>
+    public class ReverseBuffer : IDisposable, IVideoFramesContainer
+    {
+        #region Properties
+        public VideoFrame CurrentFrame {
+            get { return m_Current; }
+        }
+        public VideoSection Segment
+        {
+            get
+            {
+                lock(m_Locker)
+                    return m_Segment;
+            }
+        }
+        public int Capacity
+        {
+            get { return m_Capacity; }
+            set
+            {
+                lock(m_Locker)
+                {
+                    m_Capacity = Math.Max(value, MinCapacity);
+                    m_NewFramesCapacity = Math.Min(m_Capacity / 8, DefaultNewFramesCapacity);
+                }
+            }
+        }
+        /// <summary>
+        /// Number of frames to decode at once so that the next chunk can be decoded while the current one is played.
+        /// </summary>
+        public int ChunkCapacity
+        {
+            get { return Math.Max((m_Capacity - m_NewFramesCapacity) / 2, 1); }
+        }
+        /// <summary>
+        /// Timestamp of the oldest frame in the buffer, or -1 if the buffer is empty.
+        /// </summary>
+        public long Oldest
+        {
+            get
+            {
+                lock(m_Locker)
+                    return m_Frames.Count > 0 ? m_Frames[0].Timestamp : -1;
+            }
+        }
+        #endregion
+
+        #region Members
+        private List<VideoFrame> m_Frames = new List<VideoFrame>();
+        private VideoSection m_Segment = VideoSection.MakeEmpty();
+        private long m_Top = -1;
+        private int m_CurrentIndex = -1;
+        private VideoFrame m_Current;
+        private readonly object m_Locker = new object();
+
+        private const int MinCapacity = 8;
+        private const int DefaultNewFramesCapacity = 8;
+        private int m_Capacity = 64;
+        private int m_NewFramesCapacity = DefaultNewFramesCapacity;
+        private const int WaitTimeout = 100;
+        private VideoFrameDisposer m_DisposeBitmap;
+        #endregion
+
+        #region Construction & Disposal
+        public ReverseBuffer(){}
+        public ReverseBuffer(VideoFrameDisposer _disposeDelegate)
+        {
+            m_DisposeBitmap = _disposeDelegate;
+        }
+        public void Dispose()
+        {
+            Dispose(true);
+            GC.SuppressFinalize(this);
+        }
+        ~ReverseBuffer()
+        {
+            Dispose(false);
+        }
+        protected virtual void Dispose(bool disposing)
+        {
+            if (disposing)
+                Clear();
+        }
+        #endregion
+
+        #region Public methods
+        /// <summary>
+        /// Move to the last frame at or before the timestamp.
+        /// </summary>
+        public bool MoveTo(long _timestamp)
+        {
+            if(!Contains(_timestamp))
+                return false;
+
+            if(m_Current != null && _timestamp == m_Current.Timestamp)
+                return true;
+
+            lock(m_Locker)
+            {
+                for(int i = m_Frames.Count - 1; i >= 0; i--)
+                {
+                    if(m_Frames[i].Timestamp <= _timestamp)
+                    {
+                        m_CurrentIndex = i;
+                        break;
+                    }
+                }
+
+                if(m_CurrentIndex >= 0 && m_CurrentIndex <= m_Frames.Count - 1)
+                    m_Current = m_Frames[m_CurrentIndex];
+            }
+
+            ForgetNewFrames();
+
+            return true;
+        }
+        public void Add(VideoFrame _frame)
+        {
+            AddRange(new List<VideoFrame>() { _frame }, _frame.Timestamp + 1);
+        }
+        /// <summary>
+        /// Add a chunk of frames sorted by timestamp. The chunk must end where the buffer starts.
+        /// Frames overlapping the buffer are disposed.
+        /// _end is the exclusive end of the decoded section, when the buffer was empty any timestamp before it is covered.
+        /// </summary>
+        public void AddRange(IList<VideoFrame> _frames, long _end)
+        {
+            if(_frames.Count == 0)
+                return;
+
+            lock(m_Locker)
+            {
+                if(m_Frames.Count == 0)
+                    m_Top = _end - 1;
+
+                long oldest = m_Frames.Count > 0 ? m_Frames[0].Timestamp : long.MaxValue;
+                List<VideoFrame> chunk = new List<VideoFrame>(_frames.Count);
+                foreach(VideoFrame frame in _frames)
+                {
+                    if(frame.Timestamp < oldest)
+                        chunk.Add(frame);
+                    else
+                        DisposeFrame(frame);
+                }
+
+                m_Frames.InsertRange(0, chunk);
+                if(m_CurrentIndex >= 0)
+                    m_CurrentIndex += chunk.Count;
+
+                UpdateSegment();
+                Monitor.PulseAll(m_Locker);
+            }
+        }
+        public bool Contains(long _timestamp)
+        {
+            lock(m_Locker)
+                return m_Segment.Contains(_timestamp);
+        }
+        /// <summary>
+        /// Blocks until the buffer has room for a chunk of frames. Used by the decoding thread.
+        /// Returns false if the thread was cancelled while waiting.
+        /// </summary>
+        public bool WaitForRoom(int _frames, ThreadCanceler _canceler)
+        {
+            lock(m_Locker)
+            {
+                while(m_Frames.Count + _frames > m_Capacity && !_canceler.CancellationPending)
+                    Monitor.Wait(m_Locker, WaitTimeout);
+            }
+
+            return !_canceler.CancellationPending;
+        }
+        /// <summary>
+        /// Blocks until the frame at the timestamp has been decoded, or the timeout expires. Used by the UI thread.
+        /// </summary>
+        public bool WaitFor(long _timestamp, int _timeout)
+        {
+            lock(m_Locker)
+            {
+                if(!m_Segment.Contains(_timestamp))
+                    Monitor.Wait(m_Locker, _timeout);
+
+                return m_Segment.Contains(_timestamp);
+            }
+        }
+        public void Unblock()
+        {
+            lock(m_Locker)
+                Monitor.PulseAll(m_Locker);
+        }
+        public void Clear()
+        {
+            lock(m_Locker)
+            {
+                m_Current = null;
+
+                foreach(VideoFrame vf in m_Frames)
+                    DisposeFrame(vf);
+
+                m_Frames.Clear();
+                m_Top = -1;
+                m_CurrentIndex = -1;
+                m_Segment = VideoSection.MakeEmpty();
+
+                Monitor.PulseAll(m_Locker);
+            }
+        }
+        #endregion
+
+        #region Private methods
+        private void DisposeFrame(VideoFrame _frame)
+        {
+            if(m_DisposeBitmap != null)
+                m_DisposeBitmap(_frame);
+            else
+                _frame.Image.Dispose();
+        }
+        private void UpdateSegment()
+        {
+            // Always inside a lock.
+            if(m_Frames.Count < 1)
+                m_Segment = VideoSection.MakeEmpty();
+            else
+                m_Segment = new VideoSection(m_Frames[0].Timestamp, Math.Max(m_Frames[m_Frames.Count - 1].Timestamp, m_Top));
+        }
+        private void ForgetNewFrames()
+        {
+            lock(m_Locker)
+            {
+                int framesToForget = m_Frames.Count - 1 - m_CurrentIndex - m_NewFramesCapacity;
+                if(m_CurrentIndex < 0 || framesToForget <= 0)
+                    return;
+
+                for(int i = m_Frames.Count - framesToForget; i < m_Frames.Count; i++)
+                    DisposeFrame(m_Frames[i]);
+
+                m_Frames.RemoveRange(m_Frames.Count - framesToForget, framesToForget);
+                m_Top = m_Frames[m_Frames.Count - 1].Timestamp;
+                UpdateSegment();
+
+                Monitor.PulseAll(m_Locker);
+            }
+        }
+        #endregion
+    }
+}
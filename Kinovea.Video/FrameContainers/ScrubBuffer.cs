@@ -0,0 +1,350 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+using System.Collections.Generic;
+using Kinovea.Services;
+
+namespace Kinovea.Video
+{
+    /// <summary>
+    /// A sparse set of frames around the playhead, filled speculatively while scrubbing.
+    /// Unlike the PreBuffer the frames are not contiguous. Frames decoded in sequence are linked together,
+    /// so a timestamp falling between two linked frames is known to belong to the first one.
+    /// </summary>
+    /// <remarks>
+    /// When the buffer is full, the frames furthest from the playhead are dropped.
+    ///
+    /// Thread safety:
+    /// Frames are added by the prefetching thread and by the UI thread on misses, all access to m_Entries is locked.
+    /// Only the UI thread changes m_Current.
+    /// </remarks>
+    public class ScrubBuffer : IDisposable, IVideoFramesContainer
+    {
+        #region Properties
+        public VideoFrame CurrentFrame {
+            get { return m_Current; }
+        }
+        /// <summary>
+        /// The run of linked frames around the playhead.
+        /// </summary>
+        public VideoSection Segment
+        {
+            get
+            {
+                lock(m_Locker)
+                    return GetCurrentRun();
+            }
+        }
+        public int Capacity
+        {
+            get { return m_Capacity; }
+            set { m_Capacity = Math.Max(value, MinCapacity); }
+        }
+        public PrefetchStatistics Statistics
+        {
+            get
+            {
+                lock(m_Locker)
+                    return new PrefetchStatistics(m_Hits, m_Misses, m_Prefetched, m_Unused);
+            }
+        }
+        #endregion
+
+        #region Members
+        private class Entry
+        {
+            public VideoFrame Frame;
+            public long Last;
+            public bool Served;
+        }
+
+        private SortedList<long, Entry> m_Entries = new SortedList<long, Entry>();
+        private VideoFrame m_Current;
+        private readonly object m_Locker = new object();
+        private const int MinCapacity = 8;
+        private int m_Capacity = 64;
+        private int m_Hits;
+        private int m_Misses;
+        private int m_Prefetched;
+        private int m_Unused;
+        private VideoFrameDisposer m_DisposeBitmap;
+        #endregion
+
+        #region Construction & Disposal
+        public ScrubBuffer(){}
+        public ScrubBuffer(VideoFrameDisposer _disposeDelegate)
+        {
+            m_DisposeBitmap = _disposeDelegate;
+        }
+        public void Dispose()
+        {
+            Dispose(true);
+            GC.SuppressFinalize(this);
+        }
+        ~ScrubBuffer()
+        {
+            Dispose(false);
+        }
+        protected virtual void Dispose(bool disposing)
+        {
+            if (disposing)
+                Clear();
+        }
+        #endregion
+
+        #region Public methods
+        /// <summary>
+        /// Move to the frame covering the timestamp if we have it, and count it as a hit or a miss.
+        /// </summary>
+        public bool TryMoveTo(long _timestamp)
+        {
+            lock(m_Locker)
+            {
+                bool moved = MoveTo(_timestamp);
+                if(moved)
+                    m_Hits++;
+                else
+                    m_Misses++;
+
+                return moved;
+            }
+        }
+        /// <summary>
+        /// Move to the frame covering the timestamp.
+        /// </summary>
+        public bool MoveTo(long _timestamp)
+        {
+            lock(m_Locker)
+            {
+                int index = FindCovering(_timestamp);
+                if(index < 0)
+                    return false;
+
+                Entry entry = m_Entries.Values[index];
+                entry.Served = true;
+                m_Current = entry.Frame;
+                return true;
+            }
+        }
+        /// <summary>
+        /// Add a frame decoded on demand.
+        /// </summary>
+        public void Add(VideoFrame _frame)
+        {
+            lock(m_Locker)
+                Insert(_frame);
+        }
+        /// <summary>
+        /// Add a frame decoded ahead of time by the prefetching thread.
+        /// </summary>
+        public void AddSpeculative(VideoFrame _frame)
+        {
+            lock(m_Locker)
+            {
+                if(Insert(_frame))
+                    m_Prefetched++;
+            }
+        }
+        /// <summary>
+        /// Records that there is no frame between the two timestamps.
+        /// </summary>
+        public void Link(long _previous, long _next)
+        {
+            lock(m_Locker)
+            {
+                Entry entry;
+                if(m_Entries.TryGetValue(_previous, out entry))
+                    entry.Last = Math.Max(entry.Last, _next - 1);
+            }
+        }
+        public bool Contains(long _timestamp)
+        {
+            lock(m_Locker)
+                return m_Entries.ContainsKey(_timestamp);
+        }
+        /// <summary>
+        /// Whether the frame covering the timestamp is in the buffer.
+        /// </summary>
+        public bool Covers(long _timestamp)
+        {
+            lock(m_Locker)
+                return FindCovering(_timestamp) >= 0;
+        }
+        /// <summary>
+        /// Remove a frame from the buffer without disposing it, to hand it over to another container.
+        /// </summary>
+        public VideoFrame Take(long _timestamp)
+        {
+            lock(m_Locker)
+            {
+                Entry entry;
+                if(!m_Entries.TryGetValue(_timestamp, out entry))
+                    return null;
+
+                m_Entries.Remove(_timestamp);
+                if(m_Current == entry.Frame)
+                    m_Current = null;
+
+                return entry.Frame;
+            }
+        }
+        public void Clear()
+        {
+            lock(m_Locker)
+            {
+                m_Current = null;
+
+                foreach(Entry entry in m_Entries.Values)
+                    DisposeEntry(entry);
+
+                m_Entries.Clear();
+            }
+        }
+        public void ResetStatistics()
+        {
+            lock(m_Locker)
+            {
+                m_Hits = 0;
+                m_Misses = 0;
+                m_Prefetched = 0;
+                m_Unused = 0;
+            }
+        }
+        #endregion
+
+        #region Private methods
+        private bool Insert(VideoFrame _frame)
+        {
+            // Always inside a lock.
+            if(m_Entries.ContainsKey(_frame.Timestamp))
+            {
+                DisposeFrame(_frame);
+                return false;
+            }
+
+            Entry entry = new Entry();
+            entry.Frame = _frame;
+            entry.Last = _frame.Timestamp;
+            m_Entries.Add(_frame.Timestamp, entry);
+
+            // Frames decoded in sequence may complete the link from the frame before.
+            int index = m_Entries.IndexOfKey(_frame.Timestamp);
+            if(index > 0 && m_Entries.Values[index - 1].Last >= _frame.Timestamp)
+                m_Entries.Values[index - 1].Last = _frame.Timestamp - 1;
+
+            while(m_Entries.Count > m_Capacity)
+                EvictFurthest();
+
+            return true;
+        }
+        private void EvictFurthest()
+        {
+            // Always inside a lock.
+            long playhead = m_Current != null ? m_Current.Timestamp : m_Entries.Keys[m_Entries.Count / 2];
+            int furthest = -1;
+            long maxDistance = -1;
+            for(int i = 0; i < m_Entries.Count; i++)
+            {
+                if(m_Entries.Values[i].Frame == m_Current)
+                    continue;
+
+                long distance = Math.Abs(m_Entries.Keys[i] - playhead);
+                if(distance > maxDistance)
+                {
+                    maxDistance = distance;
+                    furthest = i;
+                }
+            }
+
+            if(furthest < 0)
+                return;
+
+            // The frame before the evicted one can't claim the gap anymore.
+            if(furthest > 0 && m_Entries.Values[furthest - 1].Last >= m_Entries.Keys[furthest] - 1)
+                m_Entries.Values[furthest - 1].Last = m_Entries.Values[furthest - 1].Frame.Timestamp;
+
+            DisposeEntry(m_Entries.Values[furthest]);
+            m_Entries.RemoveAt(furthest);
+        }
+        private int FindCovering(long _timestamp)
+        {
+            // Always inside a lock.
+            // Binary search for the last frame at or before the timestamp.
+            IList<long> keys = m_Entries.Keys;
+            int lo = 0;
+            int hi = keys.Count - 1;
+            int found = -1;
+            while(lo <= hi)
+            {
+                int mid = lo + (hi - lo) / 2;
+                if(keys[mid] <= _timestamp)
+                {
+                    found = mid;
+                    lo = mid + 1;
+                }
+                else
+                {
+                    hi = mid - 1;
+                }
+            }
+
+            if(found < 0 || m_Entries.Values[found].Last < _timestamp)
+                return -1;
+
+            return found;
+        }
+        private VideoSection GetCurrentRun()
+        {
+            // Always inside a lock.
+            if(m_Current == null)
+                return VideoSection.MakeEmpty();
+
+            int index = m_Entries.IndexOfKey(m_Current.Timestamp);
+            if(index < 0)
+                return VideoSection.MakeEmpty();
+
+            int first = index;
+            while(first > 0 && m_Entries.Values[first - 1].Last + 1 >= m_Entries.Keys[first])
+                first--;
+
+            int last = index;
+            while(last < m_Entries.Count - 1 && m_Entries.Values[last].Last + 1 >= m_Entries.Keys[last + 1])
+                last++;
+
+            return new VideoSection(m_Entries.Keys[first], m_Entries.Keys[last]);
+        }
+        private void DisposeEntry(Entry _entry)
+        {
+            if(!_entry.Served)
+                m_Unused++;
+
+            DisposeFrame(_entry.Frame);
+        }
+        private void DisposeFrame(VideoFrame _frame)
+        {
+            if(m_DisposeBitmap != null)
+                m_DisposeBitmap(_frame);
+            else
+                _frame.Image.Dispose();
+        }
+        #endregion
+    }
+}
@@ -0,0 +1,145 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+
+namespace Kinovea.Video
+{
+    /// <summary>
+    /// Decides how many frames the PreBuffer should hold based on how long frames take to decode.
+    /// The decoding time is smoothed and its deviation tracked, in the same way as round-trip time estimators.
+    /// The depth grows when the smoothed time plus a margin for jitter exceeds the frame budget,
+    /// and shrinks back slowly when decoding is comfortably faster than playback.
+    /// </summary>
+    /// <remarks>
+    /// Decoding times are recorded by the prebuffering thread, the other members are only changed while it is stopped.
+    /// </remarks>
+    public class PreBufferDepthPolicy
+    {
+        #region Properties
+        /// <summary>
+        /// Target number of frames in the prebuffer.
+        /// </summary>
+        public int Depth
+        {
+            get { return depth; }
+        }
+
+        /// <summary>
+        /// Upper bound on the depth, typically derived from the memory available for the size of the decoded frames.
+        /// </summary>
+        public int MaxDepth
+        {
+            get { return maxDepth; }
+            set
+            {
+                maxDepth = Math.Max(value, MinDepth);
+                depth = Math.Min(depth, maxDepth);
+            }
+        }
+
+        /// <summary>
+        /// Time available to decode one frame at normal playback speed, in milliseconds.
+        /// </summary>
+        public double BudgetMilliseconds
+        {
+            get { return budget; }
+            set { budget = value; }
+        }
+
+        /// <summary>
+        /// Smoothed decoding time, in milliseconds.
+        /// </summary>
+        public double AverageMilliseconds
+        {
+            get { return average; }
+        }
+
+        /// <summary>
+        /// Smoothed absolute deviation of the decoding time, in milliseconds.
+        /// </summary>
+        public double JitterMilliseconds
+        {
+            get { return jitter; }
+        }
+        #endregion
+
+        #region Members
+        public const int MinDepth = 8;
+        public const int DefaultDepth = 25;
+        private const double Gain = 1.0 / 8;
+        private const double JitterGain = 1.0 / 4;
+        private const double JitterMargin = 4;
+        private const double HighWater = 1.0;
+        private const double LowWater = 0.5;
+        private const int EvaluationInterval = 25;
+        private int depth = DefaultDepth;
+        private int maxDepth = DefaultDepth;
+        private double budget;
+        private double average;
+        private double jitter;
+        private int samples;
+        #endregion
+
+        #region Public methods
+        /// <summary>
+        /// Records the time it took to decode one frame.
+        /// Returns true if the depth changed.
+        /// </summary>
+        public bool Record(double milliseconds)
+        {
+            if (samples == 0)
+            {
+                average = milliseconds;
+                jitter = milliseconds / 2;
+            }
+            else
+            {
+                jitter += JitterGain * (Math.Abs(milliseconds - average) - jitter);
+                average += Gain * (milliseconds - average);
+            }
+
+            samples++;
+            if (budget <= 0 || samples % EvaluationInterval != 0)
+                return false;
+
+            int oldDepth = depth;
+            double load = (average + JitterMargin * jitter) / budget;
+            if (load > HighWater)
+                depth = Math.Min(depth + Math.Max(depth / 4, 4), maxDepth);
+            else if (load < LowWater)
+                depth = Math.Max(depth - Math.Max(depth / 8, 1), MinDepth);
+
+            return depth != oldDepth;
+        }
+
+        /// <summary>
+        /// Forget the decoding history and go back to the default depth.
+        /// </summary>
+        public void Reset()
+        {
+            depth = Math.Min(DefaultDepth, maxDepth);
+            average = 0;
+            jitter = 0;
+            samples = 0;
+        }
+        #endregion
+    }
+}
@@ -0,0 +1,68 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+
+namespace Kinovea.Video
+{
+    /// <summary>
+    /// Counters of a speculative frame buffer, used to tune the prefetching window.
+    /// </summary>
+    public struct PrefetchStatistics
+    {
+        /// <summary>
+        /// Number of requests served from the buffer.
+        /// </summary>
+        public readonly int Hits;
+
+        /// <summary>
+        /// Number of requests that had to be decoded synchronously.
+        /// </summary>
+        public readonly int Misses;
+
+        /// <summary>
+        /// Number of frames decoded ahead of time.
+        /// </summary>
+        public readonly int Prefetched;
+
+        /// <summary>
+        /// Number of frames dropped from the buffer without ever being shown.
+        /// </summary>
+        public readonly int Unused;
+
+        public double HitRatio
+        {
+            get { return Hits + Misses == 0 ? 0 : (double)Hits / (Hits + Misses); }
+        }
+
+        public PrefetchStatistics(int hits, int misses, int prefetched, int unused)
+        {
+            this.Hits = hits;
+            this.Misses = misses;
+            this.Prefetched = prefetched;
+            this.Unused = unused;
+        }
+
+        public override string ToString()
+        {
+            return string.Format("Hits:{0}, Misses:{1}, Hit ratio:{2:0.00}, Prefetched:{3}, Unused:{4}", Hits, Misses, HitRatio, Prefetched, Unused);
+        }
+    }
+}
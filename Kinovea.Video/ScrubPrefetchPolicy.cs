@@ -0,0 +1,206 @@
+﻿#region License
+/*
+Copyright © Joan Charmant 2023.
+jcharmant@gmail.com
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+*/
+#endregion
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using Kinovea.Services;
+
+namespace Kinovea.Video
+{
+    /// <summary>
+    /// Decides which frames to decode ahead of time while scrubbing.
+    /// Recent seek targets give the scrub velocity, the window of frames to prefetch is centered on the predicted
+    /// playhead and skewed in the direction of motion.
+    /// </summary>
+    /// <remarks>
+    /// Targets are recorded by the UI thread and the window is computed by the prefetching thread.
+    /// The generation number changes with each new target so the prefetching thread can tell when to replan.
+    /// </remarks>
+    public class ScrubPrefetchPolicy
+    {
+        #region Properties
+        /// <summary>
+        /// How far in the future the playhead is predicted, in milliseconds.
+        /// Should be about the time it takes to decode a GOP.
+        /// </summary>
+        public int LookaheadMilliseconds
+        {
+            get { return lookaheadMilliseconds; }
+            set { lookaheadMilliseconds = Math.Max(value, 0); }
+        }
+
+        /// <summary>
+        /// Fraction of the window placed ahead of the playhead in the direction of motion.
+        /// When the playhead is not moving the window is centered.
+        /// </summary>
+        public double ForwardRatio
+        {
+            get { return forwardRatio; }
+            set { forwardRatio = Math.Min(Math.Max(value, 0.5), 1.0); }
+        }
+
+        /// <summary>
+        /// Targets older than this are not used to compute the velocity, in milliseconds.
+        /// </summary>
+        public int HistoryMilliseconds
+        {
+            get { return historyMilliseconds; }
+            set { historyMilliseconds = Math.Max(value, 1); }
+        }
+
+        public int Generation
+        {
+            get { lock (locker) return generation; }
+        }
+
+        /// <summary>
+        /// Last recorded target, or -1 if none.
+        /// </summary>
+        public long Playhead
+        {
+            get { lock (locker) return history.Count > 0 ? history[history.Count - 1].Timestamp : -1; }
+        }
+
+        /// <summary>
+        /// Scrub velocity in timestamps per second. Positive when going forward.
+        /// </summary>
+        public double Velocity
+        {
+            get { lock (locker) return ComputeVelocity(); }
+        }
+        #endregion
+
+        #region Members
+        private struct Sample
+        {
+            public long Timestamp;
+            public long Ticks;
+        }
+
+        private List<Sample> history = new List<Sample>();
+        private int generation;
+        private int lookaheadMilliseconds = 150;
+        private double forwardRatio = 0.75;
+        private int historyMilliseconds = 500;
+        private const int MaxSamples = 16;
+        private readonly object locker = new object();
+        #endregion
+
+        #region Public methods
+        public void Record(long target)
+        {
+            lock (locker)
+            {
+                Sample sample = new Sample();
+                sample.Timestamp = target;
+                sample.Ticks = Stopwatch.GetTimestamp();
+                history.Add(sample);
+                if (history.Count > MaxSamples)
+                    history.RemoveAt(0);
+
+                generation++;
+            }
+        }
+
+        public void Reset()
+        {
+            lock (locker)
+            {
+                history.Clear();
+                generation++;
+            }
+        }
+
+        /// <summary>
+        /// Returns the predicted playhead.
+        /// </summary>
+        public long Predict(VideoSection zone)
+        {
+            lock (locker)
+            {
+                if (history.Count == 0)
+                    return -1;
+
+                long playhead = history[history.Count - 1].Timestamp;
+                long predicted = playhead + (long)(ComputeVelocity() * lookaheadMilliseconds / 1000.0);
+                return Clamp(predicted, zone);
+            }
+        }
+
+        /// <summary>
+        /// Returns the section to prefetch, made of about the requested number of frames.
+        /// </summary>
+        public VideoSection GetWindow(int frames, long averageTimestampsPerFrame, VideoSection zone)
+        {
+            lock (locker)
+            {
+                if (history.Count == 0)
+                    return VideoSection.MakeEmpty();
+
+                double velocity = ComputeVelocity();
+                long playhead = history[history.Count - 1].Timestamp;
+                long predicted = Clamp(playhead + (long)(velocity * lookaheadMilliseconds / 1000.0), zone);
+
+                double ratio = velocity == 0 ? 0.5 : forwardRatio;
+                long ahead = (long)(frames * ratio) * averageTimestampsPerFrame;
+                long behind = (long)(frames * (1 - ratio)) * averageTimestampsPerFrame;
+
+                long start = velocity >= 0 ? predicted - behind : predicted - ahead;
+                long end = velocity >= 0 ? predicted + ahead : predicted + behind;
+                return new VideoSection(Clamp(start, zone), Clamp(end, zone));
+            }
+        }
+        #endregion
+
+        #region Private methods
+        private double ComputeVelocity()
+        {
+            // Always inside a lock.
+            if (history.Count < 2)
+                return 0;
+
+            Sample last = history[history.Count - 1];
+            long oldestTicks = last.Ticks - (historyMilliseconds * Stopwatch.Frequency / 1000);
+
+            int first = history.Count - 1;
+            while (first > 0 && history[first - 1].Ticks >= oldestTicks)
+                first--;
+
+            if (first == history.Count - 1)
+                return 0;
+
+            double seconds = (double)(last.Ticks - history[first].Ticks) / Stopwatch.Frequency;
+            if (seconds <= 0)
+                return 0;
+
+            return (last.Timestamp - history[first].Timestamp) / seconds;
+        }
+
+        private static long Clamp(long timestamp, VideoSection zone)
+        {
+            if (zone.IsEmpty)
+                return timestamp;
+
+            return Math.Min(Math.Max(timestamp, zone.Start), zone.End);
+        }
+        #endregion
+    }
+}
@@ -26,7 +26,50 @@ namespace Kinovea.Video
     public class VideoFrame
     {
         public long Timestamp;
-        public Bitmap Image;
+
+        /// <summary>
+        /// The displayable image.
+        /// For compact frames this is produced on first access and may be released later by the reader.
+        /// </summary>
+        public Bitmap Image
+        {
+            get
+            {
+                if (image == null && materializer != null)
+                    image = materializer(this);
+
+                return image;
+            }
+            set { image = value; }
+        }
+
+        /// <summary>
+        /// Whether the displayable image currently exists, without triggering its creation.
+        /// </summary>
+        public bool HasImage
+        {
+            get { return image != null; }
+        }
+
+        /// <summary>
+        /// Whether the frame is stored in a compact, reader-specific format instead of a Bitmap.
+        /// </summary>
+        public bool IsCompact
+        {
+            get { return materializer != null; }
+        }
+
+        /// <summary>
+        /// Native buffer holding the compact frame. Only meaningful to the reader that created the frame.
+        /// </summary>
+        public IntPtr CompactBuffer
+        {
+            get { return compactBuffer; }
+        }
+
+        private Bitmap image;
+        private IntPtr compactBuffer = IntPtr.Zero;
+        private VideoFrameMaterializer materializer;
         
         public VideoFrame(){}
         public VideoFrame(long _ts, Bitmap _img)
@@ -34,5 +77,22 @@ namespace Kinovea.Video
             Timestamp = _ts;
             Image = _img;
         }
+        public VideoFrame(long _ts, IntPtr _compactBuffer, VideoFrameMaterializer _materializer)
+        {
+            Timestamp = _ts;
+            compactBuffer = _compactBuffer;
+            materializer = _materializer;
+        }
+
+        /// <summary>
+        /// Forget the displayable image of a compact frame and return it.
+        /// The caller, the reader that materialized it, must dispose the returned image.
+        /// </summary>
+        public Bitmap ReleaseImage()
+        {
+            Bitmap released = image;
+            image = null;
+            return released;
+        }
     }
 }
@@ -65,6 +65,12 @@ namespace Kinovea.Video
         /// </summary>
         public ImageRotation ImageRotation;
 
+        /// <summary>
+        /// Bayer pattern of raw recordings storing the sensor mosaic, from video internal metadata.
+        /// None for regular videos.
+        /// </summary>
+        public Demosaicing Demosaicing;
+
         // Timing info - some of this might be overriden by the user.
         public long AverageTimeStampsPerFrame;
         public double AverageTimeStampsPerSeconds;
@@ -74,6 +80,11 @@ namespace Kinovea.Video
         public long FirstTimeStamp;
         public long LastTimeStamp;
         public long DurationTimeStamps;
+
+        /// <summary>
+        /// Exact number of frames in the video stream, when known from a packet index. 0 if unknown.
+        /// </summary>
+        public int FrameCount;
         
         public static VideoInfo Empty {
             get {
@@ -88,6 +99,7 @@ namespace Kinovea.Video
                     SampleAspectRatio = new Fraction(),
                     IsCodecMpeg2 = false,
                     ImageRotation = ImageRotation.Rotate0,
+                    Demosaicing = Demosaicing.None,
        
                     AverageTimeStampsPerFrame = 0,
                     AverageTimeStampsPerSeconds = 0,
@@ -95,7 +107,8 @@ namespace Kinovea.Video
                     FrameIntervalMilliseconds = 0,
                     FirstTimeStamp = 0,
                     LastTimeStamp = 0,
-                    DurationTimeStamps = 0
+                    DurationTimeStamps = 0,
+                    FrameCount = 0
                 };
             }
         }
@@ -30,6 +30,21 @@ namespace Kinovea.Video
         public Demosaicing Demosaicing { get; set; }
         public bool Deinterlace { get; set; }
 
+        /// <summary>
+        /// Number of threads used by the decoder. 0 for automatic selection based on the number of cores.
+        /// </summary>
+        public int DecodingThreads { get; set; }
+
+        /// <summary>
+        /// Whether the working zone cache may keep frames in the decoder planar format and convert them on display.
+        /// </summary>
+        public bool PlanarCache { get; set; }
+
+        /// <summary>
+        /// Size of the window of the file read ahead of the demuxer by a dedicated I/O thread, in megabytes. 0 to read the file directly.
+        /// </summary>
+        public int ReadAheadMemory { get; set; }
+
         public VideoOptions(ImageAspectRatio aspect, ImageRotation rotation, Demosaicing demosaicing, bool deinterlace)
         {
             ImageAspectRatio = aspect;
@@ -62,6 +62,10 @@ namespace Kinovea.Video
         public virtual VideoSection PreBufferingSegment {
             get { return VideoSection.MakeEmpty(); }
         }
+        // Time spent in each stage of decoding, if the reader is instrumented.
+        public virtual DecodingStatistics DecodingStatistics {
+            get { return null; }
+        }
         // If the reader is subject to decoding drops (prebuffering), this property should be filled accordingly.
         public virtual int Drops {
             get {return 0; }